@@ -156,6 +156,7 @@ def do_image_job(
     png_file = os.path.join(output_dir, 'image_0.png')
     log_file = os.path.join(output_dir, runspv.LOGFILE_NAME)
     status_file = os.path.join(output_dir, 'STATUS')
+    watchdog_file = os.path.join(output_dir, runspv.WATCHDOG_FILENAME)
     nondet_0 = os.path.join(output_dir, 'nondet0.png')
     nondet_1 = os.path.join(output_dir, 'nondet1.png')
 
@@ -235,6 +236,12 @@ def do_image_job(
             res.status = tt.JobStatus.CRASH
         elif status == 'TIMEOUT':
             res.status = tt.JobStatus.TIMEOUT
+            # The legacy worker records the stage that exceeded its deadline.
+            if os.path.isfile(watchdog_file):
+                with gfuzz_common.open_helper(watchdog_file, 'r') as f:
+                    stage = f.read().strip()
+                if stage in tt.JobStage._NAMES_TO_VALUES:
+                    res.stage = tt.JobStage._NAMES_TO_VALUES[stage]
         elif status == 'COHERENCE_ERROR':
             res.status = tt.JobStatus.COHERENCE_ERROR
         elif status == 'UNEXPECTED_ERROR':
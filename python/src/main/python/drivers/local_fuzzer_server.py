@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+
+# Copyright 2019 The GraphicsFuzz Project Authors
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import argparse
+import glob
+import os
+import sys
+from typing import List
+
+import gfuzz_common
+
+HERE = os.path.abspath(__file__)
+
+# Add directory above to Python path for access to dependencies.
+# Prepend it so we override any globally installed dependencies.
+sys.path.insert(0, os.path.dirname(os.path.dirname(HERE)))
+
+# noinspection PyPep8
+from fuzzer_service import FuzzerService
+# noinspection PyPep8
+import fuzzer_service.ttypes as tt
+# noinspection PyPep8
+from thrift.protocol import TBinaryProtocol
+# noinspection PyPep8
+from thrift.server import THttpServer
+
+# A stand-in for glsl-server, to test workers that talk to the server directly, such as the legacy
+# Vulkan worker in server mode:
+#
+#   local-fuzzer-server shaderfamilies/family results/ --port 8080 &
+#   vkworker --server http://localhost:8080 --worker local --max_jobs 3
+#
+# Each shader job of the input directory is given to the worker until it replies with a result.
+# Results are written to the output directory:
+#   <name>.png, <name>_nondet.png: images returned by the worker, if any
+#   <name>.txt: status, stage, timing information and log
+
+
+def load_image_jobs(input_dir: str) -> List[tt.ImageJob]:
+    image_jobs = []  # type: List[tt.ImageJob]
+    for json_file in sorted(glob.glob(os.path.join(input_dir, '*.json'))):
+        prefix = gfuzz_common.remove_end(json_file, '.json')
+        frag_file = prefix + '.frag'
+        if not os.path.isfile(frag_file):
+            continue
+        image_job = tt.ImageJob()
+        image_job.name = os.path.basename(prefix)
+        with gfuzz_common.open_helper(json_file, 'r') as f:
+            image_job.uniformsInfo = f.read()
+        with gfuzz_common.open_helper(frag_file, 'r') as f:
+            image_job.fragmentSource = f.read()
+        if os.path.isfile(prefix + '.vert'):
+            with gfuzz_common.open_helper(prefix + '.vert', 'r') as f:
+                image_job.vertexSource = f.read()
+        image_jobs.append(image_job)
+    return image_jobs
+
+
+def write_result(name: str, result: tt.ImageJobResult, output_dir: str) -> None:
+    if result.PNG:
+        with gfuzz_common.open_bin_helper(os.path.join(output_dir, name + '.png'), 'wb') as f:
+            f.write(result.PNG)
+    if result.PNG2:
+        with gfuzz_common.open_bin_helper(os.path.join(output_dir, name + '_nondet.png'), 'wb') as f:
+            f.write(result.PNG2)
+
+    lines = [
+        'status: ' + tt.JobStatus._VALUES_TO_NAMES.get(result.status, str(result.status)),
+        'stage: ' + tt.JobStage._VALUES_TO_NAMES.get(result.stage, str(result.stage)),
+    ]
+    if result.timingInfo:
+        lines += [
+            'compilationTime: ' + str(result.timingInfo.compilationTime),
+            'firstRenderTime: ' + str(result.timingInfo.firstRenderTime),
+            'otherRendersTime: ' + str(result.timingInfo.otherRendersTime),
+            'captureTime: ' + str(result.timingInfo.captureTime),
+        ]
+    lines += ['log:', result.log or '']
+    gfuzz_common.write_to_file('\n'.join(lines) + '\n', os.path.join(output_dir, name + '.txt'))
+
+
+class LocalFuzzerService(FuzzerService.Iface):
+
+    def __init__(self, image_jobs: List[tt.ImageJob], output_dir: str):
+        self.pending = list(image_jobs)
+        self.output_dir = output_dir
+        self.next_job_id = 1
+
+    def getWorkerName(self, platformInfo, workerName):
+        print('getWorkerName(): ' + workerName)
+        gfuzz_common.write_to_file(platformInfo, os.path.join(self.output_dir, 'worker_info.json'))
+        return tt.GetWorkerNameResult(workerName=workerName)
+
+    def getJob(self, workerName):
+        if not self.pending:
+            return tt.Job(jobId=0, noJob=tt.NoJob())
+        # Like the real server, the job is given again until the worker replies.
+        print('getJob(): ' + self.pending[0].name)
+        return tt.Job(jobId=self.next_job_id, imageJob=self.pending[0])
+
+    def jobDone(self, workerName, job):
+        if not self.pending or job.jobId != self.next_job_id or job.imageJob is None \
+                or job.imageJob.result is None:
+            print('jobDone(): unexpected job ' + str(job.jobId))
+            return
+        name = self.pending.pop(0).name
+        result = job.imageJob.result
+        print('jobDone(): ' + name + ': ' + tt.JobStatus._VALUES_TO_NAMES.get(result.status, '?'))
+        write_result(name, result, self.output_dir)
+        self.next_job_id += 1
+
+
+def main_helper(args: List[str]) -> None:
+    description = (
+        'Serve the shader jobs of a directory to a single worker, as glsl-server would, and write '
+        'the results to a directory. Exits once all jobs are done.')
+
+    parser = argparse.ArgumentParser(description=description)
+
+    # Required arguments
+    parser.add_argument('input_dir', help='A directory of shader jobs (.json and .frag files, '
+                                          'and optionally .vert files).')
+    parser.add_argument('output_dir', help='The directory in which to write results.')
+
+    # Optional arguments
+    parser.add_argument('--port', type=int, default=8080, help='Port to listen on (default: 8080)')
+
+    args = parser.parse_args(args)
+
+    if not os.path.isdir(args.input_dir):
+        raise ValueError('Input directory ' + '\'' + args.input_dir + '\' not found.')
+
+    image_jobs = load_image_jobs(args.input_dir)
+    if not image_jobs:
+        raise ValueError('No shader job found in ' + '\'' + args.input_dir + '\'.')
+
+    os.makedirs(args.output_dir, exist_ok=True)
+
+    service = LocalFuzzerService(image_jobs, args.output_dir)
+    server = THttpServer.THttpServer(
+        FuzzerService.Processor(service),
+        ('localhost', args.port),
+        TBinaryProtocol.TBinaryProtocolFactory())
+
+    print('Serving ' + str(len(image_jobs)) + ' jobs on port ' + str(args.port))
+    while service.pending:
+        server.httpd.handle_request()
@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+
+# Copyright 2019 The GraphicsFuzz Project Authors
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import argparse
+import glob
+import os
+import struct
+import tempfile
+from typing import List, Optional
+
+import runspv
+
+# Packed corpus format, as read by the legacy Vulkan worker (vulkan-worker/src/common/corpus.h).
+# All integers are little-endian.
+#
+#   header: magic (8 bytes) | version (uint32) | number of jobs (uint32)
+#   index:  one entry per job, 8 x uint64:
+#           name offset | name size | vertex offset | vertex number of words |
+#           fragment offset | fragment number of words | uniforms offset | uniforms size
+#   data:   job names, SPIR-V binaries and uniforms JSON.
+#
+# Offsets are relative to the start of the file. SPIR-V binaries are 4-byte aligned. Names and
+# uniforms are followed by a '\0' that is not counted in their size, such that the worker can use
+# them in place.
+
+CORPUS_MAGIC = b'GFZCORP\0'
+CORPUS_VERSION = 1
+CORPUS_HEADER_FORMAT = '<8sII'
+CORPUS_INDEX_ENTRY_FORMAT = '<8Q'
+
+
+class CorpusJob:
+    def __init__(self, name: str, vertex_spv: bytes, fragment_spv: bytes, uniforms: bytes):
+        assert len(vertex_spv) % 4 == 0, 'SPIR-V size must be a multiple of 4: ' + name
+        assert len(fragment_spv) % 4 == 0, 'SPIR-V size must be a multiple of 4: ' + name
+        self.name = name
+        self.vertex_spv = vertex_spv
+        self.fragment_spv = fragment_spv
+        self.uniforms = uniforms
+
+
+def align(offset: int, alignment: int) -> int:
+    return (offset + alignment - 1) // alignment * alignment
+
+
+def write_corpus(jobs: List[CorpusJob], output: str) -> None:
+    header_size = struct.calcsize(CORPUS_HEADER_FORMAT)
+    entry_size = struct.calcsize(CORPUS_INDEX_ENTRY_FORMAT)
+
+    data = bytearray()
+    data_start = header_size + entry_size * len(jobs)
+    index = bytearray()
+
+    def append(blob: bytes, alignment: int, terminate: bool) -> int:
+        padding = align(data_start + len(data), alignment) - (data_start + len(data))
+        data.extend(b'\0' * padding)
+        offset = data_start + len(data)
+        data.extend(blob)
+        if terminate:
+            data.extend(b'\0')
+        return offset
+
+    for job in jobs:
+        name = job.name.encode('utf-8')
+        name_offset = append(name, 1, True)
+        vertex_offset = append(job.vertex_spv, 4, False)
+        fragment_offset = append(job.fragment_spv, 4, False)
+        uniforms_offset = append(job.uniforms, 1, True)
+        index.extend(struct.pack(
+            CORPUS_INDEX_ENTRY_FORMAT,
+            name_offset, len(name),
+            vertex_offset, len(job.vertex_spv) // 4,
+            fragment_offset, len(job.fragment_spv) // 4,
+            uniforms_offset, len(job.uniforms)))
+
+    with runspv.open_bin_helper(output, 'wb') as f:
+        f.write(struct.pack(CORPUS_HEADER_FORMAT, CORPUS_MAGIC, CORPUS_VERSION, len(jobs)))
+        f.write(index)
+        f.write(data)
+
+
+def read_binary(filename: str) -> bytes:
+    with runspv.open_bin_helper(filename, 'rb') as f:
+        return f.read()
+
+
+def load_shader_job(
+    json_file: str,
+    work_dir: str,
+    spirv_opt_args: Optional[List[str]]
+) -> Optional[CorpusJob]:
+    shader_prefix = os.path.splitext(json_file)[0]
+    if not runspv.some_shader_format_exists(shader_prefix, 'frag'):
+        return None
+    if not runspv.some_shader_format_exists(shader_prefix, 'vert'):
+        raise ValueError('Fragment shader requires accompanying vertex shader: ' + json_file)
+
+    vert = runspv.prepare_shader(
+        work_dir, runspv.pick_shader_format(shader_prefix, 'vert'), spirv_opt_args)
+    frag = runspv.prepare_shader(
+        work_dir, runspv.pick_shader_format(shader_prefix, 'frag'), spirv_opt_args)
+
+    return CorpusJob(
+        name=os.path.basename(shader_prefix),
+        vertex_spv=read_binary(vert),
+        fragment_spv=read_binary(frag),
+        uniforms=read_binary(json_file))
+
+
+def main_helper(args: List[str]) -> None:
+    description = (
+        'Pack all the shader jobs of a shader family directory into a single corpus file, '
+        'to be run by the legacy Vulkan worker with --corpus.')
+
+    parser = argparse.ArgumentParser(description=description)
+
+    # Required arguments
+    parser.add_argument('input_dir', help='A shader family directory, or any directory of shader '
+                                          'jobs with vertex and fragment shaders.')
+    parser.add_argument('output', help='The corpus file to create.')
+
+    # Optional arguments
+    parser.add_argument('--spirvopt', help=runspv.SPIRV_OPT_OPTION_HELP)
+
+    args = parser.parse_args(args)
+
+    if not os.path.isdir(args.input_dir):
+        raise ValueError('Input directory ' + '\'' + args.input_dir + '\' not found.')
+
+    spirv_opt_args = None  # type: Optional[List[str]]
+    if args.spirvopt:
+        spirv_opt_args = args.spirvopt.split()
+
+    jobs = []  # type: List[CorpusJob]
+    with tempfile.TemporaryDirectory() as work_dir:
+        for json_file in sorted(glob.glob(os.path.join(args.input_dir, '*.json'))):
+            job = load_shader_job(json_file, work_dir, spirv_opt_args)
+            if job is None:
+                print('Skipping ' + json_file + ': no shader found')
+                continue
+            jobs.append(job)
+
+    write_corpus(jobs, args.output)
+    print('Packed ' + str(len(jobs)) + ' shader jobs into ' + args.output)
@@ -66,6 +66,12 @@ BUSY_WAIT_SLEEP_SLOW = 1.0
 BUSY_WAIT_SLEEP_FAST = 0.1
 AMBER_FENCE_TIMEOUT_MS = 60000
 TIMEOUT_SPIRV_OPT_SECONDS = 120
+# Deadline for the legacy worker to create a graphics pipeline; on expiry, the worker writes the
+# name of the stage to the WATCHDOG file and exits.
+TIMEOUT_COMPILE_MS = 10000
+WATCHDOG_FILENAME = 'WATCHDOG'
+# On a crash, the legacy worker writes the signal, stage and stack frames to the CRASH file.
+CRASH_FILENAME = 'CRASH'
 
 ################################################################################
 # Common
@@ -594,7 +600,7 @@ def run_image_android_legacy(
     adb_check(['push', json_file, ANDROID_SDCARD_GRAPHICSFUZZ_DIR + '/test.json'])
 
     # Build app args.
-    flags = '--num-render {}'.format(NUM_RENDER)
+    flags = '--num-render {} --compile-timeout-ms {}'.format(NUM_RENDER, TIMEOUT_COMPILE_MS)
     if skip_render:
         flags += ' --skip-render'
 
@@ -656,7 +662,15 @@ def run_image_android_legacy(
             status = 'SUCCESS'
             break
 
-        # App has terminated and there is no DONE file; this definitely looks like a crash.
+        # App has terminated and there is no DONE file. Either the watchdog terminated it, or
+        # this definitely looks like a crash.
+        if adb_can_fail([
+            'shell',
+            'test -f ' + ANDROID_SDCARD_GRAPHICSFUZZ_DIR + '/' + WATCHDOG_FILENAME
+        ]).returncode == 0:
+            status = 'TIMEOUT'
+            break
+
         status = 'CRASH'
         break
 
@@ -762,6 +776,9 @@ def run_image_host_legacy(
         '-coherence_before={}'.format(os.path.join(output_dir, 'coherence_before.png')),
         '-coherence_after={}'.format(os.path.join(output_dir, 'coherence_after.png')),
         '-skip_render=' + ('true' if skip_render else 'false'),
+        '-compile_timeout_ms={}'.format(TIMEOUT_COMPILE_MS),
+        '-watchdog_file={}'.format(os.path.join(output_dir, WATCHDOG_FILENAME)),
+        '-crash_file={}'.format(os.path.join(output_dir, CRASH_FILENAME)),
     ]
     status = 'SUCCESS'
     try:
@@ -773,7 +790,14 @@ def run_image_host_legacy(
     except subprocess.TimeoutExpired:
         status = 'TIMEOUT'
     except subprocess.CalledProcessError:
-        status = 'CRASH'
+        if os.path.isfile(os.path.join(output_dir, WATCHDOG_FILENAME)):
+            status = 'TIMEOUT'
+        else:
+            status = 'CRASH'
+            crash_file = os.path.join(output_dir, CRASH_FILENAME)
+            if os.path.isfile(crash_file):
+                with open_helper(crash_file, 'r') as f:
+                    log('\nCRASH RECORD\n' + f.read())
 
     log('\nSTATUS ' + status + '\n')
 
@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+
+# Copyright 2019 The GraphicsFuzz Project Authors
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import errno
+import mmap
+import os
+import select
+import struct
+import time
+from typing import Iterator, Optional
+
+# Result ring buffer, as written by the legacy Vulkan worker with --result_transport
+# (vulkan-worker/src/common/result_transport.h). All integers are little-endian.
+#
+#   header: magic (8 bytes) | version (uint32) | data offset (uint32) | data size (uint64) |
+#           write offset (uint64) | read offset (uint64) | worker pid (uint32) | closed (uint32) |
+#           generation (uint32)
+#   data:   records, at data offset in the file.
+#
+#   record: type (uint32) | name size (uint32) | record size (uint64) | data offset (uint64) |
+#           data size (uint64) | width (uint32) | height (uint32) | name | data
+#
+# Write and read offsets count the bytes published by the worker and released by the consumer;
+# a record starts at offset % data size, 64-byte aligned, and never wraps around. The worker
+# writes a byte to the FIFO '<file>.doorbell' after publishing records, and sets closed when it
+# exits. A worker that reuses the file, e.g. restarted after a crash, rewrites the header with the
+# next generation and starts again from offset 0.
+
+RING_MAGIC = b'GFZRING\0'
+RING_VERSION = 2
+RING_HEADER_FORMAT = '<8sIIQQQIII'
+RING_OFFSET_FORMAT = '<Q'
+RING_WRITE_OFFSET_OFFSET = 24
+RING_READ_OFFSET_OFFSET = 32
+RING_CLOSED_FORMAT = '<I'
+RING_CLOSED_OFFSET = 44
+RECORD_HEADER_FORMAT = '<IIQQQII'
+
+RECORD_PADDING = 0
+RECORD_FILE = 1
+RECORD_FRAME = 2
+
+
+class ResultRecord:
+    def __init__(self, record_type: int, name: str, data: memoryview, width: int, height: int):
+        self.type = record_type
+        # The result file the record replaces, e.g. 'variant_0.png'.
+        self.name = name
+        # Maps the ring buffer: only valid until the next record is requested.
+        self.data = data
+        # Frames are raw RGBA pixels, width * height * 4 bytes.
+        self.width = width
+        self.height = height
+
+
+class ResultRing:
+    def __init__(self, filename: str):
+        self.filename = filename
+        doorbell_filename = filename + '.doorbell'
+        try:
+            os.mkfifo(doorbell_filename)
+        except OSError as error:
+            if error.errno != errno.EEXIST:
+                raise
+        self.doorbell = os.open(doorbell_filename, os.O_RDONLY | os.O_NONBLOCK)
+        self.mapping = self._map()
+        magic, version, self.data_offset, self.data_size, _, self.read_offset, self.worker_pid, _, \
+            self.generation = struct.unpack_from(RING_HEADER_FORMAT, self.mapping)
+        if magic != RING_MAGIC or version != RING_VERSION:
+            raise ValueError('Not a result ring buffer: ' + filename)
+
+    def _map(self) -> mmap.mmap:
+        with open(self.filename, 'r+b') as f:
+            return mmap.mmap(f.fileno(), 0)
+
+    def restarted(self) -> bool:
+        """Returns whether another worker took over the file, e.g. after a crash, or is rewriting
+        the header to do so."""
+        magic, version, _, _, _, _, worker_pid, _, generation = \
+            struct.unpack_from(RING_HEADER_FORMAT, self.mapping)
+        return magic != RING_MAGIC or version != RING_VERSION or \
+            worker_pid != self.worker_pid or generation != self.generation
+
+    def sync(self) -> bool:
+        """Starts over from the first record when another worker took over the file. Returns False
+        while a worker is rewriting the header."""
+        if not self.restarted():
+            return True
+        # The buffer may have another size
+        self.mapping.close()
+        self.mapping = self._map()
+        magic, version, self.data_offset, self.data_size, _, _, self.worker_pid, _, \
+            self.generation = struct.unpack_from(RING_HEADER_FORMAT, self.mapping)
+        if magic != RING_MAGIC or version != RING_VERSION:
+            return False
+        self.release(0)
+        return True
+
+    def close(self) -> None:
+        os.close(self.doorbell)
+        self.mapping.close()
+
+    def write_offset(self) -> int:
+        return struct.unpack_from(RING_OFFSET_FORMAT, self.mapping, RING_WRITE_OFFSET_OFFSET)[0]
+
+    def closed(self) -> bool:
+        return struct.unpack_from(RING_CLOSED_FORMAT, self.mapping, RING_CLOSED_OFFSET)[0] != 0
+
+    def wait(self, timeout: Optional[float] = None) -> bool:
+        """Waits for the doorbell. Returns False once the worker is gone, as the FIFO then has no
+        writer left."""
+        select.select([self.doorbell], [], [], timeout)
+        try:
+            return len(os.read(self.doorbell, 4096)) > 0
+        except BlockingIOError:
+            return True
+
+    def release(self, offset: int) -> None:
+        self.read_offset = offset
+        struct.pack_into(RING_OFFSET_FORMAT, self.mapping, RING_READ_OFFSET_OFFSET, offset)
+
+    def records(self, block: bool = True) -> Iterator[ResultRecord]:
+        """Yields the published records, in order, releasing each one when the next one is
+        requested: copy the data of a record to keep it. Without block, stops at the last record
+        published, otherwise when the worker is done or gone."""
+        while True:
+            if not self.sync():
+                if not block:
+                    return
+                time.sleep(0.01)
+                continue
+            # Read closed before the write offset: records published before closing are not missed.
+            closed = self.closed()
+            write_offset = self.write_offset()
+            while self.read_offset < write_offset and not self.restarted():
+                position = self.data_offset + self.read_offset % self.data_size
+                record_type, name_size, size, data_offset, data_size, width, height = \
+                    struct.unpack_from(RECORD_HEADER_FORMAT, self.mapping, position)
+                if record_type != RECORD_PADDING:
+                    name_start = position + struct.calcsize(RECORD_HEADER_FORMAT)
+                    name = self.mapping[name_start:name_start + name_size].decode('utf-8')
+                    data_start = position + data_offset
+                    view = memoryview(self.mapping)
+                    data = view[data_start:data_start + data_size]
+                    yield ResultRecord(record_type, name, data, width, height)
+                    data.release()
+                    view.release()
+                    if self.restarted():
+                        # The new worker owns the read offset until the next sync
+                        break
+                self.release(self.read_offset + size)
+            if closed or not block:
+                return
+            if not self.wait():
+                # Crashed: check for records published meanwhile, once
+                block = False
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+
+# Copyright 2019 The GraphicsFuzz Project Authors
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import os
+import pathlib2
+import pytest
+import struct
+import sys
+
+HERE = os.path.abspath(__file__)
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(HERE)) + os.sep + "drivers")
+import pack_vkworker_corpus
+
+
+def write_shader_job(directory: pathlib2.Path, name: str, vert: bytes, frag: bytes, json: str):
+    (directory / (name + '.vert.spv')).write_bytes(vert)
+    (directory / (name + '.frag.spv')).write_bytes(frag)
+    (directory / (name + '.json')).write_text(json)
+
+
+def read_corpus(corpus: pathlib2.Path):
+    data = corpus.read_bytes()
+    magic, version, num_jobs = struct.unpack_from(pack_vkworker_corpus.CORPUS_HEADER_FORMAT, data)
+    assert magic == pack_vkworker_corpus.CORPUS_MAGIC
+    assert version == pack_vkworker_corpus.CORPUS_VERSION
+    header_size = struct.calcsize(pack_vkworker_corpus.CORPUS_HEADER_FORMAT)
+    entry_size = struct.calcsize(pack_vkworker_corpus.CORPUS_INDEX_ENTRY_FORMAT)
+    jobs = []
+    for i in range(0, num_jobs):
+        (name_offset, name_size, vertex_offset, vertex_num_words, fragment_offset,
+         fragment_num_words, uniforms_offset, uniforms_size) = struct.unpack_from(
+            pack_vkworker_corpus.CORPUS_INDEX_ENTRY_FORMAT, data, header_size + i * entry_size)
+        assert vertex_offset % 4 == 0
+        assert fragment_offset % 4 == 0
+        assert data[name_offset + name_size] == 0
+        assert data[uniforms_offset + uniforms_size] == 0
+        jobs.append((
+            data[name_offset:name_offset + name_size].decode('utf-8'),
+            data[vertex_offset:vertex_offset + vertex_num_words * 4],
+            data[fragment_offset:fragment_offset + fragment_num_words * 4],
+            data[uniforms_offset:uniforms_offset + uniforms_size].decode('utf-8')))
+    return jobs
+
+
+def test_pack_shader_family(tmp_path: pathlib2.Path):
+    family = tmp_path / 'family'
+    family.mkdir()
+    write_shader_job(family, 'reference', b'\x03\x02\x23\x07', b'\x03\x02\x23\x07\x01\x00\x00\x00',
+                     '{}')
+    write_shader_job(family, 'variant_000', b'\x03\x02\x23\x07\x02\x00\x00\x00',
+                     b'\x03\x02\x23\x07', '{"injectionSwitch": {}}')
+    corpus = tmp_path / 'corpus.bin'
+    pack_vkworker_corpus.main_helper([str(family), str(corpus)])
+
+    jobs = read_corpus(corpus)
+    assert jobs == [
+        ('reference', b'\x03\x02\x23\x07', b'\x03\x02\x23\x07\x01\x00\x00\x00', '{}'),
+        ('variant_000', b'\x03\x02\x23\x07\x02\x00\x00\x00', b'\x03\x02\x23\x07',
+         '{"injectionSwitch": {}}'),
+    ]
+
+
+def test_pack_skips_json_without_shader(tmp_path: pathlib2.Path):
+    family = tmp_path / 'family'
+    family.mkdir()
+    write_shader_job(family, 'reference', b'\x03\x02\x23\x07', b'\x03\x02\x23\x07', '{}')
+    (family / 'infos.json').write_text('{}')
+    corpus = tmp_path / 'corpus.bin'
+    pack_vkworker_corpus.main_helper([str(family), str(corpus)])
+
+    jobs = read_corpus(corpus)
+    assert [job[0] for job in jobs] == ['reference']
+
+
+def test_pack_rejects_fragment_shader_without_vertex_shader(tmp_path: pathlib2.Path):
+    family = tmp_path / 'family'
+    family.mkdir()
+    (family / 'reference.frag.spv').write_bytes(b'\x03\x02\x23\x07')
+    (family / 'reference.json').write_text('{}')
+    with pytest.raises(ValueError) as value_error:
+        pack_vkworker_corpus.main_helper([str(family), str(tmp_path / 'corpus.bin')])
+    assert 'requires accompanying vertex shader' in str(value_error)
+
+
+def test_pack_rejects_missing_directory(tmp_path: pathlib2.Path):
+    with pytest.raises(ValueError) as value_error:
+        pack_vkworker_corpus.main_helper([str(tmp_path / 'missing'), str(tmp_path / 'corpus.bin')])
+    assert 'not found' in str(value_error)
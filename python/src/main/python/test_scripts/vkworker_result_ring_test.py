@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+
+# Copyright 2019 The GraphicsFuzz Project Authors
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import os
+import pathlib2
+import pytest
+import struct
+import sys
+
+HERE = os.path.abspath(__file__)
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(HERE)) + os.sep + "drivers")
+import vkworker_result_ring
+
+DATA_OFFSET = 4096
+DATA_SIZE = 1024
+
+
+def align(offset: int) -> int:
+    return (offset + 63) // 64 * 64
+
+
+class RingWriter:
+    """Writes records as the worker does."""
+
+    def __init__(self, ring: pathlib2.Path, worker_pid: int = 1234, generation: int = 0,
+                 data_size: int = DATA_SIZE):
+        self.ring = ring
+        self.data_size = data_size
+        self.data = bytearray(DATA_OFFSET + data_size)
+        self.write_offset = 0
+        self.closed = 0
+        self.worker_pid = worker_pid
+        self.generation = generation
+        # A new worker starts with a released buffer
+        if self.ring.exists():
+            with open(str(self.ring), 'r+b') as f:
+                f.truncate(DATA_OFFSET + data_size)
+                f.seek(vkworker_result_ring.RING_READ_OFFSET_OFFSET)
+                f.write(bytes(8))
+        self.flush()
+
+    def flush(self):
+        struct.pack_into(vkworker_result_ring.RING_HEADER_FORMAT, self.data, 0,
+                         vkworker_result_ring.RING_MAGIC, vkworker_result_ring.RING_VERSION,
+                         DATA_OFFSET, self.data_size, self.write_offset, 0, self.worker_pid,
+                         self.closed, self.generation)
+        with open(str(self.ring), 'r+b' if self.ring.exists() else 'wb') as f:
+            f.seek(0)
+            f.write(self.data[0:vkworker_result_ring.RING_READ_OFFSET_OFFSET])
+            f.seek(vkworker_result_ring.RING_READ_OFFSET_OFFSET + 8)
+            f.write(self.data[vkworker_result_ring.RING_READ_OFFSET_OFFSET + 8:])
+
+    def write(self, record_type: int, name: str, content: bytes, width: int = 0, height: int = 0):
+        header_size = struct.calcsize(vkworker_result_ring.RECORD_HEADER_FORMAT)
+        data_offset = align(header_size + len(name))
+        size = align(data_offset + len(content))
+        position = self.write_offset % self.data_size
+        if self.data_size - position < size:
+            struct.pack_into(vkworker_result_ring.RECORD_HEADER_FORMAT, self.data,
+                             DATA_OFFSET + position, vkworker_result_ring.RECORD_PADDING, 0,
+                             self.data_size - position, 0, 0, 0, 0)
+            self.write_offset += self.data_size - position
+            position = 0
+        start = DATA_OFFSET + position
+        struct.pack_into(vkworker_result_ring.RECORD_HEADER_FORMAT, self.data, start, record_type,
+                         len(name), size, data_offset, len(content), width, height)
+        self.data[start + header_size:start + header_size + len(name)] = name.encode('utf-8')
+        self.data[start + data_offset:start + data_offset + len(content)] = content
+        self.write_offset += size
+        self.flush()
+
+
+def test_read_records(tmp_path: pathlib2.Path):
+    writer = RingWriter(tmp_path / 'ring')
+    writer.write(vkworker_result_ring.RECORD_FRAME, 'variant_0.png', b'\x01\x02\x03\x04' * 4, 2, 2)
+    writer.write(vkworker_result_ring.RECORD_FILE, 'variant_num_render.txt', b'3\n')
+    writer.closed = 1
+    writer.flush()
+
+    ring = vkworker_result_ring.ResultRing(str(tmp_path / 'ring'))
+    records = []
+    for record in ring.records():
+        records.append((record.type, record.name, bytes(record.data), record.width, record.height))
+    assert records == [
+        (vkworker_result_ring.RECORD_FRAME, 'variant_0.png', b'\x01\x02\x03\x04' * 4, 2, 2),
+        (vkworker_result_ring.RECORD_FILE, 'variant_num_render.txt', b'3\n', 0, 0),
+    ]
+    assert ring.read_offset == writer.write_offset
+    ring.close()
+
+
+def test_records_wrap_around(tmp_path: pathlib2.Path):
+    writer = RingWriter(tmp_path / 'ring')
+    ring = vkworker_result_ring.ResultRing(str(tmp_path / 'ring'))
+    names = []
+    for i in range(0, 10):
+        writer.write(vkworker_result_ring.RECORD_FILE, 'file_' + str(i), bytes([i]) * 300)
+        for record in ring.records(block=False):
+            assert bytes(record.data) == bytes([i]) * 300
+            names.append(record.name)
+    assert names == ['file_' + str(i) for i in range(0, 10)]
+    assert writer.write_offset > DATA_SIZE
+    ring.close()
+
+
+def test_restarted_worker(tmp_path: pathlib2.Path):
+    writer = RingWriter(tmp_path / 'ring')
+    ring = vkworker_result_ring.ResultRing(str(tmp_path / 'ring'))
+    for i in range(0, 3):
+        writer.write(vkworker_result_ring.RECORD_FILE, 'old_' + str(i), bytes([i]) * 100)
+    assert [record.name for record in ring.records(block=False)] == ['old_0', 'old_1', 'old_2']
+    assert ring.read_offset == writer.write_offset
+
+    # The worker crashed and another one, with a larger buffer, starts over from offset 0
+    writer = RingWriter(tmp_path / 'ring', worker_pid=5678, generation=1, data_size=2 * DATA_SIZE)
+    writer.write(vkworker_result_ring.RECORD_FILE, 'new_0', b'\x07' * 1500)
+    names = []
+    for record in ring.records(block=False):
+        assert bytes(record.data) == b'\x07' * 1500
+        names.append(record.name)
+    assert names == ['new_0']
+    assert ring.read_offset == writer.write_offset
+    assert ring.data_size == 2 * DATA_SIZE
+    ring.close()
+
+
+def test_same_pid_next_generation(tmp_path: pathlib2.Path):
+    writer = RingWriter(tmp_path / 'ring')
+    ring = vkworker_result_ring.ResultRing(str(tmp_path / 'ring'))
+    writer.write(vkworker_result_ring.RECORD_FILE, 'old', bytes(500))
+    assert [record.name for record in ring.records(block=False)] == ['old']
+
+    writer = RingWriter(tmp_path / 'ring', generation=1)
+    writer.write(vkworker_result_ring.RECORD_FILE, 'new', bytes(100))
+    assert [record.name for record in ring.records(block=False)] == ['new']
+    assert ring.read_offset == writer.write_offset
+    ring.close()
+
+
+def test_rejects_other_files(tmp_path: pathlib2.Path):
+    (tmp_path / 'ring').write_bytes(b'\0' * (DATA_OFFSET + DATA_SIZE))
+    with pytest.raises(ValueError) as value_error:
+        vkworker_result_ring.ResultRing(str(tmp_path / 'ring'))
+    assert 'Not a result ring buffer' in str(value_error)
@@ -19,6 +19,7 @@
 #include "platform.h"
 
 #include <assert.h>
+#include <stdlib.h> // exit()
 #include <string>
 #include <sstream>
 #include <iostream>
@@ -29,6 +30,8 @@ typedef struct AppData {
   FILE *vertex_file;
   FILE *fragment_file;
   FILE *uniform_file;
+  FILE *batch_file;
+  Corpus *corpus;
 } AppData;
 
 void ProcessAppCmd (struct android_app *app, int32_t cmd) {
@@ -47,10 +50,16 @@ void ProcessAppCmd (struct android_app *app, int32_t cmd) {
         assert(app->window != nullptr);
         app_data->platform_data->window = app->window;
         app_data->vulkan_worker = new VulkanWorker(app_data->platform_data);
-        assert(app_data->vertex_file != nullptr);
-        assert(app_data->fragment_file != nullptr);
-        assert(app_data->uniform_file != nullptr);
-        app_data->vulkan_worker->RunTest(app_data->vertex_file, app_data->fragment_file, app_data->uniform_file, FLAGS_skip_render);
+        if (app_data->batch_file != nullptr) {
+          app_data->vulkan_worker->RunBatch(app_data->batch_file);
+        } else if (app_data->corpus != nullptr) {
+          app_data->vulkan_worker->RunCorpus(app_data->corpus, FLAGS_skip_render);
+        } else {
+          assert(app_data->vertex_file != nullptr);
+          assert(app_data->fragment_file != nullptr);
+          assert(app_data->uniform_file != nullptr);
+          app_data->vulkan_worker->RunTest(app_data->vertex_file, app_data->fragment_file, app_data->uniform_file, FLAGS_skip_render);
+        }
         ANativeActivity_finish(app->activity);
       }
       break;
@@ -172,6 +181,54 @@ void android_main(struct android_app* state) {
   FLAGS_info = false;
   FLAGS_skip_render = false;
   FLAGS_num_render = 3;
+  FLAGS_fast_render = false;
+  FLAGS_max_render = 0;
+  FLAGS_batch = "";
+  FLAGS_batch_columns = 16;
+  FLAGS_batch_max_tiles = 64;
+  FLAGS_gpu_hash = false;
+  FLAGS_reference_hash = "";
+  FLAGS_corpus = "";
+  FLAGS_prefetch_depth = 4;
+  FLAGS_coherence_every = 1;
+  FLAGS_compile_timeout_ms = 0;
+  FLAGS_watchdog_file = "/sdcard/graphicsfuzz/WATCHDOG";
+  FLAGS_crash_file = "";
+  FLAGS_async_log = false;
+  FLAGS_log_buffer = 4096;
+  FLAGS_log_overflow = "block";
+  FLAGS_metrics_file = "";
+  FLAGS_metrics_port = 0;
+  FLAGS_metrics_interval_ms = 10000;
+  FLAGS_async_output = false;
+  FLAGS_output_fsync = "none";
+  FLAGS_output_shards = 0;
+  FLAGS_result_cache = "";
+  FLAGS_interesting_if = "";
+  FLAGS_reference_image = "";
+  FLAGS_compare = "exact";
+  FLAGS_fuzzy_component_threshold = 25;
+  FLAGS_fuzzy_distance_threshold = 4;
+  FLAGS_fuzzy_bad_pixels_threshold = 100;
+  FLAGS_fuzzy_bad_sparse_pixels_threshold = 10;
+  FLAGS_save_images = false;
+  FLAGS_host_memory_stats = false;
+  FLAGS_recycle_memory_growth_mb = 0;
+  FLAGS_recycle_leaky_jobs = 0;
+  FLAGS_compile_farm = "";
+  FLAGS_compile_threads = 4;
+  FLAGS_batch_journal = "";
+  FLAGS_pipeline_cache = "";
+  FLAGS_pipeline_cache_max_mb = 256;
+  FLAGS_pipeline_cache_export_interval = 100;
+  FLAGS_result_transport = "";
+  FLAGS_result_transport_mb = 64;
+  FLAGS_perf_reference = "";
+  FLAGS_perf_iterations = 30;
+  FLAGS_perf_warmup = 5;
+  FLAGS_perf_draws = 16;
+  FLAGS_perf_slowdown = 1.5;
+  FLAGS_device = 0;
 
   int argc = 0;
   char **argv = nullptr;
@@ -179,8 +236,20 @@ void android_main(struct android_app* state) {
   gflags::SetUsageMessage("GraphicsFuzz Vulkan worker http://github.com/google/graphicsfuzz");
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 
+  // Results handed through the ring buffer are never PNG files, which the
+  // result cache stores
+  if (!FLAGS_result_transport.empty() && !FLAGS_result_cache.empty()) {
+    log("Error: --result_transport cannot be used with --result_cache");
+    exit(EXIT_FAILURE);
+  }
+
   AppData *app_data = new AppData;
   app_data->vulkan_worker = nullptr;
+  app_data->vertex_file = nullptr;
+  app_data->fragment_file = nullptr;
+  app_data->uniform_file = nullptr;
+  app_data->batch_file = nullptr;
+  app_data->corpus = nullptr;
   state->userData = (void *)app_data;
 
   PlatformData platform_data = {};
@@ -191,7 +260,14 @@ void android_main(struct android_app* state) {
   state->onAppCmd = ProcessAppCmd;
   state->onInputEvent = ProcessInputEvent;
 
-  if (!FLAGS_info) {
+  if (!FLAGS_info && !FLAGS_batch.empty()) {
+    log("BATCH");
+    app_data->batch_file = fopen(FLAGS_batch.c_str(), "r");
+    assert(app_data->batch_file != nullptr);
+  } else if (!FLAGS_info && !FLAGS_corpus.empty()) {
+    log("CORPUS");
+    app_data->corpus = new Corpus(FLAGS_corpus.c_str());
+  } else if (!FLAGS_info) {
     log("NOT DUMP INFO");
     app_data->vertex_file = fopen("/sdcard/graphicsfuzz/test.vert.spv", "r");
     assert(app_data->vertex_file != nullptr);
@@ -237,6 +313,12 @@ void android_main(struct android_app* state) {
         if (app_data->uniform_file != nullptr) {
           fclose(app_data->uniform_file);
         }
+        if (app_data->batch_file != nullptr) {
+          fclose(app_data->batch_file);
+        }
+        if (app_data->corpus != nullptr) {
+          delete app_data->corpus;
+        }
         delete app_data;
 
         log("\nANDROID TERMINATE OK\n");
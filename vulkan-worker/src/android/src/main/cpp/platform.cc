@@ -57,3 +57,8 @@ void PlatformGetWidthHeight(PlatformData *platform_data, uint32_t *width, uint32
   }
   *height = height_value;
 }
+
+// Called by the log sink flusher
+void PlatformWriteLog(const char *line) {
+  __android_log_write(ANDROID_LOG_INFO, "GfzVk", line);
+}
@@ -22,7 +22,9 @@
 #include <android/log.h> // __android_log_print()
 #include <vector> // std::vector<>
 
-#define log(...) __android_log_print(ANDROID_LOG_INFO, "GfzVk", __VA_ARGS__)
+#include "log_sink.h"
+
+#define log(...) (LogSink::IsRunning() ? LogSink::Print(__VA_ARGS__) : (void)__android_log_print(ANDROID_LOG_INFO, "GfzVk", __VA_ARGS__))
 
 typedef struct PlatformData {
   ANativeWindow *window;
@@ -32,5 +34,6 @@ void PlatformGetInstanceExtensions(std::vector<const char *>& extensions);
 void PlatformGetInstanceLayers(std::vector<const char*> &layers);
 void PlatformCreateSurface(PlatformData *platform_data, VkInstance instance, VkSurfaceKHR *surface);
 void PlatformGetWidthHeight(PlatformData *platform_data, uint32_t *width, uint32_t *height);
+void PlatformWriteLog(const char *line);
 
 #endif
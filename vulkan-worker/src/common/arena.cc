@@ -0,0 +1,118 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "arena.h"
+#include "platform.h"
+
+#include <assert.h> // assert()
+#include <stdlib.h> // malloc(), free()
+
+Arena::Arena(size_t chunk_size) {
+  used_ = 0;
+  num_chunk_allocations_ = 0;
+  AddChunk(chunk_size);
+}
+
+Arena::~Arena() {
+  for (Chunk &chunk : chunks_) {
+    free(chunk.data);
+  }
+}
+
+void Arena::AddChunk(size_t size) {
+  Chunk chunk;
+  // malloc() returns memory aligned for any fundamental type
+  chunk.data = (unsigned char *)malloc(size);
+  assert(chunk.data != nullptr);
+  chunk.size = size;
+  chunks_.push_back(chunk);
+  used_ = 0;
+  num_chunk_allocations_++;
+}
+
+void *Arena::Allocate(size_t size, size_t alignment) {
+  assert(alignment <= alignof(max_align_t) && (alignment & (alignment - 1)) == 0);
+  size_t offset = (used_ + alignment - 1) & ~(alignment - 1);
+  if (offset + size > chunks_.back().size) {
+    // Grow geometrically, such that a large job needs few chunks
+    size_t chunk_size = 2 * chunks_.back().size;
+    AddChunk(chunk_size > size ? chunk_size : size);
+    offset = 0;
+  }
+  used_ = offset + size;
+  return chunks_.back().data + offset;
+}
+
+bool Arena::Contains(const void *memory) const {
+  for (const Chunk &chunk : chunks_) {
+    if ((const unsigned char *)memory >= chunk.data && (const unsigned char *)memory < chunk.data + chunk.size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Arena::Reset() {
+  if (chunks_.size() > 1) {
+    size_t total_size = 0;
+    for (Chunk &chunk : chunks_) {
+      total_size += chunk.size;
+      free(chunk.data);
+    }
+    chunks_.clear();
+    AddChunk(total_size);
+  }
+  used_ = 0;
+}
+
+size_t Arena::GetNumChunkAllocations() const {
+  return num_chunk_allocations_;
+}
+
+ArenaPool::ArenaPool(size_t chunk_size) {
+  chunk_size_ = chunk_size;
+}
+
+ArenaPool::~ArenaPool() {
+  for (Arena *arena : arenas_) {
+    delete arena;
+  }
+}
+
+Arena *ArenaPool::Acquire() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (free_arenas_.empty()) {
+    Arena *arena = new Arena(chunk_size_);
+    arenas_.push_back(arena);
+    return arena;
+  }
+  Arena *arena = free_arenas_.back();
+  free_arenas_.pop_back();
+  return arena;
+}
+
+void ArenaPool::Release(Arena *arena) {
+  arena->Reset();
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_arenas_.push_back(arena);
+}
+
+void ArenaPool::LogCounters() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t num_chunk_allocations = 0;
+  for (Arena *arena : arenas_) {
+    num_chunk_allocations += arena->GetNumChunkAllocations();
+  }
+  log("ARENAPOOL arenas %zu chunk allocations %zu", arenas_.size(), num_chunk_allocations);
+}
@@ -0,0 +1,69 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <stddef.h>
+
+#include <mutex>
+#include <vector>
+
+// Bump allocator for the host data of a job: file contents, parsed uniforms,
+// image buffers. Memory is not freed piecewise but all at once by Reset(),
+// which keeps the memory for the next job. When a job did not fit in a single
+// chunk, Reset() replaces the chunks by one large enough, such that a steady
+// stream of similar jobs does not call malloc() at all. Not thread safe: an
+// arena is used by one thread at a time.
+class Arena {
+  private:
+  typedef struct Chunk {
+    unsigned char *data;
+    size_t size;
+  } Chunk;
+
+  std::vector<Chunk> chunks_;
+  // In the last chunk
+  size_t used_;
+  size_t num_chunk_allocations_;
+
+  void AddChunk(size_t size);
+
+  public:
+  Arena(size_t chunk_size);
+  ~Arena();
+  void *Allocate(size_t size, size_t alignment = alignof(max_align_t));
+  bool Contains(const void *memory) const;
+  void Reset();
+  size_t GetNumChunkAllocations() const;
+};
+
+// Arenas handed out to jobs, e.g. by the prefetch thread, and given back once
+// the job is done, e.g. by the render thread.
+class ArenaPool {
+  private:
+  size_t chunk_size_;
+  std::mutex mutex_;
+  std::vector<Arena *> free_arenas_;
+  std::vector<Arena *> arenas_;
+
+  public:
+  ArenaPool(size_t chunk_size);
+  ~ArenaPool();
+  Arena *Acquire();
+  void Release(Arena *arena);
+  void LogCounters();
+};
+
+#endif
@@ -0,0 +1,149 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "batch_journal.h"
+#include "platform.h"
+
+#include <assert.h> // assert()
+#include <fcntl.h> // open()
+#include <string.h> // strcmp()
+#include <unistd.h> // write(), close()
+
+#include <fstream>
+
+BatchJournal::BatchJournal(const char *filename) {
+  std::vector<std::string> records;
+  std::ifstream journal(filename);
+  std::string line;
+  while (std::getline(journal, line)) {
+    records.push_back(line);
+  }
+
+  fd_ = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  assert(fd_ >= 0 && "Cannot open batch journal");
+  Replay(records);
+}
+
+BatchJournal::~BatchJournal() {
+  close(fd_);
+}
+
+void BatchJournal::Append(const std::string &job, const std::string &record) {
+  std::string line = job + " " + record + "\n";
+  ssize_t num_written = write(fd_, line.data(), line.size());
+  assert(num_written == (ssize_t)line.size() && "Cannot write batch journal");
+  (void)num_written;
+}
+
+// Jobs that were in flight when the previous run stopped are run again, except
+// the one the last record names, which crashed the worker. When that record is
+// the render of an atlas, the crash may come from any job of the atlas.
+void BatchJournal::Replay(const std::vector<std::string> &records) {
+  std::string last_job;
+  std::string last_stage;
+  for (const std::string &record : records) {
+    size_t separator = record.find(' ');
+    if (separator == std::string::npos) {
+      // Cut short
+      continue;
+    }
+    std::string job = record.substr(0, separator);
+    std::string stage = record.substr(separator + 1);
+    JournalJob &state = jobs_[job];
+    if (stage == "DONE") {
+      state.stage = stage;
+      state.finished = true;
+    } else if (stage.compare(0, 6, "CRASH ") == 0) {
+      state.stage = stage.substr(6);
+      state.finished = true;
+    } else if (stage == "ISOLATE") {
+      // Pending again, not in flight
+      state.stage.clear();
+      state.isolated = true;
+    } else {
+      state.stage = stage;
+      state.finished = false;
+    }
+    last_job = job;
+    last_stage = stage;
+  }
+
+  std::vector<std::string> rendering;
+  for (auto &job : jobs_) {
+    if (!job.second.finished && job.second.stage == "IMAGE_RENDER") {
+      rendering.push_back(job.first);
+    }
+  }
+
+  if (last_stage == "IMAGE_RENDER" && rendering.size() > 1) {
+    for (const std::string &job : rendering) {
+      Append(job, "ISOLATE");
+      jobs_[job].stage.clear();
+      jobs_[job].isolated = true;
+    }
+  } else if (!last_job.empty() && !jobs_[last_job].finished && !jobs_[last_job].stage.empty()) {
+    JournalJob &state = jobs_[last_job];
+    Append(last_job, "CRASH " + state.stage);
+    state.finished = true;
+    JournalCrash crash;
+    crash.job = last_job;
+    crash.stage = state.stage;
+    crashes_.push_back(crash);
+  }
+}
+
+bool BatchJournal::IsFinished(const std::string &job) const {
+  auto state = jobs_.find(job);
+  return state != jobs_.end() && state->second.finished;
+}
+
+bool BatchJournal::IsIsolated(const std::string &job) const {
+  auto state = jobs_.find(job);
+  return state != jobs_.end() && state->second.isolated;
+}
+
+const std::vector<JournalCrash> &BatchJournal::GetCrashes() const {
+  return crashes_;
+}
+
+void BatchJournal::Record(const std::string &job, const char *stage) {
+  current_job_ = strcmp(stage, "IMAGE_PREPARE") == 0 ? job : "";
+  Append(job, stage);
+}
+
+// Stages within PrepareTest(), which also prepares pipelines of no job, e.g.
+// for coherence frames.
+void BatchJournal::RecordStage(const char *stage) {
+  if (!current_job_.empty()) {
+    Append(current_job_, stage);
+  }
+}
+
+void BatchJournal::LogCounters() {
+  size_t num_done = 0;
+  size_t num_crashed = 0;
+  size_t num_isolated = 0;
+  for (auto &job : jobs_) {
+    if (job.second.finished) {
+      if (job.second.stage == "DONE") {
+        num_done++;
+      } else {
+        num_crashed++;
+      }
+    } else if (job.second.isolated) {
+      num_isolated++;
+    }
+  }
+  log("BATCHJOURNAL replayed %zu done, %zu crashed, %zu isolated", num_done, num_crashed, num_isolated);
+}
@@ -0,0 +1,73 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __BATCH_JOURNAL__
+#define __BATCH_JOURNAL__
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Progress of a batch job, as replayed from the journal
+typedef struct JournalJob {
+  // Last stage recorded, e.g. IMAGE_RENDER, or DONE
+  std::string stage;
+  // DONE or CRASH: the job is not run again
+  bool finished;
+  // Was in flight with other jobs when the worker crashed, see Replay()
+  bool isolated;
+} JournalJob;
+
+// A job found to have crashed the worker, with the stage it was at
+typedef struct JournalCrash {
+  std::string job;
+  std::string stage;
+} JournalCrash;
+
+// Append-only journal of batch jobs going through JobStage values, such that a
+// worker restarted after a driver crash resumes the batch where it stopped.
+// Each record is one line, '<job> <stage>', written with a single write() as
+// the stage starts: a crash of the process cannot lose it. Stages are named
+// after the JobStage values of the server, plus DONE, and 'CRASH <stage>' for
+// jobs marked as crashed when the journal is replayed.
+//
+// Jobs of an atlas are rendered together: when the worker crashed while
+// rendering several jobs, the culprit is unknown. These jobs are marked
+// ISOLATE, and rendered alone by the next runs, such that a crash pins the
+// culprit down.
+class BatchJournal {
+  private:
+  int fd_;
+  std::map<std::string, JournalJob> jobs_;
+  // Job being prepared, for RecordStage()
+  std::string current_job_;
+  std::vector<JournalCrash> crashes_;
+
+  void Append(const std::string &job, const std::string &record);
+  void Replay(const std::vector<std::string> &records);
+
+  public:
+  BatchJournal(const char *filename);
+  ~BatchJournal();
+  bool IsFinished(const std::string &job) const;
+  bool IsIsolated(const std::string &job) const;
+  // Jobs marked as crashed by the replay
+  const std::vector<JournalCrash> &GetCrashes() const;
+  void Record(const std::string &job, const char *stage);
+  // For the job being prepared, if any
+  void RecordStage(const char *stage);
+  void LogCounters();
+};
+
+#endif
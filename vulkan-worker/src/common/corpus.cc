@@ -0,0 +1,80 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "corpus.h"
+#include "platform.h"
+
+#include <assert.h> // assert()
+#include <fcntl.h> // open()
+#include <string.h> // memcmp()
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+#include <unistd.h> // close()
+
+static const char kCorpusMagic[8] = {'G', 'F', 'Z', 'C', 'O', 'R', 'P', '\0'};
+static const uint32_t kCorpusVersion = 1;
+
+Corpus::Corpus(const char *filename) {
+  fd_ = open(filename, O_RDONLY);
+  if (fd_ < 0) {
+    log("Error: cannot open corpus %s", filename);
+    assert(false && "Cannot open corpus");
+  }
+
+  struct stat corpus_stat;
+  int fstat_result = fstat(fd_, &corpus_stat);
+  assert(fstat_result == 0);
+  size_ = corpus_stat.st_size;
+  assert(size_ >= sizeof(CorpusHeader) && "Corpus is too small");
+
+  void *mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  assert(mapped != MAP_FAILED);
+  data_ = (const unsigned char *)mapped;
+
+  header_ = (const CorpusHeader *)data_;
+  assert(memcmp(header_->magic, kCorpusMagic, sizeof(kCorpusMagic)) == 0 && "Not a corpus file");
+  assert(header_->version == kCorpusVersion && "Unsupported corpus version");
+  assert(sizeof(CorpusHeader) + header_->num_jobs * sizeof(CorpusIndexEntry) <= size_ && "Corpus index is truncated");
+  index_ = (const CorpusIndexEntry *)(data_ + sizeof(CorpusHeader));
+
+  log("CORPUS %s: %u jobs", filename, header_->num_jobs);
+}
+
+Corpus::~Corpus() {
+  munmap((void *)data_, size_);
+  close(fd_);
+}
+
+uint32_t Corpus::GetNumJobs() {
+  return header_->num_jobs;
+}
+
+void Corpus::GetJob(uint32_t index, CorpusJob *job) {
+  assert(index < header_->num_jobs);
+  const CorpusIndexEntry *entry = &(index_[index]);
+
+  assert(entry->name_offset + entry->name_size < size_);
+  assert(entry->vertex_offset % sizeof(uint32_t) == 0);
+  assert(entry->vertex_offset + entry->vertex_num_words * sizeof(uint32_t) <= size_);
+  assert(entry->fragment_offset % sizeof(uint32_t) == 0);
+  assert(entry->fragment_offset + entry->fragment_num_words * sizeof(uint32_t) <= size_);
+  assert(entry->uniforms_offset + entry->uniforms_size < size_);
+
+  job->name = (const char *)(data_ + entry->name_offset);
+  job->vertex_spv = (const uint32_t *)(data_ + entry->vertex_offset);
+  job->vertex_num_words = entry->vertex_num_words;
+  job->fragment_spv = (const uint32_t *)(data_ + entry->fragment_offset);
+  job->fragment_num_words = entry->fragment_num_words;
+  job->uniforms = (const char *)(data_ + entry->uniforms_offset);
+}
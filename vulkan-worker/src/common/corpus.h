@@ -0,0 +1,69 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __CORPUS__
+#define __CORPUS__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A packed corpus gathers many jobs in a single file, which is memory-mapped
+// such that iterating over jobs needs no filesystem operation. Corpus files are
+// created by python/src/main/python/drivers/pack-vkworker-corpus, which
+// documents the format.
+
+typedef struct CorpusHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_jobs;
+} CorpusHeader;
+
+typedef struct CorpusIndexEntry {
+  uint64_t name_offset;
+  uint64_t name_size;
+  uint64_t vertex_offset;
+  uint64_t vertex_num_words;
+  uint64_t fragment_offset;
+  uint64_t fragment_num_words;
+  uint64_t uniforms_offset;
+  uint64_t uniforms_size;
+} CorpusIndexEntry;
+
+// Pointers into the mapped file, valid as long as the corpus is alive. Name
+// and uniforms are '\0'-terminated.
+typedef struct CorpusJob {
+  const char *name;
+  const uint32_t *vertex_spv;
+  size_t vertex_num_words;
+  const uint32_t *fragment_spv;
+  size_t fragment_num_words;
+  const char *uniforms;
+} CorpusJob;
+
+class Corpus {
+  private:
+  int fd_;
+  const unsigned char *data_;
+  size_t size_;
+  const CorpusHeader *header_;
+  const CorpusIndexEntry *index_;
+
+  public:
+  Corpus(const char *filename);
+  ~Corpus();
+  uint32_t GetNumJobs();
+  void GetJob(uint32_t index, CorpusJob *job);
+};
+
+#endif
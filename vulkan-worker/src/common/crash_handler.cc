@@ -0,0 +1,356 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "crash_handler.h"
+#include "platform.h"
+
+#include <fcntl.h> // open()
+#include <link.h> // dl_iterate_phdr()
+#include <pthread.h> // pthread_getattr_np()
+#include <signal.h> // sigaction()
+#include <stdlib.h> // malloc()
+#include <string.h> // strncpy()
+#include <ucontext.h> // ucontext_t
+#include <unistd.h> // write(), unlink(), readlink()
+
+#include <atomic>
+#include <string>
+
+static const int kCrashSignals[] = { SIGSEGV, SIGABRT, SIGBUS, SIGFPE };
+static const int kNumCrashSignals = sizeof(kCrashSignals) / sizeof(kCrashSignals[0]);
+static const int kMaxFrames = 64;
+static const int kMaxModules = 512;
+static const size_t kAlternateStackSize = 64 * 1024;
+
+// The executable range of a loaded module. Offsets are relative to base, the
+// load address, as addr2line and llvm-symbolizer expect.
+typedef struct Module {
+  uintptr_t base;
+  uintptr_t start;
+  uintptr_t end;
+  char name[128];
+} Module;
+
+// Modules are listed ahead of time, as dl_iterate_phdr() and dladdr() take
+// the loader lock: there are two snapshots, such that the handler always
+// reads a complete one while UpdateModules() writes the other.
+typedef struct ModuleSnapshot {
+  Module modules[kMaxModules];
+  int num_modules;
+} ModuleSnapshot;
+
+// Everything the handler needs is allocated at installation: the handler only
+// formats into these buffers and calls write().
+static int record_fd_ = -1;
+static std::string record_filename_;
+static struct sigaction previous_actions_[kNumCrashSignals];
+static char record_[16 * 1024];
+static size_t record_size_;
+static ModuleSnapshot module_snapshots_[2];
+static std::atomic<int> current_snapshot_(0);
+static char executable_name_[128];
+
+// Each thread has its own alternate stack, and the bounds of its stack such
+// that frame pointers are only followed inside of it.
+static thread_local void *alternate_stack_ = nullptr;
+static thread_local uintptr_t stack_low_ = 0;
+static thread_local uintptr_t stack_high_ = 0;
+// Compile farm threads run jobs concurrently: the stage and the job are the
+// ones of the faulting thread, as crash signals are delivered to the thread
+// that raised them.
+static thread_local std::atomic<const char *> stage_("NOT_STARTED");
+static thread_local std::atomic<int64_t> job_id_(-1);
+static thread_local char job_name_[256];
+
+static void Append(const char *string) {
+  while (*string != '\0' && record_size_ < sizeof(record_)) {
+    record_[record_size_++] = *string++;
+  }
+}
+
+static void AppendHex(uintptr_t value) {
+  char digits[2 + 2 * sizeof(value) + 1];
+  digits[0] = '0';
+  digits[1] = 'x';
+  for (size_t i = 0; i < 2 * sizeof(value); i++) {
+    digits[2 + i] = "0123456789abcdef"[(value >> (4 * (2 * sizeof(value) - 1 - i))) & 0xf];
+  }
+  digits[sizeof(digits) - 1] = '\0';
+  Append(digits);
+}
+
+static void AppendDecimal(int64_t value) {
+  char digits[24];
+  int i = sizeof(digits) - 1;
+  digits[i] = '\0';
+  uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  do {
+    digits[--i] = '0' + (magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0) {
+    digits[--i] = '-';
+  }
+  Append(digits + i);
+}
+
+static const char *GetSignalName(int signal_number) {
+  switch (signal_number) {
+    case SIGSEGV: return "SIGSEGV";
+    case SIGABRT: return "SIGABRT";
+    case SIGBUS: return "SIGBUS";
+    case SIGFPE: return "SIGFPE";
+    default: return "UNKNOWN";
+  }
+}
+
+// The program counter, stack pointer and frame pointer at the fault
+static void GetFaultingRegisters(void *context, uintptr_t *pc, uintptr_t *sp, uintptr_t *fp) {
+  ucontext_t *ucontext = (ucontext_t *)context;
+#if defined(__x86_64__)
+  *pc = (uintptr_t)ucontext->uc_mcontext.gregs[REG_RIP];
+  *sp = (uintptr_t)ucontext->uc_mcontext.gregs[REG_RSP];
+  *fp = (uintptr_t)ucontext->uc_mcontext.gregs[REG_RBP];
+#elif defined(__i386__)
+  *pc = (uintptr_t)ucontext->uc_mcontext.gregs[REG_EIP];
+  *sp = (uintptr_t)ucontext->uc_mcontext.gregs[REG_ESP];
+  *fp = (uintptr_t)ucontext->uc_mcontext.gregs[REG_EBP];
+#elif defined(__aarch64__)
+  *pc = (uintptr_t)ucontext->uc_mcontext.pc;
+  *sp = (uintptr_t)ucontext->uc_mcontext.sp;
+  *fp = (uintptr_t)ucontext->uc_mcontext.regs[29];
+#else
+  // The layout of frame records is not fixed on 32-bit ARM: only the faulting
+  // instruction is recorded.
+  (void)ucontext;
+  *pc = 0;
+  *sp = 0;
+  *fp = 0;
+#if defined(__arm__)
+  *pc = (uintptr_t)ucontext->uc_mcontext.arm_pc;
+#endif
+#endif
+}
+
+static void AppendFrame(int index, uintptr_t pc) {
+  Append("frame ");
+  AppendDecimal(index);
+  Append(" ");
+  const ModuleSnapshot *snapshot = &module_snapshots_[current_snapshot_.load()];
+  for (int i = 0; i < snapshot->num_modules; i++) {
+    const Module *module = &snapshot->modules[i];
+    if (pc >= module->start && pc < module->end) {
+      Append(module->name);
+      Append("+");
+      AppendHex(pc - module->base);
+      Append("\n");
+      return;
+    }
+  }
+  AppendHex(pc);
+  Append("\n");
+}
+
+// Frames are found by following the frame pointer chain from the faulting
+// context, not from the handler: the frames of the handler and of the signal
+// trampoline are never part of the record. The walk stops at the first frame
+// pointer that is not inside of the stack of the thread, and reads nothing
+// else, such that it cannot fault. Code built without frame pointers ends
+// the chain early.
+static void AppendFrames(void *context) {
+  uintptr_t pc = 0;
+  uintptr_t sp = 0;
+  uintptr_t fp = 0;
+  GetFaultingRegisters(context, &pc, &sp, &fp);
+  if (pc == 0) {
+    return;
+  }
+  AppendFrame(0, pc);
+
+  int num_frames = 1;
+  uintptr_t low = sp;
+  while (num_frames < kMaxFrames && stack_high_ != 0 && fp >= low && fp >= stack_low_ &&
+         fp + 2 * sizeof(uintptr_t) <= stack_high_ && fp % sizeof(uintptr_t) == 0) {
+    // A frame record is the caller's frame pointer then the return address
+    const uintptr_t *record = (const uintptr_t *)fp;
+    uintptr_t return_address = record[1];
+    if (return_address == 0) {
+      break;
+    }
+    // Return addresses follow the call: report the call instruction
+    AppendFrame(num_frames++, return_address - 1);
+    low = fp + 2 * sizeof(uintptr_t);
+    fp = record[0];
+  }
+}
+
+static void HandleCrash(int signal_number, siginfo_t *info, void *context) {
+  record_size_ = 0;
+  Append("signal ");
+  Append(GetSignalName(signal_number));
+  // Raised signals have no faulting address
+  if (signal_number != SIGABRT) {
+    Append("\naddress ");
+    AppendHex((uintptr_t)info->si_addr);
+  }
+  Append("\nstage ");
+  Append(stage_.load());
+  Append("\njob_id ");
+  AppendDecimal(job_id_.load());
+  Append("\njob ");
+  Append(job_name_);
+  Append("\n");
+  AppendFrames(context);
+
+  size_t written = 0;
+  while (written < record_size_) {
+    ssize_t result = write(record_fd_, record_ + written, record_size_ - written);
+    if (result <= 0) {
+      break;
+    }
+    written += result;
+  }
+  // Also in the log, as catchsegv output used to be
+  write(STDOUT_FILENO, record_, record_size_);
+
+  // The handler was reset on entry: terminate with the original signal, such
+  // that the exit status is the same as without the crash handler.
+  raise(signal_number);
+}
+
+static int AddModule(struct dl_phdr_info *info, size_t, void *data) {
+  ModuleSnapshot *snapshot = (ModuleSnapshot *)data;
+  const char *name = info->dlpi_name;
+  if (name == nullptr || name[0] == '\0') {
+    name = executable_name_;
+  }
+  const char *base_name = strrchr(name, '/');
+  base_name = base_name != nullptr ? base_name + 1 : name;
+  for (int i = 0; i < info->dlpi_phnum && snapshot->num_modules < kMaxModules; i++) {
+    const ElfW(Phdr) *header = &info->dlpi_phdr[i];
+    if (header->p_type != PT_LOAD || (header->p_flags & PF_X) == 0) {
+      continue;
+    }
+    Module *module = &snapshot->modules[snapshot->num_modules++];
+    module->base = (uintptr_t)info->dlpi_addr;
+    module->start = module->base + header->p_vaddr;
+    module->end = module->start + header->p_memsz;
+    strncpy(module->name, base_name, sizeof(module->name) - 1);
+    module->name[sizeof(module->name) - 1] = '\0';
+  }
+  return 0;
+}
+
+void CrashHandler::UpdateModules() {
+  if (record_fd_ < 0) {
+    return;
+  }
+  int next_snapshot = 1 - current_snapshot_.load();
+  module_snapshots_[next_snapshot].num_modules = 0;
+  dl_iterate_phdr(AddModule, &module_snapshots_[next_snapshot]);
+  current_snapshot_.store(next_snapshot);
+}
+
+void CrashHandler::Install(const char *record_filename) {
+  record_filename_ = record_filename;
+  record_fd_ = open(record_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (record_fd_ < 0) {
+    log("Error: cannot open crash record file %s", record_filename);
+    return;
+  }
+
+  ssize_t length = readlink("/proc/self/exe", executable_name_, sizeof(executable_name_) - 1);
+  executable_name_[length > 0 ? length : 0] = '\0';
+  UpdateModules();
+  InstallThread();
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = HandleCrash;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  for (int i = 0; i < kNumCrashSignals; i++) {
+    sigaction(kCrashSignals[i], &action, &previous_actions_[i]);
+  }
+  log("CRASHHANDLER %s", record_filename);
+}
+
+// The record file is only left behind by a crash
+void CrashHandler::Uninstall() {
+  if (record_fd_ < 0) {
+    return;
+  }
+  for (int i = 0; i < kNumCrashSignals; i++) {
+    sigaction(kCrashSignals[i], &previous_actions_[i], nullptr);
+  }
+  UninstallThread();
+  close(record_fd_);
+  record_fd_ = -1;
+  unlink(record_filename_.c_str());
+}
+
+// On an alternate stack, such that stack overflows are recorded too. The
+// alternate stack is per thread: threads that do not call this are left
+// without one.
+void CrashHandler::InstallThread() {
+  if (record_fd_ < 0 || alternate_stack_ != nullptr) {
+    return;
+  }
+  alternate_stack_ = malloc(kAlternateStackSize);
+  if (alternate_stack_ != nullptr) {
+    stack_t stack = {};
+    stack.ss_sp = alternate_stack_;
+    stack.ss_size = kAlternateStackSize;
+    stack.ss_flags = 0;
+    sigaltstack(&stack, nullptr);
+  }
+
+  pthread_attr_t attributes;
+  if (pthread_getattr_np(pthread_self(), &attributes) == 0) {
+    void *stack_address = nullptr;
+    size_t stack_size = 0;
+    if (pthread_attr_getstack(&attributes, &stack_address, &stack_size) == 0) {
+      stack_low_ = (uintptr_t)stack_address;
+      stack_high_ = stack_low_ + stack_size;
+    }
+    pthread_attr_destroy(&attributes);
+  }
+}
+
+void CrashHandler::UninstallThread() {
+  if (alternate_stack_ == nullptr) {
+    return;
+  }
+  stack_t disabled_stack = {};
+  disabled_stack.ss_flags = SS_DISABLE;
+  sigaltstack(&disabled_stack, nullptr);
+  free(alternate_stack_);
+  alternate_stack_ = nullptr;
+  stack_low_ = 0;
+  stack_high_ = 0;
+}
+
+void CrashHandler::SetStage(const char *stage) {
+  stage_.store(stage);
+}
+
+void CrashHandler::SetJobId(int64_t job_id) {
+  job_id_.store(job_id);
+}
+
+// A crash of this thread while the name is being set may record a mix of both
+// names
+void CrashHandler::SetJobName(const char *job_name) {
+  strncpy(job_name_, job_name, sizeof(job_name_) - 1);
+}
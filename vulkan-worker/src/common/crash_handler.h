@@ -0,0 +1,61 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __CRASH_HANDLER__
+#define __CRASH_HANDLER__
+
+#include <stdint.h>
+
+// Signal handlers for SIGSEGV, SIGABRT, SIGBUS and SIGFPE, which write a crash
+// record to a file opened at installation, then let the signal terminate the
+// process as it would have without them. The record is plain text, one field
+// per line, e.g.:
+//
+//   signal SIGSEGV
+//   address 0x0000000000000010
+//   stage IMAGE_VALIDATE_PROGRAM
+//   job_id 42
+//   job results/variant_001/image
+//   frame 0 libvulkan_intel.so+0x00000000004a2b10
+//   frame 1 libvulkan_intel.so+0x000000000039c8e4
+//
+// Stages are named after the JobStage values of the server, except for
+// RECYCLE_DEVICE, a label of this worker for crashes between jobs while the
+// device is recreated, which the server has no value for. Frames start at
+// the faulting instruction, and are given as module and offset, such that
+// crashes can be deduplicated across runs; symbolize them offline, e.g. with
+// addr2line -e <module> <offset>. The handler only writes: modules are listed
+// at installation and by UpdateModules(), and frames are found by following
+// frame pointers. The record file is removed on clean exit.
+//
+// State is global, as signal handlers are: there is at most one installed
+// crash handler per process. Only the stage, job id and job name are per
+// thread. Threads that may crash, other than the one that installs the
+// handler, call InstallThread() first and UninstallThread() before they exit,
+// for an alternate stack of their own.
+class CrashHandler {
+  public:
+  static void Install(const char *record_filename);
+  static void Uninstall();
+  static void InstallThread();
+  static void UninstallThread();
+  // Call after loading libraries, such as the driver, whose frames to record
+  static void UpdateModules();
+  // stage must be a string literal
+  static void SetStage(const char *stage);
+  static void SetJobId(int64_t job_id);
+  static void SetJobName(const char *job_name);
+};
+
+#endif
@@ -0,0 +1,178 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "host_allocator.h"
+
+#include <assert.h> // assert()
+#include <stdio.h> // snprintf()
+#include <stdlib.h> // posix_memalign(), free()
+#include <string.h> // memcpy()
+
+// Stored right before each block handed to the driver
+typedef struct AllocationHeader {
+  size_t size;
+  // From the start of the underlying allocation to the block
+  size_t offset;
+} AllocationHeader;
+
+static void UpdatePeak(std::atomic<int64_t> &peak, int64_t value) {
+  int64_t current = peak.load(std::memory_order_relaxed);
+  while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+  }
+}
+
+HostAllocator::HostAllocator() {
+  callbacks_.pUserData = this;
+  callbacks_.pfnAllocation = AllocationFunction;
+  callbacks_.pfnReallocation = ReallocationFunction;
+  callbacks_.pfnFree = FreeFunction;
+  callbacks_.pfnInternalAllocation = InternalAllocationNotification;
+  callbacks_.pfnInternalFree = InternalFreeNotification;
+  for (int i = 0; i < kNumAllocationScopes; i++) {
+    allocated_bytes_[i].store(0);
+  }
+  num_allocations_.store(0);
+  live_allocations_.store(0);
+  total_live_bytes_.store(0);
+  peak_bytes_.store(0);
+  job_peak_bytes_.store(0);
+  job_start_ = HostMemoryUsage();
+}
+
+const VkAllocationCallbacks *HostAllocator::GetCallbacks() const {
+  return &callbacks_;
+}
+
+void HostAllocator::CountAllocation(size_t size, VkSystemAllocationScope scope) {
+  allocated_bytes_[scope].fetch_add(size, std::memory_order_relaxed);
+  num_allocations_.fetch_add(1, std::memory_order_relaxed);
+  live_allocations_.fetch_add(1, std::memory_order_relaxed);
+  int64_t live = total_live_bytes_.fetch_add(size, std::memory_order_relaxed) + (int64_t)size;
+  UpdatePeak(peak_bytes_, live);
+  UpdatePeak(job_peak_bytes_, live);
+}
+
+void HostAllocator::CountFree(size_t size) {
+  live_allocations_.fetch_sub(1, std::memory_order_relaxed);
+  total_live_bytes_.fetch_sub(size, std::memory_order_relaxed);
+}
+
+void *HostAllocator::Allocate(size_t size, size_t alignment, VkSystemAllocationScope scope) {
+  assert(scope >= 0 && scope < kNumAllocationScopes);
+  // Vulkan alignments are powers of two
+  if (alignment < alignof(max_align_t)) {
+    alignment = alignof(max_align_t);
+  }
+  size_t offset = (sizeof(AllocationHeader) + alignment - 1) & ~(alignment - 1);
+  void *base = nullptr;
+  if (posix_memalign(&base, alignment, offset + size) != 0) {
+    return nullptr;
+  }
+  unsigned char *memory = (unsigned char *)base + offset;
+  AllocationHeader *header = (AllocationHeader *)memory - 1;
+  header->size = size;
+  header->offset = offset;
+  CountAllocation(size, scope);
+  return memory;
+}
+
+void HostAllocator::Free(void *memory) {
+  if (memory == nullptr) {
+    return;
+  }
+  AllocationHeader *header = (AllocationHeader *)memory - 1;
+  CountFree(header->size);
+  free((unsigned char *)memory - header->offset);
+}
+
+VKAPI_ATTR void *VKAPI_CALL HostAllocator::AllocationFunction(void *user_data, size_t size, size_t alignment, VkSystemAllocationScope scope) {
+  return ((HostAllocator *)user_data)->Allocate(size, alignment, scope);
+}
+
+VKAPI_ATTR void *VKAPI_CALL HostAllocator::ReallocationFunction(void *user_data, void *original, size_t size, size_t alignment, VkSystemAllocationScope scope) {
+  HostAllocator *allocator = (HostAllocator *)user_data;
+  if (original == nullptr) {
+    return allocator->Allocate(size, alignment, scope);
+  }
+  if (size == 0) {
+    allocator->Free(original);
+    return nullptr;
+  }
+  // The original block is left untouched on failure, as required
+  void *memory = allocator->Allocate(size, alignment, scope);
+  if (memory == nullptr) {
+    return nullptr;
+  }
+  size_t original_size = ((AllocationHeader *)original - 1)->size;
+  memcpy(memory, original, original_size < size ? original_size : size);
+  allocator->Free(original);
+  return memory;
+}
+
+VKAPI_ATTR void VKAPI_CALL HostAllocator::FreeFunction(void *user_data, void *memory) {
+  ((HostAllocator *)user_data)->Free(memory);
+}
+
+// Memory the driver allocates by itself, e.g. executable memory for shaders
+VKAPI_ATTR void VKAPI_CALL HostAllocator::InternalAllocationNotification(void *user_data, size_t size, VkInternalAllocationType, VkSystemAllocationScope scope) {
+  ((HostAllocator *)user_data)->CountAllocation(size, scope);
+}
+
+VKAPI_ATTR void VKAPI_CALL HostAllocator::InternalFreeNotification(void *user_data, size_t size, VkInternalAllocationType, VkSystemAllocationScope) {
+  ((HostAllocator *)user_data)->CountFree(size);
+}
+
+void HostAllocator::GetUsage(HostMemoryUsage *usage) {
+  for (int i = 0; i < kNumAllocationScopes; i++) {
+    usage->allocated_bytes[i] = allocated_bytes_[i].load(std::memory_order_relaxed);
+  }
+  usage->num_allocations = num_allocations_.load(std::memory_order_relaxed);
+  usage->live_bytes = total_live_bytes_.load(std::memory_order_relaxed);
+  usage->live_allocations = live_allocations_.load(std::memory_order_relaxed);
+  usage->peak_bytes = peak_bytes_.load(std::memory_order_relaxed);
+}
+
+void HostAllocator::BeginJob() {
+  GetUsage(&job_start_);
+  job_peak_bytes_.store(job_start_.live_bytes, std::memory_order_relaxed);
+}
+
+// The peak of a job is relative to the memory live when it started
+void HostAllocator::EndJob(HostMemoryUsage *usage) {
+  GetUsage(usage);
+  for (int i = 0; i < kNumAllocationScopes; i++) {
+    usage->allocated_bytes[i] -= job_start_.allocated_bytes[i];
+  }
+  usage->num_allocations -= job_start_.num_allocations;
+  usage->live_bytes -= job_start_.live_bytes;
+  usage->live_allocations -= job_start_.live_allocations;
+  usage->peak_bytes = job_peak_bytes_.load(std::memory_order_relaxed) - job_start_.live_bytes;
+}
+
+std::string HostAllocator::FormatUsage(const HostMemoryUsage &usage) {
+  uint64_t allocated_bytes = 0;
+  for (int i = 0; i < kNumAllocationScopes; i++) {
+    allocated_bytes += usage.allocated_bytes[i];
+  }
+  char text[512];
+  snprintf(text, sizeof(text), "allocated %llu bytes in %llu allocations (command %llu, object %llu, cache %llu, device %llu, instance %llu), live %lld bytes in %lld allocations, peak %lld bytes",
+           (unsigned long long)allocated_bytes, (unsigned long long)usage.num_allocations,
+           (unsigned long long)usage.allocated_bytes[VK_SYSTEM_ALLOCATION_SCOPE_COMMAND],
+           (unsigned long long)usage.allocated_bytes[VK_SYSTEM_ALLOCATION_SCOPE_OBJECT],
+           (unsigned long long)usage.allocated_bytes[VK_SYSTEM_ALLOCATION_SCOPE_CACHE],
+           (unsigned long long)usage.allocated_bytes[VK_SYSTEM_ALLOCATION_SCOPE_DEVICE],
+           (unsigned long long)usage.allocated_bytes[VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE],
+           (long long)usage.live_bytes, (long long)usage.live_allocations, (long long)usage.peak_bytes);
+  return text;
+}
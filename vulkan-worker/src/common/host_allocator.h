@@ -0,0 +1,77 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __HOST_ALLOCATOR__
+#define __HOST_ALLOCATOR__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include <vulkan/vulkan.h>
+
+// One counter per VkSystemAllocationScope
+const int kNumAllocationScopes = VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE + 1;
+
+// Host memory used by the driver, in bytes. For a job, counts are relative to
+// the start of the job: live_bytes still allocated at the end of a job were
+// leaked by it, or are held in a driver cache.
+typedef struct HostMemoryUsage {
+  // Allocated, by VkSystemAllocationScope, including internal allocations
+  uint64_t allocated_bytes[kNumAllocationScopes];
+  uint64_t num_allocations;
+  int64_t live_bytes;
+  int64_t live_allocations;
+  // Highest live_bytes seen
+  int64_t peak_bytes;
+} HostMemoryUsage;
+
+// VkAllocationCallbacks that count the host memory the driver allocates on
+// behalf of the worker. Drivers may allocate from their own threads, hence the
+// atomic counters. Each block is preceded by a header holding its size, such
+// that frees can be accounted for.
+class HostAllocator {
+  private:
+  VkAllocationCallbacks callbacks_;
+  std::atomic<uint64_t> allocated_bytes_[kNumAllocationScopes];
+  std::atomic<uint64_t> num_allocations_;
+  std::atomic<int64_t> live_allocations_;
+  std::atomic<int64_t> total_live_bytes_;
+  std::atomic<int64_t> peak_bytes_;
+  std::atomic<int64_t> job_peak_bytes_;
+  // See BeginJob()
+  HostMemoryUsage job_start_;
+
+  void CountAllocation(size_t size, VkSystemAllocationScope scope);
+  void CountFree(size_t size);
+  void *Allocate(size_t size, size_t alignment, VkSystemAllocationScope scope);
+  void Free(void *memory);
+  static VKAPI_ATTR void *VKAPI_CALL AllocationFunction(void *user_data, size_t size, size_t alignment, VkSystemAllocationScope scope);
+  static VKAPI_ATTR void *VKAPI_CALL ReallocationFunction(void *user_data, void *original, size_t size, size_t alignment, VkSystemAllocationScope scope);
+  static VKAPI_ATTR void VKAPI_CALL FreeFunction(void *user_data, void *memory);
+  static VKAPI_ATTR void VKAPI_CALL InternalAllocationNotification(void *user_data, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope);
+  static VKAPI_ATTR void VKAPI_CALL InternalFreeNotification(void *user_data, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope);
+
+  public:
+  HostAllocator();
+  const VkAllocationCallbacks *GetCallbacks() const;
+  void GetUsage(HostMemoryUsage *usage);
+  void BeginJob();
+  void EndJob(HostMemoryUsage *usage);
+  static std::string FormatUsage(const HostMemoryUsage &usage);
+};
+
+#endif
@@ -0,0 +1,117 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "job_prefetcher.h"
+#include "crash_handler.h"
+#include "platform.h"
+
+#include <assert.h> // assert()
+#include <stdlib.h> // free()
+
+#include <chrono>
+
+JobPrefetcher::JobPrefetcher(size_t num_jobs, size_t depth, LoadFunction load) {
+  load_ = load;
+  num_jobs_ = num_jobs;
+  depth_ = depth;
+  num_loaded_ = 0;
+  num_popped_ = 0;
+  quit_ = false;
+  num_starved_ = 0;
+  starved_microseconds_ = 0;
+  num_full_ = 0;
+  if (depth_ > 0 && num_jobs_ > 0) {
+    thread_ = std::thread([this] {
+      CrashHandler::InstallThread();
+      Run();
+      CrashHandler::UninstallThread();
+    });
+  }
+}
+
+JobPrefetcher::~JobPrefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  condition_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+
+  // Jobs that were loaded but never popped still own their uniform values.
+  // Arenas are freed with their pool.
+  for (TestJob &job : queue_) {
+    if (job.arena != nullptr) {
+      continue;
+    }
+    for (UniformEntry &uniform_entry : job.uniform_entries) {
+      free(uniform_entry.value);
+    }
+  }
+}
+
+void JobPrefetcher::Run() {
+  for (size_t index = 0; index < num_jobs_; index++) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (queue_.size() >= depth_) {
+        num_full_++;
+        condition_.wait(lock, [this] { return quit_ || queue_.size() < depth_; });
+      }
+      if (quit_) {
+        return;
+      }
+    }
+
+    // Load without holding the lock, such that Pop() can proceed meanwhile
+    TestJob job;
+    load_(index, &job);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(job));
+      num_loaded_++;
+    }
+    condition_.notify_all();
+  }
+}
+
+void JobPrefetcher::Pop(TestJob *job) {
+  assert(num_popped_ < num_jobs_ && "No job left to pop");
+
+  if (depth_ == 0) {
+    load_(num_popped_, job);
+    num_popped_++;
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (queue_.empty()) {
+    num_starved_++;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    condition_.wait(lock, [this] { return !queue_.empty(); });
+    starved_microseconds_ += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+  *job = std::move(queue_.front());
+  queue_.pop_front();
+  num_popped_++;
+  lock.unlock();
+  condition_.notify_all();
+}
+
+void JobPrefetcher::LogCounters() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  log("PREFETCH depth %zu jobs %zu starved %zu (%lld us) full %zu", depth_, num_popped_, num_starved_, (long long)starved_microseconds_, num_full_);
+}
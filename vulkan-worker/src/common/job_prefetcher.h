@@ -0,0 +1,66 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __JOB_PREFETCHER__
+#define __JOB_PREFETCHER__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "vulkan_worker.h"
+
+// Loads jobs on a background thread, in order, ahead of the job loop: reading
+// files and parsing uniforms then overlap with pipeline creation and rendering.
+// At most `depth` loaded jobs wait in the queue. With a depth of 0, there is no
+// thread and each job is loaded by Pop().
+//
+// The counters tell whether the job loop starves on I/O: a starved Pop() had to
+// wait for the loader, while a full queue means the loader is ahead.
+class JobPrefetcher {
+  public:
+  typedef std::function<void(size_t index, TestJob *job)> LoadFunction;
+
+  private:
+  LoadFunction load_;
+  size_t num_jobs_;
+  size_t depth_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<TestJob> queue_;
+  size_t num_loaded_;
+  size_t num_popped_;
+  bool quit_;
+
+  // Counters
+  size_t num_starved_;
+  int64_t starved_microseconds_;
+  size_t num_full_;
+
+  void Run();
+
+  public:
+  JobPrefetcher(size_t num_jobs, size_t depth, LoadFunction load);
+  ~JobPrefetcher();
+  void Pop(TestJob *job);
+  void LogCounters();
+};
+
+#endif
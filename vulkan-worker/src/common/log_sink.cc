@@ -0,0 +1,188 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "log_sink.h"
+#include "platform.h"
+
+#include <assert.h> // assert()
+#include <stdarg.h> // va_list
+#include <stdio.h> // vsnprintf(), fflush()
+#include <string.h> // strcmp()
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+static const size_t kLogTextSize = 1000;
+
+// A slot of the ring. The sequence number tells whether the slot is free for
+// the producer at a given position, or ready for the consumer, see
+// http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+typedef struct LogRecord {
+  std::atomic<size_t> sequence;
+  int64_t time_us;
+  int64_t job_id;
+  char text[kLogTextSize];
+} LogRecord;
+
+static LogRecord *records_ = nullptr;
+static size_t capacity_ = 0;
+static LogOverflowPolicy overflow_policy_ = LOG_OVERFLOW_BLOCK;
+static std::atomic<bool> running_(false);
+static std::atomic<bool> quit_(false);
+static std::atomic<size_t> enqueue_position_(0);
+static std::atomic<size_t> dequeue_position_(0);
+static std::atomic<size_t> num_dropped_(0);
+static std::atomic<int64_t> job_id_(-1);
+static std::chrono::steady_clock::time_point start_time_;
+static std::thread flusher_;
+
+static void WriteRecord(const LogRecord *record) {
+  char line[kLogTextSize + 64];
+  int prefix_size;
+  if (record->job_id >= 0) {
+    prefix_size = snprintf(line, sizeof(line), "[%lld.%06lld job %lld] ", (long long)(record->time_us / 1000000), (long long)(record->time_us % 1000000), (long long)record->job_id);
+  } else {
+    prefix_size = snprintf(line, sizeof(line), "[%lld.%06lld] ", (long long)(record->time_us / 1000000), (long long)(record->time_us % 1000000));
+  }
+  snprintf(line + prefix_size, sizeof(line) - prefix_size, "%s", record->text);
+  PlatformWriteLog(line);
+}
+
+// Single consumer: records are written in the order their slots were claimed
+static void RunFlusher() {
+  while (true) {
+    bool drained = true;
+    size_t position = dequeue_position_.load(std::memory_order_relaxed);
+    while (true) {
+      LogRecord *record = &records_[position % capacity_];
+      if (record->sequence.load(std::memory_order_acquire) != position + 1) {
+        break;
+      }
+      WriteRecord(record);
+      record->sequence.store(position + capacity_, std::memory_order_release);
+      position++;
+      dequeue_position_.store(position, std::memory_order_release);
+      drained = false;
+    }
+    size_t num_dropped = num_dropped_.exchange(0);
+    if (num_dropped > 0) {
+      char line[64];
+      snprintf(line, sizeof(line), "LOGSINK dropped %zu records\n", num_dropped);
+      PlatformWriteLog(line);
+    }
+    if (!drained) {
+      fflush(stdout);
+    }
+    if (quit_.load() && position == enqueue_position_.load()) {
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+void LogSink::Start(size_t capacity, LogOverflowPolicy overflow_policy) {
+  assert(!running_.load() && capacity > 0);
+  capacity_ = capacity;
+  overflow_policy_ = overflow_policy;
+  records_ = new LogRecord[capacity_];
+  for (size_t i = 0; i < capacity_; i++) {
+    records_[i].sequence.store(i);
+  }
+  enqueue_position_.store(0);
+  dequeue_position_.store(0);
+  quit_.store(false);
+  start_time_ = std::chrono::steady_clock::now();
+  flusher_ = std::thread(RunFlusher);
+  running_.store(true);
+}
+
+// Writes all pending records. No other thread may log at this point.
+void LogSink::Stop() {
+  if (!running_.load()) {
+    return;
+  }
+  // Later records are written synchronously
+  running_.store(false);
+  quit_.store(true);
+  flusher_.join();
+  delete[] records_;
+  records_ = nullptr;
+}
+
+// Waits until the records logged so far are written
+void LogSink::Flush() {
+  if (!running_.load()) {
+    return;
+  }
+  size_t position = enqueue_position_.load();
+  while (dequeue_position_.load(std::memory_order_acquire) < position) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+bool LogSink::IsRunning() {
+  return running_.load(std::memory_order_relaxed);
+}
+
+void LogSink::SetJobId(int64_t job_id) {
+  job_id_.store(job_id);
+}
+
+void LogSink::Print(const char *format, ...) {
+  size_t position = enqueue_position_.load(std::memory_order_relaxed);
+  LogRecord *record;
+  while (true) {
+    record = &records_[position % capacity_];
+    size_t sequence = record->sequence.load(std::memory_order_acquire);
+    if (sequence == position) {
+      if (enqueue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (sequence < position) {
+      // The ring is full
+      if (overflow_policy_ == LOG_OVERFLOW_DROP) {
+        num_dropped_++;
+        return;
+      }
+      std::this_thread::yield();
+      position = enqueue_position_.load(std::memory_order_relaxed);
+    } else {
+      position = enqueue_position_.load(std::memory_order_relaxed);
+    }
+  }
+
+  record->time_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time_).count();
+  record->job_id = job_id_.load(std::memory_order_relaxed);
+  va_list arguments;
+  va_start(arguments, format);
+  int size = vsnprintf(record->text, kLogTextSize, format, arguments);
+  va_end(arguments);
+  if (size >= (int)kLogTextSize) {
+    // Keep the trailing newline of the format, if any
+    bool newline = format[0] != '\0' && format[strlen(format) - 1] == '\n';
+    strcpy(record->text + kLogTextSize - 5, newline ? "...\n" : "...");
+  }
+  record->sequence.store(position + 1, std::memory_order_release);
+}
+
+LogOverflowPolicy LogSink::ParseOverflowPolicy(const char *name) {
+  if (strcmp(name, "block") == 0) {
+    return LOG_OVERFLOW_BLOCK;
+  } else if (strcmp(name, "drop") == 0) {
+    return LOG_OVERFLOW_DROP;
+  }
+  assert(false && "Invalid log overflow policy, expected block or drop");
+  return LOG_OVERFLOW_BLOCK;
+}
@@ -0,0 +1,47 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __LOG_SINK__
+#define __LOG_SINK__
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum LogOverflowPolicy {
+  // Wait for the flusher to free a slot: no record is lost
+  LOG_OVERFLOW_BLOCK,
+  // Drop the record, the number of dropped records is logged
+  LOG_OVERFLOW_DROP,
+};
+
+// Asynchronous sink behind the log() macro of the platform layers. Once
+// started, log() formats the record into a slot of a bounded lock-free ring
+// buffer, and returns: a flusher thread prefixes each record with a timestamp
+// and the current job id, and hands it to PlatformWriteLog(). Before Start()
+// and after Stop(), log() writes synchronously, as it always did.
+//
+// Records still in the ring are lost if the process crashes: crash records
+// are written directly, and the watchdog flushes the ring before exiting.
+class LogSink {
+  public:
+  static void Start(size_t capacity, LogOverflowPolicy overflow_policy);
+  static void Stop();
+  static void Flush();
+  static bool IsRunning();
+  static void SetJobId(int64_t job_id);
+  static void Print(const char *format, ...) __attribute__((format(printf, 1, 2)));
+  static LogOverflowPolicy ParseOverflowPolicy(const char *name);
+};
+
+#endif
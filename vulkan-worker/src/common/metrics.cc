@@ -0,0 +1,282 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "metrics.h"
+#include "platform.h"
+
+#include <arpa/inet.h> // htons()
+#include <assert.h> // assert()
+#include <netinet/in.h> // sockaddr_in
+#include <poll.h> // poll()
+#include <stdio.h> // fopen(), rename()
+#include <string.h> // strcmp()
+#include <sys/socket.h> // socket()
+#include <unistd.h> // close()
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum MetricType {
+  METRIC_COUNTER,
+  METRIC_GAUGE,
+  METRIC_HISTOGRAM,
+};
+
+typedef struct MetricInfo {
+  const char *name;
+  MetricType type;
+  const char *help;
+} MetricInfo;
+
+static const MetricInfo kMetricInfos[] = {
+  { "gfz_uptime_seconds", METRIC_GAUGE, "Time since the worker started" },
+  { "gfz_jobs_total", METRIC_COUNTER, "Jobs done, by JobStatus" },
+  { "gfz_compile_seconds", METRIC_HISTOGRAM, "Time to create the pipeline of a test, shader compilation included" },
+  { "gfz_render_seconds", METRIC_HISTOGRAM, "Time to render a frame" },
+  { "gfz_readback_seconds", METRIC_HISTOGRAM, "Time to read a frame back to host memory" },
+  { "gfz_encode_seconds", METRIC_HISTOGRAM, "Time to encode a frame to PNG" },
+  { "gfz_result_cache_lookups_total", METRIC_COUNTER, "Result cache lookups, by result" },
+  { "gfz_fence_timeouts_total", METRIC_COUNTER, "Fence waits that timed out and were retried" },
+  { "gfz_device_lost_total", METRIC_COUNTER, "Fence waits that failed with VK_ERROR_DEVICE_LOST" },
+  { "gfz_device_memory_bytes", METRIC_GAUGE, "Device memory allocated by the worker" },
+  { "gfz_host_memory_bytes", METRIC_GAUGE, "Host memory allocated by the driver, with --host_memory_stats" },
+  { "gfz_leaky_jobs_total", METRIC_COUNTER, "Jobs that left device memory or objects above their level before the job" },
+  { "gfz_device_recycles_total", METRIC_COUNTER, "Times the device was recreated because of memory growth" },
+};
+static const size_t kNumMetrics = sizeof(kMetricInfos) / sizeof(kMetricInfos[0]);
+
+// Upper bounds, in seconds, of latency histogram buckets
+static const double kBucketBounds[] = { 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+static const size_t kNumBuckets = sizeof(kBucketBounds) / sizeof(kBucketBounds[0]);
+
+typedef struct MetricValues {
+  // Counters and gauges, by labels
+  std::map<std::string, double> values;
+  // Histograms, the last bucket is +Inf
+  std::vector<uint64_t> bucket_counts;
+  double sum;
+  uint64_t count;
+} MetricValues;
+
+static std::mutex mutex_;
+static MetricValues metric_values_[kNumMetrics];
+static std::chrono::steady_clock::time_point start_time_ = std::chrono::steady_clock::now();
+
+static std::string filename_;
+static std::mutex file_mutex_;
+static int listen_fd_ = -1;
+static int32_t interval_ms_ = 0;
+static std::atomic<bool> quit_(false);
+static std::thread exporter_;
+
+static size_t GetMetricIndex(const char *name, MetricType type) {
+  for (size_t i = 0; i < kNumMetrics; i++) {
+    if (strcmp(kMetricInfos[i].name, name) == 0) {
+      assert(kMetricInfos[i].type == type && "Wrong metric type");
+      return i;
+    }
+  }
+  log("Error: unknown metric %s", name);
+  assert(false && "Unknown metric");
+  return 0;
+}
+
+void Metrics::Increment(const char *name, const std::string &labels) {
+  size_t index = GetMetricIndex(name, METRIC_COUNTER);
+  std::lock_guard<std::mutex> lock(mutex_);
+  metric_values_[index].values[labels] += 1;
+}
+
+void Metrics::Set(const char *name, double value) {
+  size_t index = GetMetricIndex(name, METRIC_GAUGE);
+  std::lock_guard<std::mutex> lock(mutex_);
+  metric_values_[index].values[""] = value;
+}
+
+void Metrics::ObserveMicroseconds(const char *name, int64_t microseconds) {
+  size_t index = GetMetricIndex(name, METRIC_HISTOGRAM);
+  double seconds = microseconds / 1e6;
+  std::lock_guard<std::mutex> lock(mutex_);
+  MetricValues &metric = metric_values_[index];
+  if (metric.bucket_counts.empty()) {
+    metric.bucket_counts.resize(kNumBuckets + 1, 0);
+    metric.sum = 0;
+    metric.count = 0;
+  }
+  size_t bucket = 0;
+  while (bucket < kNumBuckets && seconds > kBucketBounds[bucket]) {
+    bucket++;
+  }
+  metric.bucket_counts[bucket]++;
+  metric.sum += seconds;
+  metric.count++;
+}
+
+// Prometheus text exposition format, version 0.0.4
+std::string Metrics::Export() {
+  Set("gfz_uptime_seconds", std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time_).count());
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string text;
+  char line[256];
+  for (size_t i = 0; i < kNumMetrics; i++) {
+    const MetricInfo &info = kMetricInfos[i];
+    const MetricValues &metric = metric_values_[i];
+    const char *type_name = info.type == METRIC_COUNTER ? "counter" : (info.type == METRIC_GAUGE ? "gauge" : "histogram");
+    text += std::string("# HELP ") + info.name + " " + info.help + "\n";
+    text += std::string("# TYPE ") + info.name + " " + type_name + "\n";
+
+    if (info.type != METRIC_HISTOGRAM) {
+      for (const auto &value : metric.values) {
+        std::string labels = value.first.empty() ? "" : "{" + value.first + "}";
+        snprintf(line, sizeof(line), "%s%s %.10g\n", info.name, labels.c_str(), value.second);
+        text += line;
+      }
+      if (metric.values.empty() && info.type == METRIC_COUNTER) {
+        text += std::string(info.name) + " 0\n";
+      }
+      continue;
+    }
+
+    uint64_t cumulative_count = 0;
+    for (size_t bucket = 0; bucket <= kNumBuckets; bucket++) {
+      cumulative_count += metric.bucket_counts.empty() ? 0 : metric.bucket_counts[bucket];
+      if (bucket < kNumBuckets) {
+        snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", info.name, kBucketBounds[bucket], (unsigned long long)cumulative_count);
+      } else {
+        snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", info.name, (unsigned long long)cumulative_count);
+      }
+      text += line;
+    }
+    snprintf(line, sizeof(line), "%s_sum %.10g\n%s_count %llu\n", info.name, metric.bucket_counts.empty() ? 0.0 : metric.sum, info.name, (unsigned long long)cumulative_count);
+    text += line;
+  }
+  return text;
+}
+
+// Written under a temporary name, such that readers never see a partial file
+void Metrics::WriteFile() {
+  if (filename_.empty()) {
+    return;
+  }
+  std::string text = Export();
+  std::lock_guard<std::mutex> lock(file_mutex_);
+  std::string temporary_filename = filename_ + ".tmp";
+  FILE *file = fopen(temporary_filename.c_str(), "w");
+  if (file == nullptr) {
+    log("METRICS cannot write %s", temporary_filename.c_str());
+    return;
+  }
+  fwrite(text.data(), 1, text.size(), file);
+  fclose(file);
+  rename(temporary_filename.c_str(), filename_.c_str());
+}
+
+static void ServeRequest(int fd) {
+  // The request itself does not matter: any path gets the metrics
+  char request[1024];
+  struct pollfd request_poll = { fd, POLLIN, 0 };
+  if (poll(&request_poll, 1, 1000) > 0) {
+    ssize_t ignored = recv(fd, request, sizeof(request), 0);
+    (void)ignored;
+  }
+  std::string body = Metrics::Export();
+  std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+  size_t sent = 0;
+  while (sent < response.size()) {
+    ssize_t result = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+    if (result <= 0) {
+      break;
+    }
+    sent += result;
+  }
+}
+
+static void RunExporter() {
+  std::chrono::steady_clock::time_point next_write = std::chrono::steady_clock::now();
+  while (!quit_.load()) {
+    if (!filename_.empty() && std::chrono::steady_clock::now() >= next_write) {
+      Metrics::WriteFile();
+      next_write += std::chrono::milliseconds(interval_ms_);
+    }
+    // Short timeout, to notice Stop()
+    if (listen_fd_ < 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      continue;
+    }
+    struct pollfd listen_poll = { listen_fd_, POLLIN, 0 };
+    if (poll(&listen_poll, 1, 100) > 0) {
+      int fd = accept(listen_fd_, nullptr, nullptr);
+      if (fd >= 0) {
+        ServeRequest(fd);
+        close(fd);
+      }
+    }
+  }
+}
+
+// Metrics are only served to the local host
+static int Listen(int32_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons((uint16_t)port);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 4) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void Metrics::Start(const char *filename, int32_t port, int32_t interval_ms) {
+  filename_ = filename;
+  interval_ms_ = interval_ms > 0 ? interval_ms : 1000;
+  if (port > 0) {
+    listen_fd_ = Listen(port);
+    if (listen_fd_ < 0) {
+      log("METRICS cannot listen on port %d", port);
+    } else {
+      log("METRICS http://127.0.0.1:%d/metrics", port);
+    }
+  }
+  if (filename_.empty() && listen_fd_ < 0) {
+    return;
+  }
+  quit_.store(false);
+  exporter_ = std::thread(RunExporter);
+}
+
+// The file gets the final values
+void Metrics::Stop() {
+  if (!exporter_.joinable()) {
+    return;
+  }
+  quit_.store(true);
+  exporter_.join();
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+  }
+  WriteFile();
+}
@@ -0,0 +1,42 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __METRICS__
+#define __METRICS__
+
+#include <stdint.h>
+
+#include <string>
+
+// In-process registry of counters, gauges and latency histograms, exported in
+// the Prometheus text format, such that farm dashboards can follow the health
+// and throughput of long-running workers. All metrics are declared in the
+// table of metrics.cc, which gives their type and help text. Labels are given
+// in the exposition syntax, e.g. "status=\"SUCCESS\"".
+//
+// The exporter thread writes the metrics to a file periodically, and/or serves
+// them over HTTP on a local port. As the other process-wide facilities, the
+// registry is global.
+class Metrics {
+  public:
+  static void Increment(const char *name, const std::string &labels = "");
+  static void Set(const char *name, double value);
+  static void ObserveMicroseconds(const char *name, int64_t microseconds);
+  static std::string Export();
+  static void Start(const char *filename, int32_t port, int32_t interval_ms);
+  static void Stop();
+  static void WriteFile();
+};
+
+#endif
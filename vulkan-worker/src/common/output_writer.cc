@@ -0,0 +1,483 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "output_writer.h"
+#include "crash_handler.h"
+#include "platform.h"
+
+#include <assert.h> // assert()
+#include <errno.h> // errno
+#include <fcntl.h> // open()
+#include <string.h> // memset()
+#include <sys/stat.h> // mkdir()
+#include <sys/uio.h> // struct iovec
+#include <unistd.h> // pwrite(), fsync(), close()
+
+#include <set>
+
+// io_uring is used through raw system calls, to avoid depending on liburing.
+// Android does not allow it, and older kernels or sandboxes may not support it:
+// SetupRing() then fails and the writer thread writes files one by one.
+#if defined(__linux__) && !defined(__ANDROID__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define OUTPUT_WRITER_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h> // mmap()
+#include <sys/syscall.h> // syscall()
+#endif
+#endif
+
+// Each file of a batch needs up to two submission queue entries: write, fsync
+const unsigned kRingEntries = 64;
+const size_t kMaxBatchFiles = kRingEntries / 2;
+const uint64_t kFsyncUserData = 1ULL << 63;
+
+// Write() blocks above this amount of queued data, rather than exhausting memory
+const size_t kMaxQueuedBytes = 256 * 1024 * 1024;
+
+OutputWriter::OutputWriter(bool async, FsyncPolicy fsync_policy, uint32_t num_shards, ResultTransport *transport) {
+  // Handing a file to the transport is a copy to memory, nothing to wait for
+  async_ = async && transport == nullptr;
+  transport_ = transport;
+  fsync_policy_ = fsync_policy;
+  num_shards_ = num_shards;
+  queued_bytes_ = 0;
+  num_writing_ = 0;
+  quit_ = false;
+
+  ring_supported_ = false;
+  ring_fd_ = -1;
+  sq_ring_ = nullptr;
+  sq_ring_size_ = 0;
+  cq_ring_ = nullptr;
+  cq_ring_size_ = 0;
+  sqes_ = nullptr;
+  sqes_size_ = 0;
+
+  num_files_ = 0;
+  num_bytes_ = 0;
+  num_batches_ = 0;
+  num_errors_ = 0;
+  num_stalls_ = 0;
+
+  if (async_) {
+    SetupRing();
+    thread_ = std::thread([this] {
+      CrashHandler::InstallThread();
+      Run();
+      CrashHandler::UninstallThread();
+    });
+  }
+  log("OUTPUTWRITER %s", transport_ != nullptr ? "transport" : (!async_ ? "sync" : (ring_supported_ ? "io_uring" : "thread")));
+}
+
+OutputWriter::~OutputWriter() {
+  if (async_) {
+    Flush();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    condition_.notify_all();
+    thread_.join();
+    CleanRing();
+  }
+}
+
+void OutputWriter::SetupRing() {
+#ifdef OUTPUT_WRITER_IO_URING
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd_ = (int)syscall(__NR_io_uring_setup, kRingEntries, &params);
+  if (ring_fd_ < 0) {
+    log("OUTPUTWRITER io_uring not available: %s", strerror(errno));
+    return;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    sq_ring_size_ = sq_ring_size_ > cq_ring_size_ ? sq_ring_size_ : cq_ring_size_;
+  }
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    CleanRing();
+    return;
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      CleanRing();
+      return;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED) {
+    sqes_ = nullptr;
+    CleanRing();
+    return;
+  }
+
+  unsigned char *sq_ring = (unsigned char *)sq_ring_;
+  sq_head_ = (unsigned *)(sq_ring + params.sq_off.head);
+  sq_tail_ = (unsigned *)(sq_ring + params.sq_off.tail);
+  sq_mask_ = (unsigned *)(sq_ring + params.sq_off.ring_mask);
+  sq_array_ = (unsigned *)(sq_ring + params.sq_off.array);
+  unsigned char *cq_ring = (unsigned char *)cq_ring_;
+  cq_head_ = (unsigned *)(cq_ring + params.cq_off.head);
+  cq_tail_ = (unsigned *)(cq_ring + params.cq_off.tail);
+  cq_mask_ = (unsigned *)(cq_ring + params.cq_off.ring_mask);
+  cqes_ = cq_ring + params.cq_off.cqes;
+  ring_supported_ = true;
+#endif
+}
+
+void OutputWriter::CleanRing() {
+#ifdef OUTPUT_WRITER_IO_URING
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != nullptr) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+  }
+#endif
+  sqes_ = nullptr;
+  cq_ring_ = nullptr;
+  sq_ring_ = nullptr;
+  ring_fd_ = -1;
+  ring_supported_ = false;
+}
+
+// The content is taken over, and left empty
+void OutputWriter::Write(const std::string &filename, std::vector<unsigned char> &content) {
+  OutputFile file;
+  file.filename = filename;
+  file.content.swap(content);
+  size_t size = file.content.size();
+
+  if (transport_ != nullptr) {
+    transport_->WriteFile(file.filename, file.content.data(), size);
+    num_files_++;
+    num_bytes_ += size;
+    return;
+  }
+
+  if (!async_) {
+    std::vector<OutputFile> batch;
+    batch.push_back(std::move(file));
+    size_t num_errors = WriteBatch(batch);
+    num_files_++;
+    num_bytes_ += size;
+    num_batches_++;
+    num_errors_ += num_errors;
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (queued_bytes_ > kMaxQueuedBytes) {
+    num_stalls_++;
+    condition_.wait(lock, [this] { return queued_bytes_ <= kMaxQueuedBytes; });
+  }
+  queued_bytes_ += size;
+  queue_.push_back(std::move(file));
+  lock.unlock();
+  condition_.notify_all();
+}
+
+void OutputWriter::Write(const std::string &filename, const std::string &content) {
+  std::vector<unsigned char> bytes(content.begin(), content.end());
+  Write(filename, bytes);
+}
+
+// Waits until all queued files are written
+void OutputWriter::Flush() {
+  if (!async_) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  condition_.wait(lock, [this] { return queue_.empty() && num_writing_ == 0; });
+}
+
+size_t OutputWriter::GetNumErrors() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_errors_;
+}
+
+void OutputWriter::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    condition_.wait(lock, [this] { return quit_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+
+    std::vector<OutputFile> batch;
+    size_t batch_bytes = 0;
+    while (!queue_.empty() && batch.size() < kMaxBatchFiles) {
+      batch_bytes += queue_.front().content.size();
+      batch.push_back(std::move(queue_.front()));
+      queue_.pop_front();
+    }
+    num_writing_ = batch.size();
+    lock.unlock();
+
+    size_t num_errors = WriteBatch(batch);
+
+    lock.lock();
+    num_writing_ = 0;
+    queued_bytes_ -= batch_bytes;
+    num_files_ += batch.size();
+    num_bytes_ += batch_bytes;
+    num_batches_++;
+    num_errors_ += num_errors;
+    condition_.notify_all();
+  }
+}
+
+// Shard directories are created on first use
+int OutputWriter::OpenOutputFile(const std::string &filename) {
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0 && errno == ENOENT) {
+    size_t slash = filename.rfind('/');
+    if (slash != std::string::npos) {
+      mkdir(filename.substr(0, slash).c_str(), 0755);
+      fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+  }
+  if (fd < 0) {
+    log("OUTPUTWRITER cannot open %s: %s", filename.c_str(), strerror(errno));
+  }
+  return fd;
+}
+
+// Returns the number of files that could not be written
+size_t OutputWriter::WriteBatch(std::vector<OutputFile> &batch) {
+  size_t num_errors = 0;
+  std::vector<int> fds(batch.size());
+  for (size_t i = 0; i < batch.size(); i++) {
+    fds[i] = OpenOutputFile(batch[i].filename);
+    if (fds[i] < 0) {
+      num_errors++;
+    }
+  }
+
+  std::vector<size_t> written(batch.size(), 0);
+  if (ring_supported_) {
+    WriteBatchRing(batch, fds, written);
+  }
+  // Files not written through the ring, or only partly
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (fds[i] >= 0 && (written[i] < batch[i].content.size() || batch[i].content.empty() || !ring_supported_)) {
+      if (!WriteFile(fds[i], batch[i], written[i])) {
+        num_errors++;
+      }
+    }
+  }
+
+  for (int fd : fds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  if (fsync_policy_ == FSYNC_FULL) {
+    SyncDirectories(batch);
+  }
+  return num_errors;
+}
+
+// Submits a write, and an fsync if needed, for each open file of the batch in
+// a single system call, then waits for all completions. Records in written the
+// number of bytes written for each file whose fsync, if any, also succeeded:
+// anything else is redone by WriteFile().
+void OutputWriter::WriteBatchRing(std::vector<OutputFile> &batch, std::vector<int> &fds, std::vector<size_t> &written) {
+#ifdef OUTPUT_WRITER_IO_URING
+  assert(batch.size() <= kMaxBatchFiles);
+  std::vector<struct iovec> iovecs(batch.size());
+  struct io_uring_sqe *sqes = (struct io_uring_sqe *)sqes_;
+  struct io_uring_cqe *cqes = (struct io_uring_cqe *)cqes_;
+  unsigned tail = *sq_tail_;
+  unsigned num_entries = 0;
+
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (fds[i] < 0 || batch[i].content.empty()) {
+      continue;
+    }
+    iovecs[i].iov_base = batch[i].content.data();
+    iovecs[i].iov_len = batch[i].content.size();
+
+    unsigned index = tail & *sq_mask_;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fds[i];
+    sqe->addr = (uint64_t)(uintptr_t)&iovecs[i];
+    sqe->len = 1;
+    sqe->off = 0;
+    sqe->user_data = i;
+    if (fsync_policy_ != FSYNC_NONE) {
+      // The fsync only starts once the write completed
+      sqe->flags = IOSQE_IO_LINK;
+    }
+    sq_array_[index] = index;
+    tail++;
+    num_entries++;
+
+    if (fsync_policy_ != FSYNC_NONE) {
+      index = tail & *sq_mask_;
+      sqe = &sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_FSYNC;
+      sqe->fd = fds[i];
+      sqe->fsync_flags = (fsync_policy_ == FSYNC_DATA) ? IORING_FSYNC_DATASYNC : 0;
+      sqe->user_data = i | kFsyncUserData;
+      sq_array_[index] = index;
+      tail++;
+      num_entries++;
+    }
+  }
+  __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+  std::vector<size_t> write_results(batch.size(), 0);
+  std::vector<bool> fsync_failed(batch.size(), false);
+  unsigned num_submitted = 0;
+  unsigned num_completed = 0;
+  while (num_completed < num_entries) {
+    int result = (int)syscall(__NR_io_uring_enter, ring_fd_, num_entries - num_submitted, num_entries - num_completed, IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // Entries may be left in the ring: stop using it, files are rewritten
+      // from the start by WriteFile().
+      log("OUTPUTWRITER io_uring_enter failed: %s", strerror(errno));
+      CleanRing();
+      return;
+    }
+    num_submitted += result;
+
+    unsigned head = *cq_head_;
+    unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    while (head != cq_tail) {
+      struct io_uring_cqe *cqe = &cqes[head & *cq_mask_];
+      size_t i = (size_t)(cqe->user_data & ~kFsyncUserData);
+      if (cqe->user_data & kFsyncUserData) {
+        fsync_failed[i] = (cqe->res < 0);
+      } else {
+        write_results[i] = (cqe->res > 0) ? (size_t)cqe->res : 0;
+      }
+      head++;
+      num_completed++;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  for (size_t i = 0; i < batch.size(); i++) {
+    written[i] = fsync_failed[i] ? 0 : write_results[i];
+  }
+#else
+  (void)batch;
+  (void)fds;
+  (void)written;
+#endif
+}
+
+// Writes the content from the given offset, and syncs according to the policy
+bool OutputWriter::WriteFile(int fd, const OutputFile &file, size_t offset) {
+  while (offset < file.content.size()) {
+    ssize_t num_bytes = pwrite(fd, file.content.data() + offset, file.content.size() - offset, offset);
+    if (num_bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log("OUTPUTWRITER cannot write %s: %s", file.filename.c_str(), strerror(errno));
+      return false;
+    }
+    offset += num_bytes;
+  }
+  int result = 0;
+  if (fsync_policy_ == FSYNC_DATA) {
+    result = fdatasync(fd);
+  } else if (fsync_policy_ == FSYNC_FULL) {
+    result = fsync(fd);
+  }
+  if (result != 0) {
+    log("OUTPUTWRITER cannot sync %s: %s", file.filename.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// New directory entries are only durable once their directory is synced
+void OutputWriter::SyncDirectories(std::vector<OutputFile> &batch) {
+  std::set<std::string> directories;
+  for (OutputFile &file : batch) {
+    size_t slash = file.filename.rfind('/');
+    directories.insert(slash == std::string::npos ? "." : file.filename.substr(0, slash));
+  }
+  for (const std::string &directory : directories) {
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+}
+
+// With sharding, the files of a job go to one of num_shards subdirectories,
+// chosen by a hash of the job name, such that no directory gets huge:
+// "dir/name" becomes "dir/<shard>/name".
+std::string OutputWriter::ShardTemplate(const std::string &path_template) const {
+  if (num_shards_ == 0) {
+    return path_template;
+  }
+  size_t slash = path_template.rfind('/');
+  std::string directory = (slash == std::string::npos) ? "" : path_template.substr(0, slash + 1);
+  std::string name = (slash == std::string::npos) ? path_template : path_template.substr(slash + 1);
+  // FNV-1a
+  uint32_t hash = 2166136261U;
+  for (char c : name) {
+    hash = (hash ^ (unsigned char)c) * 16777619U;
+  }
+  return directory + std::to_string(hash % num_shards_) + "/" + name;
+}
+
+void OutputWriter::LogCounters() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  log("OUTPUTWRITER files %zu bytes %zu batches %zu errors %zu stalls %zu", num_files_, num_bytes_, num_batches_, num_errors_, num_stalls_);
+}
+
+FsyncPolicy OutputWriter::ParseFsyncPolicy(const std::string &name) {
+  if (name == "none") {
+    return FSYNC_NONE;
+  } else if (name == "data") {
+    return FSYNC_DATA;
+  } else if (name == "full") {
+    return FSYNC_FULL;
+  }
+  log("Error: invalid fsync policy: %s", name.c_str());
+  assert(false && "Invalid fsync policy, expected none, data or full");
+  return FSYNC_NONE;
+}
@@ -0,0 +1,112 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __OUTPUT_WRITER__
+#define __OUTPUT_WRITER__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "result_transport.h"
+
+enum FsyncPolicy {
+  // Leave it to the kernel
+  FSYNC_NONE,
+  // fdatasync() each file
+  FSYNC_DATA,
+  // fsync() each file and the directories it was created in
+  FSYNC_FULL,
+};
+
+typedef struct OutputFile {
+  std::string filename;
+  std::vector<unsigned char> content;
+} OutputFile;
+
+// Writes result files (images, hashes, ...) such that the render loop does not
+// block on disk. In asynchronous mode, files are queued and written in batches
+// by a writer thread, through io_uring when the kernel supports it, such that a
+// batch costs a single system call. Otherwise files are written when queued.
+// With a transport, files are handed to it instead of being written to disk.
+class OutputWriter {
+  private:
+  bool async_;
+  ResultTransport *transport_;
+  FsyncPolicy fsync_policy_;
+  uint32_t num_shards_;
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<OutputFile> queue_;
+  size_t queued_bytes_;
+  size_t num_writing_;
+  bool quit_;
+
+  // io_uring, see SetupRing()
+  bool ring_supported_;
+  int ring_fd_;
+  void *sq_ring_;
+  size_t sq_ring_size_;
+  void *cq_ring_;
+  size_t cq_ring_size_;
+  void *sqes_;
+  size_t sqes_size_;
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned *sq_mask_;
+  unsigned *sq_array_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned *cq_mask_;
+  void *cqes_;
+
+  // Counters
+  size_t num_files_;
+  size_t num_bytes_;
+  size_t num_batches_;
+  size_t num_errors_;
+  size_t num_stalls_;
+
+  void Run();
+  void SetupRing();
+  void CleanRing();
+  int OpenOutputFile(const std::string &filename);
+  size_t WriteBatch(std::vector<OutputFile> &batch);
+  void WriteBatchRing(std::vector<OutputFile> &batch, std::vector<int> &fds, std::vector<size_t> &written);
+  bool WriteFile(int fd, const OutputFile &file, size_t offset);
+  void SyncDirectories(std::vector<OutputFile> &batch);
+
+  public:
+  OutputWriter(bool async, FsyncPolicy fsync_policy, uint32_t num_shards, ResultTransport *transport);
+  ~OutputWriter();
+  void Write(const std::string &filename, std::vector<unsigned char> &content);
+  void Write(const std::string &filename, const std::string &content);
+  void Flush();
+  // Of files that could not be written, so far. Once flushed, a job whose
+  // files failed increased it.
+  size_t GetNumErrors();
+  std::string ShardTemplate(const std::string &path_template) const;
+  void LogCounters();
+  static FsyncPolicy ParseFsyncPolicy(const std::string &name);
+};
+
+#endif
@@ -0,0 +1,166 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "perf_stats.h"
+
+#include <assert.h> // assert()
+#include <math.h> // erfc(), log(), exp()
+
+#include <algorithm> // std::sort()
+#include <utility> // std::pair
+
+// Two-sided 95% quantile of the standard normal distribution
+static const double kNormalQuantile95 = 1.959964;
+// Durations are clamped to it before taking logarithms, in nanoseconds
+static const double kMinDuration = 1.0;
+
+// Linear interpolation between closest ranks
+static double Quantile(const std::vector<double> &sorted, double q) {
+  assert(!sorted.empty());
+  double position = q * (sorted.size() - 1);
+  size_t below = (size_t)position;
+  if (below + 1 >= sorted.size()) {
+    return sorted.back();
+  }
+  double fraction = position - below;
+  return sorted[below] + fraction * (sorted[below + 1] - sorted[below]);
+}
+
+std::vector<double> PerfStats::RejectOutliers(const std::vector<double> &samples) {
+  if (samples.size() < 4) {
+    return samples;
+  }
+  std::vector<double> sorted = samples;
+  std::sort(sorted.begin(), sorted.end());
+  double q1 = Quantile(sorted, 0.25);
+  double q3 = Quantile(sorted, 0.75);
+  double low = q1 - 1.5 * (q3 - q1);
+  double high = q3 + 1.5 * (q3 - q1);
+  std::vector<double> kept;
+  for (double sample : samples) {
+    if (sample >= low && sample <= high) {
+      kept.push_back(sample);
+    }
+  }
+  return kept;
+}
+
+PerfSummary PerfStats::Summarize(const std::vector<double> &samples, size_t num_outliers) {
+  PerfSummary summary = {};
+  summary.num_samples = samples.size();
+  summary.num_outliers = num_outliers;
+  if (samples.empty()) {
+    return summary;
+  }
+  std::vector<double> sorted = samples;
+  std::sort(sorted.begin(), sorted.end());
+  summary.median = Quantile(sorted, 0.5);
+  summary.min = sorted.front();
+  summary.max = sorted.back();
+  double sum = 0.0;
+  for (double sample : sorted) {
+    sum += sample;
+  }
+  summary.mean = sum / sorted.size();
+  double sum_squares = 0.0;
+  for (double sample : sorted) {
+    sum_squares += (sample - summary.mean) * (sample - summary.mean);
+  }
+  summary.stddev = sorted.size() > 1 ? sqrt(sum_squares / (sorted.size() - 1)) : 0.0;
+  return summary;
+}
+
+void PerfStats::MannWhitney(const std::vector<double> &reference, const std::vector<double> &variant, double *u, double *p_value) {
+  double n_reference = (double)reference.size();
+  double n_variant = (double)variant.size();
+  double n = n_reference + n_variant;
+
+  // Pooled samples, the second member telling variant samples apart
+  std::vector<std::pair<double, bool>> pooled;
+  for (double sample : reference) {
+    pooled.push_back(std::make_pair(sample, false));
+  }
+  for (double sample : variant) {
+    pooled.push_back(std::make_pair(sample, true));
+  }
+  std::sort(pooled.begin(), pooled.end());
+
+  // Tied samples share the average of their ranks
+  double variant_rank_sum = 0.0;
+  double tie_correction = 0.0;
+  for (size_t first = 0; first < pooled.size();) {
+    size_t last = first;
+    while (last + 1 < pooled.size() && pooled[last + 1].first == pooled[first].first) {
+      last++;
+    }
+    double rank = (first + last) / 2.0 + 1.0;
+    double num_tied = (double)(last - first + 1);
+    tie_correction += num_tied * num_tied * num_tied - num_tied;
+    for (size_t i = first; i <= last; i++) {
+      if (pooled[i].second) {
+        variant_rank_sum += rank;
+      }
+    }
+    first = last + 1;
+  }
+
+  *u = variant_rank_sum - n_variant * (n_variant + 1.0) / 2.0;
+  double mean = n_reference * n_variant / 2.0;
+  double variance = n_reference * n_variant / 12.0 * ((n + 1.0) - tie_correction / (n * (n - 1.0)));
+  if (n_reference == 0 || n_variant == 0 || variance <= 0.0) {
+    // All samples tied: no evidence either way
+    *p_value = 1.0;
+    return;
+  }
+  double z = (*u - mean - 0.5) / sqrt(variance);
+  *p_value = 0.5 * erfc(z / sqrt(2.0));
+}
+
+void PerfStats::RatioInterval(const std::vector<double> &reference, const std::vector<double> &variant, double *ratio, double *low, double *high) {
+  std::vector<double> log_ratios;
+  log_ratios.reserve(reference.size() * variant.size());
+  for (double variant_sample : variant) {
+    for (double reference_sample : reference) {
+      log_ratios.push_back(log(std::max(variant_sample, kMinDuration)) - log(std::max(reference_sample, kMinDuration)));
+    }
+  }
+  if (log_ratios.empty()) {
+    *ratio = *low = *high = 1.0;
+    return;
+  }
+  std::sort(log_ratios.begin(), log_ratios.end());
+  *ratio = exp(Quantile(log_ratios, 0.5));
+
+  double num_pairs = (double)log_ratios.size();
+  double n_reference = (double)reference.size();
+  double n_variant = (double)variant.size();
+  // k is a 1-based rank: the interval goes from the k-th smallest to the k-th
+  // largest log ratio. Too few samples give k < 1, i.e. all of the pairs.
+  double k = floor(num_pairs / 2.0 - kNormalQuantile95 * sqrt(n_reference * n_variant * (n_reference + n_variant + 1.0) / 12.0));
+  size_t rank = k >= 1.0 ? (size_t)k : 1;
+  rank = std::min(rank, log_ratios.size());
+  *low = exp(log_ratios[rank - 1]);
+  *high = exp(log_ratios[log_ratios.size() - rank]);
+}
+
+PerfComparison PerfStats::Compare(const std::vector<double> &reference, const std::vector<double> &variant) {
+  std::vector<double> kept_reference = RejectOutliers(reference);
+  std::vector<double> kept_variant = RejectOutliers(variant);
+  PerfComparison comparison = {};
+  comparison.reference = Summarize(kept_reference, reference.size() - kept_reference.size());
+  comparison.variant = Summarize(kept_variant, variant.size() - kept_variant.size());
+  MannWhitney(kept_reference, kept_variant, &comparison.mann_whitney_u, &comparison.p_value);
+  RatioInterval(kept_reference, kept_variant, &comparison.ratio, &comparison.ratio_low, &comparison.ratio_high);
+  return comparison;
+}
@@ -0,0 +1,64 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __PERF_STATS__
+#define __PERF_STATS__
+
+#include <stddef.h>
+
+#include <vector>
+
+// Of the samples of one test, outliers excluded, in nanoseconds
+typedef struct PerfSummary {
+  size_t num_samples;
+  size_t num_outliers;
+  double median;
+  double mean;
+  double stddev;
+  double min;
+  double max;
+} PerfSummary;
+
+typedef struct PerfComparison {
+  PerfSummary reference;
+  PerfSummary variant;
+  // Mann-Whitney U of the variant, and one-sided p-value of the variant
+  // being slower than the reference
+  double mann_whitney_u;
+  double p_value;
+  // Slowdown of the variant, variant time over reference time, as the
+  // Hodges-Lehmann estimate and its 95% confidence interval
+  double ratio;
+  double ratio_low;
+  double ratio_high;
+} PerfComparison;
+
+// Distribution-free statistics on GPU time samples, see
+// VulkanWorker::RunPerfTest(). Timings are skewed by clock changes, preemption
+// and other processes: outliers are rejected with Tukey fences, and the tests
+// and interval make no assumption on the distribution.
+class PerfStats {
+  public:
+  // Keeps the samples within 1.5 interquartile ranges of the quartiles
+  static std::vector<double> RejectOutliers(const std::vector<double> &samples);
+  static PerfSummary Summarize(const std::vector<double> &samples, size_t num_outliers);
+  // Normal approximation, with tie and continuity corrections
+  static void MannWhitney(const std::vector<double> &reference, const std::vector<double> &variant, double *u, double *p_value);
+  // From the pairwise ratios of variant and reference samples, as the
+  // interval that matches the Mann-Whitney test
+  static void RatioInterval(const std::vector<double> &reference, const std::vector<double> &variant, double *ratio, double *low, double *high);
+  static PerfComparison Compare(const std::vector<double> &reference, const std::vector<double> &variant);
+};
+
+#endif
@@ -0,0 +1,264 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pipeline_cache_store.h"
+#include "platform.h"
+#include "vkcheck.h"
+
+#include <assert.h> // assert()
+#include <dirent.h> // opendir()
+#include <fcntl.h> // open()
+#include <stdio.h> // fopen(), rename()
+#include <string.h> // memcmp()
+#include <sys/file.h> // flock()
+#include <sys/stat.h> // stat(), mkdir()
+#include <unistd.h> // getpid(), unlink()
+
+#include <algorithm> // std::sort()
+
+static const char kPipelineCacheMagic[8] = { 'G', 'F', 'Z', 'P', 'C', 'A', 'C', 'H' };
+static const uint32_t kPipelineCacheVersion = 1;
+// Header of VkPipelineCache data, as of VK_PIPELINE_CACHE_HEADER_VERSION_ONE:
+// length, version, vendorID, deviceID, pipelineCacheUUID
+static const size_t kVulkanHeaderSize = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+
+typedef struct ExportFile {
+  std::string filename;
+  int64_t mtime_ns;
+} ExportFile;
+
+PipelineCacheStore::PipelineCacheStore(const char *directory, size_t max_size, uint32_t export_interval, const VkAllocationCallbacks *allocator) {
+  directory_ = directory;
+  max_size_ = max_size;
+  export_interval_ = export_interval;
+  allocator_ = allocator;
+  vendor_id_ = 0;
+  device_id_ = 0;
+  memset(pipeline_cache_uuid_, 0, sizeof(pipeline_cache_uuid_));
+  num_pipelines_.store(0);
+  num_exports_ = 0;
+  mkdir(directory_.c_str(), 0755);
+}
+
+void PipelineCacheStore::SetDevice(const VkPhysicalDeviceProperties &properties) {
+  vendor_id_ = properties.vendorID;
+  device_id_ = properties.deviceID;
+  memcpy(pipeline_cache_uuid_, properties.pipelineCacheUUID, VK_UUID_SIZE);
+  char device_name[32];
+  snprintf(device_name, sizeof(device_name), "%08x_%08x_", vendor_id_, device_id_);
+  base_ = directory_ + "/" + device_name;
+  for (int i = 0; i < VK_UUID_SIZE; i++) {
+    char hex[3];
+    snprintf(hex, sizeof(hex), "%02x", pipeline_cache_uuid_[i]);
+    base_ += hex;
+  }
+  export_filename_ = base_ + "." + std::to_string(getpid()) + ".export";
+}
+
+// Files from another driver, or cut short, are ignored
+bool PipelineCacheStore::ReadCacheFile(const std::string &filename, std::vector<unsigned char> &data, uint32_t *generation) {
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  PipelineCacheFileHeader header;
+  bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+               memcmp(header.magic, kPipelineCacheMagic, sizeof(kPipelineCacheMagic)) == 0 &&
+               header.version == kPipelineCacheVersion &&
+               header.data_size >= kVulkanHeaderSize && header.data_size <= max_size_;
+  if (valid) {
+    data.resize(header.data_size);
+    valid = fread(data.data(), 1, data.size(), file) == data.size();
+  }
+  fclose(file);
+  if (!valid) {
+    return false;
+  }
+
+  uint32_t vulkan_header[4];
+  memcpy(vulkan_header, data.data(), sizeof(vulkan_header));
+  if (vulkan_header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE || vulkan_header[2] != vendor_id_ || vulkan_header[3] != device_id_ ||
+      memcmp(data.data() + sizeof(vulkan_header), pipeline_cache_uuid_, VK_UUID_SIZE) != 0) {
+    return false;
+  }
+  *generation = header.generation;
+  return true;
+}
+
+// Written under a temporary name, such that readers never see a partial file
+bool PipelineCacheStore::WriteCacheFile(const std::string &filename, const std::vector<unsigned char> &data, uint32_t generation) {
+  std::string temporary_filename = filename + "." + std::to_string(getpid()) + ".tmp";
+  FILE *file = fopen(temporary_filename.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  PipelineCacheFileHeader header = {};
+  memcpy(header.magic, kPipelineCacheMagic, sizeof(kPipelineCacheMagic));
+  header.version = kPipelineCacheVersion;
+  header.generation = generation;
+  header.data_size = data.size();
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(data.data(), 1, data.size(), file) == data.size();
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temporary_filename.c_str(), filename.c_str()) != 0) {
+    unlink(temporary_filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool PipelineCacheStore::GetCacheData(VkDevice device, VkPipelineCache pipeline_cache, std::vector<unsigned char> &data) {
+  // Other threads may add pipelines to the cache meanwhile
+  VkResult result;
+  do {
+    size_t data_size = 0;
+    VKCHECK(vkGetPipelineCacheData(device, pipeline_cache, &data_size, nullptr));
+    data.resize(data_size);
+    result = vkGetPipelineCacheData(device, pipeline_cache, &data_size, data.data());
+    data.resize(data_size);
+  } while (result == VK_INCOMPLETE);
+  return result == VK_SUCCESS && data.size() >= kVulkanHeaderSize;
+}
+
+VkPipelineCache PipelineCacheStore::Load(VkDevice device, const VkPhysicalDeviceProperties &properties) {
+  SetDevice(properties);
+  std::string shared_filename = base_ + ".cache";
+  int lock_fd = open((base_ + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  assert(lock_fd >= 0 && "Cannot open pipeline cache lock");
+  flock(lock_fd, LOCK_EX);
+
+  // Exports of this device, most recently written first
+  std::vector<ExportFile> exports;
+  std::string export_prefix = base_.substr(directory_.size() + 1) + ".";
+  DIR *directory = opendir(directory_.c_str());
+  assert(directory != nullptr);
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != nullptr) {
+    std::string name = entry->d_name;
+    if (name.compare(0, export_prefix.size(), export_prefix) != 0 || name.size() < 7 || name.compare(name.size() - 7, 7, ".export") != 0) {
+      continue;
+    }
+    ExportFile export_file;
+    export_file.filename = directory_ + "/" + name;
+    struct stat export_stat;
+    if (stat(export_file.filename.c_str(), &export_stat) != 0) {
+      continue;
+    }
+    export_file.mtime_ns = (int64_t)export_stat.st_mtim.tv_sec * 1000000000 + export_stat.st_mtim.tv_nsec;
+    exports.push_back(export_file);
+  }
+  closedir(directory);
+  std::sort(exports.begin(), exports.end(), [](const ExportFile &a, const ExportFile &b) { return a.mtime_ns > b.mtime_ns; });
+
+  // The shared cache comes last, as the oldest source
+  std::vector<std::string> sources;
+  for (const ExportFile &export_file : exports) {
+    sources.push_back(export_file.filename);
+  }
+  sources.push_back(shared_filename);
+
+  std::vector<VkPipelineCache> source_caches;
+  size_t total_size = 0;
+  uint32_t generation = 0;
+  size_t num_dropped = 0;
+  for (const std::string &source : sources) {
+    std::vector<unsigned char> data;
+    uint32_t source_generation = 0;
+    if (!ReadCacheFile(source, data, &source_generation)) {
+      continue;
+    }
+    if (source == shared_filename) {
+      generation = source_generation;
+    }
+    if (total_size + data.size() > max_size_) {
+      num_dropped++;
+      continue;
+    }
+    VkPipelineCacheCreateInfo pipeline_cache_create_info = {};
+    pipeline_cache_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    pipeline_cache_create_info.pNext = nullptr;
+    pipeline_cache_create_info.flags = 0;
+    pipeline_cache_create_info.initialDataSize = data.size();
+    pipeline_cache_create_info.pInitialData = data.data();
+    VkPipelineCache source_cache = VK_NULL_HANDLE;
+    if (vkCreatePipelineCache(device, &pipeline_cache_create_info, allocator_, &source_cache) == VK_SUCCESS) {
+      source_caches.push_back(source_cache);
+      total_size += data.size();
+    }
+  }
+
+  // Merged data may exceed the size limit, as the driver adds its own headers:
+  // the oldest sources are then left out, one at a time, until it fits.
+  VkPipelineCacheCreateInfo pipeline_cache_create_info = {};
+  pipeline_cache_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  pipeline_cache_create_info.pNext = nullptr;
+  pipeline_cache_create_info.flags = 0;
+  pipeline_cache_create_info.initialDataSize = 0;
+  pipeline_cache_create_info.pInitialData = nullptr;
+  VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+  std::vector<unsigned char> data;
+  bool has_data = false;
+  size_t num_merged = source_caches.size();
+  while (true) {
+    VKCHECK(vkCreatePipelineCache(device, &pipeline_cache_create_info, allocator_, &pipeline_cache));
+    if (num_merged > 0) {
+      VKCHECK(vkMergePipelineCaches(device, pipeline_cache, (uint32_t)num_merged, source_caches.data()));
+    }
+    has_data = GetCacheData(device, pipeline_cache, data);
+    if (!has_data || data.size() <= max_size_ || num_merged == 0) {
+      break;
+    }
+    vkDestroyPipelineCache(device, pipeline_cache, allocator_);
+    num_merged--;
+    num_dropped++;
+  }
+  for (VkPipelineCache source_cache : source_caches) {
+    vkDestroyPipelineCache(device, source_cache, allocator_);
+  }
+
+  // Merged exports are dropped once the shared cache holds them, workers still
+  // alive export theirs again. Until then, they are kept for the next merge.
+  bool written = has_data && data.size() <= max_size_ && WriteCacheFile(shared_filename, data, generation + 1);
+  if (written) {
+    for (const ExportFile &export_file : exports) {
+      unlink(export_file.filename.c_str());
+    }
+  }
+  flock(lock_fd, LOCK_UN);
+  close(lock_fd);
+
+  if (!written) {
+    log("PIPELINECACHE cannot write the shared cache, %zu bytes, kept %zu exports", data.size(), exports.size());
+    return pipeline_cache;
+  }
+  log("PIPELINECACHE generation %u, merged %zu files, dropped %zu, %zu bytes", generation + 1, num_merged, num_dropped, data.size());
+  return pipeline_cache;
+}
+
+void PipelineCacheStore::Export(VkDevice device, VkPipelineCache pipeline_cache) {
+  std::lock_guard<std::mutex> lock(export_mutex_);
+  std::vector<unsigned char> data;
+  if (GetCacheData(device, pipeline_cache, data) && data.size() <= max_size_ && WriteCacheFile(export_filename_, data, 0)) {
+    num_exports_++;
+  }
+}
+
+void PipelineCacheStore::CountPipeline(VkDevice device, VkPipelineCache pipeline_cache) {
+  if (export_interval_ > 0 && (num_pipelines_.fetch_add(1) + 1) % export_interval_ == 0) {
+    Export(device, pipeline_cache);
+  }
+}
+
+void PipelineCacheStore::LogCounters() {
+  log("PIPELINECACHE pipelines %u exports %zu", num_pipelines_.load(), num_exports_);
+}
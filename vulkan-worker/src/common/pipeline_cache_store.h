@@ -0,0 +1,82 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __PIPELINE_CACHE_STORE__
+#define __PIPELINE_CACHE_STORE__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+// Header of the files of the store, followed by VkPipelineCache data
+typedef struct PipelineCacheFileHeader {
+  char magic[8];
+  uint32_t version;
+  // Of the shared cache, incremented by each merge. 0 for exports.
+  uint32_t generation;
+  uint64_t data_size;
+} PipelineCacheFileHeader;
+
+// Pipeline cache shared by the workers using the same device and driver, in a
+// directory. Each worker exports the data of its VkPipelineCache to its own
+// file, '<device>.<pid>.export', every few pipelines and when its device is
+// destroyed. When a worker creates its device, it merges the exports of all
+// workers into the shared cache, '<device>.cache', with vkMergePipelineCaches(),
+// and starts from the result: a shader compiled by one worker is cheaper to
+// compile for the others. <device> names the vendor, the device and the
+// pipelineCacheUUID, such that a driver update starts a new cache.
+//
+// Cache data is opaque, hence trimmed by whole files: exports are merged from
+// the most recently written one, which live workers keep refreshing, then the
+// previous shared cache, for as long as they fit in the size limit. Exports of
+// workers gone for long are dropped first. Merges are serialized with a lock
+// file, such that workers of a pool can start at the same time.
+class PipelineCacheStore {
+  private:
+  std::string directory_;
+  size_t max_size_;
+  uint32_t export_interval_;
+  const VkAllocationCallbacks *allocator_;
+  // '<directory>/<device>', see SetDevice()
+  std::string base_;
+  std::string export_filename_;
+  uint8_t pipeline_cache_uuid_[VK_UUID_SIZE];
+  uint32_t vendor_id_;
+  uint32_t device_id_;
+  std::atomic<uint32_t> num_pipelines_;
+  std::mutex export_mutex_;
+  size_t num_exports_;
+
+  void SetDevice(const VkPhysicalDeviceProperties &properties);
+  bool ReadCacheFile(const std::string &filename, std::vector<unsigned char> &data, uint32_t *generation);
+  bool WriteCacheFile(const std::string &filename, const std::vector<unsigned char> &data, uint32_t generation);
+  bool GetCacheData(VkDevice device, VkPipelineCache pipeline_cache, std::vector<unsigned char> &data);
+
+  public:
+  PipelineCacheStore(const char *directory, size_t max_size, uint32_t export_interval, const VkAllocationCallbacks *allocator);
+  // Merges the exports into the shared cache, and creates a cache from it
+  VkPipelineCache Load(VkDevice device, const VkPhysicalDeviceProperties &properties);
+  void Export(VkDevice device, VkPipelineCache pipeline_cache);
+  // Exports every export_interval pipelines
+  void CountPipeline(VkDevice device, VkPipelineCache pipeline_cache);
+  void LogCounters();
+};
+
+#endif
@@ -0,0 +1,139 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "result_cache.h"
+#include "metrics.h"
+#include "platform.h"
+
+#include <stdio.h> // fopen(), rename()
+#include <stdlib.h> // strtoull()
+#include <string.h> // strcmp()
+#include <sys/stat.h> // mkdir()
+#include <unistd.h> // getpid()
+
+static bool ReadFileContent(const std::string &filename, std::vector<unsigned char> &content) {
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  content.clear();
+  unsigned char buffer[4096];
+  size_t num_bytes;
+  while ((num_bytes = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    content.insert(content.end(), buffer, buffer + num_bytes);
+  }
+  fclose(file);
+  return true;
+}
+
+ResultCache::ResultCache(const char *directory) {
+  directory_ = directory;
+  num_hits_ = 0;
+  num_misses_ = 0;
+  num_stores_ = 0;
+  mkdir(directory_.c_str(), 0755);
+  log("RESULTCACHE %s", directory_.c_str());
+}
+
+// FNV-1a, chained through hash
+uint64_t ResultCache::HashBytes(const void *data, size_t size, uint64_t hash) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+std::string ResultCache::GetPath(const std::string &key, const std::string &suffix) const {
+  return directory_ + "/" + key + suffix;
+}
+
+bool ResultCache::WriteFileAtomically(const std::string &filename, const std::vector<unsigned char> &content) {
+  std::string temporary_filename = filename + ".tmp" + std::to_string(getpid());
+  FILE *file = fopen(temporary_filename.c_str(), "wb");
+  if (file == nullptr) {
+    log("RESULTCACHE cannot write %s", temporary_filename.c_str());
+    return false;
+  }
+  bool written = fwrite(content.data(), 1, content.size(), file) == content.size();
+  written = (fclose(file) == 0) && written;
+  if (!written || rename(temporary_filename.c_str(), filename.c_str()) != 0) {
+    log("RESULTCACHE cannot write %s", filename.c_str());
+    remove(temporary_filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ResultCache::Lookup(const std::string &key, ResultCacheEntry *entry) {
+  FILE *file = fopen(GetPath(key, ".result").c_str(), "r");
+  if (file == nullptr) {
+    num_misses_++;
+    Metrics::Increment("gfz_result_cache_lookups_total", "result=\"miss\"");
+    return false;
+  }
+  char hash_string[32] = {};
+  int num_fields = fscanf(file, "num_render %d\nnondet_render %d\nimage_hash %31s", &entry->num_render, &entry->nondet_render, hash_string);
+  entry->image_hash = strtoull(hash_string, nullptr, 16);
+  entry->frame_hashes.clear();
+  char word[32] = {};
+  if (num_fields == 3 && fscanf(file, "%31s", word) == 1 && strcmp(word, "frame_hashes") == 0) {
+    while (fscanf(file, "%31s", hash_string) == 1) {
+      entry->frame_hashes.push_back(strtoull(hash_string, nullptr, 16));
+    }
+  }
+  fclose(file);
+  if (num_fields != 3) {
+    log("RESULTCACHE ignore corrupt entry %s", key.c_str());
+    num_misses_++;
+    Metrics::Increment("gfz_result_cache_lookups_total", "result=\"miss\"");
+    return false;
+  }
+  num_hits_++;
+  Metrics::Increment("gfz_result_cache_lookups_total", "result=\"hit\"");
+  return true;
+}
+
+// Images must be stored before the entry, which marks it complete
+void ResultCache::Store(const std::string &key, const ResultCacheEntry &entry) {
+  char record[128];
+  int size = snprintf(record, sizeof(record), "num_render %d\nnondet_render %d\nimage_hash %016llx\nframe_hashes", entry.num_render, entry.nondet_render, (unsigned long long)entry.image_hash);
+  std::string content_string(record, size);
+  for (uint64_t frame_hash : entry.frame_hashes) {
+    snprintf(record, sizeof(record), " %016llx", (unsigned long long)frame_hash);
+    content_string += record;
+  }
+  content_string += "\n";
+  std::vector<unsigned char> content(content_string.begin(), content_string.end());
+  if (WriteFileAtomically(GetPath(key, ".result"), content)) {
+    num_stores_++;
+  }
+}
+
+bool ResultCache::LoadImage(const std::string &key, int render_index, std::vector<unsigned char> &png) {
+  return ReadFileContent(GetPath(key, "_" + std::to_string(render_index) + ".png"), png);
+}
+
+// Copies an image of the test into the cache, if it was saved
+void ResultCache::StoreImage(const std::string &key, int render_index, const std::string &png_filename) {
+  std::vector<unsigned char> png;
+  if (!ReadFileContent(png_filename, png)) {
+    return;
+  }
+  WriteFileAtomically(GetPath(key, "_" + std::to_string(render_index) + ".png"), png);
+}
+
+void ResultCache::LogCounters() {
+  log("RESULTCACHE hits %zu misses %zu stores %zu", num_hits_, num_misses_, num_stores_);
+}
@@ -0,0 +1,63 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __RESULT_CACHE__
+#define __RESULT_CACHE__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Initial value of ResultCache::HashBytes()
+const uint64_t kResultCacheHashSeed = 14695981039346656037ULL;
+
+// Outcome of a test, as stored in the cache
+typedef struct ResultCacheEntry {
+  int num_render;
+  int nondet_render;
+  uint64_t image_hash;
+  // Of each frame rendered, for the '.hash' files of --gpu_hash. Empty in
+  // entries stored before they were recorded.
+  std::vector<uint64_t> frame_hashes;
+} ResultCacheEntry;
+
+// On-disk cache of test outcomes, such that byte-identical jobs submitted again
+// (e.g. by a reducer re-testing a candidate) are not rendered again. Keys are
+// built by the worker from the device, the driver, the shaders, the uniforms
+// and the render settings. An entry is a '<key>.result' text file, next to
+// copies of the images of the test, '<key>_<#id>.png'. Files are written under
+// a temporary name and renamed, such that several workers can share a cache.
+class ResultCache {
+  private:
+  std::string directory_;
+  size_t num_hits_;
+  size_t num_misses_;
+  size_t num_stores_;
+
+  std::string GetPath(const std::string &key, const std::string &suffix) const;
+  static bool WriteFileAtomically(const std::string &filename, const std::vector<unsigned char> &content);
+
+  public:
+  ResultCache(const char *directory);
+  static uint64_t HashBytes(const void *data, size_t size, uint64_t hash);
+  bool Lookup(const std::string &key, ResultCacheEntry *entry);
+  void Store(const std::string &key, const ResultCacheEntry &entry);
+  bool LoadImage(const std::string &key, int render_index, std::vector<unsigned char> &png);
+  void StoreImage(const std::string &key, int render_index, const std::string &png_filename);
+  void LogCounters();
+};
+
+#endif
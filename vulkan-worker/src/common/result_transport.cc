@@ -0,0 +1,168 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "result_transport.h"
+#include "platform.h"
+
+#include <assert.h> // assert()
+#include <errno.h> // errno
+#include <fcntl.h> // open()
+#include <string.h> // memcpy()
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // mkfifo()
+#include <unistd.h> // ftruncate(), usleep()
+
+static const char kResultRingMagic[8] = { 'G', 'F', 'Z', 'R', 'I', 'N', 'G', '\0' };
+static const uint32_t kResultRingVersion = 2;
+// The buffer starts on its own page
+static const uint32_t kResultRingDataOffset = 4096;
+
+static uint64_t AlignRecord(uint64_t size) {
+  return (size + kResultRecordAlignment - 1) / kResultRecordAlignment * kResultRecordAlignment;
+}
+
+ResultTransport::ResultTransport(const char *filename, size_t data_size) {
+  assert(data_size > 0 && data_size % kResultRecordAlignment == 0);
+  data_size_ = data_size;
+  mapping_size_ = kResultRingDataOffset + data_size;
+  fd_ = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  assert(fd_ >= 0 && "Cannot open result transport file");
+  int result = ftruncate(fd_, mapping_size_);
+  assert(result == 0 && "Cannot size result transport file");
+  (void)result;
+  void *mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  assert(mapping != MAP_FAILED);
+  header_ = (ResultRingHeader *)mapping;
+  data_ = (unsigned char *)mapping + kResultRingDataOffset;
+
+  // A FIFO opened for reading and writing never blocks on open, whether the
+  // consumer opened it yet or not
+  std::string doorbell_filename = std::string(filename) + ".doorbell";
+  if (mkfifo(doorbell_filename.c_str(), 0644) != 0) {
+    assert(errno == EEXIST && "Cannot create doorbell FIFO");
+  }
+  doorbell_fd_ = open(doorbell_filename.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  assert(doorbell_fd_ >= 0 && "Cannot open doorbell FIFO");
+
+  write_offset_ = 0;
+  pending_size_ = 0;
+  num_records_ = 0;
+  num_bytes_ = 0;
+  num_stalls_ = 0;
+
+  uint32_t generation = 0;
+  if (memcmp(header_->magic, kResultRingMagic, sizeof(kResultRingMagic)) == 0) {
+    generation = header_->generation + 1;
+  }
+
+  // The magic goes last, such that a consumer finding it sees a valid header
+  memset(header_, 0, sizeof(ResultRingHeader));
+  header_->version = kResultRingVersion;
+  header_->data_offset = kResultRingDataOffset;
+  header_->data_size = data_size_;
+  header_->worker_pid = (uint32_t)getpid();
+  header_->generation = generation;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(header_->magic, kResultRingMagic, sizeof(kResultRingMagic));
+  log("RESULTTRANSPORT %s, %zu bytes, generation %u", filename, data_size_, generation);
+}
+
+ResultTransport::~ResultTransport() {
+  assert(pending_size_ == 0);
+  __atomic_store_n(&header_->closed, 1, __ATOMIC_RELEASE);
+  char doorbell = 'C';
+  ssize_t num_bytes = write(doorbell_fd_, &doorbell, 1);
+  (void)num_bytes;
+  munmap(header_, mapping_size_);
+  close(doorbell_fd_);
+  close(fd_);
+}
+
+bool ResultTransport::HasSpace(uint64_t size) {
+  uint64_t read_offset = __atomic_load_n(&header_->read_offset, __ATOMIC_ACQUIRE);
+  return read_offset <= write_offset_ && write_offset_ + size - read_offset <= data_size_;
+}
+
+void ResultTransport::WaitForSpace(uint64_t size) {
+  if (HasSpace(size)) {
+    return;
+  }
+  num_stalls_++;
+  while (!HasSpace(size)) {
+    usleep(1000);
+  }
+}
+
+unsigned char *ResultTransport::Reserve(ResultRecordType type, const std::string &name, size_t data_size, uint32_t width, uint32_t height) {
+  assert(pending_size_ == 0 && "Previous frame not ended");
+  uint64_t data_offset = AlignRecord(sizeof(ResultRecordHeader) + name.size());
+  uint64_t record_size = AlignRecord(data_offset + data_size);
+  assert(record_size <= data_size_ && "Record larger than --result_transport_mb");
+
+  uint64_t position = write_offset_ % data_size_;
+  uint64_t padding_size = data_size_ - position < record_size ? data_size_ - position : 0;
+  WaitForSpace(padding_size + record_size);
+  if (padding_size > 0) {
+    ResultRecordHeader *padding = (ResultRecordHeader *)(data_ + position);
+    memset(padding, 0, sizeof(ResultRecordHeader));
+    padding->type = RESULT_RECORD_PADDING;
+    padding->size = padding_size;
+    write_offset_ += padding_size;
+    position = 0;
+  }
+
+  ResultRecordHeader *record = (ResultRecordHeader *)(data_ + position);
+  record->type = type;
+  record->name_size = (uint32_t)name.size();
+  record->size = record_size;
+  record->data_offset = data_offset;
+  record->data_size = data_size;
+  record->width = width;
+  record->height = height;
+  memcpy(data_ + position + sizeof(ResultRecordHeader), name.data(), name.size());
+  pending_size_ = record_size;
+  return data_ + position + data_offset;
+}
+
+void ResultTransport::Publish() {
+  write_offset_ += pending_size_;
+  num_records_++;
+  num_bytes_ += pending_size_;
+  pending_size_ = 0;
+  __atomic_store_n(&header_->write_offset, write_offset_, __ATOMIC_RELEASE);
+  // A full FIFO already rings
+  char doorbell = 'R';
+  ssize_t num_bytes = write(doorbell_fd_, &doorbell, 1);
+  (void)num_bytes;
+}
+
+unsigned char *ResultTransport::BeginFrame(const std::string &name, uint32_t width, uint32_t height) {
+  return Reserve(RESULT_RECORD_FRAME, name, (size_t)width * height * 4, width, height);
+}
+
+void ResultTransport::EndFrame() {
+  Publish();
+}
+
+void ResultTransport::WriteFile(const std::string &name, const unsigned char *content, size_t size) {
+  unsigned char *data = Reserve(RESULT_RECORD_FILE, name, size, 0, 0);
+  if (size > 0) {
+    memcpy(data, content, size);
+  }
+  Publish();
+}
+
+void ResultTransport::LogCounters() {
+  log("RESULTTRANSPORT records %zu bytes %zu stalls %zu", num_records_, num_bytes_, num_stalls_);
+}
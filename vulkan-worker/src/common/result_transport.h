@@ -0,0 +1,119 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __RESULT_TRANSPORT__
+#define __RESULT_TRANSPORT__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+enum ResultRecordType {
+  // Fills the end of the ring buffer, when the next record does not fit
+  RESULT_RECORD_PADDING = 0,
+  // A result file, e.g. '<png_template>_num_render.txt', with its content
+  RESULT_RECORD_FILE = 1,
+  // A frame, named after the PNG file it replaces, as raw RGBA pixels
+  RESULT_RECORD_FRAME = 2,
+};
+
+// At the start of the shared file, followed by the ring buffer at data_offset
+typedef struct ResultRingHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t data_offset;
+  uint64_t data_size;
+  // Bytes published by the worker since it started. Records up to it are
+  // complete.
+  uint64_t write_offset;
+  // Bytes released by the consumer since the worker started. The worker only
+  // reuses the space behind it.
+  uint64_t read_offset;
+  uint32_t worker_pid;
+  // Set when the worker is done: no record follows the ones published
+  uint32_t closed;
+  // Incremented by each worker that reuses the file, e.g. after a crash: the
+  // consumer then starts over from offset 0
+  uint32_t generation;
+} ResultRingHeader;
+
+// Records start at write_offset % data_size, aligned to kResultRecordAlignment,
+// and never wrap around the end of the buffer.
+typedef struct ResultRecordHeader {
+  uint32_t type;
+  // The name follows the header, without '\0'
+  uint32_t name_size;
+  // Of the whole record, header and padding included
+  uint64_t size;
+  // From the start of the record
+  uint64_t data_offset;
+  uint64_t data_size;
+  // Of frames, 0 for other records
+  uint32_t width;
+  uint32_t height;
+} ResultRecordHeader;
+
+static const size_t kResultRecordAlignment = 64;
+
+// Hands result files and frames to a driver script through a ring buffer in a
+// shared file, e.g. on tmpfs, instead of writing them to disk: frames are read
+// back from the device straight into the buffer, as raw RGBA without PNG
+// encoding, and the consumer maps the file and reads them in place.
+//
+// Doorbell: after publishing records, the worker writes a byte to the FIFO
+// '<file>.doorbell', which the consumer blocks on. The consumer releases
+// records by advancing read_offset; the worker waits for space, polling
+// read_offset, when the buffer is full. Both offsets only grow, and are
+// accessed with acquire and release semantics. A read offset beyond the write
+// offset was released by a consumer that has not seen a restart yet: the
+// worker waits for it to start over. The consumer must keep up: the
+// worker blocks until it does.
+//
+// Records are written by a single thread.
+class ResultTransport {
+  private:
+  int fd_;
+  int doorbell_fd_;
+  ResultRingHeader *header_;
+  size_t mapping_size_;
+  unsigned char *data_;
+  size_t data_size_;
+  uint64_t write_offset_;
+  // Of the record being written by BeginFrame(), 0 if none
+  uint64_t pending_size_;
+
+  // Counters
+  size_t num_records_;
+  size_t num_bytes_;
+  size_t num_stalls_;
+
+  unsigned char *Reserve(ResultRecordType type, const std::string &name, size_t data_size, uint32_t width, uint32_t height);
+  bool HasSpace(uint64_t size);
+  void WaitForSpace(uint64_t size);
+  void Publish();
+
+  public:
+  // data_size must be a multiple of kResultRecordAlignment
+  ResultTransport(const char *filename, size_t data_size);
+  ~ResultTransport();
+  // Returns the buffer to write the width x height RGBA pixels of the frame
+  // to, published by EndFrame()
+  unsigned char *BeginFrame(const std::string &name, uint32_t width, uint32_t height);
+  void EndFrame();
+  void WriteFile(const std::string &name, const unsigned char *content, size_t size);
+  void LogCounters();
+};
+
+#endif
@@ -17,12 +17,20 @@
 #include <assert.h> // assert()
 #include <stdlib.h> // malloc()
 #include <string.h> // memcpy(), strcmp()
+#include <algorithm> // std::max()
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <string> // std::string for == comparison
+#include <thread>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 
 #include "cJSON.h"
 #include "lodepng.h" // lodepng_encode32()
+#include "job_prefetcher.h"
+#include "perf_stats.h"
 #include "vulkan_worker.h"
 #include "vkcheck.h"
 
@@ -32,7 +40,55 @@ DEFINE_bool(skip_render, false, "Prepare graphics pipeline but skip rendering");
 DEFINE_string(coherence_before, "coherence_before.png", "Path to save coherence image recorded before test");
 DEFINE_string(coherence_after, "coherence_after.png", "Path to save coherence image recorded after test");
 DEFINE_int32(num_render, 3, "Number of times to render");
+DEFINE_bool(fast_render, false, "Stop rendering after two identical frames, instead of rendering --num_render times");
+DEFINE_int32(max_render, 0, "Number of times to render once two frames differ, to gather more evidence of nondeterminism. Ignored if lower than --num_render");
 DEFINE_string(png_template, "image", "Path template to image output, '_<#id>.png' will be added");
+DEFINE_string(batch, "", "Path to a batch file, one job per line: '<vert.spv> <frag.spv> <uniforms.json> <png_template>'. All jobs are rendered into a single atlas image. A job whose pipeline cannot be created gets no tile, and its VkResult is written to '<png_template>_compile_error.txt'");
+DEFINE_int32(batch_columns, 16, "Maximum number of tiles per row in the batch atlas image");
+DEFINE_int32(batch_max_tiles, 64, "Maximum number of jobs rendered into one batch atlas. Larger batches are split into several atlases, which bounds the number of live pipelines and the size of the atlas");
+DEFINE_bool(gpu_hash, false, "Hash each rendered frame on the GPU and save it to '<png_template>_<#id>.hash'. The PNG is exported only if the hash differs from the reference hash and from the previous frame");
+DEFINE_int32(compile_timeout_ms, 0, "Deadline to create a graphics pipeline, in milliseconds. On expiry, the stage is written to --watchdog_file and the worker exits immediately. 0 disables the deadline");
+DEFINE_string(watchdog_file, "WATCHDOG", "Path to the file recording the stage that exceeded its deadline, see --compile_timeout_ms");
+DEFINE_string(crash_file, "", "Path to write a crash record to on SIGSEGV, SIGABRT, SIGBUS or SIGFPE: signal, stage, job and stack frames. The file is removed on clean exit. Empty disables the crash handler");
+DEFINE_bool(async_log, false, "Log through a lock-free ring buffer written by a background thread, with timestamps and job ids, instead of writing each line synchronously");
+DEFINE_int32(log_buffer, 4096, "Number of records of the --async_log ring buffer");
+DEFINE_string(log_overflow, "block", "What to do when the --async_log ring buffer is full: 'block' until a record is written, or 'drop' the record");
+DEFINE_string(metrics_file, "", "Path of a file to write metrics to periodically, in the Prometheus text format");
+DEFINE_int32(metrics_port, 0, "Local port to serve metrics on, in the Prometheus text format. 0 disables the server");
+DEFINE_int32(metrics_interval_ms, 10000, "Period of metrics file updates, in milliseconds");
+DEFINE_int32(prefetch_depth, 4, "In batch and corpus modes, number of jobs loaded ahead of rendering by a background thread. 0 loads each job when it is needed");
+DEFINE_string(corpus, "", "Path to a packed corpus file, as created by pack-vkworker-corpus. Images are saved to '<png_template>_<job name>_<#id>.png'");
+DEFINE_int32(coherence_every, 1, "In corpus mode, check coherence every N jobs, and after the last job. In server, spool and pipe modes, check coherence after every N jobs of the worker, 0 disables these checks. Checks compare hashes against the first coherence frame, and write --coherence_after only on mismatch");
+DEFINE_bool(async_output, false, "Write images and other result files in the background, in batches, instead of blocking rendering. Files are complete when the worker exits: files still queued are lost if the driver crashes the worker. In server, spool and pipe modes, the files of a job are written before its status is reported");
+DEFINE_string(output_fsync, "none", "Durability of result files: 'none', 'data' to fdatasync() each file, or 'full' to also fsync() their directories");
+DEFINE_int32(output_shards, 0, "In batch and corpus modes, spread result files over this number of subdirectories of the --png_template directory, by hash of the job name. 0 disables sharding");
+DEFINE_string(result_cache, "", "Directory of the result cache. A test already rendered on the same device and driver, with the same shaders, uniforms and render settings, is not rendered again: its stored outcome and images are reused");
+DEFINE_string(interesting_if, "", "Interestingness test mode, for the reducer: render the test, compare frame 0 to the reference in memory, and exit with 0 if interesting, 3 if not, 4 if the test cannot be judged. 'different': interesting if the image differs from the reference, 'same': if it matches it, 'nondet': if frames differ from each other");
+DEFINE_string(reference_image, "", "In interestingness test mode, path to the reference PNG image. Otherwise, --reference_hash is used, with --gpu_hash");
+DEFINE_string(compare, "exact", "In interestingness test mode, how to compare to --reference_image: 'exact', or 'fuzzy' as FuzzyImageComparison does");
+DEFINE_int32(fuzzy_component_threshold, 25, "Fuzzy comparison: maximum difference of a color component between similar pixels");
+DEFINE_int32(fuzzy_distance_threshold, 4, "Fuzzy comparison: maximum distance, in pixels, to look for a similar pixel");
+DEFINE_int32(fuzzy_bad_pixels_threshold, 100, "Fuzzy comparison: images are different when more pixels than this have no similar pixel nearby");
+DEFINE_int32(fuzzy_bad_sparse_pixels_threshold, 10, "Fuzzy comparison: images are different when more bad pixels than this remain once sparse ones are removed");
+DEFINE_bool(save_images, false, "In interestingness test mode, also save the rendered images to '<png_template>_<#id>.png'");
+DEFINE_bool(host_memory_stats, false, "Pass instrumented allocation callbacks to the driver, and report the host memory it uses for each job: bytes allocated by allocation scope, live allocations and peak usage");
+DEFINE_int32(recycle_memory_growth_mb, 0, "Recreate the Vulkan device between jobs once the memory used by the worker grew by this many megabytes since the device was created, e.g. because of driver leaks. Measured with VK_EXT_memory_budget when available, or else as the device memory allocated by the worker plus, with --host_memory_stats, the host memory of the driver. In batch mode, the device is recreated between atlases. 0 disables this threshold");
+DEFINE_int32(recycle_leaky_jobs, 0, "Recreate the Vulkan device between jobs once this many jobs left device memory or objects above their level before the job. 0 disables this threshold");
+DEFINE_string(compile_farm, "", "Compile farm mode: create the pipelines of all the jobs of --corpus on --compile_threads threads against one device, without any render target, and write one line per job to this file: '<name> START' when the job starts, then '<name> SUCCESS <microseconds>' or '<name> COMPILE_ERROR <microseconds> <VkResult>'. Jobs left at START were in flight when the worker crashed or hit --compile_timeout_ms");
+DEFINE_int32(compile_threads, 4, "Number of threads of --compile_farm");
+DEFINE_string(batch_journal, "", "In batch mode, path of a journal to append the stage of each job to, as it starts. A worker restarted with the same journal skips the jobs already done, marks the job that crashed the previous run with CRASH and writes its stage to '<png_template>_crash.txt', and resumes with the next job");
+DEFINE_string(pipeline_cache, "", "Directory of a pipeline cache shared by the workers of a device, see PipelineCacheStore. Each worker exports its pipeline cache there, and merges the exports of all workers into the shared cache when it creates its device");
+DEFINE_int32(pipeline_cache_max_mb, 256, "Size limit of the shared pipeline cache, in megabytes. Exports that would exceed it are dropped, least recently written first");
+DEFINE_int32(pipeline_cache_export_interval, 100, "Export the pipeline cache to --pipeline_cache every this many pipelines, as well as when the device is destroyed. 0 only exports when the device is destroyed");
+DEFINE_string(result_transport, "", "Path of a shared file, e.g. on tmpfs, to hand images and result files to a driver script through, see ResultTransport, instead of writing them to disk. Images are raw RGBA frames instead of PNG files, hence --result_cache and --server cannot be used with it");
+DEFINE_int32(result_transport_mb, 64, "Size of the --result_transport ring buffer, in megabytes. It must hold at least one frame");
+DEFINE_string(perf_reference, "", "Performance regression mode: '<vert.spv> <frag.spv> <uniforms.json>' of the reference, the test given as arguments being the variant. Both are timed on the GPU, alternately, and the worker exits with 0 if the variant is significantly slower than --perf_slowdown times the reference, 3 if not, 4 if the test cannot be judged. Statistics are saved to '<png_template>_perf.json'");
+DEFINE_int32(perf_iterations, 30, "In performance regression mode, number of timed samples of each test");
+DEFINE_int32(perf_warmup, 5, "In performance regression mode, number of untimed samples of each test, rendered first");
+DEFINE_int32(perf_draws, 16, "In performance regression mode, number of draws of a test per sample, such that a sample outweighs the timestamp resolution");
+DEFINE_double(perf_slowdown, 1.5, "In performance regression mode, the variant is interesting if even the low end of the confidence interval of its slowdown exceeds this ratio");
+DEFINE_int32(device, 0, "Index of the physical device to use, in the order of vkEnumeratePhysicalDevices()");
+DEFINE_string(reference_hash, "", "Hexadecimal hash of the reference image, as found in a '.hash' file produced with --gpu_hash on the same device");
 
 // Constants
 static const VkSampleCountFlagBits num_samples_ = VK_SAMPLE_COUNT_1_BIT;
@@ -43,6 +99,33 @@ static const uint64_t fence_timeout_nanoseconds_ = 100000000;
 static const float clear_color_[4] = {0.0f, 0.0f, 0.0f, 0.0f};
 // Coherence
 const char *coherence_uniforms_string = "{}";
+// Initial size of the arenas of jobs and frames, see Arena
+static const size_t arena_chunk_size_ = 64 * 1024;
+
+// cJSON allocates from the arena of the job being parsed, see LoadUniforms()
+static thread_local Arena *json_arena_ = nullptr;
+
+static void *JsonMalloc(size_t size) {
+  if (json_arena_ != nullptr) {
+    return json_arena_->Allocate(size);
+  }
+  return malloc(size);
+}
+
+// Arena memory is released with the whole arena
+static void JsonFree(void *memory) {
+  if (json_arena_ != nullptr && json_arena_->Contains(memory)) {
+    return;
+  }
+  free(memory);
+}
+
+static void *AllocateJobData(Arena *arena, size_t size) {
+  if (arena != nullptr) {
+    return arena->Allocate(size);
+  }
+  return malloc(size);
+}
 
 // Hardcoded quad
 #define RED2D(_x, _y)  (_x), (_y), 0.0f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f
@@ -64,20 +147,149 @@ static const Vertex vertex_input_data[] = {
 // Coherence shader binaries are stored as byte arrays, see coherence/coherence.sh
 #include "coherence/coherence_vert.inc"
 #include "coherence/coherence_frag.inc"
+// Frame hash shader binary, see frame_hash/frame_hash.sh
+#include "frame_hash/frame_hash_comp.inc"
+
+static int64_t GetTimeMicroseconds() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 VulkanWorker::VulkanWorker(PlatformData *platform_data) {
   platform_data_ = platform_data;
-  PlatformGetWidthHeight(platform_data_, &width_, &height_);
+  if (FLAGS_async_log) {
+    LogSink::Start((size_t)FLAGS_log_buffer, LogSink::ParseOverflowPolicy(FLAGS_log_overflow.c_str()));
+  }
+  Metrics::Start(FLAGS_metrics_file.c_str(), FLAGS_metrics_port, FLAGS_metrics_interval_ms);
+  memory_in_use_ = 0;
+  num_live_objects_ = 0;
+  // Before anything loads the driver
+  if (!FLAGS_crash_file.empty()) {
+    CrashHandler::Install(FLAGS_crash_file.c_str());
+  }
+  watchdog_ = nullptr;
+  if (FLAGS_compile_timeout_ms > 0) {
+    watchdog_ = new Watchdog(FLAGS_watchdog_file.c_str());
+  }
+  result_cache_ = nullptr;
+  if (!FLAGS_result_cache.empty()) {
+    result_cache_ = new ResultCache(FLAGS_result_cache.c_str());
+  }
+  batch_journal_ = nullptr;
+  if (!FLAGS_batch_journal.empty()) {
+    batch_journal_ = new BatchJournal(FLAGS_batch_journal.c_str());
+  }
+  host_allocator_ = nullptr;
+  allocator_ = nullptr;
+  if (FLAGS_host_memory_stats) {
+    host_allocator_ = new HostAllocator();
+    allocator_ = host_allocator_->GetCallbacks();
+  }
+  pipeline_cache_store_ = nullptr;
+  pipeline_cache_ = VK_NULL_HANDLE;
+  if (!FLAGS_pipeline_cache.empty()) {
+    pipeline_cache_store_ = new PipelineCacheStore(FLAGS_pipeline_cache.c_str(), (size_t)FLAGS_pipeline_cache_max_mb * 1024 * 1024,
+                                                   (uint32_t)FLAGS_pipeline_cache_export_interval, allocator_);
+  }
+  result_transport_ = nullptr;
+  if (!FLAGS_result_transport.empty()) {
+    result_transport_ = new ResultTransport(FLAGS_result_transport.c_str(), (size_t)FLAGS_result_transport_mb * 1024 * 1024);
+  }
+  output_writer_ = new OutputWriter(FLAGS_async_output, OutputWriter::ParseFsyncPolicy(FLAGS_output_fsync), (uint32_t)FLAGS_output_shards,
+                                    result_transport_);
+  job_arenas_ = new ArenaPool(arena_chunk_size_);
+  frame_arena_ = new Arena(arena_chunk_size_);
+  cJSON_Hooks json_hooks = {};
+  json_hooks.malloc_fn = JsonMalloc;
+  json_hooks.free_fn = JsonFree;
+  cJSON_InitHooks(&json_hooks);
+  compile_only_ = !FLAGS_compile_farm.empty();
+  if (compile_only_) {
+    // Nothing is drawn, the size only sets the viewport of pipelines
+    width_ = 256;
+    height_ = 256;
+  } else {
+    PlatformGetWidthHeight(platform_data_, &width_, &height_);
+  }
 
   LoadSpirvFromArray(coherence_vert_spv, coherence_vert_spv_len, coherence_vertex_shader_spv_);
   LoadSpirvFromArray(coherence_frag_spv, coherence_frag_spv_len, coherence_fragment_shader_spv_);
+  LoadSpirvFromArray(frame_hash_comp_spv, frame_hash_comp_spv_len, frame_hash_shader_spv_);
+  frame_hash_supported_ = false;
+  has_previous_frame_hash_ = false;
+  previous_frame_hash_ = 0;
+  has_coherence_reference_hash_ = false;
+  coherence_reference_hash_ = 0;
+  server_coherence_ = nullptr;
+  num_server_jobs_ = 0;
+
+  recycle_device_ = false;
+  num_leaky_jobs_ = 0;
 
   CreateInstance();
   EnumeratePhysicalDevices();
   PreparePhysicalDevice();
   GetPhysicalDeviceQueueFamilyProperties();
+  if (compile_only_) {
+    CreateCompileResources();
+  } else {
+    CreateSurface();
+    CreateDeviceResources();
+  }
+  GetMemorySnapshot(&memory_baseline_);
+}
+
+VulkanWorker::~VulkanWorker() {
+  if (server_coherence_ != nullptr) {
+    CleanTest(server_coherence_);
+    delete server_coherence_;
+  }
+  if (compile_only_) {
+    DestroyCompileResources();
+  } else {
+    DestroyDeviceResources();
+  }
+  DestroyInstance();
+  if (pipeline_cache_store_ != nullptr) {
+    pipeline_cache_store_->LogCounters();
+    delete pipeline_cache_store_;
+  }
+  if (host_allocator_ != nullptr) {
+    // Anything still live was leaked by the driver
+    HostMemoryUsage usage;
+    host_allocator_->GetUsage(&usage);
+    log("HOSTMEMORY total %s", HostAllocator::FormatUsage(usage).c_str());
+    delete host_allocator_;
+  }
+  if (watchdog_ != nullptr) {
+    delete watchdog_;
+  }
+  // Waits for queued files
+  delete output_writer_;
+  if (result_transport_ != nullptr) {
+    result_transport_->LogCounters();
+    delete result_transport_;
+  }
+  if (result_cache_ != nullptr) {
+    result_cache_->LogCounters();
+    delete result_cache_;
+  }
+  if (batch_journal_ != nullptr) {
+    delete batch_journal_;
+  }
+  job_arenas_->LogCounters();
+  delete job_arenas_;
+  delete frame_arena_;
+  CrashHandler::Uninstall();
+  Metrics::Stop();
+
+  log("GFZVK DONE");
+  LogSink::Stop();
+}
+
+// The device and everything created from it, see RecycleDevice()
+void VulkanWorker::CreateDeviceResources() {
   CreateDevice();
-  CreateSurface();
+  CreatePipelineCache();
   FindGraphicsAndPresentQueueFamily();
   CreateCommandPool();
   AllocateCommandBuffer();
@@ -89,22 +301,66 @@ VulkanWorker::VulkanWorker(PlatformData *platform_data) {
   AllocateDepthMemory();
   BindDepthImageMemory();
   CreateDepthImageView();
+  CreateRenderPass(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, &render_pass_);
+  SetObjectName(VK_OBJECT_TYPE_RENDER_PASS, (uint64_t)render_pass_, "render pass");
+  CreateFramebuffers();
   PrepareVertexBufferObject();
   PrepareExport();
+  if (FLAGS_gpu_hash) {
+    PrepareFrameHash();
+  }
 }
 
-VulkanWorker::~VulkanWorker() {
+void VulkanWorker::DestroyDeviceResources() {
+  if (frame_hash_supported_) {
+    CleanFrameHash();
+    frame_hash_supported_ = false;
+  }
   CleanExport();
   CleanVertexBufferObject();
+  DestroyFramebuffers();
+  DestroyRenderPass(render_pass_);
   DestroyDepthResources();
   DestroySwapchainImageViews();
   DestroySwapchain();
   FreeCommandBuffers();
   DestroyCommandPool();
+  DestroyPipelineCache();
   DestroyDevice();
-  DestroyInstance();
+}
 
-  log("GFZVK DONE");
+// Compile farm mode: a device and a render pass to create pipelines against,
+// without swapchain, image, or buffer. The surface only gives the format.
+void VulkanWorker::CreateCompileResources() {
+  bool found = false;
+  for (uint32_t i = 0; i < queue_family_properties_.size() && !found; i++) {
+    if (queue_family_properties_[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+      found = true;
+      queue_family_index_ = i;
+    }
+  }
+  assert(found && "Cannot find a queue with VK_QUEUE_GRAPHICS_BIT");
+  CreateDevice();
+  CreatePipelineCache();
+  // Pipelines are created against the same color format as when rendering,
+  // such that drivers compile the same code. Without a window, e.g. on a
+  // headless machine, that format cannot be queried.
+  if (platform_data_->window != nullptr) {
+    CreateSurface();
+    FindFormat();
+  } else {
+    format_ = VK_FORMAT_B8G8R8A8_UNORM;
+    log("COMPILEFARM no window, assume color format %d", format_);
+  }
+  CreateRenderPass(VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, &render_pass_);
+  SetObjectName(VK_OBJECT_TYPE_RENDER_PASS, (uint64_t)render_pass_, "compile render pass");
+  PrepareVertexInputDescriptions();
+}
+
+void VulkanWorker::DestroyCompileResources() {
+  DestroyRenderPass(render_pass_);
+  DestroyPipelineCache();
+  DestroyDevice();
 }
 
 void VulkanWorker::CreateInstance() {
@@ -132,6 +388,7 @@ void VulkanWorker::CreateInstance() {
   const char *debug_utils  = "VK_EXT_debug_utils";
   bool found_debug_report = false;
   bool found_debug_utils = false;
+  bool found_properties2 = false;
   for (uint32_t i = 0; i < num_properties; i++) {
     log("Extension #%d: %s", i, properties[i].extensionName);
     if (strcmp(properties[i].extensionName, debug_report) == 0) {
@@ -140,6 +397,13 @@ void VulkanWorker::CreateInstance() {
     if (strcmp(properties[i].extensionName, debug_utils) == 0) {
       found_debug_utils = true;
     }
+    if (strcmp(properties[i].extensionName, VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME) == 0) {
+      found_properties2 = true;
+    }
+  }
+  // Needed to query VK_EXT_memory_budget
+  if (found_properties2) {
+    enabled_extension_names.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
   }
   // debug_utils should be preferred, but there is no guarantee any is available
   if (found_debug_utils) {
@@ -165,27 +429,83 @@ void VulkanWorker::CreateInstance() {
   instance_create_info.enabledExtensionCount = enabled_extension_names.size();
   instance_create_info.ppEnabledExtensionNames = enabled_extension_names.data();
 
-  VKCHECK(vkCreateInstance(&instance_create_info, nullptr, &instance_));
+  VKCHECK(vkCreateInstance(&instance_create_info, allocator_, &instance_));
+  // The loader has loaded the driver
+  CrashHandler::UpdateModules();
+
+  get_physical_device_memory_properties2_ = nullptr;
+  if (found_properties2) {
+    get_physical_device_memory_properties2_ = (PFN_vkGetPhysicalDeviceMemoryProperties2KHR)vkGetInstanceProcAddr(instance_, "vkGetPhysicalDeviceMemoryProperties2KHR");
+  }
+
+  set_debug_utils_object_name_ = nullptr;
+  cmd_begin_debug_utils_label_ = nullptr;
+  cmd_end_debug_utils_label_ = nullptr;
+  if (found_debug_utils) {
+    set_debug_utils_object_name_ = (PFN_vkSetDebugUtilsObjectNameEXT)vkGetInstanceProcAddr(instance_, "vkSetDebugUtilsObjectNameEXT");
+    cmd_begin_debug_utils_label_ = (PFN_vkCmdBeginDebugUtilsLabelEXT)vkGetInstanceProcAddr(instance_, "vkCmdBeginDebugUtilsLabelEXT");
+    cmd_end_debug_utils_label_ = (PFN_vkCmdEndDebugUtilsLabelEXT)vkGetInstanceProcAddr(instance_, "vkCmdEndDebugUtilsLabelEXT");
+    if (cmd_begin_debug_utils_label_ == nullptr || cmd_end_debug_utils_label_ == nullptr) {
+      cmd_begin_debug_utils_label_ = nullptr;
+      cmd_end_debug_utils_label_ = nullptr;
+    }
+  }
 }
 
 void VulkanWorker::DestroyInstance() {
-  VKLOG(vkDestroyInstance(instance_, nullptr));
+  VKLOG(vkDestroyInstance(instance_, allocator_));
+}
+
+// Object names and command buffer labels show up in captures of RenderDoc,
+// GFXReconstruct and vendor profilers. They are no-ops without debug_utils.
+// Dispatchable handles, such as command buffers, are pointers even on 32-bit
+// Android: pass them as (uint64_t)(uintptr_t)handle.
+void VulkanWorker::SetObjectName(VkObjectType object_type, uint64_t object_handle, const std::string &name) {
+  if (set_debug_utils_object_name_ == nullptr) {
+    return;
+  }
+  VkDebugUtilsObjectNameInfoEXT object_name_info = {};
+  object_name_info.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT;
+  object_name_info.pNext = nullptr;
+  object_name_info.objectType = object_type;
+  object_name_info.objectHandle = object_handle;
+  object_name_info.pObjectName = name.c_str();
+  VKLOG(set_debug_utils_object_name_(device_, &object_name_info));
+}
+
+void VulkanWorker::BeginLabel(VkCommandBuffer command_buffer, const std::string &label) {
+  if (cmd_begin_debug_utils_label_ == nullptr) {
+    return;
+  }
+  VkDebugUtilsLabelEXT label_info = {};
+  label_info.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT;
+  label_info.pNext = nullptr;
+  label_info.pLabelName = label.c_str();
+  VKLOG(cmd_begin_debug_utils_label_(command_buffer, &label_info));
+}
+
+void VulkanWorker::EndLabel(VkCommandBuffer command_buffer) {
+  if (cmd_end_debug_utils_label_ == nullptr) {
+    return;
+  }
+  VKLOG(cmd_end_debug_utils_label_(command_buffer));
 }
 
 void VulkanWorker::EnumeratePhysicalDevices() {
   uint32_t num_physical_devices = 0;
   VKCHECK(vkEnumeratePhysicalDevices(instance_, &num_physical_devices, nullptr));
-  assert(num_physical_devices > 0 || "Cannot find any physical device");
+  assert(num_physical_devices > 0 && "Cannot find any physical device");
   physical_devices_.resize(num_physical_devices);
   VKCHECK(vkEnumeratePhysicalDevices(instance_, &num_physical_devices, physical_devices_.data()));
   log("Number of physical devices (i.e., actual GPU chips): %d", num_physical_devices);
 }
 
 void VulkanWorker::PreparePhysicalDevice() {
+  assert(FLAGS_device >= 0 && (size_t)FLAGS_device < physical_devices_.size() && "No physical device of index --device");
   if (physical_devices_.size() > 1) {
-    log("Warning: more than one GPU detected, the worker always targets the first one listed");
+    log("Warning: more than one GPU detected, the worker targets device %d, see --device", FLAGS_device);
   }
-  physical_device_ = physical_devices_[0];
+  physical_device_ = physical_devices_[FLAGS_device];
   VKLOG(vkGetPhysicalDeviceMemoryProperties(physical_device_, &physical_device_memory_properties_));
   VKLOG(vkGetPhysicalDeviceProperties(physical_device_, &physical_device_properties_));
   log("Physical device properties:");
@@ -200,7 +520,7 @@ void VulkanWorker::PreparePhysicalDevice() {
 void VulkanWorker::GetPhysicalDeviceQueueFamilyProperties() {
   uint32_t num_queue_family_properties = 0;
   VKLOG(vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &num_queue_family_properties, nullptr));
-  assert(num_queue_family_properties > 0 || "Cannot find any queue family property");
+  assert(num_queue_family_properties > 0 && "Cannot find any queue family property");
   queue_family_properties_.resize(num_queue_family_properties);
   VKLOG(vkGetPhysicalDeviceQueueFamilyProperties(physical_device_, &num_queue_family_properties, queue_family_properties_.data()));
 }
@@ -217,7 +537,7 @@ void VulkanWorker::FindGraphicsAndPresentQueueFamily() {
       }
     }
   }
-  assert(found || "Cannot find a queue with both VK_QUEUE_GRAPHICS_BIT and supporting 'present'");
+  assert(found && "Cannot find a queue with both VK_QUEUE_GRAPHICS_BIT and supporting 'present'");
 
   VKLOG(vkGetDeviceQueue(device_, queue_family_index_, 0, &queue_));
 }
@@ -233,7 +553,24 @@ void VulkanWorker::CreateDevice() {
   device_queue_create_info.pQueuePriorities = queue_priorities;
 
   std::vector<const char *> device_extension_names;
-  device_extension_names.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+  if (!compile_only_) {
+    device_extension_names.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+  }
+
+  memory_budget_supported_ = false;
+  if (get_physical_device_memory_properties2_ != nullptr) {
+    uint32_t num_properties = 0;
+    VKCHECK(vkEnumerateDeviceExtensionProperties(physical_device_, nullptr, &num_properties, nullptr));
+    std::vector<VkExtensionProperties> properties(num_properties);
+    VKCHECK(vkEnumerateDeviceExtensionProperties(physical_device_, nullptr, &num_properties, properties.data()));
+    for (const VkExtensionProperties &property : properties) {
+      if (strcmp(property.extensionName, "VK_EXT_memory_budget") == 0) {
+        log("Enable extension memory_budget");
+        device_extension_names.push_back("VK_EXT_memory_budget");
+        memory_budget_supported_ = true;
+      }
+    }
+  }
 
   VkDeviceCreateInfo device_create_info = {};
   device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -247,11 +584,27 @@ void VulkanWorker::CreateDevice() {
   device_create_info.ppEnabledLayerNames = nullptr;
   device_create_info.pEnabledFeatures = nullptr;
 
-  VKCHECK(vkCreateDevice(physical_device_, &device_create_info, nullptr, &device_));
+  VKCHECK(vkCreateDevice(physical_device_, &device_create_info, allocator_, &device_));
+  CrashHandler::UpdateModules();
 }
 
 void VulkanWorker::DestroyDevice() {
-  VKLOG(vkDestroyDevice(device_, nullptr));
+  VKLOG(vkDestroyDevice(device_, allocator_));
+}
+
+// Without --pipeline_cache, pipelines are created without cache
+void VulkanWorker::CreatePipelineCache() {
+  if (pipeline_cache_store_ != nullptr) {
+    pipeline_cache_ = pipeline_cache_store_->Load(device_, physical_device_properties_);
+  }
+}
+
+void VulkanWorker::DestroyPipelineCache() {
+  if (pipeline_cache_ != VK_NULL_HANDLE) {
+    pipeline_cache_store_->Export(device_, pipeline_cache_);
+    VKLOG(vkDestroyPipelineCache(device_, pipeline_cache_, allocator_));
+    pipeline_cache_ = VK_NULL_HANDLE;
+  }
 }
 
 void VulkanWorker::CreateCommandPool() {
@@ -260,11 +613,11 @@ void VulkanWorker::CreateCommandPool() {
   command_pool_create_info.pNext = nullptr;
   command_pool_create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
   command_pool_create_info.queueFamilyIndex = queue_family_index_;
-  VKCHECK(vkCreateCommandPool(device_, &command_pool_create_info, nullptr, &command_pool_));
+  VKCHECK(vkCreateCommandPool(device_, &command_pool_create_info, allocator_, &command_pool_));
 }
 
 void VulkanWorker::DestroyCommandPool() {
-  VKLOG(vkDestroyCommandPool(device_, command_pool_, nullptr));
+  VKLOG(vkDestroyCommandPool(device_, command_pool_, allocator_));
 }
 
 void VulkanWorker::AllocateCommandBuffer() {
@@ -275,6 +628,7 @@ void VulkanWorker::AllocateCommandBuffer() {
   command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
   command_buffer_allocate_info.commandBufferCount = 1;
   VKCHECK(vkAllocateCommandBuffers(device_, &command_buffer_allocate_info, &command_buffer_));
+  SetObjectName(VK_OBJECT_TYPE_COMMAND_BUFFER, (uint64_t)(uintptr_t)command_buffer_, "render");
 }
 
 void VulkanWorker::FreeCommandBuffers() {
@@ -382,11 +736,11 @@ void VulkanWorker::CreateSwapchain() {
   swapchain_create_info.imageSharingMode = image_sharing_mode;
   swapchain_create_info.queueFamilyIndexCount = queue_family_index_count;
   swapchain_create_info.pQueueFamilyIndices = queue_family_indices;
-  VKCHECK(vkCreateSwapchainKHR(device_, &swapchain_create_info, nullptr, &swapchain_));
+  VKCHECK(vkCreateSwapchainKHR(device_, &swapchain_create_info, allocator_, &swapchain_));
 }
 
 void VulkanWorker::DestroySwapchain() {
-  VKLOG(vkDestroySwapchainKHR(device_, swapchain_, nullptr));
+  VKLOG(vkDestroySwapchainKHR(device_, swapchain_, allocator_));
 }
 
 void VulkanWorker::GetSwapchainImages() {
@@ -395,6 +749,9 @@ void VulkanWorker::GetSwapchainImages() {
   assert(num_images > 0);
   images_.resize(num_images);
   VKCHECK(vkGetSwapchainImagesKHR(device_, swapchain_, &num_images, images_.data()));
+  for (uint32_t i = 0; i < num_images; i++) {
+    SetObjectName(VK_OBJECT_TYPE_IMAGE, (uint64_t)images_[i], "swapchain image " + std::to_string(i));
+  }
 }
 
 void VulkanWorker::CreateSwapchainImageViews() {
@@ -418,13 +775,13 @@ void VulkanWorker::CreateSwapchainImageViews() {
 
   for (size_t i = 0; i < images_.size(); i++) {
     image_view_create_info.image = images_[i];
-    VKCHECK(vkCreateImageView(device_, &image_view_create_info, nullptr, &(image_views_[i])));
+    VKCHECK(vkCreateImageView(device_, &image_view_create_info, allocator_, &(image_views_[i])));
   }
 }
 
 void VulkanWorker::DestroySwapchainImageViews() {
   for (VkImageView view: image_views_) {
-    VKLOG(vkDestroyImageView(device_, view, nullptr));
+    VKLOG(vkDestroyImageView(device_, view, allocator_));
   }
 }
 
@@ -457,7 +814,7 @@ void VulkanWorker::CreateDepthImage() {
     assert(false && "Not sure how to set tiling for depth buffer");
   }
 
-  VKCHECK(vkCreateImage(device_, &image_create_info, nullptr, &depth_image_));
+  VKCHECK(vkCreateImage(device_, &image_create_info, allocator_, &depth_image_));
 }
 
 void VulkanWorker::AllocateDepthMemory() {
@@ -469,11 +826,12 @@ void VulkanWorker::AllocateDepthMemory() {
   depth_memory_allocate_info.pNext = nullptr;
   depth_memory_allocate_info.allocationSize = depth_memory_requirements.size;
   depth_memory_allocate_info.memoryTypeIndex = GetMemoryTypeIndex(depth_memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-  VKCHECK(vkAllocateMemory(device_, &depth_memory_allocate_info, nullptr, &depth_memory_));
+  AllocateMemory(&depth_memory_allocate_info, &depth_memory_);
 }
 
 void VulkanWorker::BindDepthImageMemory() {
   VKCHECK(vkBindImageMemory(device_, depth_image_, depth_memory_, /* memory_offset */ 0));
+  SetObjectName(VK_OBJECT_TYPE_IMAGE, (uint64_t)depth_image_, "depth image");
 }
 
 void VulkanWorker::CreateDepthImageView() {
@@ -500,13 +858,13 @@ void VulkanWorker::CreateDepthImageView() {
     depth_image_view_create_info.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
   }
 
-  VKCHECK(vkCreateImageView(device_, &depth_image_view_create_info, nullptr, &depth_image_view_));
+  VKCHECK(vkCreateImageView(device_, &depth_image_view_create_info, allocator_, &depth_image_view_));
 }
 
 void VulkanWorker::DestroyDepthResources() {
-  VKLOG(vkDestroyImageView(device_, depth_image_view_, nullptr));
-  VKLOG(vkFreeMemory(device_, depth_memory_, nullptr));
-  VKLOG(vkDestroyImage(device_, depth_image_, nullptr));
+  VKLOG(vkDestroyImageView(device_, depth_image_view_, allocator_));
+  FreeMemory(depth_memory_);
+  VKLOG(vkDestroyImage(device_, depth_image_, allocator_));
 }
 
 uint32_t VulkanWorker::GetMemoryTypeIndex(uint32_t memory_requirements_type_bits, VkMemoryPropertyFlags required_properties) {
@@ -524,10 +882,10 @@ uint32_t VulkanWorker::GetMemoryTypeIndex(uint32_t memory_requirements_type_bits
   return UINT32_MAX; // unreachable
 }
 
-void VulkanWorker::PrepareUniformBuffer() {
-  uniform_buffers_.resize(uniform_entries_.size());
-  uniform_memories_.resize(uniform_entries_.size());
-  descriptor_buffer_infos_.resize(uniform_entries_.size());
+void VulkanWorker::PrepareUniformBuffer(TestPipeline *test) {
+  test->uniform_buffers.resize(test->uniform_entries.size());
+  test->uniform_memories.resize(test->uniform_entries.size());
+  test->descriptor_buffer_infos.resize(test->uniform_entries.size());
 
   // Buffer create info is same for any uniform, except for size
   VkBufferCreateInfo uniform_buffer_create_info = {};
@@ -539,14 +897,15 @@ void VulkanWorker::PrepareUniformBuffer() {
   uniform_buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
   uniform_buffer_create_info.flags = 0;
 
-  for (size_t i = 0; i < uniform_entries_.size(); i++) {
-    UniformEntry uniform_entry = uniform_entries_[i];
+  for (size_t i = 0; i < test->uniform_entries.size(); i++) {
+    UniformEntry uniform_entry = test->uniform_entries[i];
 
     uniform_buffer_create_info.size = uniform_entry.size;
-    VKCHECK(vkCreateBuffer(device_, &uniform_buffer_create_info, nullptr, &(uniform_buffers_[i])));
+    VKCHECK(vkCreateBuffer(device_, &uniform_buffer_create_info, allocator_, &(test->uniform_buffers[i])));
+    num_live_objects_++;
 
     VkMemoryRequirements uniform_memory_requirements = {};
-    VKLOG(vkGetBufferMemoryRequirements(device_, uniform_buffers_[i], &uniform_memory_requirements));
+    VKLOG(vkGetBufferMemoryRequirements(device_, test->uniform_buffers[i], &uniform_memory_requirements));
 
     VkMemoryPropertyFlags uniform_memory_property_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
     VkMemoryAllocateInfo uniform_memory_allocate_info = {};
@@ -554,35 +913,38 @@ void VulkanWorker::PrepareUniformBuffer() {
     uniform_memory_allocate_info.pNext = nullptr;
     uniform_memory_allocate_info.allocationSize = uniform_memory_requirements.size;
     uniform_memory_allocate_info.memoryTypeIndex = GetMemoryTypeIndex(uniform_memory_requirements.memoryTypeBits, uniform_memory_property_flags);
-    VKCHECK(vkAllocateMemory(device_, &uniform_memory_allocate_info, nullptr, &(uniform_memories_[i])));
+    AllocateMemory(&uniform_memory_allocate_info, &test->uniform_memories[i]);
 
     void *uniform_data = nullptr;
-    VKCHECK(vkMapMemory(device_, uniform_memories_[i], /* offset */ 0, uniform_memory_requirements.size, /* flags */ 0, &uniform_data));
+    VKCHECK(vkMapMemory(device_, test->uniform_memories[i], /* offset */ 0, uniform_memory_requirements.size, /* flags */ 0, &uniform_data));
     assert(uniform_data != nullptr);
     memcpy(uniform_data, uniform_entry.value, uniform_entry.size);
-    VKLOG(vkUnmapMemory(device_, uniform_memories_[i]));
+    VKLOG(vkUnmapMemory(device_, test->uniform_memories[i]));
 
-    VKCHECK(vkBindBufferMemory(device_, uniform_buffers_[i], uniform_memories_[i], /* offset */ 0));
+    VKCHECK(vkBindBufferMemory(device_, test->uniform_buffers[i], test->uniform_memories[i], /* offset */ 0));
 
-    descriptor_buffer_infos_[i].buffer = uniform_buffers_[i];
-    descriptor_buffer_infos_[i].offset = 0;
-    descriptor_buffer_infos_[i].range = uniform_entry.size;
+    test->descriptor_buffer_infos[i].buffer = test->uniform_buffers[i];
+    test->descriptor_buffer_infos[i].offset = 0;
+    test->descriptor_buffer_infos[i].range = uniform_entry.size;
   }
 }
 
-void VulkanWorker::DestroyUniformResources() {
-  for (size_t i = 0; i < uniform_entries_.size(); i++) {
-    free(uniform_entries_[i].value);
-    VKLOG(vkFreeMemory(device_, uniform_memories_[i], nullptr));
-    VKLOG(vkDestroyBuffer(device_, uniform_buffers_[i], nullptr));
+void VulkanWorker::DestroyUniformResources(TestPipeline *test) {
+  for (size_t i = 0; i < test->uniform_entries.size(); i++) {
+    if (test->arena == nullptr) {
+      free(test->uniform_entries[i].value);
+    }
+    FreeMemory(test->uniform_memories[i]);
+    VKLOG(vkDestroyBuffer(device_, test->uniform_buffers[i], allocator_));
+    num_live_objects_--;
   }
 }
 
-void VulkanWorker::CreateDescriptorSetLayout() {
+void VulkanWorker::CreateDescriptorSetLayout(TestPipeline *test) {
   std::vector<VkDescriptorSetLayoutBinding> descriptor_set_layout_bindings;
-  descriptor_set_layout_bindings.resize(uniform_entries_.size());
+  descriptor_set_layout_bindings.resize(test->uniform_entries.size());
 
-  for (size_t i = 0; i < uniform_entries_.size(); i++) {
+  for (size_t i = 0; i < test->uniform_entries.size(); i++) {
     descriptor_set_layout_bindings[i].binding = i;
     descriptor_set_layout_bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
     descriptor_set_layout_bindings[i].descriptorCount = 1;
@@ -594,16 +956,18 @@ void VulkanWorker::CreateDescriptorSetLayout() {
   VkDescriptorSetLayoutCreateInfo descriptor_set_layout_create_info = {};
   descriptor_set_layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
   descriptor_set_layout_create_info.pNext = nullptr;
-  descriptor_set_layout_create_info.bindingCount = uniform_entries_.size();
+  descriptor_set_layout_create_info.bindingCount = test->uniform_entries.size();
   descriptor_set_layout_create_info.pBindings = descriptor_set_layout_bindings.data();
-  VKCHECK(vkCreateDescriptorSetLayout(device_, &descriptor_set_layout_create_info, nullptr, &descriptor_set_layout_));
+  VKCHECK(vkCreateDescriptorSetLayout(device_, &descriptor_set_layout_create_info, allocator_, &(test->descriptor_set_layout)));
+  num_live_objects_++;
 }
 
-void VulkanWorker::DestroyDescriptorSetLayout() {
-  VKLOG(vkDestroyDescriptorSetLayout(device_, descriptor_set_layout_, nullptr));
+void VulkanWorker::DestroyDescriptorSetLayout(TestPipeline *test) {
+  VKLOG(vkDestroyDescriptorSetLayout(device_, test->descriptor_set_layout, allocator_));
+  num_live_objects_--;
 }
 
-void VulkanWorker::CreatePipelineLayout() {
+void VulkanWorker::CreatePipelineLayout(TestPipeline *test) {
   VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
   pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
   pipeline_layout_create_info.pNext = nullptr;
@@ -611,25 +975,27 @@ void VulkanWorker::CreatePipelineLayout() {
   // TODO: push constant range seem to be another way of passing constants to shader, have a look at it.
   pipeline_layout_create_info.pushConstantRangeCount = 0;
   pipeline_layout_create_info.pPushConstantRanges = nullptr;
-  if (uniform_entries_.size() > 0) {
+  if (test->uniform_entries.size() > 0) {
     pipeline_layout_create_info.setLayoutCount = 1;
-    pipeline_layout_create_info.pSetLayouts = &descriptor_set_layout_;
+    pipeline_layout_create_info.pSetLayouts = &(test->descriptor_set_layout);
   } else {
     pipeline_layout_create_info.setLayoutCount = 0;
     pipeline_layout_create_info.pSetLayouts = nullptr;
   }
-  VKCHECK(vkCreatePipelineLayout(device_, &pipeline_layout_create_info, nullptr, &pipeline_layout_));
+  VKCHECK(vkCreatePipelineLayout(device_, &pipeline_layout_create_info, allocator_, &(test->pipeline_layout)));
+  num_live_objects_++;
 }
 
-void VulkanWorker::DestroyPipelineLayout() {
-  VKLOG(vkDestroyPipelineLayout(device_, pipeline_layout_, nullptr));
+void VulkanWorker::DestroyPipelineLayout(TestPipeline *test) {
+  VKLOG(vkDestroyPipelineLayout(device_, test->pipeline_layout, allocator_));
+  num_live_objects_--;
 }
 
-void VulkanWorker::CreateDescriptorPool() {
+void VulkanWorker::CreateDescriptorPool(TestPipeline *test) {
   // We need only one descriptor pool, but we could have more using an array.
   VkDescriptorPoolSize descriptor_pool_size;
   descriptor_pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  descriptor_pool_size.descriptorCount = uniform_entries_.size();
+  descriptor_pool_size.descriptorCount = test->uniform_entries.size();
 
   VkDescriptorPoolCreateInfo descriptor_pool_create_info = {};
   descriptor_pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -639,44 +1005,48 @@ void VulkanWorker::CreateDescriptorPool() {
   descriptor_pool_create_info.poolSizeCount = 1;
   descriptor_pool_create_info.pPoolSizes = &descriptor_pool_size;
 
-  VKCHECK(vkCreateDescriptorPool(device_, &descriptor_pool_create_info, nullptr, &descriptor_pool_));
+  VKCHECK(vkCreateDescriptorPool(device_, &descriptor_pool_create_info, allocator_, &(test->descriptor_pool)));
+  num_live_objects_++;
 }
 
-void VulkanWorker::DestroyDescriptorPool() {
-  VKLOG(vkDestroyDescriptorPool(device_, descriptor_pool_, nullptr));
+void VulkanWorker::DestroyDescriptorPool(TestPipeline *test) {
+  VKLOG(vkDestroyDescriptorPool(device_, test->descriptor_pool, allocator_));
+  num_live_objects_--;
 }
 
-void VulkanWorker::AllocateDescriptorSet() {
+void VulkanWorker::AllocateDescriptorSet(TestPipeline *test) {
 
   VkDescriptorSetAllocateInfo descriptor_set_allocate_info;
   descriptor_set_allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
   descriptor_set_allocate_info.pNext = nullptr;
-  descriptor_set_allocate_info.descriptorPool = descriptor_pool_;
+  descriptor_set_allocate_info.descriptorPool = test->descriptor_pool;
   descriptor_set_allocate_info.descriptorSetCount = 1;
-  descriptor_set_allocate_info.pSetLayouts = &descriptor_set_layout_;
-  VKCHECK(vkAllocateDescriptorSets(device_, &descriptor_set_allocate_info, &descriptor_set_));
+  descriptor_set_allocate_info.pSetLayouts = &(test->descriptor_set_layout);
+  VKCHECK(vkAllocateDescriptorSets(device_, &descriptor_set_allocate_info, &(test->descriptor_set)));
+  num_live_objects_++;
 }
 
-void VulkanWorker::FreeDescriptorSet() {
-  VKLOG(vkFreeDescriptorSets(device_, descriptor_pool_, 1, &descriptor_set_));
+void VulkanWorker::FreeDescriptorSet(TestPipeline *test) {
+  VKLOG(vkFreeDescriptorSets(device_, test->descriptor_pool, 1, &(test->descriptor_set)));
+  num_live_objects_--;
 }
 
-void VulkanWorker::UpdateDescriptorSet() {
+void VulkanWorker::UpdateDescriptorSet(TestPipeline *test) {
   VkWriteDescriptorSet write_descriptor_set;
   write_descriptor_set = {};
   write_descriptor_set.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
   write_descriptor_set.pNext = nullptr;
-  write_descriptor_set.dstSet = descriptor_set_;
-  write_descriptor_set.descriptorCount = uniform_entries_.size();
+  write_descriptor_set.dstSet = test->descriptor_set;
+  write_descriptor_set.descriptorCount = test->uniform_entries.size();
   write_descriptor_set.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  write_descriptor_set.pBufferInfo = descriptor_buffer_infos_.data();
+  write_descriptor_set.pBufferInfo = test->descriptor_buffer_infos.data();
   write_descriptor_set.dstArrayElement = 0;
   write_descriptor_set.dstBinding = 0;
 
   VKLOG(vkUpdateDescriptorSets(device_, 1, &write_descriptor_set, 0, nullptr));
 }
 
-void VulkanWorker::CreateRenderPass() {
+void VulkanWorker::CreateRenderPass(VkImageLayout color_final_layout, VkRenderPass *render_pass) {
   VkAttachmentDescription attachment_descriptions[2];
   // color
   attachment_descriptions[0].format = format_;
@@ -687,7 +1057,7 @@ void VulkanWorker::CreateRenderPass() {
   attachment_descriptions[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   attachment_descriptions[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
   attachment_descriptions[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  attachment_descriptions[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  attachment_descriptions[0].finalLayout = color_final_layout;
   // depth
   attachment_descriptions[1].format = depth_format_;
   attachment_descriptions[1].flags = 0;
@@ -719,6 +1089,17 @@ void VulkanWorker::CreateRenderPass() {
   subpass_description.preserveAttachmentCount = 0;
   subpass_description.pPreserveAttachments = nullptr;
 
+  // When the color attachment is read back right after the render pass (batch
+  // atlas), make the copy wait for the color writes.
+  VkSubpassDependency subpass_dependency = {};
+  subpass_dependency.srcSubpass = 0;
+  subpass_dependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+  subpass_dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  subpass_dependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+  subpass_dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  subpass_dependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  subpass_dependency.dependencyFlags = 0;
+
   VkRenderPassCreateInfo render_pass_create_info = {};
   render_pass_create_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
   render_pass_create_info.pNext = nullptr;
@@ -727,49 +1108,75 @@ void VulkanWorker::CreateRenderPass() {
   render_pass_create_info.pAttachments = attachment_descriptions;
   render_pass_create_info.subpassCount = 1;
   render_pass_create_info.pSubpasses = &subpass_description;
-  render_pass_create_info.dependencyCount = 0;
-  render_pass_create_info.pDependencies = nullptr;
-  VKCHECK(vkCreateRenderPass(device_, &render_pass_create_info, nullptr, &render_pass_));
+  if (color_final_layout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
+    render_pass_create_info.dependencyCount = 1;
+    render_pass_create_info.pDependencies = &subpass_dependency;
+  } else {
+    render_pass_create_info.dependencyCount = 0;
+    render_pass_create_info.pDependencies = nullptr;
+  }
+  VKCHECK(vkCreateRenderPass(device_, &render_pass_create_info, allocator_, render_pass));
 }
 
-void VulkanWorker::DestroyRenderPass() {
-  VKLOG(vkDestroyRenderPass(device_, render_pass_, nullptr));
+void VulkanWorker::DestroyRenderPass(VkRenderPass render_pass) {
+  VKLOG(vkDestroyRenderPass(device_, render_pass, allocator_));
 }
 
-void VulkanWorker::CreateShaderModules() {
+// Modules that cannot be created are left null
+VkResult VulkanWorker::CreateShaderModules(TestPipeline *test) {
+  test->vertex_shader_module = VK_NULL_HANDLE;
+  test->fragment_shader_module = VK_NULL_HANDLE;
   VkShaderModuleCreateInfo module_create_info = {};
   module_create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
   module_create_info.pNext = nullptr;
   module_create_info.flags = 0;
 
   // Vertex
-  module_create_info.codeSize = vertex_shader_spv_.size() * sizeof(uint32_t);
-  module_create_info.pCode = vertex_shader_spv_.data();
-  VKCHECK(vkCreateShaderModule(device_, &module_create_info, nullptr, &vertex_shader_module_));
+  module_create_info.codeSize = test->vertex_shader_spv.size() * sizeof(uint32_t);
+  module_create_info.pCode = test->vertex_shader_spv.data();
+  VkResult result = vkCreateShaderModule(device_, &module_create_info, allocator_, &(test->vertex_shader_module));
+  if (result != VK_SUCCESS) {
+    test->vertex_shader_module = VK_NULL_HANDLE;
+    return result;
+  }
+  num_live_objects_++;
 
   // Fragment
-  module_create_info.codeSize = fragment_shader_spv_.size() * sizeof(uint32_t);
-  module_create_info.pCode = fragment_shader_spv_.data();
-  VKCHECK(vkCreateShaderModule(device_, &module_create_info, nullptr, &fragment_shader_module_));
+  module_create_info.codeSize = test->fragment_shader_spv.size() * sizeof(uint32_t);
+  module_create_info.pCode = test->fragment_shader_spv.data();
+  result = vkCreateShaderModule(device_, &module_create_info, allocator_, &(test->fragment_shader_module));
+  if (result != VK_SUCCESS) {
+    test->fragment_shader_module = VK_NULL_HANDLE;
+    return result;
+  }
+  num_live_objects_++;
+  return VK_SUCCESS;
 }
 
-void VulkanWorker::DestroyShaderModules() {
-  VKLOG(vkDestroyShaderModule(device_, vertex_shader_module_, nullptr));
-  VKLOG(vkDestroyShaderModule(device_, fragment_shader_module_, nullptr));
+// Null handles were not created, see CreateShaderModules()
+void VulkanWorker::DestroyShaderModules(TestPipeline *test) {
+  if (test->vertex_shader_module != VK_NULL_HANDLE) {
+    VKLOG(vkDestroyShaderModule(device_, test->vertex_shader_module, allocator_));
+    num_live_objects_--;
+  }
+  if (test->fragment_shader_module != VK_NULL_HANDLE) {
+    VKLOG(vkDestroyShaderModule(device_, test->fragment_shader_module, allocator_));
+    num_live_objects_--;
+  }
 }
 
-void VulkanWorker::PrepareShaderStages() {
+void VulkanWorker::PrepareShaderStages(TestPipeline *test) {
   for (size_t i = 0; i < 2; i++) {
-    shader_stages_[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    shader_stages_[i].pNext = nullptr;
-    shader_stages_[i].flags = 0;
-    shader_stages_[i].pSpecializationInfo = nullptr;
-    shader_stages_[i].pName = "main";
+    test->shader_stages[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    test->shader_stages[i].pNext = nullptr;
+    test->shader_stages[i].flags = 0;
+    test->shader_stages[i].pSpecializationInfo = nullptr;
+    test->shader_stages[i].pName = "main";
   }
-  shader_stages_[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-  shader_stages_[0].module = vertex_shader_module_;
-  shader_stages_[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  shader_stages_[1].module = fragment_shader_module_;
+  test->shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+  test->shader_stages[0].module = test->vertex_shader_module;
+  test->shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  test->shader_stages[1].module = test->fragment_shader_module;
 }
 
 void VulkanWorker::CreateFramebuffers() {
@@ -791,13 +1198,13 @@ void VulkanWorker::CreateFramebuffers() {
 
   for (size_t i = 0; i < images_.size(); i++) {
     attachments[0] = image_views_[i];
-    VKCHECK(vkCreateFramebuffer(device_, &framebuffer_create_info, nullptr, &(framebuffers_[i])));
+    VKCHECK(vkCreateFramebuffer(device_, &framebuffer_create_info, allocator_, &(framebuffers_[i])));
   }
 }
 
 void VulkanWorker::DestroyFramebuffers() {
   for (size_t i = 0; i < images_.size(); i++) {
-    VKLOG(vkDestroyFramebuffer(device_, framebuffers_[i], nullptr));
+    VKLOG(vkDestroyFramebuffer(device_, framebuffers_[i], allocator_));
   }
 }
 
@@ -811,7 +1218,7 @@ void VulkanWorker::PrepareVertexBufferObject() {
   vertex_buffer_create_info.queueFamilyIndexCount = 0;
   vertex_buffer_create_info.pQueueFamilyIndices = nullptr;
   vertex_buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  VKCHECK(vkCreateBuffer(device_, &vertex_buffer_create_info, nullptr, &vertex_buffer_));
+  VKCHECK(vkCreateBuffer(device_, &vertex_buffer_create_info, allocator_, &vertex_buffer_));
 
   VkMemoryRequirements vertex_memory_requirements = {};
   VKLOG(vkGetBufferMemoryRequirements(device_, vertex_buffer_, &vertex_memory_requirements));
@@ -822,7 +1229,7 @@ void VulkanWorker::PrepareVertexBufferObject() {
   vertex_memory_allocate_info.pNext = nullptr;
   vertex_memory_allocate_info.allocationSize = vertex_memory_requirements.size;
   vertex_memory_allocate_info.memoryTypeIndex = GetMemoryTypeIndex(vertex_memory_requirements.memoryTypeBits, vertex_memory_property_flags);
-  VKCHECK(vkAllocateMemory(device_, &vertex_memory_allocate_info, nullptr, &vertex_memory_));
+  AllocateMemory(&vertex_memory_allocate_info, &vertex_memory_);
 
   void *vertex_data = nullptr;
   VKCHECK(vkMapMemory(device_, vertex_memory_, /* offset */ 0, vertex_memory_requirements.size, /* flags */ 0, &vertex_data));
@@ -831,7 +1238,12 @@ void VulkanWorker::PrepareVertexBufferObject() {
   VKLOG(vkUnmapMemory(device_, vertex_memory_));
 
   VKCHECK(vkBindBufferMemory(device_, vertex_buffer_, vertex_memory_, /* offset */ 0));
+  SetObjectName(VK_OBJECT_TYPE_BUFFER, (uint64_t)vertex_buffer_, "vertex buffer");
+
+  PrepareVertexInputDescriptions();
+}
 
+void VulkanWorker::PrepareVertexInputDescriptions() {
   vertex_input_binding_description_.binding = 0;
   vertex_input_binding_description_.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
   vertex_input_binding_description_.stride = sizeof(vertex_input_data[0]);
@@ -848,11 +1260,13 @@ void VulkanWorker::PrepareVertexBufferObject() {
 }
 
 void VulkanWorker::CleanVertexBufferObject() {
-  VKLOG(vkFreeMemory(device_, vertex_memory_, nullptr));
-  VKLOG(vkDestroyBuffer(device_, vertex_buffer_, nullptr));
+  FreeMemory(vertex_memory_);
+  VKLOG(vkDestroyBuffer(device_, vertex_buffer_, allocator_));
 }
 
-void VulkanWorker::CreateGraphicsPipeline() {
+// Errors are returned rather than checked, such that the compile farm can
+// record them.
+VkResult VulkanWorker::CreateGraphicsPipeline(TestPipeline *test, VkRenderPass render_pass, const VkRect2D &render_area, Watchdog *watchdog) {
   VkPipelineVertexInputStateCreateInfo pipeline_vertex_input_state_create_info = {};
   pipeline_vertex_input_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
   pipeline_vertex_input_state_create_info.pNext = nullptr;
@@ -909,16 +1323,13 @@ void VulkanWorker::CreateGraphicsPipeline() {
   VkViewport viewports[1] = {};
   viewports[0].minDepth = 0.0f;
   viewports[0].maxDepth = 1.0f;
-  viewports[0].x = 0;
-  viewports[0].y = 0;
-  viewports[0].width = width_;
-  viewports[0].height = height_;
+  viewports[0].x = render_area.offset.x;
+  viewports[0].y = render_area.offset.y;
+  viewports[0].width = render_area.extent.width;
+  viewports[0].height = render_area.extent.height;
 
   VkRect2D scissors[1] = {};
-  scissors[0].extent.width = width_;
-  scissors[0].extent.height = height_;
-  scissors[0].offset.x = 0;
-  scissors[0].offset.y = 0;
+  scissors[0] = render_area;
 
   VkPipelineViewportStateCreateInfo pipeline_viewport_state_create_info = {};
   pipeline_viewport_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
@@ -963,7 +1374,7 @@ void VulkanWorker::CreateGraphicsPipeline() {
   VkGraphicsPipelineCreateInfo graphics_pipeline_create_info = {};
   graphics_pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
   graphics_pipeline_create_info.pNext = nullptr;
-  graphics_pipeline_create_info.layout = pipeline_layout_;
+  graphics_pipeline_create_info.layout = test->pipeline_layout;
   graphics_pipeline_create_info.basePipelineHandle = VK_NULL_HANDLE;
   graphics_pipeline_create_info.basePipelineIndex = 0;
   graphics_pipeline_create_info.flags = 0;
@@ -976,17 +1387,50 @@ void VulkanWorker::CreateGraphicsPipeline() {
   graphics_pipeline_create_info.pDynamicState = nullptr;
   graphics_pipeline_create_info.pViewportState = &pipeline_viewport_state_create_info;
   graphics_pipeline_create_info.pDepthStencilState = &pipeline_depth_stencil_state_create_info;
-  graphics_pipeline_create_info.pStages = shader_stages_;
+  graphics_pipeline_create_info.pStages = test->shader_stages;
   graphics_pipeline_create_info.stageCount = 2;
-  graphics_pipeline_create_info.renderPass = render_pass_;
+  graphics_pipeline_create_info.renderPass = render_pass;
   graphics_pipeline_create_info.subpass = 0;
 
-  VKCHECK(vkCreateGraphicsPipelines(device_, VK_NULL_HANDLE, 1, &graphics_pipeline_create_info, nullptr, &graphics_pipeline_));
-  log("GFZVK pipeline ok");
+  // Driver compilers may hang on fuzzed shaders
+  CrashHandler::SetStage("IMAGE_VALIDATE_PROGRAM");
+  if (batch_journal_ != nullptr) {
+    batch_journal_->RecordStage("IMAGE_VALIDATE_PROGRAM");
+  }
+  if (watchdog != nullptr) {
+    watchdog->Arm("IMAGE_VALIDATE_PROGRAM", FLAGS_compile_timeout_ms);
+  }
+  VkResult result = vkCreateGraphicsPipelines(device_, pipeline_cache_, 1, &graphics_pipeline_create_info, allocator_, &(test->graphics_pipeline));
+  if (watchdog != nullptr) {
+    watchdog->Disarm();
+  }
+  if (result == VK_SUCCESS) {
+    log("GFZVK pipeline ok");
+    num_live_objects_++;
+    if (pipeline_cache_store_ != nullptr) {
+      pipeline_cache_store_->CountPipeline(device_, pipeline_cache_);
+    }
+  }
+  return result;
+}
+
+void VulkanWorker::DestroyGraphicsPipeline(TestPipeline *test) {
+  if (test->graphics_pipeline != VK_NULL_HANDLE) {
+    VKLOG(vkDestroyPipeline(device_, test->graphics_pipeline, allocator_));
+    num_live_objects_--;
+  }
 }
 
-void VulkanWorker::DestroyGraphicsPipeline() {
-  VKLOG(vkDestroyPipeline(device_, graphics_pipeline_, nullptr));
+// What LoadSpirvFromFile() asserts on, checked without loading the file
+bool VulkanWorker::CheckSpirvFile(FILE *source) {
+  uint32_t magic = 0;
+  if (fseek(source, 0, SEEK_END) != 0) {
+    return false;
+  }
+  long size = ftell(source);
+  bool valid = size >= 5 * (long)sizeof(uint32_t) && size % sizeof(uint32_t) == 0 && fseek(source, 0, SEEK_SET) == 0 && fread(&magic, sizeof(uint32_t), 1, source) == 1 && magic == 0x07230203;
+  rewind(source);
+  return valid;
 }
 
 void VulkanWorker::LoadSpirvFromFile(FILE *source, std::vector<uint32_t> &spv) {
@@ -1002,6 +1446,8 @@ void VulkanWorker::LoadSpirvFromFile(FILE *source, std::vector<uint32_t> &spv) {
       assert(feof(source) && "Error: cannot load spir-v binary");
     }
   }
+  // A SPIR-V module starts with a 5-word header, the first word being the magic number
+  assert(spv.size() >= 5 && spv[0] == 0x07230203 && "Error: invalid spir-v binary");
 }
 
 void VulkanWorker::LoadSpirvFromArray(unsigned char *array, unsigned int len, std::vector<uint32_t> &spv) {
@@ -1021,24 +1467,25 @@ void VulkanWorker::CreateSemaphore() {
   semaphore_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
   semaphore_create_info.pNext = nullptr;
   semaphore_create_info.flags = 0;
-  VKCHECK(vkCreateSemaphore(device_, &semaphore_create_info, nullptr, &semaphore_));
+  VKCHECK(vkCreateSemaphore(device_, &semaphore_create_info, allocator_, &semaphore_));
 }
 
 void VulkanWorker::DestroySemaphore() {
-  VKLOG(vkDestroySemaphore(device_, semaphore_, nullptr));
+  VKLOG(vkDestroySemaphore(device_, semaphore_, allocator_));
 }
 
 void VulkanWorker::AcquireNextImage() {
   VKCHECK(vkAcquireNextImageKHR(device_, swapchain_, UINT64_MAX, semaphore_, VK_NULL_HANDLE, &swapchain_image_index_));
 }
 
-void VulkanWorker::PrepareCommandBuffer() {
+void VulkanWorker::PrepareCommandBuffer(TestPipeline *test, const char *label) {
   VkCommandBufferBeginInfo command_buffer_begin_info = {};
   command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
   command_buffer_begin_info.pNext = nullptr;
   command_buffer_begin_info.flags = 0;
   command_buffer_begin_info.pInheritanceInfo = nullptr;
   VKCHECK(vkBeginCommandBuffer(command_buffer_, &command_buffer_begin_info));
+  BeginLabel(command_buffer_, std::string("render ") + label);
 
   VkClearValue clear_values[2];
   clear_values[0].color.float32[0] = clear_color_[0];
@@ -1061,10 +1508,10 @@ void VulkanWorker::PrepareCommandBuffer() {
   render_pass_begin_info.pClearValues = clear_values;
   VKLOG(vkCmdBeginRenderPass(command_buffer_, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE));
 
-  VKLOG(vkCmdBindPipeline(command_buffer_, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipeline_));
+  VKLOG(vkCmdBindPipeline(command_buffer_, VK_PIPELINE_BIND_POINT_GRAPHICS, test->graphics_pipeline));
 
-  if (uniform_entries_.size() > 0) {
-    VKLOG(vkCmdBindDescriptorSets(command_buffer_, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, 0, 1, &descriptor_set_, 0, nullptr));
+  if (test->uniform_entries.size() > 0) {
+    VKLOG(vkCmdBindDescriptorSets(command_buffer_, VK_PIPELINE_BIND_POINT_GRAPHICS, test->pipeline_layout, 0, 1, &(test->descriptor_set), 0, nullptr));
   }
 
   const VkDeviceSize offsets[1] = {0};
@@ -1073,19 +1520,155 @@ void VulkanWorker::PrepareCommandBuffer() {
   VKLOG(vkCmdDraw(command_buffer_, /* two triangles */ 2 * 3, 1, 0, 0));
 
   VKLOG(vkCmdEndRenderPass(command_buffer_));
+  EndLabel(command_buffer_);
   VKCHECK(vkEndCommandBuffer(command_buffer_));
 }
 
+// Device memory is allocated and freed through these, to track its use
+void VulkanWorker::AllocateMemory(const VkMemoryAllocateInfo *memory_allocate_info, VkDeviceMemory *memory) {
+  VKCHECK(vkAllocateMemory(device_, memory_allocate_info, allocator_, memory));
+  memory_sizes_[*memory] = memory_allocate_info->allocationSize;
+  memory_in_use_ += memory_allocate_info->allocationSize;
+  Metrics::Set("gfz_device_memory_bytes", (double)memory_in_use_);
+}
+
+void VulkanWorker::FreeMemory(VkDeviceMemory memory) {
+  VKLOG(vkFreeMemory(device_, memory, allocator_));
+  auto memory_size = memory_sizes_.find(memory);
+  if (memory_size != memory_sizes_.end()) {
+    memory_in_use_ -= memory_size->second;
+    memory_sizes_.erase(memory_size);
+  }
+  Metrics::Set("gfz_device_memory_bytes", (double)memory_in_use_);
+}
+
+void VulkanWorker::GetMemorySnapshot(MemorySnapshot *snapshot) {
+  *snapshot = MemorySnapshot();
+  if (memory_budget_supported_) {
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT memory_budget_properties = {};
+    memory_budget_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+    memory_budget_properties.pNext = nullptr;
+    VkPhysicalDeviceMemoryProperties2 memory_properties = {};
+    memory_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    memory_properties.pNext = &memory_budget_properties;
+    VKLOG(get_physical_device_memory_properties2_(physical_device_, &memory_properties));
+    snapshot->num_heaps = memory_properties.memoryProperties.memoryHeapCount;
+    for (uint32_t i = 0; i < snapshot->num_heaps; i++) {
+      snapshot->heap_usage[i] = memory_budget_properties.heapUsage[i];
+      snapshot->heap_budget[i] = memory_budget_properties.heapBudget[i];
+    }
+  }
+  snapshot->memory_in_use = memory_in_use_;
+  snapshot->num_memory_allocations = memory_sizes_.size();
+  snapshot->num_live_objects = num_live_objects_.load();
+  if (host_allocator_ != nullptr) {
+    HostMemoryUsage usage;
+    host_allocator_->GetUsage(&usage);
+    snapshot->host_live_bytes = usage.live_bytes;
+    snapshot->host_live_allocations = usage.live_allocations;
+  }
+}
+
+// Returns whether more memory or objects are alive after a job than before it.
+// Device heap usage may also grow because of driver caches: the recycling
+// thresholds tell leaks from a warm driver.
+bool VulkanWorker::CheckMemoryLeak(const MemorySnapshot &before, const MemorySnapshot &after) {
+  bool leak = false;
+  for (uint32_t i = 0; i < after.num_heaps; i++) {
+    if (after.heap_usage[i] > before.heap_usage[i]) {
+      log("MEMORYLEAK heap %u usage +%llu bytes, now %llu of %llu budget", i, (unsigned long long)(after.heap_usage[i] - before.heap_usage[i]), (unsigned long long)after.heap_usage[i], (unsigned long long)after.heap_budget[i]);
+      leak = true;
+    }
+  }
+  if (after.num_memory_allocations > before.num_memory_allocations) {
+    log("MEMORYLEAK %zu device memory allocations", after.num_memory_allocations - before.num_memory_allocations);
+    leak = true;
+  }
+  if (after.num_live_objects > before.num_live_objects) {
+    log("MEMORYLEAK %lld Vulkan objects", (long long)(after.num_live_objects - before.num_live_objects));
+    leak = true;
+  }
+  if (after.host_live_allocations > before.host_live_allocations) {
+    log("MEMORYLEAK %lld host allocations of the driver, %lld bytes", (long long)(after.host_live_allocations - before.host_live_allocations), (long long)(after.host_live_bytes - before.host_live_bytes));
+    leak = true;
+  }
+  return leak;
+}
+
+// Compares memory use to the baseline taken when the device was created, and
+// decides whether the device should be recreated before the next job. Heap
+// usage already includes the device memory allocated by the worker: without
+// VK_EXT_memory_budget, that allocated memory is used instead, plus the host
+// memory of the driver with --host_memory_stats.
+void VulkanWorker::CheckMemoryGrowth(const MemorySnapshot &snapshot) {
+  int64_t growth = 0;
+  if (memory_budget_supported_) {
+    for (uint32_t i = 0; i < snapshot.num_heaps; i++) {
+      growth += (int64_t)snapshot.heap_usage[i] - (int64_t)memory_baseline_.heap_usage[i];
+    }
+  } else {
+    growth = (int64_t)snapshot.memory_in_use - (int64_t)memory_baseline_.memory_in_use;
+    growth += snapshot.host_live_bytes - memory_baseline_.host_live_bytes;
+  }
+  if (FLAGS_recycle_memory_growth_mb > 0 && growth > (int64_t)FLAGS_recycle_memory_growth_mb * 1024 * 1024) {
+    log("MEMORYGROWTH %lld bytes since the device was created, recycle the device", (long long)growth);
+    recycle_device_ = true;
+  }
+  if (FLAGS_recycle_leaky_jobs > 0 && num_leaky_jobs_ >= (uint32_t)FLAGS_recycle_leaky_jobs) {
+    log("MEMORYGROWTH %u leaky jobs since the device was created, recycle the device", num_leaky_jobs_);
+    recycle_device_ = true;
+  }
+}
+
+// Recreate the device and everything created from it, such that memory held by
+// the driver for the old device is given back. Pipelines of tests must have
+// been cleaned. The instance and the surface are kept.
+void VulkanWorker::RecycleDevice() {
+  log("RECYCLEDEVICE START");
+  CrashHandler::SetStage("RECYCLE_DEVICE");
+  VKCHECK(vkDeviceWaitIdle(device_));
+  DestroyDeviceResources();
+  if (!memory_sizes_.empty()) {
+    log("WARNING: %zu device memory allocations not freed", memory_sizes_.size());
+    memory_sizes_.clear();
+    memory_in_use_ = 0;
+  }
+  CreateDeviceResources();
+  GetMemorySnapshot(&memory_baseline_);
+  recycle_device_ = false;
+  num_leaky_jobs_ = 0;
+  Metrics::Increment("gfz_device_recycles_total");
+  log("RECYCLEDEVICE END");
+}
+
 void VulkanWorker::CreateFence() {
   VkFenceCreateInfo fence_create_info = {};
   fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
   fence_create_info.pNext = nullptr;
   fence_create_info.flags = 0;
-  VKCHECK(vkCreateFence(device_, &fence_create_info, nullptr, &fence_));
+  VKCHECK(vkCreateFence(device_, &fence_create_info, allocator_, &fence_));
 }
 
 void VulkanWorker::DestroyFence() {
-  VKLOG(vkDestroyFence(device_, fence_, nullptr));
+  VKLOG(vkDestroyFence(device_, fence_, allocator_));
+}
+
+void VulkanWorker::WaitForFence() {
+  VkResult result = VK_TIMEOUT;
+  do {
+    // Do not use VKCHECK as VK_TIMEOUT is a valid result
+    result = vkWaitForFences(device_, 1, &fence_, VK_TRUE, fence_timeout_nanoseconds_);
+    log("vkWaitForFences(): %s", getVkResultString(result));
+    if (result == VK_TIMEOUT) {
+      Metrics::Increment("gfz_fence_timeouts_total");
+    }
+  } while (result == VK_TIMEOUT);
+  if (result == VK_ERROR_DEVICE_LOST) {
+    // The assert below terminates the worker
+    Metrics::Increment("gfz_device_lost_total");
+    Metrics::WriteFile();
+  }
+  assert(result == VK_SUCCESS);
 }
 
 void VulkanWorker::SubmitCommandBuffer() {
@@ -1102,14 +1685,7 @@ void VulkanWorker::SubmitCommandBuffer() {
   submit_info[0].signalSemaphoreCount = 0;
   submit_info[0].pSignalSemaphores = nullptr;
   VKCHECK(vkQueueSubmit(queue_, 1, submit_info, fence_));
-
-  VkResult result = VK_TIMEOUT;
-  do {
-    // Do not use VKCHECK as VK_TIMEOUT is a valid result
-    result = vkWaitForFences(device_, 1, &fence_, VK_TRUE, fence_timeout_nanoseconds_);
-    log("vkWaitForFences(): %s", getVkResultString(result));
-  } while (result == VK_TIMEOUT);
-  assert(result == VK_SUCCESS);
+  WaitForFence();
 }
 
 void VulkanWorker::PresentToDisplay() {
@@ -1218,7 +1794,7 @@ void VulkanWorker::PrepareExport() {
     export_image_create_info.pQueueFamilyIndices = nullptr;
     export_image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     export_image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    VKCHECK(vkCreateImage(device_, &export_image_create_info, nullptr, &export_image_));
+    VKCHECK(vkCreateImage(device_, &export_image_create_info, allocator_, &export_image_));
 
     VKLOG(vkGetImageMemoryRequirements(device_, export_image_, &export_image_memory_requirements_));
 
@@ -1227,9 +1803,11 @@ void VulkanWorker::PrepareExport() {
     export_image_memory_allocate_info.pNext = nullptr;
     export_image_memory_allocate_info.allocationSize = export_image_memory_requirements_.size;
     export_image_memory_allocate_info.memoryTypeIndex = GetMemoryTypeIndex(export_image_memory_requirements_.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    VKCHECK(vkAllocateMemory(device_, &export_image_memory_allocate_info, nullptr, &(export_image_memory_)));
+    AllocateMemory(&export_image_memory_allocate_info, &export_image_memory_);
 
     VKCHECK(vkBindImageMemory(device_, export_image_, export_image_memory_, 0));
+    SetObjectName(VK_OBJECT_TYPE_IMAGE, (uint64_t)export_image_, "export image");
+    SetObjectName(VK_OBJECT_TYPE_DEVICE_MEMORY, (uint64_t)export_image_memory_, "export image memory");
   }
 
   {
@@ -1255,6 +1833,8 @@ void VulkanWorker::PrepareExport() {
       export_command_buffer_begin_info.flags = 0;
       export_command_buffer_begin_info.pInheritanceInfo = nullptr;
       VKCHECK(vkBeginCommandBuffer(export_command_buffer, &export_command_buffer_begin_info));
+      SetObjectName(VK_OBJECT_TYPE_COMMAND_BUFFER, (uint64_t)(uintptr_t)export_command_buffer, "readback copy " + std::to_string(i));
+      BeginLabel(export_command_buffer, "readback copy");
 
       UpdateImageLayout(export_command_buffer, export_image_, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
       UpdateImageLayout(export_command_buffer, images_[i], VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
@@ -1281,6 +1861,7 @@ void VulkanWorker::PrepareExport() {
 
       UpdateImageLayout(export_command_buffer, export_image_, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT);
 
+      EndLabel(export_command_buffer);
       VKCHECK(vkEndCommandBuffer(export_command_buffer));
     }
   }
@@ -1289,17 +1870,319 @@ void VulkanWorker::PrepareExport() {
 
 void VulkanWorker::CleanExport() {
   VKLOG(vkFreeCommandBuffers(device_, command_pool_, export_command_buffers_.size(), export_command_buffers_.data()));
-  VKLOG(vkFreeMemory(device_, export_image_memory_, nullptr));
-  VKLOG(vkDestroyImage(device_, export_image_, nullptr));
+  FreeMemory(export_image_memory_);
+  VKLOG(vkDestroyImage(device_, export_image_, allocator_));
+}
+
+void VulkanWorker::PrepareFrameHash() {
+  if (!(queue_family_properties_[queue_family_index_].queueFlags & VK_QUEUE_COMPUTE_BIT)) {
+    log("WARNING: queue does not support compute, --gpu_hash is ignored");
+    return;
+  }
+  frame_hash_supported_ = true;
+
+  VkMemoryRequirements memory_requirements = {};
+  VkMemoryAllocateInfo memory_allocate_info = {};
+  memory_allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  memory_allocate_info.pNext = nullptr;
+
+  VkBufferCreateInfo buffer_create_info = {};
+  buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_create_info.pNext = nullptr;
+  buffer_create_info.flags = 0;
+  buffer_create_info.queueFamilyIndexCount = 0;
+  buffer_create_info.pQueueFamilyIndices = nullptr;
+  buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  {
+    // Pixels, copied from the swapchain image: stays on the device
+    buffer_create_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_create_info.size = width_ * height_ * 4;
+    VKCHECK(vkCreateBuffer(device_, &buffer_create_info, allocator_, &frame_hash_pixel_buffer_));
+
+    VKLOG(vkGetBufferMemoryRequirements(device_, frame_hash_pixel_buffer_, &memory_requirements));
+    memory_allocate_info.allocationSize = memory_requirements.size;
+    memory_allocate_info.memoryTypeIndex = GetMemoryTypeIndex(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    AllocateMemory(&memory_allocate_info, &frame_hash_pixel_memory_);
+    VKCHECK(vkBindBufferMemory(device_, frame_hash_pixel_buffer_, frame_hash_pixel_memory_, 0));
+  }
+
+  {
+    // Row hashes, read back by the host
+    buffer_create_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    buffer_create_info.size = height_ * sizeof(uint32_t);
+    VKCHECK(vkCreateBuffer(device_, &buffer_create_info, allocator_, &frame_hash_row_buffer_));
+
+    VKLOG(vkGetBufferMemoryRequirements(device_, frame_hash_row_buffer_, &memory_requirements));
+    memory_allocate_info.allocationSize = memory_requirements.size;
+    memory_allocate_info.memoryTypeIndex = GetMemoryTypeIndex(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    AllocateMemory(&memory_allocate_info, &frame_hash_row_memory_);
+    VKCHECK(vkBindBufferMemory(device_, frame_hash_row_buffer_, frame_hash_row_memory_, 0));
+  }
+
+  {
+    // Descriptors
+    VkDescriptorSetLayoutBinding descriptor_set_layout_bindings[2] = {};
+    for (uint32_t i = 0; i < 2; i++) {
+      descriptor_set_layout_bindings[i].binding = i;
+      descriptor_set_layout_bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      descriptor_set_layout_bindings[i].descriptorCount = 1;
+      descriptor_set_layout_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+      descriptor_set_layout_bindings[i].pImmutableSamplers = nullptr;
+    }
+
+    VkDescriptorSetLayoutCreateInfo descriptor_set_layout_create_info = {};
+    descriptor_set_layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptor_set_layout_create_info.pNext = nullptr;
+    descriptor_set_layout_create_info.flags = 0;
+    descriptor_set_layout_create_info.bindingCount = 2;
+    descriptor_set_layout_create_info.pBindings = descriptor_set_layout_bindings;
+    VKCHECK(vkCreateDescriptorSetLayout(device_, &descriptor_set_layout_create_info, allocator_, &frame_hash_descriptor_set_layout_));
+
+    VkPushConstantRange push_constant_range = {};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = 2 * sizeof(uint32_t); // width, height
+
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info = {};
+    pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_create_info.pNext = nullptr;
+    pipeline_layout_create_info.flags = 0;
+    pipeline_layout_create_info.setLayoutCount = 1;
+    pipeline_layout_create_info.pSetLayouts = &frame_hash_descriptor_set_layout_;
+    pipeline_layout_create_info.pushConstantRangeCount = 1;
+    pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+    VKCHECK(vkCreatePipelineLayout(device_, &pipeline_layout_create_info, allocator_, &frame_hash_pipeline_layout_));
+
+    VkDescriptorPoolSize descriptor_pool_size = {};
+    descriptor_pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptor_pool_size.descriptorCount = 2;
+
+    VkDescriptorPoolCreateInfo descriptor_pool_create_info = {};
+    descriptor_pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptor_pool_create_info.pNext = nullptr;
+    descriptor_pool_create_info.flags = 0;
+    descriptor_pool_create_info.maxSets = 1;
+    descriptor_pool_create_info.poolSizeCount = 1;
+    descriptor_pool_create_info.pPoolSizes = &descriptor_pool_size;
+    VKCHECK(vkCreateDescriptorPool(device_, &descriptor_pool_create_info, allocator_, &frame_hash_descriptor_pool_));
+
+    VkDescriptorSetAllocateInfo descriptor_set_allocate_info = {};
+    descriptor_set_allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptor_set_allocate_info.pNext = nullptr;
+    descriptor_set_allocate_info.descriptorPool = frame_hash_descriptor_pool_;
+    descriptor_set_allocate_info.descriptorSetCount = 1;
+    descriptor_set_allocate_info.pSetLayouts = &frame_hash_descriptor_set_layout_;
+    VKCHECK(vkAllocateDescriptorSets(device_, &descriptor_set_allocate_info, &frame_hash_descriptor_set_));
+
+    VkDescriptorBufferInfo descriptor_buffer_infos[2] = {};
+    descriptor_buffer_infos[0].buffer = frame_hash_pixel_buffer_;
+    descriptor_buffer_infos[0].offset = 0;
+    descriptor_buffer_infos[0].range = VK_WHOLE_SIZE;
+    descriptor_buffer_infos[1].buffer = frame_hash_row_buffer_;
+    descriptor_buffer_infos[1].offset = 0;
+    descriptor_buffer_infos[1].range = VK_WHOLE_SIZE;
+
+    VkWriteDescriptorSet write_descriptor_set = {};
+    write_descriptor_set.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write_descriptor_set.pNext = nullptr;
+    write_descriptor_set.dstSet = frame_hash_descriptor_set_;
+    write_descriptor_set.dstBinding = 0;
+    write_descriptor_set.dstArrayElement = 0;
+    write_descriptor_set.descriptorCount = 2;
+    write_descriptor_set.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write_descriptor_set.pImageInfo = nullptr;
+    write_descriptor_set.pBufferInfo = descriptor_buffer_infos;
+    write_descriptor_set.pTexelBufferView = nullptr;
+    VKLOG(vkUpdateDescriptorSets(device_, 1, &write_descriptor_set, 0, nullptr));
+  }
+
+  {
+    // Compute pipeline
+    VkShaderModuleCreateInfo shader_module_create_info = {};
+    shader_module_create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    shader_module_create_info.pNext = nullptr;
+    shader_module_create_info.flags = 0;
+    shader_module_create_info.codeSize = frame_hash_shader_spv_.size() * sizeof(uint32_t);
+    shader_module_create_info.pCode = frame_hash_shader_spv_.data();
+    VKCHECK(vkCreateShaderModule(device_, &shader_module_create_info, allocator_, &frame_hash_shader_module_));
+
+    VkComputePipelineCreateInfo compute_pipeline_create_info = {};
+    compute_pipeline_create_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    compute_pipeline_create_info.pNext = nullptr;
+    compute_pipeline_create_info.flags = 0;
+    compute_pipeline_create_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    compute_pipeline_create_info.stage.pNext = nullptr;
+    compute_pipeline_create_info.stage.flags = 0;
+    compute_pipeline_create_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    compute_pipeline_create_info.stage.module = frame_hash_shader_module_;
+    compute_pipeline_create_info.stage.pName = "main";
+    compute_pipeline_create_info.stage.pSpecializationInfo = nullptr;
+    compute_pipeline_create_info.layout = frame_hash_pipeline_layout_;
+    compute_pipeline_create_info.basePipelineHandle = VK_NULL_HANDLE;
+    compute_pipeline_create_info.basePipelineIndex = 0;
+    VKCHECK(vkCreateComputePipelines(device_, pipeline_cache_, 1, &compute_pipeline_create_info, allocator_, &frame_hash_pipeline_));
+    SetObjectName(VK_OBJECT_TYPE_SHADER_MODULE, (uint64_t)frame_hash_shader_module_, "frame hash");
+    SetObjectName(VK_OBJECT_TYPE_PIPELINE, (uint64_t)frame_hash_pipeline_, "frame hash");
+  }
+
+  {
+    // Command buffers: one per swapchain image
+    uint32_t num_swapchain_images = images_.size();
+    frame_hash_command_buffers_.resize(num_swapchain_images);
+
+    VkCommandBufferAllocateInfo command_buffer_allocate_info = {};
+    command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    command_buffer_allocate_info.pNext = nullptr;
+    command_buffer_allocate_info.commandPool = command_pool_;
+    command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    command_buffer_allocate_info.commandBufferCount = num_swapchain_images;
+    VKCHECK(vkAllocateCommandBuffers(device_, &command_buffer_allocate_info, frame_hash_command_buffers_.data()));
+
+    const uint32_t push_constants[2] = {width_, height_};
+
+    for (uint32_t i = 0; i < num_swapchain_images; i++) {
+      VkCommandBuffer command_buffer = frame_hash_command_buffers_[i];
+
+      VkCommandBufferBeginInfo command_buffer_begin_info = {};
+      command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      command_buffer_begin_info.pNext = nullptr;
+      command_buffer_begin_info.flags = 0;
+      command_buffer_begin_info.pInheritanceInfo = nullptr;
+      VKCHECK(vkBeginCommandBuffer(command_buffer, &command_buffer_begin_info));
+      SetObjectName(VK_OBJECT_TYPE_COMMAND_BUFFER, (uint64_t)(uintptr_t)command_buffer, "frame hash " + std::to_string(i));
+      BeginLabel(command_buffer, "frame hash");
+
+      UpdateImageLayout(command_buffer, images_[i], VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+      VkBufferImageCopy buffer_image_copy = {};
+      buffer_image_copy.bufferOffset = 0;
+      buffer_image_copy.bufferRowLength = 0; // tightly packed
+      buffer_image_copy.bufferImageHeight = 0;
+      buffer_image_copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      buffer_image_copy.imageSubresource.mipLevel = 0;
+      buffer_image_copy.imageSubresource.baseArrayLayer = 0;
+      buffer_image_copy.imageSubresource.layerCount = 1;
+      buffer_image_copy.imageOffset.x = 0;
+      buffer_image_copy.imageOffset.y = 0;
+      buffer_image_copy.imageOffset.z = 0;
+      buffer_image_copy.imageExtent.width = width_;
+      buffer_image_copy.imageExtent.height = height_;
+      buffer_image_copy.imageExtent.depth = 1;
+      VKLOG(vkCmdCopyImageToBuffer(command_buffer, images_[i], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, frame_hash_pixel_buffer_, 1, &buffer_image_copy));
+
+      // Give the image back in the layout expected by the export command buffers
+      UpdateImageLayout(command_buffer, images_[i], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+
+      VkBufferMemoryBarrier buffer_memory_barrier = {};
+      buffer_memory_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+      buffer_memory_barrier.pNext = nullptr;
+      buffer_memory_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      buffer_memory_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      buffer_memory_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      buffer_memory_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      buffer_memory_barrier.buffer = frame_hash_pixel_buffer_;
+      buffer_memory_barrier.offset = 0;
+      buffer_memory_barrier.size = VK_WHOLE_SIZE;
+      VKLOG(vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &buffer_memory_barrier, 0, nullptr));
+
+      VKLOG(vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, frame_hash_pipeline_));
+      VKLOG(vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, frame_hash_pipeline_layout_, 0, 1, &frame_hash_descriptor_set_, 0, nullptr));
+      VKLOG(vkCmdPushConstants(command_buffer, frame_hash_pipeline_layout_, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_constants), push_constants));
+      // One invocation per row, 64 invocations per workgroup: see frame_hash.comp
+      VKLOG(vkCmdDispatch(command_buffer, (height_ + 63) / 64, 1, 1));
+
+      buffer_memory_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+      buffer_memory_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+      buffer_memory_barrier.buffer = frame_hash_row_buffer_;
+      VKLOG(vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &buffer_memory_barrier, 0, nullptr));
+
+      EndLabel(command_buffer);
+      VKCHECK(vkEndCommandBuffer(command_buffer));
+    }
+  }
+}
+
+void VulkanWorker::CleanFrameHash() {
+  VKLOG(vkFreeCommandBuffers(device_, command_pool_, frame_hash_command_buffers_.size(), frame_hash_command_buffers_.data()));
+  VKLOG(vkDestroyPipeline(device_, frame_hash_pipeline_, allocator_));
+  VKLOG(vkDestroyShaderModule(device_, frame_hash_shader_module_, allocator_));
+  VKLOG(vkDestroyDescriptorPool(device_, frame_hash_descriptor_pool_, allocator_));
+  VKLOG(vkDestroyPipelineLayout(device_, frame_hash_pipeline_layout_, allocator_));
+  VKLOG(vkDestroyDescriptorSetLayout(device_, frame_hash_descriptor_set_layout_, allocator_));
+  FreeMemory(frame_hash_row_memory_);
+  VKLOG(vkDestroyBuffer(device_, frame_hash_row_buffer_, allocator_));
+  FreeMemory(frame_hash_pixel_memory_);
+  VKLOG(vkDestroyBuffer(device_, frame_hash_pixel_buffer_, allocator_));
+}
+
+// Run the frame hash compute pass on the current swapchain image, and combine
+// the per-row hashes into a single 64-bit FNV-1a hash.
+uint64_t VulkanWorker::HashFrame() {
+  log("HASHFRAME START");
+
+  VKCHECK(vkResetFences(device_, 1, &fence_));
+
+  VkSubmitInfo submit_info = {};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.pNext = nullptr;
+  submit_info.waitSemaphoreCount = 0;
+  submit_info.pWaitSemaphores = nullptr;
+  submit_info.pWaitDstStageMask = nullptr;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &(frame_hash_command_buffers_[swapchain_image_index_]);
+  submit_info.signalSemaphoreCount = 0;
+  submit_info.pSignalSemaphores = nullptr;
+  VKCHECK(vkQueueSubmit(queue_, 1, &submit_info, fence_));
+  WaitForFence();
+
+  void *device_memory = nullptr;
+  VKCHECK(vkMapMemory(device_, frame_hash_row_memory_, 0, VK_WHOLE_SIZE, 0, &device_memory));
+  assert(device_memory != nullptr);
+  const uint32_t *row_hashes = (const uint32_t *)device_memory;
+  uint64_t hash = 14695981039346656037ULL;
+  for (uint32_t y = 0; y < height_; y++) {
+    hash = (hash ^ row_hashes[y]) * 1099511628211ULL;
+  }
+  VKLOG(vkUnmapMemory(device_, frame_hash_row_memory_));
+
+  log("HASHFRAME END");
+  return hash;
+}
+
+// Save the frame hash, and read the full image back only when it cannot be
+// deduced from the reference or from the previous frame. png_exported tells
+// which.
+uint64_t VulkanWorker::ExportFrameHash(const char *png_filename, const char *hash_filename, bool *png_exported) {
+  uint64_t hash = HashFrame();
+  log("FRAMEHASH %016llx", (unsigned long long)hash);
+
+  char hash_string[32];
+  snprintf(hash_string, sizeof(hash_string), "%016llx\n", (unsigned long long)hash);
+  output_writer_->Write(hash_filename, hash_string);
+
+  bool same_as_reference = !FLAGS_reference_hash.empty() && hash == strtoull(FLAGS_reference_hash.c_str(), nullptr, 16);
+  bool same_as_previous = has_previous_frame_hash_ && hash == previous_frame_hash_;
+  has_previous_frame_hash_ = true;
+  previous_frame_hash_ = hash;
+
+  *png_exported = !(same_as_reference || same_as_previous);
+  if (*png_exported) {
+    ExportPNG(png_filename);
+  } else {
+    log("FRAMEHASH MATCH %s", same_as_reference ? "reference" : "previous");
+  }
+  return hash;
 }
 
-char *VulkanWorker::GetFileContent(FILE *file) {
+// The content is allocated from arena, or with malloc() when arena is null.
+char *VulkanWorker::GetFileContent(FILE *file, Arena *arena) {
   assert(file != nullptr);
   fseek(file, 0, SEEK_END);
   const long file_num_char = ftell(file);
   const long file_content_size = file_num_char + 1; // One more char for final '\0'
   fseek(file, 0, SEEK_SET);
-  char *file_content = (char *)malloc(file_content_size);
+  char *file_content = (char *)AllocateJobData(arena, file_content_size);
   assert(file_content != nullptr);
   file_content[file_num_char] = '\0';
   long num_read_char = 0;
@@ -1313,17 +2196,77 @@ char *VulkanWorker::GetFileContent(FILE *file) {
   return file_content;
 }
 
-// TODO: defensive: check that each uniform entry targets a different binding
-void VulkanWorker::LoadUniforms(const char *uniforms_string) {
+// The uniforms LoadUniforms() asserts on, and entries that share a binding,
+// reported instead: uniforms that come from the server or a job file must fail
+// the job, not the worker.
+bool VulkanWorker::CheckUniforms(const char *uniforms_string, std::string *error) {
+  static const struct { const char *func; int num_args; } kUniformFuncs[] = {
+    {"glUniform1f", 1}, {"glUniform2f", 2}, {"glUniform3f", 3}, {"glUniform4f", 4},
+    {"glUniform1i", 1}, {"glUniform2i", 2}, {"glUniform3i", 3}, {"glUniform4i", 4},
+  };
+
+  error->clear();
+  const char *return_past_end = nullptr;
+  cJSON *uniform_json = cJSON_ParseWithOpts(uniforms_string, &return_past_end, true);
+  if (uniform_json == nullptr || !(cJSON_IsObject(uniform_json) || cJSON_IsArray(uniform_json))) {
+    cJSON_Delete(uniform_json);
+    *error = "cannot parse uniforms JSON";
+    return false;
+  }
+
+  size_t num_uniforms = cJSON_GetArraySize(uniform_json);
+  std::vector<bool> bound(num_uniforms, false);
+  for (size_t i = 0; i < num_uniforms && error->empty(); i++) {
+    cJSON *json_entry = cJSON_GetArrayItem(uniform_json, i);
+    cJSON *json_binding = cJSON_GetObjectItemCaseSensitive(json_entry, "binding");
+    cJSON *json_func = cJSON_GetObjectItemCaseSensitive(json_entry, "func");
+    cJSON *json_args = cJSON_GetObjectItemCaseSensitive(json_entry, "args");
+    if (!cJSON_IsObject(json_entry) || !cJSON_IsNumber(json_binding) || !cJSON_IsString(json_func) || !cJSON_IsArray(json_args)) {
+      *error = "uniform " + std::to_string(i) + " needs 'binding', 'func' and 'args'";
+      break;
+    }
+    int binding = json_binding->valueint;
+    if (binding < 0 || (size_t)binding >= num_uniforms || bound[binding]) {
+      *error = "invalid or duplicate uniform binding " + std::to_string(binding);
+      break;
+    }
+    bound[binding] = true;
+
+    int num_args = -1;
+    for (const auto &uniform_func : kUniformFuncs) {
+      if (strcmp(json_func->valuestring, uniform_func.func) == 0) {
+        num_args = uniform_func.num_args;
+      }
+    }
+    if (num_args < 0) {
+      *error = std::string("invalid or unsupported uniform 'func': ") + json_func->valuestring;
+    } else if (cJSON_GetArraySize(json_args) != num_args) {
+      *error = "uniform " + std::to_string(binding) + " needs " + std::to_string(num_args) + " args";
+    }
+    for (int j = 0; j < cJSON_GetArraySize(json_args) && error->empty(); j++) {
+      if (!cJSON_IsNumber(cJSON_GetArrayItem(json_args, j))) {
+        *error = "uniform " + std::to_string(binding) + " has a non-numeric arg";
+      }
+    }
+  }
+  cJSON_Delete(uniform_json);
+  return error->empty();
+}
+
+// Values are allocated from arena, or with malloc() when arena is null. The
+// JSON tree is allocated from arena too. Uniforms from outside the worker must
+// pass CheckUniforms() first.
+void VulkanWorker::LoadUniforms(const char *uniforms_string, std::vector<UniformEntry> &uniform_entries, Arena *arena) {
 
   // Parse
+  json_arena_ = arena;
   const char *return_past_end = nullptr;
   cJSON *uniform_json = cJSON_ParseWithOpts(uniforms_string, &return_past_end, true);
-  assert(return_past_end == nullptr || "Error when parsing uniform JSON");
+  assert(uniform_json != nullptr && "Error when parsing uniform JSON");
 
   // Extract uniforms
   size_t num_uniforms = cJSON_GetArraySize(uniform_json);
-  uniform_entries_.resize(num_uniforms);
+  uniform_entries.resize(num_uniforms);
 
   for (size_t i = 0; i < num_uniforms; i++) {
     cJSON *json_entry = cJSON_GetArrayItem(uniform_json, i);
@@ -1333,7 +2276,7 @@ void VulkanWorker::LoadUniforms(const char *uniforms_string) {
     int binding = json_binding->valueint;
     assert(binding >= 0 && (size_t)binding < num_uniforms);
 
-    UniformEntry *uniform_entry = &(uniform_entries_[binding]);
+    UniformEntry *uniform_entry = &(uniform_entries[binding]);
 
     cJSON *json_func = cJSON_GetObjectItemCaseSensitive(json_entry, "func");
     assert(json_func != nullptr && cJSON_IsString(json_func));
@@ -1347,7 +2290,7 @@ void VulkanWorker::LoadUniforms(const char *uniforms_string) {
         cJSON *x = cJSON_GetArrayItem(json_args, 0);
         assert(cJSON_IsNumber(x));
         uniform_entry->size = sizeof(float);
-        uniform_entry->value = malloc(uniform_entry->size);
+        uniform_entry->value = AllocateJobData(arena, uniform_entry->size);
         assert(uniform_entry->value != nullptr);
         ((float *)uniform_entry->value)[0] = x->valuedouble;
     } else if (func == "glUniform2f") {
@@ -1357,7 +2300,7 @@ void VulkanWorker::LoadUniforms(const char *uniforms_string) {
         cJSON *y = cJSON_GetArrayItem(json_args, 1);
         assert(cJSON_IsNumber(y));
         uniform_entry->size = 2 * sizeof(float);
-        uniform_entry->value = malloc(uniform_entry->size);
+        uniform_entry->value = AllocateJobData(arena, uniform_entry->size);
         assert(uniform_entry->value != nullptr);
         ((float *)uniform_entry->value)[0] = x->valuedouble;
         ((float *)uniform_entry->value)[1] = y->valuedouble;
@@ -1370,7 +2313,7 @@ void VulkanWorker::LoadUniforms(const char *uniforms_string) {
         cJSON *z = cJSON_GetArrayItem(json_args, 2);
         assert(cJSON_IsNumber(z));
         uniform_entry->size = 3 * sizeof(float);
-        uniform_entry->value = malloc(uniform_entry->size);
+        uniform_entry->value = AllocateJobData(arena, uniform_entry->size);
         assert(uniform_entry->value != nullptr);
         ((float *)uniform_entry->value)[0] = x->valuedouble;
         ((float *)uniform_entry->value)[1] = y->valuedouble;
@@ -1386,7 +2329,7 @@ void VulkanWorker::LoadUniforms(const char *uniforms_string) {
         cJSON *w = cJSON_GetArrayItem(json_args, 3);
         assert(cJSON_IsNumber(z));
         uniform_entry->size = 4 * sizeof(float);
-        uniform_entry->value = malloc(uniform_entry->size);
+        uniform_entry->value = AllocateJobData(arena, uniform_entry->size);
         assert(uniform_entry->value != nullptr);
         ((float *)uniform_entry->value)[0] = x->valuedouble;
         ((float *)uniform_entry->value)[1] = y->valuedouble;
@@ -1399,7 +2342,7 @@ void VulkanWorker::LoadUniforms(const char *uniforms_string) {
       cJSON *x = cJSON_GetArrayItem(json_args, 0);
       assert(cJSON_IsNumber(x));
       uniform_entry->size = sizeof(int);
-      uniform_entry->value = malloc(uniform_entry->size);
+      uniform_entry->value = AllocateJobData(arena, uniform_entry->size);
       assert(uniform_entry->value != nullptr);
       ((int *)uniform_entry->value)[0] = x->valueint;
     } else if (func == "glUniform2i") {
@@ -1409,7 +2352,7 @@ void VulkanWorker::LoadUniforms(const char *uniforms_string) {
       cJSON *y = cJSON_GetArrayItem(json_args, 1);
       assert(cJSON_IsNumber(y));
       uniform_entry->size = 2 * sizeof(int);
-      uniform_entry->value = malloc(uniform_entry->size);
+      uniform_entry->value = AllocateJobData(arena, uniform_entry->size);
       assert(uniform_entry->value != nullptr);
       ((int *)uniform_entry->value)[0] = x->valueint;
       ((int *)uniform_entry->value)[1] = y->valueint;
@@ -1422,7 +2365,7 @@ void VulkanWorker::LoadUniforms(const char *uniforms_string) {
       cJSON *z = cJSON_GetArrayItem(json_args, 2);
       assert(cJSON_IsNumber(z));
       uniform_entry->size = 3 * sizeof(int);
-      uniform_entry->value = malloc(uniform_entry->size);
+      uniform_entry->value = AllocateJobData(arena, uniform_entry->size);
       assert(uniform_entry->value != nullptr);
       ((int *)uniform_entry->value)[0] = x->valueint;
       ((int *)uniform_entry->value)[1] = y->valueint;
@@ -1438,7 +2381,7 @@ void VulkanWorker::LoadUniforms(const char *uniforms_string) {
       cJSON *w = cJSON_GetArrayItem(json_args, 3);
       assert(cJSON_IsNumber(z));
       uniform_entry->size = 4 * sizeof(int);
-      uniform_entry->value = malloc(uniform_entry->size);
+      uniform_entry->value = AllocateJobData(arena, uniform_entry->size);
       assert(uniform_entry->value != nullptr);
       ((int *)uniform_entry->value)[0] = x->valueint;
       ((int *)uniform_entry->value)[1] = y->valueint;
@@ -1454,10 +2397,13 @@ void VulkanWorker::LoadUniforms(const char *uniforms_string) {
   }
 
   cJSON_Delete(uniform_json);
+  json_arena_ = nullptr;
 }
 
-void VulkanWorker::ExportPNG(const char *png_filename) {
+// Read the current swapchain image back to plain, continuous RGBA.
+void VulkanWorker::ReadbackFrame(unsigned char *rgba_blob) {
   log("EXPORTTOCPU START");
+  int64_t start = GetTimeMicroseconds();
 
   VKCHECK(vkResetFences(device_, 1, &fence_));
 
@@ -1474,17 +2420,10 @@ void VulkanWorker::ExportPNG(const char *png_filename) {
   submit_info[0].pSignalSemaphores = nullptr;
 
   VKCHECK(vkQueueSubmit(queue_, 1, submit_info, fence_));
-
-  VkResult result = VK_TIMEOUT;
-  do {
-    // Do not use VKCHECK as VK_TIMEOUT is a valid result
-    result = vkWaitForFences(device_, 1, &fence_, VK_TRUE, fence_timeout_nanoseconds_);
-    log("vkWaitForFences(): %s", getVkResultString(result));
-  } while (result == VK_TIMEOUT);
-  assert(result == VK_SUCCESS);
+  WaitForFence();
 
   // Get export image binary blob in whatever format the device exposes
-  unsigned char *source_image_blob = (unsigned char *)malloc(export_image_memory_requirements_.size);
+  unsigned char *source_image_blob = (unsigned char *)frame_arena_->Allocate(export_image_memory_requirements_.size);
   assert(source_image_blob != nullptr);
 
   void *device_memory = nullptr;
@@ -1500,31 +2439,91 @@ void VulkanWorker::ExportPNG(const char *png_filename) {
   image_subresource.arrayLayer = 0;
   VkSubresourceLayout subresource_layout;
   VKLOG(vkGetImageSubresourceLayout(device_, export_image_, &image_subresource, &subresource_layout));
-  unsigned char *source_line = source_image_blob + subresource_layout.offset;
 
-  unsigned char *rgba_blob = (unsigned char *)malloc(width_ * height_ * 4); // Four channels (RGBA)
-  assert(rgba_blob != nullptr);
-  uint32_t *rgba_pixel = (uint32_t *)rgba_blob;
+  Metrics::ObserveMicroseconds("gfz_readback_seconds", GetTimeMicroseconds() - start);
   log("EXPORTTOCPU END");
 
   log("DUMPRGBA START");
-  // Do not try to optimise this loop, it is not worth it.
-  // If you still want to try: measure, measure, measure.
-  // And realize: it's probably not worth it.
-  for (uint32_t y = 0; y < height_; y++) {
-    uint32_t *source_pixel = (uint32_t *)source_line;
-    for (uint32_t x = 0; x < width_; x++) {
-      switch (format_) {
+  ConvertToRGBA(source_image_blob + subresource_layout.offset, subresource_layout.rowPitch, rgba_blob);
+  log("DUMPRGBA END");
+}
 
-        case VK_FORMAT_R8G8B8A8_UNORM:
-          *rgba_pixel = *source_pixel;
-          break;
+// Returns the hash of the exported image, such that repeated frames can be
+// compared without reading the PNG files back.
+uint64_t VulkanWorker::ExportPNG(const char *png_filename) {
+  unsigned char *rgba_blob = AllocateFrame(png_filename);
+  ReadbackFrame(rgba_blob);
+  uint64_t hash = HashRGBA(rgba_blob);
+  SaveFrame(rgba_blob, png_filename);
+  return hash;
+}
 
-        case VK_FORMAT_B8G8R8A8_UNORM:
-          // fallthrough
-        case VK_FORMAT_B8G8R8A8_SRGB:
-          // Convert BGRA (AA RR GG BB) to RGBA (AA BB GG RR)
-          *rgba_pixel = (*source_pixel & 0xff00ff00) | ((*source_pixel & 0x00ff0000) >> 16) | ((*source_pixel & 0x000000ff) << 16);
+// With --result_transport, frames are read back straight into the ring buffer,
+// and published by SaveFrame() instead of being encoded.
+unsigned char *VulkanWorker::AllocateFrame(const char *png_filename) {
+  unsigned char *rgba_blob;
+  if (result_transport_ != nullptr) {
+    rgba_blob = result_transport_->BeginFrame(png_filename, width_, height_);
+  } else {
+    rgba_blob = (unsigned char *)frame_arena_->Allocate(width_ * height_ * 4); // Four channels (RGBA)
+  }
+  assert(rgba_blob != nullptr);
+  return rgba_blob;
+}
+
+void VulkanWorker::SaveFrame(const unsigned char *rgba_blob, const char *png_filename) {
+  if (result_transport_ != nullptr) {
+    result_transport_->EndFrame();
+  } else {
+    SavePNG(rgba_blob, png_filename);
+  }
+}
+
+uint64_t VulkanWorker::HashRGBA(const unsigned char *rgba_blob) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (uint32_t i = 0; i < width_ * height_ * 4; i++) {
+    hash = (hash ^ rgba_blob[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Hash the current swapchain image, on the GPU when possible.
+uint64_t VulkanWorker::HashCurrentFrame() {
+  if (frame_hash_supported_) {
+    return HashFrame();
+  }
+
+  unsigned char *rgba_blob = (unsigned char *)frame_arena_->Allocate(width_ * height_ * 4); // Four channels (RGBA)
+  assert(rgba_blob != nullptr);
+  ReadbackFrame(rgba_blob);
+  uint64_t hash = HashRGBA(rgba_blob);
+  return hash;
+}
+
+// Convert a width_ x height_ image, in the device format and with the given
+// row pitch, to plain and continuous RGBA.
+void VulkanWorker::ConvertToRGBA(const unsigned char *source, VkDeviceSize row_pitch, unsigned char *rgba) {
+  const unsigned char *source_line = source;
+  uint32_t *rgba_pixel = (uint32_t *)rgba;
+
+  // Do not try to optimise this loop, it is not worth it.
+  // If you still want to try: measure, measure, measure.
+  // And realize: it's probably not worth it.
+  for (uint32_t y = 0; y < height_; y++) {
+    const uint32_t *source_pixel = (const uint32_t *)source_line;
+    for (uint32_t x = 0; x < width_; x++) {
+      switch (format_) {
+
+        case VK_FORMAT_R8G8B8A8_UNORM:
+          *rgba_pixel = *source_pixel;
+          break;
+
+        case VK_FORMAT_B8G8R8A8_UNORM:
+          // fallthrough
+        case VK_FORMAT_B8G8R8A8_SRGB:
+          // Convert BGRA (AA RR GG BB) to RGBA (AA BB GG RR)
+          *rgba_pixel = (*source_pixel & 0xff00ff00) | ((*source_pixel & 0x00ff0000) >> 16) | ((*source_pixel & 0x000000ff) << 16);
           break;
 
         default:
@@ -1535,121 +2534,1604 @@ void VulkanWorker::ExportPNG(const char *png_filename) {
       rgba_pixel++;
       source_pixel++;
     }
-    source_line += subresource_layout.rowPitch;
+    source_line += row_pitch;
   }
-  log("DUMPRGBA END");
+}
 
-  // Convert to PNG
+void VulkanWorker::SavePNG(const unsigned char *rgba, const char *png_filename) {
   std::vector<unsigned char> png;
   log("PNGENCODE START");
+  int64_t start = GetTimeMicroseconds();
   lodepng::State state;
   state.encoder.auto_convert = 0;
   state.info_raw.colortype = LodePNGColorType::LCT_RGBA;
   state.info_raw.bitdepth = 8;
   state.info_png.color.colortype = LodePNGColorType::LCT_RGBA;
   state.info_png.color.bitdepth = 8;
-  unsigned int png_encode_error = lodepng::encode(png, rgba_blob, width_, height_, state);
+  unsigned int png_encode_error = lodepng::encode(png, rgba, width_, height_, state);
+  Metrics::ObserveMicroseconds("gfz_encode_seconds", GetTimeMicroseconds() - start);
   log("PNGENCODE END");
   assert(!png_encode_error);
   log("PNGSAVEFILE START");
-  lodepng::save_file(png, png_filename);
+  output_writer_->Write(png_filename, png);
   log("PNGSAVEFILE END");
-
-  free(source_image_blob);
-  free(rgba_blob);
 }
 
-void VulkanWorker::PrepareTest(std::vector<uint32_t> &vertex_spv, std::vector<uint32_t> &fragment_spv, const char *uniforms_string) {
+// The shaders and parsed uniforms of the job are moved to the test, which owns
+// them from then on.
+// Shader module and pipeline creation errors are returned, e.g. for invalid
+// SPIR-V, once the test is cleaned: CleanTest() must not be called then.
+VkResult VulkanWorker::PrepareTest(TestPipeline *test, TestJob *job, VkRenderPass render_pass, const VkRect2D &render_area) {
   log("PREPARETEST START");
+  int64_t start = GetTimeMicroseconds();
+  CrashHandler::SetStage("IMAGE_PREPARE");
+  CrashHandler::SetJobName(job->png_template.c_str());
+
+  test->name = job->png_template;
+  test->vertex_shader_spv = std::move(job->vertex_spv);
+  test->fragment_shader_spv = std::move(job->fragment_spv);
+  test->uniform_entries = std::move(job->uniform_entries);
+  job->uniform_entries.clear();
+  test->arena = job->arena;
+  job->arena = nullptr;
+
+  PrepareUniformBuffer(test);
+
+  if (test->uniform_entries.size() > 0) {
+    CreateDescriptorSetLayout(test);
+    CreateDescriptorPool(test);
+    AllocateDescriptorSet(test);
+    UpdateDescriptorSet(test);
+  }
 
-  vertex_shader_spv_ = vertex_spv;
-  fragment_shader_spv_ = fragment_spv;
-  VKLOG(LoadUniforms(uniforms_string));
-
-  PrepareUniformBuffer();
-
-  if (uniform_entries_.size() > 0) {
-    CreateDescriptorSetLayout();
-    CreateDescriptorPool();
-    AllocateDescriptorSet();
-    UpdateDescriptorSet();
+  CreatePipelineLayout(test);
+  test->graphics_pipeline = VK_NULL_HANDLE;
+  VkResult result = CreateShaderModules(test);
+  if (result == VK_SUCCESS) {
+    PrepareShaderStages(test);
+    result = CreateGraphicsPipeline(test, render_pass, render_area, watchdog_);
+  }
+  if (result != VK_SUCCESS) {
+    log("PREPARETEST ERROR %s", getVkResultString(result));
+    // Destroying a null handle is a no-op
+    CleanTest(test);
+    return result;
   }
 
-  CreatePipelineLayout();
-  CreateRenderPass();
-  CreateShaderModules();
-  PrepareShaderStages();
-  CreateFramebuffers();
-  CreateGraphicsPipeline();
+  SetObjectName(VK_OBJECT_TYPE_PIPELINE_LAYOUT, (uint64_t)test->pipeline_layout, test->name);
+  SetObjectName(VK_OBJECT_TYPE_SHADER_MODULE, (uint64_t)test->vertex_shader_module, test->name + " vert");
+  SetObjectName(VK_OBJECT_TYPE_SHADER_MODULE, (uint64_t)test->fragment_shader_module, test->name + " frag");
+  SetObjectName(VK_OBJECT_TYPE_PIPELINE, (uint64_t)test->graphics_pipeline, test->name);
 
+  Metrics::ObserveMicroseconds("gfz_compile_seconds", GetTimeMicroseconds() - start);
   log("PREPARETEST END");
+  return VK_SUCCESS;
 }
 
-void VulkanWorker::CleanTest() {
-  DestroyGraphicsPipeline();
-  DestroyFramebuffers();
-  DestroyShaderModules();
-  DestroyRenderPass();
+void VulkanWorker::CleanTest(TestPipeline *test) {
+  DestroyGraphicsPipeline(test);
+  DestroyShaderModules(test);
 
-  if (uniform_entries_.size() > 0) {
-    FreeDescriptorSet();
-    DestroyDescriptorPool();
-    DestroyDescriptorSetLayout();
+  if (test->uniform_entries.size() > 0) {
+    FreeDescriptorSet(test);
+    DestroyDescriptorPool(test);
+    DestroyDescriptorSetLayout(test);
   }
 
-  DestroyPipelineLayout();
-  DestroyUniformResources();
+  DestroyPipelineLayout(test);
+  DestroyUniformResources(test);
+  if (test->arena != nullptr) {
+    job_arenas_->Release(test->arena);
+    test->arena = nullptr;
+  }
 }
 
-void VulkanWorker::DrawTest(const char *png_filename, bool skip_render) {
+// When hash_filename is not null and --gpu_hash is set, the frame is hashed on
+// the GPU before deciding whether to export it as PNG. Returns the hash of the
+// frame, or 0 when rendering is skipped. When result is not null, it counts the
+// frame and accumulates render and capture times. When png_exported is not
+// null, it tells whether the PNG was written.
+uint64_t VulkanWorker::DrawTest(TestPipeline *test, const char *png_filename, const char *hash_filename, bool skip_render, TestResult *result, bool *png_exported) {
+  uint64_t hash = 0;
+  int64_t render_time = 0;
+  int64_t capture_time = 0;
+  bool exported = false;
 
   if (skip_render) {
     log("SKIP_RENDER");
   } else {
 
-    log("DRAWTEST START");
-    CreateSemaphore();
-    AcquireNextImage();
-    PrepareCommandBuffer();
-    CreateFence();
-    SubmitCommandBuffer();
-    log("DRAWTEST END");
+    int64_t start = GetTimeMicroseconds();
+    BeginFrame(test, png_filename);
+    int64_t rendered = GetTimeMicroseconds();
+    if (hash_filename != nullptr && frame_hash_supported_) {
+      hash = ExportFrameHash(png_filename, hash_filename, &exported);
+    } else {
+      hash = ExportPNG(png_filename);
+      exported = true;
+    }
+    EndFrame();
+    render_time = rendered - start;
+    Metrics::ObserveMicroseconds("gfz_render_seconds", render_time);
+    capture_time = GetTimeMicroseconds() - rendered;
+  }
 
-    PresentToDisplay();
+  if (result != nullptr) {
+    if (result->num_render == 0) {
+      result->first_render_time += render_time;
+    } else {
+      result->other_renders_time += render_time;
+    }
+    result->capture_time += capture_time;
+    result->num_render++;
+  }
+  if (png_exported != nullptr) {
+    *png_exported = exported;
+  }
+
+  return hash;
+}
+
+// Render and present one frame. The swapchain image stays available for export
+// until EndFrame().
+void VulkanWorker::BeginFrame(TestPipeline *test, const char *label) {
+  log("DRAWTEST START");
+  CrashHandler::SetStage("IMAGE_RENDER");
+  frame_arena_->Reset();
+  CreateSemaphore();
+  AcquireNextImage();
+  PrepareCommandBuffer(test, label);
+  CreateFence();
+  SubmitCommandBuffer();
+  log("DRAWTEST END");
+
+  PresentToDisplay();
+}
+
+void VulkanWorker::EndFrame() {
+  DestroyFence();
+  DestroySemaphore();
+}
+
+void VulkanWorker::PrepareCoherence(TestPipeline *coherence) {
+  VkRect2D render_area = {};
+  render_area.extent.width = width_;
+  render_area.extent.height = height_;
+  TestJob job;
+  job.vertex_spv = coherence_vertex_shader_spv_;
+  job.fragment_spv = coherence_fragment_shader_spv_;
+  job.png_template = "coherence";
+  LoadUniforms(coherence_uniforms_string, job.uniform_entries, nullptr);
+  VKCHECK(PrepareTest(coherence, &job, render_pass_, render_area));
+}
+
+// Render the coherence frame and compare its hash to the reference one, which
+// is captured by the first call. A PNG is written only for the reference and on
+// mismatch. Returns whether the frame matches the reference.
+bool VulkanWorker::CheckCoherence(TestPipeline *coherence, const char *png_filename) {
+  BeginFrame(coherence, png_filename);
+  uint64_t hash = HashCurrentFrame();
+  bool coherent = true;
+  if (!has_coherence_reference_hash_) {
+    log("COHERENCE REFERENCE %016llx", (unsigned long long)hash);
+    has_coherence_reference_hash_ = true;
+    coherence_reference_hash_ = hash;
     ExportPNG(png_filename);
-    DestroyFence();
-    DestroySemaphore();
+  } else if (hash != coherence_reference_hash_) {
+    log("COHERENCE MISMATCH %016llx", (unsigned long long)hash);
+    coherent = false;
+    ExportPNG(png_filename);
+  }
+  EndFrame();
+  return coherent;
+}
+
+void VulkanWorker::RunCoherence(const char *png_filename) {
+  TestPipeline coherence;
+  PrepareCoherence(&coherence);
+  DrawTest(&coherence, png_filename, nullptr, false, nullptr, nullptr);
+  CleanTest(&coherence);
+}
+
+// Only then does the number of renders vary, and is it written to
+// '<png_template>_num_render.txt'
+static bool IsAdaptiveRender() {
+  return FLAGS_fast_render || FLAGS_max_render > FLAGS_num_render;
+}
+
+void VulkanWorker::RenderTest(TestJob *job, bool skip_render, TestResult *result) {
+  VkRect2D render_area = {};
+  render_area.extent.width = width_;
+  render_area.extent.height = height_;
+
+  TestResult local_result = {};
+  if (result == nullptr) {
+    result = &local_result;
+  }
+  result->num_render = 0;
+  result->nondet_render = -1;
+  result->image_hash = 0;
+  result->cached = false;
+  result->has_host_memory = false;
+  result->memory_leak = false;
+  result->error.clear();
+  result->compile_result = VK_SUCCESS;
+  result->error_stage = nullptr;
+
+  std::string cache_key;
+  if (result_cache_ != nullptr && !skip_render) {
+    cache_key = GetResultCacheKey(job);
+    if (RestoreCachedResult(cache_key, job, result)) {
+      return;
+    }
+  }
+
+  if (host_allocator_ != nullptr) {
+    host_allocator_->BeginJob();
+  }
+  MemorySnapshot memory_before;
+  GetMemorySnapshot(&memory_before);
+
+  TestPipeline test;
+  int64_t start = GetTimeMicroseconds();
+  result->compile_result = PrepareTest(&test, job, render_pass_, render_area);
+  result->compilation_time += GetTimeMicroseconds() - start;
+  if (result->compile_result != VK_SUCCESS) {
+    result->error = std::string("cannot create pipeline: ") + getVkResultString(result->compile_result);
+    result->error_stage = "IMAGE_VALIDATE_PROGRAM";
+    if (host_allocator_ != nullptr) {
+      host_allocator_->EndJob(&result->host_memory);
+    }
+    return;
+  }
+
+  // Adaptive repeat count: with --fast_render, stop after two identical frames.
+  // As soon as two frames differ, escalate to --max_render repeats to gather
+  // more evidence of nondeterminism.
+  has_previous_frame_hash_ = false;
+  int num_render = FLAGS_num_render;
+  uint64_t first_hash = 0;
+  std::vector<uint64_t> frame_hashes;
+  std::vector<bool> pngs_exported;
+  while (result->num_render < num_render) {
+    int i = result->num_render;
+    std::string png_filename = job->png_template + "_" + std::to_string(i) + ".png";
+    std::string hash_filename = job->png_template + "_" + std::to_string(i) + ".hash";
+    bool png_exported = false;
+    uint64_t hash = DrawTest(&test, png_filename.c_str(), hash_filename.c_str(), skip_render, result, &png_exported);
+
+    if (skip_render) {
+      continue;
+    }
+    frame_hashes.push_back(hash);
+    pngs_exported.push_back(png_exported);
+    if (i == 0) {
+      first_hash = hash;
+      result->image_hash = hash;
+    } else if (hash != first_hash && result->nondet_render < 0) {
+      result->nondet_render = i;
+      if (FLAGS_max_render > num_render) {
+        log("NONDET: escalate to %d renders", FLAGS_max_render);
+        num_render = FLAGS_max_render;
+      }
+    }
+    if (FLAGS_fast_render && result->nondet_render < 0 && result->num_render == 2) {
+      break;
+    }
+  }
+
+  log("NUM_RENDER_USED %d", result->num_render);
+  if (IsAdaptiveRender()) {
+    std::string repeats_filename = job->png_template + "_num_render.txt";
+    output_writer_->Write(repeats_filename, std::to_string(result->num_render) + "\n");
+  }
+
+  CleanTest(&test);
+
+  if (host_allocator_ != nullptr) {
+    host_allocator_->EndJob(&result->host_memory);
+    result->has_host_memory = true;
+    log("HOSTMEMORY %s", HostAllocator::FormatUsage(result->host_memory).c_str());
+    HostMemoryUsage usage;
+    host_allocator_->GetUsage(&usage);
+    Metrics::Set("gfz_host_memory_bytes", (double)usage.live_bytes);
+  }
+
+  MemorySnapshot memory_after;
+  GetMemorySnapshot(&memory_after);
+  if (CheckMemoryLeak(memory_before, memory_after)) {
+    result->memory_leak = true;
+    num_leaky_jobs_++;
+    Metrics::Increment("gfz_leaky_jobs_total");
+  }
+  CheckMemoryGrowth(memory_after);
+
+  // With --gpu_hash, a frame that matches --reference_hash has no PNG, which a
+  // hit must restore: such tests are not cached
+  bool pngs_cacheable = !pngs_exported.empty() && pngs_exported[0] && (result->nondet_render < 0 || pngs_exported[result->nondet_render]);
+  if (!cache_key.empty() && !pngs_cacheable) {
+    log("RESULTCACHE SKIP %s: image not exported", cache_key.c_str());
+  } else if (!cache_key.empty()) {
+    // The images are copied from disk
+    output_writer_->Flush();
+    result_cache_->StoreImage(cache_key, 0, job->png_template + "_0.png");
+    if (result->nondet_render >= 0) {
+      result_cache_->StoreImage(cache_key, result->nondet_render, job->png_template + "_" + std::to_string(result->nondet_render) + ".png");
+    }
+    ResultCacheEntry entry = {};
+    entry.num_render = result->num_render;
+    entry.nondet_render = result->nondet_render;
+    entry.image_hash = result->image_hash;
+    entry.frame_hashes = frame_hashes;
+    result_cache_->Store(cache_key, entry);
+  }
+}
+
+// The key identifies everything a rendered image depends on: device, driver,
+// shaders, uniforms, and the settings deciding how many frames are rendered and
+// how they are hashed.
+std::string VulkanWorker::GetResultCacheKey(const TestJob *job) {
+  uint64_t vertex_hash = ResultCache::HashBytes(job->vertex_spv.data(), job->vertex_spv.size() * sizeof(uint32_t), kResultCacheHashSeed);
+  uint64_t fragment_hash = ResultCache::HashBytes(job->fragment_spv.data(), job->fragment_spv.size() * sizeof(uint32_t), kResultCacheHashSeed);
+  uint64_t uniforms_hash = kResultCacheHashSeed;
+  for (const UniformEntry &uniform_entry : job->uniform_entries) {
+    uniforms_hash = ResultCache::HashBytes(&uniform_entry.size, sizeof(uniform_entry.size), uniforms_hash);
+    uniforms_hash = ResultCache::HashBytes(uniform_entry.value, uniform_entry.size, uniforms_hash);
+  }
+  int32_t settings[] = { (int32_t)width_, (int32_t)height_, FLAGS_num_render, FLAGS_max_render, FLAGS_fast_render, FLAGS_gpu_hash && frame_hash_supported_ };
+  uint64_t settings_hash = ResultCache::HashBytes(settings, sizeof(settings), kResultCacheHashSeed);
+
+  char key[128];
+  snprintf(key, sizeof(key), "%08x-%08x-%08x-%016llx-%016llx-%016llx-%016llx",
+           physical_device_properties_.vendorID, physical_device_properties_.deviceID, physical_device_properties_.driverVersion,
+           (unsigned long long)vertex_hash, (unsigned long long)fragment_hash, (unsigned long long)uniforms_hash, (unsigned long long)settings_hash);
+  return key;
+}
+
+// On a hit, the outcome and images of the cached test are reported as if the
+// job had just been rendered.
+bool VulkanWorker::RestoreCachedResult(const std::string &key, TestJob *job, TestResult *result) {
+  ResultCacheEntry entry;
+  if (!result_cache_->Lookup(key, &entry)) {
+    return false;
+  }
+  log("RESULTCACHE HIT %s image_hash %016llx", key.c_str(), (unsigned long long)entry.image_hash);
+  result->num_render = entry.num_render;
+  result->nondet_render = entry.nondet_render;
+  result->image_hash = entry.image_hash;
+  result->cached = true;
+
+  std::vector<unsigned char> png;
+  if (result_cache_->LoadImage(key, 0, png)) {
+    output_writer_->Write(job->png_template + "_0.png", png);
+  }
+  if (entry.nondet_render >= 0 && result_cache_->LoadImage(key, entry.nondet_render, png)) {
+    output_writer_->Write(job->png_template + "_" + std::to_string(entry.nondet_render) + ".png", png);
   }
+  // As DrawTest() writes them. Older entries only tell frames up to the first
+  // one that differs.
+  if (frame_hash_supported_) {
+    for (int i = 0; i < entry.num_render; i++) {
+      uint64_t hash = entry.image_hash;
+      if ((size_t)i < entry.frame_hashes.size()) {
+        hash = entry.frame_hashes[i];
+      } else if (entry.nondet_render >= 0 && i >= entry.nondet_render) {
+        break;
+      }
+      char hash_string[32];
+      snprintf(hash_string, sizeof(hash_string), "%016llx\n", (unsigned long long)hash);
+      output_writer_->Write(job->png_template + "_" + std::to_string(i) + ".hash", hash_string);
+    }
+  }
+  log("NUM_RENDER_USED %d", result->num_render);
+  if (IsAdaptiveRender()) {
+    output_writer_->Write(job->png_template + "_num_render.txt", std::to_string(result->num_render) + "\n");
+  }
+
+  // The job is dropped without going through PrepareTest()
+  if (job->arena != nullptr) {
+    job_arenas_->Release(job->arena);
+    job->arena = nullptr;
+  } else {
+    for (UniformEntry &uniform_entry : job->uniform_entries) {
+      free(uniform_entry.value);
+    }
+  }
+  job->uniform_entries.clear();
+  return true;
+}
+
+// Jobs of the server are counted with their final status by the ServerWorker
+static void CountJob(const TestResult &result, bool coherent) {
+  const char *status = result.compile_result != VK_SUCCESS ? "COMPILE_ERROR" : !coherent ? "COHERENCE_ERROR" : (result.nondet_render >= 0 ? "NONDET" : "SUCCESS");
+  Metrics::Increment("gfz_jobs_total", std::string("status=\"") + status + "\"");
 }
 
 void VulkanWorker::RunTest(FILE *vertex_file, FILE *fragment_file, FILE *uniforms_file, bool skip_render) {
 
   // Coherence before
-  PrepareTest(coherence_vertex_shader_spv_, coherence_fragment_shader_spv_, coherence_uniforms_string);
-  DrawTest(FLAGS_coherence_before.c_str(), false);
-  CleanTest();
+  RunCoherence(FLAGS_coherence_before.c_str());
 
   // Test workload
-  std::vector<uint32_t> vertex_spv;
-  LoadSpirvFromFile(vertex_file, vertex_spv);
-  std::vector<uint32_t> fragment_spv;
-  LoadSpirvFromFile(fragment_file, fragment_spv);
-  char *uniforms_string = GetFileContent(uniforms_file);
+  TestJob job;
+  LoadSpirvFromFile(vertex_file, job.vertex_spv);
+  LoadSpirvFromFile(fragment_file, job.fragment_spv);
+  job.arena = job_arenas_->Acquire();
+  char *uniforms_string = GetFileContent(uniforms_file, job.arena);
+  LoadUniforms(uniforms_string, job.uniform_entries, job.arena);
+  job.png_template = FLAGS_png_template;
+
+  TestResult result = {};
+  RenderTest(&job, skip_render, &result);
+  // As the driver scripts expect, a test that cannot be compiled terminates
+  // the worker in single test mode
+  assert(result.compile_result == VK_SUCCESS && "Cannot create pipeline");
+  CountJob(result, true);
+
+  // Coherence after
+  RunCoherence(FLAGS_coherence_after.c_str());
+}
+
+// Port of FuzzyImageComparison, in common/: a pixel is bad when either image
+// has no similar pixel in the half-open window [p - distance, p + distance) of
+// the other image. Bad pixels that have fewer than 2 * distance bad pixels in
+// that same window around them are sparse; the other ones are counted again as
+// num_bad_sparse, which is the bad pixel count once sparse ones are removed.
+static bool HasSimilarPixel(const unsigned char *rgba, const unsigned char *other_rgba, uint32_t width, uint32_t height, uint32_t x, uint32_t y) {
+  int32_t distance = FLAGS_fuzzy_distance_threshold;
+  const unsigned char *pixel = rgba + (y * width + x) * 4;
+  int32_t y_start = std::max((int32_t)y - distance, 0);
+  int32_t y_end = std::min((int32_t)y + distance, (int32_t)height);
+  int32_t x_start = std::max((int32_t)x - distance, 0);
+  int32_t x_end = std::min((int32_t)x + distance, (int32_t)width);
+  for (int32_t other_y = y_start; other_y < y_end; other_y++) {
+    for (int32_t other_x = x_start; other_x < x_end; other_x++) {
+      const unsigned char *other_pixel = other_rgba + (other_y * width + other_x) * 4;
+      bool similar = true;
+      for (int c = 0; c < 4 && similar; c++) {
+        similar = abs((int)pixel[c] - (int)other_pixel[c]) <= FLAGS_fuzzy_component_threshold;
+      }
+      if (similar) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void CountBadPixels(const unsigned char *rgba, const unsigned char *other_rgba, uint32_t width, uint32_t height, uint32_t *num_bad, uint32_t *num_bad_sparse) {
+  std::vector<bool> bad(width * height, false);
+  *num_bad = 0;
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      if (!HasSimilarPixel(rgba, other_rgba, width, height, x, y) || !HasSimilarPixel(other_rgba, rgba, width, height, x, y)) {
+        bad[y * width + x] = true;
+        (*num_bad)++;
+      }
+    }
+  }
+
+  // Removal happens after the scan, so that a sparse pixel still counts as bad
+  // in the clusters of the pixels scanned after it, as in common/.
+  int32_t distance = FLAGS_fuzzy_distance_threshold;
+  int32_t num_bad_dense = 2 * distance;
+  uint32_t num_removed = 0;
+  for (int32_t y = 0; y < (int32_t)height; y++) {
+    for (int32_t x = 0; x < (int32_t)width; x++) {
+      if (!bad[y * width + x]) {
+        continue;
+      }
+      int32_t num_bad_in_cluster = 0;
+      for (int32_t other_y = std::max(y - distance, 0); other_y < std::min(y + distance, (int32_t)height); other_y++) {
+        for (int32_t other_x = std::max(x - distance, 0); other_x < std::min(x + distance, (int32_t)width); other_x++) {
+          if (bad[other_y * width + other_x]) {
+            num_bad_in_cluster++;
+          }
+        }
+      }
+      if (num_bad_in_cluster < num_bad_dense) {
+        num_removed++;
+      }
+    }
+  }
+  *num_bad_sparse = *num_bad - num_removed;
+}
+
+// Interestingness test for the reducer: the image is compared in memory to the
+// reference, and the verdict is the return value, to be used as exit code. No
+// file is written unless --save_images is set. Coherence is not checked: each
+// reduction step runs in a fresh process.
+int VulkanWorker::RunInterestingnessTest(FILE *vertex_file, FILE *fragment_file, FILE *uniforms_file) {
+  bool nondet_mode = (FLAGS_interesting_if == "nondet");
+  if (!nondet_mode && FLAGS_interesting_if != "different" && FLAGS_interesting_if != "same") {
+    log("Error: invalid --interesting_if: %s", FLAGS_interesting_if.c_str());
+    return kExitInvalidTest;
+  }
+  if (FLAGS_compare != "exact" && FLAGS_compare != "fuzzy") {
+    log("Error: invalid --compare: %s", FLAGS_compare.c_str());
+    return kExitInvalidTest;
+  }
+
+  std::vector<unsigned char> reference_rgba;
+  if (!FLAGS_reference_image.empty()) {
+    unsigned reference_width = 0;
+    unsigned reference_height = 0;
+    unsigned decode_error = lodepng::decode(reference_rgba, reference_width, reference_height, FLAGS_reference_image);
+    if (decode_error || reference_width != width_ || reference_height != height_) {
+      log("Error: cannot use reference image %s", FLAGS_reference_image.c_str());
+      return kExitInvalidTest;
+    }
+  } else if (!nondet_mode && (FLAGS_reference_hash.empty() || !frame_hash_supported_)) {
+    // Hash files, from which reference hashes are taken, are made by the GPU
+    log("Error: need --reference_image, or --reference_hash with --gpu_hash on a device that supports it");
+    return kExitInvalidTest;
+  }
+  bool need_rgba = !reference_rgba.empty() || FLAGS_save_images || !frame_hash_supported_;
+
+  TestJob job;
+  LoadSpirvFromFile(vertex_file, job.vertex_spv);
+  LoadSpirvFromFile(fragment_file, job.fragment_spv);
+  job.arena = job_arenas_->Acquire();
+  char *uniforms_string = GetFileContent(uniforms_file, job.arena);
+  std::string uniforms_error;
+  if (!CheckUniforms(uniforms_string, &uniforms_error)) {
+    log("Error: %s", uniforms_error.c_str());
+    job_arenas_->Release(job.arena);
+    return kExitInvalidTest;
+  }
+  LoadUniforms(uniforms_string, job.uniform_entries, job.arena);
+  job.png_template = FLAGS_png_template;
+
+  VkRect2D render_area = {};
+  render_area.extent.width = width_;
+  render_area.extent.height = height_;
+  TestPipeline test;
+  if (PrepareTest(&test, &job, render_pass_, render_area) != VK_SUCCESS) {
+    return kExitInvalidTest;
+  }
+
+  // Frames are compared by hash. Once two frames differ, the verdict is known.
+  std::vector<unsigned char> rgba(need_rgba ? width_ * height_ * 4 : 0);
+  std::vector<unsigned char> first_rgba;
+  uint64_t first_hash = 0;
+  bool nondet = false;
+  for (int i = 0; i < FLAGS_num_render && !nondet; i++) {
+    BeginFrame(&test, test.name.c_str());
+    uint64_t hash = 0;
+    if (need_rgba) {
+      ReadbackFrame(rgba.data());
+    }
+    if (frame_hash_supported_) {
+      hash = HashFrame();
+    } else {
+      hash = HashRGBA(rgba.data());
+    }
+    EndFrame();
+    log("FRAMEHASH %016llx", (unsigned long long)hash);
+    if (FLAGS_save_images) {
+      SavePNG(rgba.data(), (FLAGS_png_template + "_" + std::to_string(i) + ".png").c_str());
+    }
+
+    if (i == 0) {
+      first_hash = hash;
+      first_rgba = rgba;
+    } else if (hash != first_hash) {
+      log("NONDET at frame %d", i);
+      nondet = true;
+    }
+  }
+  CleanTest(&test);
+
+  bool interesting = false;
+  if (nondet_mode) {
+    interesting = nondet;
+  } else if (nondet) {
+    // The reference comparison is meaningless
+    interesting = false;
+  } else {
+    bool different = false;
+    if (reference_rgba.empty()) {
+      different = (first_hash != strtoull(FLAGS_reference_hash.c_str(), nullptr, 16));
+    } else if (FLAGS_compare == "exact") {
+      different = (first_rgba != reference_rgba);
+    } else {
+      uint32_t num_bad = 0;
+      uint32_t num_bad_sparse = 0;
+      CountBadPixels(first_rgba.data(), reference_rgba.data(), width_, height_, &num_bad, &num_bad_sparse);
+      log("BADPIXELS %u SPARSE %u", num_bad, num_bad_sparse);
+      different = (num_bad > (uint32_t)FLAGS_fuzzy_bad_pixels_threshold || num_bad_sparse > (uint32_t)FLAGS_fuzzy_bad_sparse_pixels_threshold);
+    }
+    interesting = (different == (FLAGS_interesting_if == "different"));
+  }
+
+  log("INTERESTING %s", interesting ? "yes" : "no");
+  return interesting ? kExitInteresting : kExitNotInteresting;
+}
+
+// The test is drawn --perf_draws times into the atlas tile image, between two
+// timestamps: queries first_query and first_query + 1.
+void VulkanWorker::RecordTimedDraws(TestPipeline *test, VkCommandBuffer command_buffer, VkQueryPool query_pool, uint32_t first_query) {
+  VkCommandBufferBeginInfo command_buffer_begin_info = {};
+  command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  command_buffer_begin_info.pNext = nullptr;
+  command_buffer_begin_info.flags = 0;
+  command_buffer_begin_info.pInheritanceInfo = nullptr;
+  VKCHECK(vkBeginCommandBuffer(command_buffer, &command_buffer_begin_info));
+  VKLOG(vkCmdResetQueryPool(command_buffer, query_pool, first_query, 2));
+  VKLOG(vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pool, first_query));
+
+  VkClearValue clear_values[2];
+  clear_values[0].color.float32[0] = clear_color_[0];
+  clear_values[0].color.float32[1] = clear_color_[1];
+  clear_values[0].color.float32[2] = clear_color_[2];
+  clear_values[0].color.float32[3] = clear_color_[3];
+  clear_values[1].depthStencil.depth = 1.0f;
+  clear_values[1].depthStencil.stencil = 0;
+
+  VkRenderPassBeginInfo render_pass_begin_info = {};
+  render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  render_pass_begin_info.pNext = nullptr;
+  render_pass_begin_info.renderPass = atlas_render_pass_;
+  render_pass_begin_info.framebuffer = atlas_framebuffer_;
+  render_pass_begin_info.renderArea.offset.x = 0;
+  render_pass_begin_info.renderArea.offset.y = 0;
+  render_pass_begin_info.renderArea.extent.width = width_;
+  render_pass_begin_info.renderArea.extent.height = height_;
+  render_pass_begin_info.clearValueCount = 2;
+  render_pass_begin_info.pClearValues = clear_values;
+  BeginLabel(command_buffer, test->name);
+  VKLOG(vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE));
+
+  const VkDeviceSize offsets[1] = {0};
+  VKLOG(vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer_, offsets));
+  VKLOG(vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, test->graphics_pipeline));
+  if (test->uniform_entries.size() > 0) {
+    VKLOG(vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, test->pipeline_layout, 0, 1, &(test->descriptor_set), 0, nullptr));
+  }
+  for (int i = 0; i < FLAGS_perf_draws; i++) {
+    VKLOG(vkCmdDraw(command_buffer, /* two triangles */ 2 * 3, 1, 0, 0));
+  }
+
+  VKLOG(vkCmdEndRenderPass(command_buffer));
+  EndLabel(command_buffer);
+  VKLOG(vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool, first_query + 1));
+  VKCHECK(vkEndCommandBuffer(command_buffer));
+}
+
+// Performance regression test: the reference of --perf_reference and the
+// variant are timed with GPU timestamps, offscreen, in alternating order such
+// that clock changes and other GPU load weigh on both. The variant is
+// interesting when it is slower than the reference with significance, and by
+// more than --perf_slowdown, see PerfStats. No image is written.
+int VulkanWorker::RunPerfTest(FILE *vertex_file, FILE *fragment_file, FILE *uniforms_file) {
+  std::istringstream reference_stream(FLAGS_perf_reference);
+  std::string reference_vertex_filename;
+  std::string reference_fragment_filename;
+  std::string reference_uniforms_filename;
+  reference_stream >> reference_vertex_filename >> reference_fragment_filename >> reference_uniforms_filename;
+  if (reference_uniforms_filename.empty()) {
+    log("Error: invalid --perf_reference: %s", FLAGS_perf_reference.c_str());
+    return kExitInvalidTest;
+  }
+  if (FLAGS_perf_iterations < 2 || FLAGS_perf_warmup < 0 || FLAGS_perf_draws < 1 || FLAGS_perf_slowdown <= 0.0) {
+    log("Error: need --perf_iterations of at least 2, --perf_draws of at least 1 and a positive --perf_slowdown");
+    return kExitInvalidTest;
+  }
+  uint32_t timestamp_valid_bits = queue_family_properties_[queue_family_index_].timestampValidBits;
+  if (timestamp_valid_bits == 0) {
+    log("Error: the queue does not support timestamps");
+    return kExitInvalidTest;
+  }
+  uint64_t timestamp_mask = (timestamp_valid_bits >= 64) ? ~0ULL : ((1ULL << timestamp_valid_bits) - 1);
+  double timestamp_period = physical_device_properties_.limits.timestampPeriod;
+
+  // Index 0 is the reference, 1 the variant
+  TestJob jobs[2];
+  jobs[0].arena = job_arenas_->Acquire();
+  jobs[1].arena = job_arenas_->Acquire();
+  std::string error;
+  char *uniforms_string = nullptr;
+  if (!LoadTestJob(reference_vertex_filename.c_str(), reference_fragment_filename.c_str(), reference_uniforms_filename.c_str(), &(jobs[0]), &error)) {
+    error = "reference: " + error;
+  } else if (!CheckSpirvFile(vertex_file) || !CheckSpirvFile(fragment_file)) {
+    error = "invalid spir-v binary";
+  } else {
+    uniforms_string = GetFileContent(uniforms_file, jobs[1].arena);
+    CheckUniforms(uniforms_string, &error);
+  }
+  if (!error.empty()) {
+    log("Error: %s", error.c_str());
+    job_arenas_->Release(jobs[0].arena);
+    job_arenas_->Release(jobs[1].arena);
+    return kExitInvalidTest;
+  }
+  jobs[0].png_template = FLAGS_png_template + "_reference";
+  LoadSpirvFromFile(vertex_file, jobs[1].vertex_spv);
+  LoadSpirvFromFile(fragment_file, jobs[1].fragment_spv);
+  LoadUniforms(uniforms_string, jobs[1].uniform_entries, jobs[1].arena);
+  jobs[1].png_template = FLAGS_png_template;
+
+  PrepareAtlas(1);
+  VkRect2D render_area = {};
+  render_area.extent.width = width_;
+  render_area.extent.height = height_;
+  TestPipeline tests[2];
+  for (int i = 0; i < 2; i++) {
+    if (PrepareTest(&(tests[i]), &(jobs[i]), atlas_render_pass_, render_area) != VK_SUCCESS) {
+      // A failed PrepareTest() cleans its own test, and only the reference
+      // can have been prepared before
+      if (i == 1) {
+        CleanTest(&(tests[0]));
+      } else {
+        job_arenas_->Release(jobs[1].arena);
+      }
+      CleanAtlas();
+      return kExitInvalidTest;
+    }
+  }
+
+  VkQueryPoolCreateInfo query_pool_create_info = {};
+  query_pool_create_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  query_pool_create_info.pNext = nullptr;
+  query_pool_create_info.flags = 0;
+  query_pool_create_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  query_pool_create_info.queryCount = 4;
+  query_pool_create_info.pipelineStatistics = 0;
+  VkQueryPool query_pool = VK_NULL_HANDLE;
+  VKCHECK(vkCreateQueryPool(device_, &query_pool_create_info, allocator_, &query_pool));
+
+  // Recorded once, submitted for every sample
+  VkCommandBuffer command_buffers[2];
+  VkCommandBufferAllocateInfo command_buffer_allocate_info = {};
+  command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  command_buffer_allocate_info.pNext = nullptr;
+  command_buffer_allocate_info.commandPool = command_pool_;
+  command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  command_buffer_allocate_info.commandBufferCount = 2;
+  VKCHECK(vkAllocateCommandBuffers(device_, &command_buffer_allocate_info, command_buffers));
+  for (uint32_t i = 0; i < 2; i++) {
+    RecordTimedDraws(&(tests[i]), command_buffers[i], query_pool, 2 * i);
+  }
+
+  log("PERF START");
+  CrashHandler::SetStage("IMAGE_RENDER");
+  CreateFence();
+  std::vector<double> samples[2];
+  for (int iteration = 0; iteration < FLAGS_perf_warmup + FLAGS_perf_iterations; iteration++) {
+    for (int step = 0; step < 2; step++) {
+      int i = (iteration + step) % 2;
+      VkSubmitInfo submit_info = {};
+      submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+      submit_info.pNext = nullptr;
+      submit_info.waitSemaphoreCount = 0;
+      submit_info.pWaitSemaphores = nullptr;
+      submit_info.pWaitDstStageMask = nullptr;
+      submit_info.commandBufferCount = 1;
+      submit_info.pCommandBuffers = &(command_buffers[i]);
+      submit_info.signalSemaphoreCount = 0;
+      submit_info.pSignalSemaphores = nullptr;
+      VKCHECK(vkQueueSubmit(queue_, 1, &submit_info, fence_));
+      WaitForFence();
+      VKCHECK(vkResetFences(device_, 1, &fence_));
+      if (iteration < FLAGS_perf_warmup) {
+        continue;
+      }
+      uint64_t timestamps[2] = {};
+      VKCHECK(vkGetQueryPoolResults(device_, query_pool, 2 * i, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+      uint64_t ticks = (timestamps[1] - timestamps[0]) & timestamp_mask;
+      samples[i].push_back(ticks * timestamp_period / FLAGS_perf_draws);
+    }
+  }
+  DestroyFence();
+  log("PERF END");
+
+  VKLOG(vkFreeCommandBuffers(device_, command_pool_, 2, command_buffers));
+  VKLOG(vkDestroyQueryPool(device_, query_pool, allocator_));
+  for (int i = 0; i < 2; i++) {
+    CleanTest(&(tests[i]));
+  }
+  CleanAtlas();
+
+  PerfComparison comparison = PerfStats::Compare(samples[0], samples[1]);
+  std::ostringstream perf_json;
+  perf_json << "{\n";
+  const PerfSummary *summaries[2] = {&comparison.reference, &comparison.variant};
+  const char *summary_names[2] = {"reference", "variant"};
+  for (int i = 0; i < 2; i++) {
+    perf_json << "  \"" << summary_names[i] << "\": {";
+    perf_json << "\"samples\": " << summaries[i]->num_samples << ", ";
+    perf_json << "\"outliers\": " << summaries[i]->num_outliers << ", ";
+    perf_json << "\"median_ns\": " << summaries[i]->median << ", ";
+    perf_json << "\"mean_ns\": " << summaries[i]->mean << ", ";
+    perf_json << "\"stddev_ns\": " << summaries[i]->stddev << ", ";
+    perf_json << "\"min_ns\": " << summaries[i]->min << ", ";
+    perf_json << "\"max_ns\": " << summaries[i]->max << "},\n";
+  }
+  perf_json << "  \"mann_whitney_u\": " << comparison.mann_whitney_u << ",\n";
+  perf_json << "  \"p_value\": " << comparison.p_value << ",\n";
+  perf_json << "  \"ratio\": " << comparison.ratio << ",\n";
+  perf_json << "  \"ratio_low\": " << comparison.ratio_low << ",\n";
+  perf_json << "  \"ratio_high\": " << comparison.ratio_high << ",\n";
+  perf_json << "  \"slowdown\": " << FLAGS_perf_slowdown << "\n";
+  perf_json << "}\n";
+  output_writer_->Write(FLAGS_png_template + "_perf.json", perf_json.str());
+
+  log("PERF reference median %.0f ns, variant median %.0f ns, ratio %.3f [%.3f, %.3f], p %.4f",
+      comparison.reference.median, comparison.variant.median, comparison.ratio, comparison.ratio_low, comparison.ratio_high, comparison.p_value);
+  if (comparison.reference.median <= 0.0 || comparison.variant.median <= 0.0) {
+    // Below the timestamp resolution, e.g. for lack of --perf_draws
+    log("Error: GPU time too short to be measured");
+    return kExitInvalidTest;
+  }
+  // The interval excludes --perf_slowdown and below, at the 95% level, which
+  // implies a significant slowdown
+  bool interesting = comparison.ratio_low > FLAGS_perf_slowdown;
+  log("INTERESTING %s", interesting ? "yes" : "no");
+  return interesting ? kExitInteresting : kExitNotInteresting;
+}
+
+// Run all jobs of a packed corpus, reading shaders and uniforms directly from
+// the mapped file. The coherence pipeline is created once, and coherence checks
+// run every --coherence_every jobs against the hash of the first coherence frame.
+void VulkanWorker::RunCorpus(Corpus *corpus, bool skip_render) {
+  TestPipeline coherence;
+  PrepareCoherence(&coherence);
+  has_coherence_reference_hash_ = false;
+
+  // Reference coherence frame
+  CheckCoherence(&coherence, FLAGS_coherence_before.c_str());
+
+  // Jobs are copied out of the mapped file and their uniforms parsed ahead of
+  // rendering, such that page faults on a cold corpus overlap with GPU work.
+  std::string png_template_prefix = FLAGS_png_template + "_";
+  OutputWriter *output_writer = output_writer_;
+  ArenaPool *job_arenas = job_arenas_;
+  JobPrefetcher prefetcher(corpus->GetNumJobs(), FLAGS_prefetch_depth, [corpus, &png_template_prefix, output_writer, job_arenas](size_t index, TestJob *job) {
+    CorpusJob corpus_job;
+    corpus->GetJob(index, &corpus_job);
+    job->vertex_spv.assign(corpus_job.vertex_spv, corpus_job.vertex_spv + corpus_job.vertex_num_words);
+    job->fragment_spv.assign(corpus_job.fragment_spv, corpus_job.fragment_spv + corpus_job.fragment_num_words);
+    job->arena = job_arenas->Acquire();
+    LoadUniforms(corpus_job.uniforms, job->uniform_entries, job->arena);
+    job->png_template = output_writer->ShardTemplate(png_template_prefix + corpus_job.name);
+  });
+
+  for (uint32_t i = 0; i < corpus->GetNumJobs(); i++) {
+    TestJob job;
+    prefetcher.Pop(&job);
+    LogSink::SetJobId(i);
+    log("CORPUSJOB %u %s", i, job.png_template.c_str());
+    TestResult result = {};
+    RenderTest(&job, skip_render, &result);
+
+    bool coherent = true;
+    bool last_job = (i + 1 == corpus->GetNumJobs());
+    if (last_job || (FLAGS_coherence_every > 0 && (i + 1) % FLAGS_coherence_every == 0)) {
+      coherent = CheckCoherence(&coherence, FLAGS_coherence_after.c_str());
+      if (!coherent) {
+        log("COHERENCE ERROR after job %u %s", i, job.png_template.c_str());
+      }
+    }
+    CountJob(result, coherent);
+
+    if (recycle_device_ && !last_job) {
+      CleanTest(&coherence);
+      RecycleDevice();
+      PrepareCoherence(&coherence);
+    }
+  }
+  prefetcher.LogCounters();
+  output_writer_->LogCounters();
+
+  CleanTest(&coherence);
+}
+
+// Create the pipeline of a corpus job, and destroy it right away. Compilation
+// errors are returned, any other error is checked.
+VkResult VulkanWorker::CompileCorpusJob(const CorpusJob &corpus_job, Arena *arena, Watchdog *watchdog) {
+  TestPipeline test;
+  test.name = corpus_job.name;
+  test.arena = arena;
+  test.vertex_shader_module = VK_NULL_HANDLE;
+  test.fragment_shader_module = VK_NULL_HANDLE;
+  LoadUniforms(corpus_job.uniforms, test.uniform_entries, arena);
+  if (test.uniform_entries.size() > 0) {
+    CreateDescriptorSetLayout(&test);
+  }
+  CreatePipelineLayout(&test);
+
+  // Shaders are taken from the mapped corpus, without copy
+  VkShaderModuleCreateInfo module_create_info = {};
+  module_create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  module_create_info.pNext = nullptr;
+  module_create_info.flags = 0;
+  module_create_info.codeSize = corpus_job.vertex_num_words * sizeof(uint32_t);
+  module_create_info.pCode = corpus_job.vertex_spv;
+  VkResult result = vkCreateShaderModule(device_, &module_create_info, allocator_, &test.vertex_shader_module);
+  if (result == VK_SUCCESS) {
+    num_live_objects_++;
+    module_create_info.codeSize = corpus_job.fragment_num_words * sizeof(uint32_t);
+    module_create_info.pCode = corpus_job.fragment_spv;
+    result = vkCreateShaderModule(device_, &module_create_info, allocator_, &test.fragment_shader_module);
+    if (result == VK_SUCCESS) {
+      num_live_objects_++;
+    } else {
+      test.fragment_shader_module = VK_NULL_HANDLE;
+    }
+  } else {
+    test.vertex_shader_module = VK_NULL_HANDLE;
+  }
+
+  if (result == VK_SUCCESS) {
+    PrepareShaderStages(&test);
+    VkRect2D render_area = {};
+    render_area.extent.width = width_;
+    render_area.extent.height = height_;
+    result = CreateGraphicsPipeline(&test, render_pass_, render_area, watchdog);
+    if (result == VK_SUCCESS) {
+      DestroyGraphicsPipeline(&test);
+    }
+  }
+
+  // Destroying a null handle is a no-op
+  DestroyShaderModules(&test);
+  DestroyPipelineLayout(&test);
+  if (test.uniform_entries.size() > 0) {
+    DestroyDescriptorSetLayout(&test);
+  }
+  return result;
+}
+
+// Compile the pipelines of all the jobs of a corpus on several threads, without
+// rendering anything. Each result line is flushed as soon as it is known, such
+// that the results survive a crash or a timeout of the driver: jobs left at
+// START were in flight at that time. With several threads, rerun them with
+// --compile_threads 1 to find the culprit.
+void VulkanWorker::RunCompileFarm(Corpus *corpus) {
+  assert(FLAGS_compile_threads > 0);
+  FILE *results = fopen(FLAGS_compile_farm.c_str(), "w");
+  assert(results != nullptr);
+  std::mutex results_mutex;
+  std::atomic<uint32_t> next_job(0);
+  std::atomic<uint32_t> num_errors(0);
+  int64_t start = GetTimeMicroseconds();
+
+  auto compile_jobs = [this, corpus, results, &results_mutex, &next_job, &num_errors]() {
+    CrashHandler::InstallThread();
+    // Each thread has its own deadline
+    Watchdog *watchdog = nullptr;
+    if (FLAGS_compile_timeout_ms > 0) {
+      watchdog = new Watchdog(FLAGS_watchdog_file.c_str());
+    }
+    Arena *arena = job_arenas_->Acquire();
+
+    for (uint32_t index = next_job++; index < corpus->GetNumJobs(); index = next_job++) {
+      CorpusJob corpus_job;
+      corpus->GetJob(index, &corpus_job);
+      {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        fprintf(results, "%s\tSTART\n", corpus_job.name);
+        fflush(results);
+      }
+      CrashHandler::SetJobId(index);
+      CrashHandler::SetJobName(corpus_job.name);
+
+      int64_t job_start = GetTimeMicroseconds();
+      VkResult result = CompileCorpusJob(corpus_job, arena, watchdog);
+      int64_t compile_time = GetTimeMicroseconds() - job_start;
+      arena->Reset();
+
+      Metrics::ObserveMicroseconds("gfz_compile_seconds", compile_time);
+      std::lock_guard<std::mutex> lock(results_mutex);
+      if (result == VK_SUCCESS) {
+        Metrics::Increment("gfz_jobs_total", "status=\"SUCCESS\"");
+        fprintf(results, "%s\tSUCCESS\t%lld\n", corpus_job.name, (long long)compile_time);
+      } else {
+        num_errors++;
+        Metrics::Increment("gfz_jobs_total", "status=\"COMPILE_ERROR\"");
+        log("COMPILEFARM %s: %s", corpus_job.name, getVkResultString(result));
+        fprintf(results, "%s\tCOMPILE_ERROR\t%lld\t%d\n", corpus_job.name, (long long)compile_time, (int)result);
+      }
+      fflush(results);
+    }
+
+    job_arenas_->Release(arena);
+    if (watchdog != nullptr) {
+      delete watchdog;
+    }
+    CrashHandler::UninstallThread();
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < FLAGS_compile_threads; i++) {
+    threads.push_back(std::thread(compile_jobs));
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  fclose(results);
+
+  int64_t duration = GetTimeMicroseconds() - start;
+  log("COMPILEFARM %u jobs, %u errors, %d threads, %.1f jobs/s", corpus->GetNumJobs(), num_errors.load(), FLAGS_compile_threads,
+      duration > 0 ? corpus->GetNumJobs() * 1e6 / duration : 0.0);
+}
+
+// Test of a server job. As in corpus mode, the first job renders the reference
+// coherence frame, and coherence is checked after every --coherence_every jobs
+// of this worker, such that a device in a bad state is reported as a coherence
+// error rather than as a bogus image.
+void VulkanWorker::RunServerTest(std::vector<uint32_t> vertex_spv, std::vector<uint32_t> fragment_spv, const char *uniforms_string, const std::string &png_template, bool skip_render, TestResult *result) {
+  result->coherent = true;
+  if (!CheckUniforms(uniforms_string, &result->error)) {
+    log("Error: invalid uniforms: %s", result->error.c_str());
+    result->error_stage = "IMAGE_PREPARE";
+    return;
+  }
+
+  size_t num_output_errors = output_writer_->GetNumErrors();
+  if (server_coherence_ == nullptr) {
+    server_coherence_ = new TestPipeline();
+    PrepareCoherence(server_coherence_);
+    has_coherence_reference_hash_ = false;
+    CheckCoherence(server_coherence_, FLAGS_coherence_before.c_str());
+  }
+
+  TestJob job;
+  job.vertex_spv = std::move(vertex_spv);
+  job.fragment_spv = std::move(fragment_spv);
+  job.arena = job_arenas_->Acquire();
+  LoadUniforms(uniforms_string, job.uniform_entries, job.arena);
+  job.png_template = png_template;
+
+  RenderTest(&job, skip_render, result);
+  num_server_jobs_++;
+  if (FLAGS_coherence_every > 0 && num_server_jobs_ % FLAGS_coherence_every == 0) {
+    result->coherent = CheckCoherence(server_coherence_, FLAGS_coherence_after.c_str());
+  }
+  // The caller reads the images
+  output_writer_->Flush();
+  if (output_writer_->GetNumErrors() > num_output_errors && result->error.empty()) {
+    result->error = "cannot write result files";
+    result->error_stage = "IMAGE_RENDER";
+  }
+
+  if (recycle_device_) {
+    CleanTest(server_coherence_);
+    RecycleDevice();
+    PrepareCoherence(server_coherence_);
+  }
+}
+
+// The atlas is an offscreen image made of atlas_columns_ x atlas_rows_ tiles,
+// each tile having the size of the regular render target. Each variant of a
+// batch is drawn into the tile image, at the origin such that gl_FragCoord
+// matches a standalone render, then copied to its own tile of the atlas: the
+// whole batch needs a single submit, and a single copy to read all images back.
+void VulkanWorker::PrepareAtlas(uint32_t num_tiles) {
+  assert(num_tiles > 0);
+  atlas_columns_ = num_tiles < (uint32_t)FLAGS_batch_columns ? num_tiles : (uint32_t)FLAGS_batch_columns;
+  atlas_rows_ = (num_tiles + atlas_columns_ - 1) / atlas_columns_;
+  atlas_width_ = atlas_columns_ * width_;
+  atlas_height_ = atlas_rows_ * height_;
+  log("ATLAS %u x %u tiles, %u x %u pixels", atlas_columns_, atlas_rows_, atlas_width_, atlas_height_);
+
+  CreateRenderPass(VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, &atlas_render_pass_);
+  SetObjectName(VK_OBJECT_TYPE_RENDER_PASS, (uint64_t)atlas_render_pass_, "atlas render pass");
+
+  VkImageCreateInfo image_create_info = {};
+  image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_create_info.pNext = nullptr;
+  image_create_info.flags = 0;
+  image_create_info.imageType = VK_IMAGE_TYPE_2D;
+  image_create_info.extent.width = atlas_width_;
+  image_create_info.extent.height = atlas_height_;
+  image_create_info.extent.depth = 1;
+  image_create_info.mipLevels = 1;
+  image_create_info.arrayLayers = 1;
+  image_create_info.samples = num_samples_;
+  image_create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_create_info.queueFamilyIndexCount = 0;
+  image_create_info.pQueueFamilyIndices = nullptr;
+  image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  VkImageViewCreateInfo image_view_create_info = {};
+  image_view_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  image_view_create_info.pNext = nullptr;
+  image_view_create_info.flags = 0;
+  image_view_create_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  image_view_create_info.components.r = VK_COMPONENT_SWIZZLE_R;
+  image_view_create_info.components.g = VK_COMPONENT_SWIZZLE_G;
+  image_view_create_info.components.b = VK_COMPONENT_SWIZZLE_B;
+  image_view_create_info.components.a = VK_COMPONENT_SWIZZLE_A;
+  image_view_create_info.subresourceRange.baseMipLevel = 0;
+  image_view_create_info.subresourceRange.levelCount = 1;
+  image_view_create_info.subresourceRange.baseArrayLayer = 0;
+  image_view_create_info.subresourceRange.layerCount = 1;
+
+  VkMemoryRequirements memory_requirements = {};
+  VkMemoryAllocateInfo memory_allocate_info = {};
+  memory_allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  memory_allocate_info.pNext = nullptr;
+
+  {
+    // Atlas, only written and read by copies
+    image_create_info.format = format_;
+    image_create_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    VKCHECK(vkCreateImage(device_, &image_create_info, allocator_, &atlas_image_));
+
+    VKLOG(vkGetImageMemoryRequirements(device_, atlas_image_, &memory_requirements));
+    memory_allocate_info.allocationSize = memory_requirements.size;
+    memory_allocate_info.memoryTypeIndex = GetMemoryTypeIndex(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    AllocateMemory(&memory_allocate_info, &atlas_image_memory_);
+    VKCHECK(vkBindImageMemory(device_, atlas_image_, atlas_image_memory_, 0));
+    SetObjectName(VK_OBJECT_TYPE_IMAGE, (uint64_t)atlas_image_, "atlas image");
+  }
+
+  // Tile render target
+  image_create_info.extent.width = width_;
+  image_create_info.extent.height = height_;
+
+  {
+    // Color
+    image_create_info.format = format_;
+    image_create_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    VKCHECK(vkCreateImage(device_, &image_create_info, allocator_, &atlas_tile_image_));
+
+    VKLOG(vkGetImageMemoryRequirements(device_, atlas_tile_image_, &memory_requirements));
+    memory_allocate_info.allocationSize = memory_requirements.size;
+    memory_allocate_info.memoryTypeIndex = GetMemoryTypeIndex(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    AllocateMemory(&memory_allocate_info, &atlas_tile_image_memory_);
+    VKCHECK(vkBindImageMemory(device_, atlas_tile_image_, atlas_tile_image_memory_, 0));
+    SetObjectName(VK_OBJECT_TYPE_IMAGE, (uint64_t)atlas_tile_image_, "atlas tile image");
+
+    image_view_create_info.image = atlas_tile_image_;
+    image_view_create_info.format = format_;
+    image_view_create_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    VKCHECK(vkCreateImageView(device_, &image_view_create_info, allocator_, &atlas_tile_image_view_));
+  }
+
+  {
+    // Depth
+    image_create_info.format = depth_format_;
+    image_create_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+    VKCHECK(vkCreateImage(device_, &image_create_info, allocator_, &atlas_depth_image_));
+
+    VKLOG(vkGetImageMemoryRequirements(device_, atlas_depth_image_, &memory_requirements));
+    memory_allocate_info.allocationSize = memory_requirements.size;
+    memory_allocate_info.memoryTypeIndex = GetMemoryTypeIndex(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    AllocateMemory(&memory_allocate_info, &atlas_depth_memory_);
+    VKCHECK(vkBindImageMemory(device_, atlas_depth_image_, atlas_depth_memory_, 0));
+    SetObjectName(VK_OBJECT_TYPE_IMAGE, (uint64_t)atlas_depth_image_, "atlas depth image");
+
+    image_view_create_info.image = atlas_depth_image_;
+    image_view_create_info.format = depth_format_;
+    image_view_create_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+    VKCHECK(vkCreateImageView(device_, &image_view_create_info, allocator_, &atlas_depth_image_view_));
+  }
+
+  {
+    // Framebuffer
+    VkImageView attachments[2] = {atlas_tile_image_view_, atlas_depth_image_view_};
+    VkFramebufferCreateInfo framebuffer_create_info = {};
+    framebuffer_create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+    framebuffer_create_info.pNext = nullptr;
+    framebuffer_create_info.flags = 0;
+    framebuffer_create_info.renderPass = atlas_render_pass_;
+    framebuffer_create_info.attachmentCount = 2;
+    framebuffer_create_info.pAttachments = attachments;
+    framebuffer_create_info.width = width_;
+    framebuffer_create_info.height = height_;
+    framebuffer_create_info.layers = 1;
+    VKCHECK(vkCreateFramebuffer(device_, &framebuffer_create_info, allocator_, &atlas_framebuffer_));
+  }
+
+  {
+    // Readback buffer, tightly packed: 4 bytes per pixel
+    VkBufferCreateInfo buffer_create_info = {};
+    buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_create_info.pNext = nullptr;
+    buffer_create_info.flags = 0;
+    buffer_create_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_create_info.size = atlas_width_ * atlas_height_ * 4;
+    buffer_create_info.queueFamilyIndexCount = 0;
+    buffer_create_info.pQueueFamilyIndices = nullptr;
+    buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VKCHECK(vkCreateBuffer(device_, &buffer_create_info, allocator_, &atlas_readback_buffer_));
+
+    VKLOG(vkGetBufferMemoryRequirements(device_, atlas_readback_buffer_, &memory_requirements));
+    memory_allocate_info.allocationSize = memory_requirements.size;
+    memory_allocate_info.memoryTypeIndex = GetMemoryTypeIndex(memory_requirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    AllocateMemory(&memory_allocate_info, &atlas_readback_memory_);
+    VKCHECK(vkBindBufferMemory(device_, atlas_readback_buffer_, atlas_readback_memory_, 0));
+    SetObjectName(VK_OBJECT_TYPE_BUFFER, (uint64_t)atlas_readback_buffer_, "atlas readback buffer");
+  }
+}
+
+void VulkanWorker::CleanAtlas() {
+  FreeMemory(atlas_readback_memory_);
+  VKLOG(vkDestroyBuffer(device_, atlas_readback_buffer_, allocator_));
+  VKLOG(vkDestroyFramebuffer(device_, atlas_framebuffer_, allocator_));
+  VKLOG(vkDestroyImageView(device_, atlas_depth_image_view_, allocator_));
+  FreeMemory(atlas_depth_memory_);
+  VKLOG(vkDestroyImage(device_, atlas_depth_image_, allocator_));
+  VKLOG(vkDestroyImageView(device_, atlas_tile_image_view_, allocator_));
+  FreeMemory(atlas_tile_image_memory_);
+  VKLOG(vkDestroyImage(device_, atlas_tile_image_, allocator_));
+  FreeMemory(atlas_image_memory_);
+  VKLOG(vkDestroyImage(device_, atlas_image_, allocator_));
+  DestroyRenderPass(atlas_render_pass_);
+}
+
+VkRect2D VulkanWorker::GetAtlasTile(uint32_t tile) {
+  VkRect2D rect = {};
+  rect.offset.x = (tile % atlas_columns_) * width_;
+  rect.offset.y = (tile / atlas_columns_) * height_;
+  rect.extent.width = width_;
+  rect.extent.height = height_;
+  return rect;
+}
+
+// Record all variants in a single command buffer, each one being drawn in the
+// tile image and copied to its own tile, then copy the whole atlas to the
+// readback buffer.
+void VulkanWorker::DrawAtlas(std::vector<TestPipeline> &tests) {
+  log("DRAWATLAS START");
+  frame_arena_->Reset();
+
+  VkCommandBufferBeginInfo command_buffer_begin_info = {};
+  command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  command_buffer_begin_info.pNext = nullptr;
+  command_buffer_begin_info.flags = 0;
+  command_buffer_begin_info.pInheritanceInfo = nullptr;
+  VKCHECK(vkBeginCommandBuffer(command_buffer_, &command_buffer_begin_info));
+
+  UpdateImageLayout(command_buffer_, atlas_image_, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+  VkClearValue clear_values[2];
+  clear_values[0].color.float32[0] = clear_color_[0];
+  clear_values[0].color.float32[1] = clear_color_[1];
+  clear_values[0].color.float32[2] = clear_color_[2];
+  clear_values[0].color.float32[3] = clear_color_[3];
+  clear_values[1].depthStencil.depth = 1.0f;
+  clear_values[1].depthStencil.stencil = 0;
 
-  PrepareTest(vertex_spv, fragment_spv, uniforms_string);
+  VkRenderPassBeginInfo render_pass_begin_info = {};
+  render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  render_pass_begin_info.pNext = nullptr;
+  render_pass_begin_info.renderPass = atlas_render_pass_;
+  render_pass_begin_info.framebuffer = atlas_framebuffer_;
+  render_pass_begin_info.renderArea.offset.x = 0;
+  render_pass_begin_info.renderArea.offset.y = 0;
+  render_pass_begin_info.renderArea.extent.width = width_;
+  render_pass_begin_info.renderArea.extent.height = height_;
+  render_pass_begin_info.clearValueCount = 2;
+  render_pass_begin_info.pClearValues = clear_values;
+
+  // The render pass leaves the tile image in TRANSFER_SRC_OPTIMAL layout
+  VkImageCopy image_copy = {};
+  image_copy.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  image_copy.srcSubresource.mipLevel = 0;
+  image_copy.srcSubresource.baseArrayLayer = 0;
+  image_copy.srcSubresource.layerCount = 1;
+  image_copy.srcOffset.x = 0;
+  image_copy.srcOffset.y = 0;
+  image_copy.srcOffset.z = 0;
+  image_copy.dstSubresource = image_copy.srcSubresource;
+  image_copy.dstOffset.z = 0;
+  image_copy.extent.width = width_;
+  image_copy.extent.height = height_;
+  image_copy.extent.depth = 1;
+
+  // The next variant overwrites the tile image and the depth image once the
+  // previous one is copied and its depth tests are done
+  VkMemoryBarrier tile_memory_barrier = {};
+  tile_memory_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  tile_memory_barrier.pNext = nullptr;
+  tile_memory_barrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  tile_memory_barrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
-  for (int i = 0; i < FLAGS_num_render; i++) {
-    std::string png_filename = FLAGS_png_template + "_" + std::to_string(i) + ".png";
-    DrawTest(png_filename.c_str(), skip_render);
+  const VkDeviceSize offsets[1] = {0};
+  BeginLabel(command_buffer_, "render atlas");
+  for (size_t i = 0; i < tests.size(); i++) {
+    TestPipeline &test = tests[i];
+    if (i > 0) {
+      VKLOG(vkCmdPipelineBarrier(command_buffer_, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                                 VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 1, &tile_memory_barrier, 0, nullptr, 0, nullptr));
+    }
+    BeginLabel(command_buffer_, test.name);
+    VKLOG(vkCmdBeginRenderPass(command_buffer_, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE));
+    VKLOG(vkCmdBindVertexBuffers(command_buffer_, 0, 1, &vertex_buffer_, offsets));
+    VKLOG(vkCmdBindPipeline(command_buffer_, VK_PIPELINE_BIND_POINT_GRAPHICS, test.graphics_pipeline));
+    if (test.uniform_entries.size() > 0) {
+      VKLOG(vkCmdBindDescriptorSets(command_buffer_, VK_PIPELINE_BIND_POINT_GRAPHICS, test.pipeline_layout, 0, 1, &(test.descriptor_set), 0, nullptr));
+    }
+    VKLOG(vkCmdDraw(command_buffer_, /* two triangles */ 2 * 3, 1, 0, 0));
+    VKLOG(vkCmdEndRenderPass(command_buffer_));
+
+    VkRect2D tile = GetAtlasTile(i);
+    image_copy.dstOffset.x = tile.offset.x;
+    image_copy.dstOffset.y = tile.offset.y;
+    VKLOG(vkCmdCopyImage(command_buffer_, atlas_tile_image_, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, atlas_image_, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &image_copy));
+    EndLabel(command_buffer_);
   }
+  EndLabel(command_buffer_);
+
+  UpdateImageLayout(command_buffer_, atlas_image_, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+  VkBufferImageCopy buffer_image_copy = {};
+  buffer_image_copy.bufferOffset = 0;
+  buffer_image_copy.bufferRowLength = 0; // tightly packed
+  buffer_image_copy.bufferImageHeight = 0;
+  buffer_image_copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  buffer_image_copy.imageSubresource.mipLevel = 0;
+  buffer_image_copy.imageSubresource.baseArrayLayer = 0;
+  buffer_image_copy.imageSubresource.layerCount = 1;
+  buffer_image_copy.imageOffset.x = 0;
+  buffer_image_copy.imageOffset.y = 0;
+  buffer_image_copy.imageOffset.z = 0;
+  buffer_image_copy.imageExtent.width = atlas_width_;
+  buffer_image_copy.imageExtent.height = atlas_height_;
+  buffer_image_copy.imageExtent.depth = 1;
+  BeginLabel(command_buffer_, "atlas readback copy");
+  VKLOG(vkCmdCopyImageToBuffer(command_buffer_, atlas_image_, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, atlas_readback_buffer_, 1, &buffer_image_copy));
+
+  VkBufferMemoryBarrier buffer_memory_barrier = {};
+  buffer_memory_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  buffer_memory_barrier.pNext = nullptr;
+  buffer_memory_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  buffer_memory_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  buffer_memory_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  buffer_memory_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  buffer_memory_barrier.buffer = atlas_readback_buffer_;
+  buffer_memory_barrier.offset = 0;
+  buffer_memory_barrier.size = VK_WHOLE_SIZE;
+  VKLOG(vkCmdPipelineBarrier(command_buffer_, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &buffer_memory_barrier, 0, nullptr));
+  EndLabel(command_buffer_);
+
+  VKCHECK(vkEndCommandBuffer(command_buffer_));
+
+  CreateFence();
+  VkSubmitInfo submit_info = {};
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.pNext = nullptr;
+  submit_info.waitSemaphoreCount = 0;
+  submit_info.pWaitSemaphores = nullptr;
+  submit_info.pWaitDstStageMask = nullptr;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &command_buffer_;
+  submit_info.signalSemaphoreCount = 0;
+  submit_info.pSignalSemaphores = nullptr;
+  VKCHECK(vkQueueSubmit(queue_, 1, &submit_info, fence_));
+  WaitForFence();
+  DestroyFence();
+
+  log("DRAWATLAS END");
+}
 
-  CleanTest();
-  free(uniforms_string);
+// Split the atlas readback buffer into one PNG per variant.
+void VulkanWorker::ExportAtlas(std::vector<TestJob> &jobs, int render_index) {
+  log("EXPORTATLAS START");
+
+  void *device_memory = nullptr;
+  VKCHECK(vkMapMemory(device_, atlas_readback_memory_, 0, VK_WHOLE_SIZE, 0, &device_memory));
+  assert(device_memory != nullptr);
+  const unsigned char *atlas = (const unsigned char *)device_memory;
+  const VkDeviceSize row_pitch = atlas_width_ * 4;
+
+  for (size_t i = 0; i < jobs.size(); i++) {
+    VkRect2D tile = GetAtlasTile(i);
+    const unsigned char *tile_origin = atlas + tile.offset.y * row_pitch + tile.offset.x * 4;
+    std::string png_filename = jobs[i].png_template + "_" + std::to_string(render_index) + ".png";
+    unsigned char *rgba_blob = AllocateFrame(png_filename.c_str());
+    ConvertToRGBA(tile_origin, row_pitch, rgba_blob);
+    SaveFrame(rgba_blob, png_filename.c_str());
+  }
+
+  VKLOG(vkUnmapMemory(device_, atlas_readback_memory_));
+
+  log("EXPORTATLAS END");
+}
+
+// Uniforms are allocated from job->arena when it is set. Returns false, with
+// the reason in error, when a file cannot be read or is invalid; the job is then
+// left empty.
+bool VulkanWorker::LoadTestJob(const char *vertex_filename, const char *fragment_filename, const char *uniforms_filename, TestJob *job, std::string *error) {
+  error->clear();
+  FILE *vertex_file = fopen(vertex_filename, "r");
+  FILE *fragment_file = fopen(fragment_filename, "r");
+  FILE *uniforms_file = fopen(uniforms_filename, "r");
+  char *uniforms_string = nullptr;
+  if (vertex_file == nullptr || fragment_file == nullptr || uniforms_file == nullptr) {
+    *error = std::string("cannot open ") + (vertex_file == nullptr ? vertex_filename : (fragment_file == nullptr ? fragment_filename : uniforms_filename));
+  } else if (!CheckSpirvFile(vertex_file) || !CheckSpirvFile(fragment_file)) {
+    *error = std::string("invalid spir-v binary ") + (CheckSpirvFile(vertex_file) ? fragment_filename : vertex_filename);
+  } else {
+    uniforms_string = GetFileContent(uniforms_file, job->arena);
+    if (CheckUniforms(uniforms_string, error)) {
+      LoadSpirvFromFile(vertex_file, job->vertex_spv);
+      LoadSpirvFromFile(fragment_file, job->fragment_spv);
+      LoadUniforms(uniforms_string, job->uniform_entries, job->arena);
+    } else {
+      *error = std::string(uniforms_filename) + ": " + *error;
+    }
+    if (job->arena == nullptr) {
+      free(uniforms_string);
+    }
+  }
+
+  for (FILE *file : {vertex_file, fragment_file, uniforms_file}) {
+    if (file != nullptr) {
+      fclose(file);
+    }
+  }
+  return error->empty();
+}
+
+void VulkanWorker::RunBatch(FILE *batch_file) {
+
+  // Parse the batch file
+  std::vector<BatchEntry> entries;
+  char *batch_string = GetFileContent(batch_file, nullptr);
+  std::istringstream batch_stream(batch_string);
+  free(batch_string);
+  std::string line;
+  while (std::getline(batch_stream, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream line_stream(line);
+    BatchEntry entry;
+    line_stream >> entry.vertex_filename >> entry.fragment_filename >> entry.uniforms_filename >> entry.png_template;
+    if (entry.png_template.empty()) {
+      log("Error: invalid batch line: %s", line.c_str());
+      assert(false && "Invalid batch line");
+    }
+    entries.push_back(entry);
+  }
+  log("BATCH %zu jobs", entries.size());
+
+  // Jobs done or crashed in a previous run are skipped. Jobs rendered when the
+  // previous run crashed are isolated, each in its own atlas.
+  std::vector<bool> isolated(entries.size(), false);
+  if (batch_journal_ != nullptr) {
+    batch_journal_->LogCounters();
+    for (const JournalCrash &crash : batch_journal_->GetCrashes()) {
+      log("BATCHJOURNAL CRASH %s at %s", crash.job.c_str(), crash.stage.c_str());
+      output_writer_->Write(output_writer_->ShardTemplate(crash.job) + "_crash.txt", crash.stage + "\n");
+      Metrics::Increment("gfz_jobs_total", "status=\"CRASH\"");
+    }
+    std::vector<BatchEntry> pending;
+    isolated.clear();
+    for (const BatchEntry &entry : entries) {
+      if (!batch_journal_->IsFinished(entry.png_template)) {
+        pending.push_back(entry);
+        isolated.push_back(batch_journal_->IsIsolated(entry.png_template));
+      }
+    }
+    log("BATCHJOURNAL %zu jobs left", pending.size());
+    entries.swap(pending);
+  }
+  if (entries.empty()) {
+    return;
+  }
+
+  // Jobs are loaded in the background, such that the jobs of the next atlas
+  // are read while the current one is rendered.
+  OutputWriter *output_writer = output_writer_;
+  ArenaPool *job_arenas = job_arenas_;
+  JobPrefetcher prefetcher(entries.size(), FLAGS_prefetch_depth, [&entries, output_writer, job_arenas](size_t index, TestJob *job) {
+    const BatchEntry &entry = entries[index];
+    job->arena = job_arenas->Acquire();
+    std::string error;
+    if (!LoadTestJob(entry.vertex_filename.c_str(), entry.fragment_filename.c_str(), entry.uniforms_filename.c_str(), job, &error)) {
+      log("Error: %s", error.c_str());
+      assert(false && "Cannot load batch job");
+    }
+    job->png_template = output_writer->ShardTemplate(entry.png_template);
+  });
+
+  // Coherence before
+  RunCoherence(FLAGS_coherence_before.c_str());
+
+  // The atlas cannot exceed the maximum image dimension nor --batch_max_tiles,
+  // split the batch into chunks that fit in one atlas.
+  uint32_t max_dimension = physical_device_properties_.limits.maxImageDimension2D;
+  assert(max_dimension >= width_ && max_dimension >= height_);
+  uint32_t max_columns = max_dimension / width_;
+  if ((uint32_t)FLAGS_batch_columns < max_columns) {
+    max_columns = (uint32_t)FLAGS_batch_columns;
+  }
+  size_t chunk_size = max_columns * (max_dimension / height_);
+  if (FLAGS_batch_max_tiles > 0 && (size_t)FLAGS_batch_max_tiles < chunk_size) {
+    chunk_size = (size_t)FLAGS_batch_max_tiles;
+  }
+
+  size_t num_jobs = 0;
+  for (size_t first_job = 0; first_job < entries.size(); first_job += num_jobs) {
+    num_jobs = 1;
+    if (!isolated[first_job]) {
+      while (num_jobs < chunk_size && first_job + num_jobs < entries.size() && !isolated[first_job + num_jobs]) {
+        num_jobs++;
+      }
+    }
+    // Leaks are only told apart per atlas: all its jobs are rendered at once
+    MemorySnapshot memory_before;
+    GetMemorySnapshot(&memory_before);
+    PrepareAtlas(num_jobs);
+    VkRect2D render_area = {};
+    render_area.extent.width = width_;
+    render_area.extent.height = height_;
+
+    // Jobs whose pipeline cannot be created get no tile: the atlas holds the
+    // other jobs of the chunk, and tile i belongs to jobs[i].
+    std::vector<TestJob> jobs;
+    std::vector<TestPipeline> tests;
+    std::vector<size_t> rendered;
+    for (size_t i = 0; i < num_jobs; i++) {
+      TestJob job;
+      prefetcher.Pop(&job);
+      if (batch_journal_ != nullptr) {
+        batch_journal_->Record(entries[first_job + i].png_template, "IMAGE_PREPARE");
+      }
+      TestPipeline test;
+      VkResult result = PrepareTest(&test, &job, atlas_render_pass_, render_area);
+      if (result != VK_SUCCESS) {
+        output_writer_->Write(job.png_template + "_compile_error.txt", std::string(getVkResultString(result)) + "\n");
+        Metrics::Increment("gfz_jobs_total", "status=\"COMPILE_ERROR\"");
+        continue;
+      }
+      jobs.push_back(std::move(job));
+      tests.push_back(std::move(test));
+      rendered.push_back(i);
+    }
+
+    if (batch_journal_ != nullptr) {
+      for (size_t i : rendered) {
+        batch_journal_->Record(entries[first_job + i].png_template, "IMAGE_RENDER");
+      }
+    }
+    if (!tests.empty()) {
+      for (int render_index = 0; render_index < FLAGS_num_render; render_index++) {
+        DrawAtlas(tests);
+        ExportAtlas(jobs, render_index);
+      }
+    }
+    if (batch_journal_ != nullptr) {
+      // A job is done once its images, or its compile error, are on disk
+      output_writer_->Flush();
+      for (size_t i = 0; i < num_jobs; i++) {
+        batch_journal_->Record(entries[first_job + i].png_template, "DONE");
+      }
+    }
+    for (size_t i = 0; i < rendered.size(); i++) {
+      Metrics::Increment("gfz_jobs_total", "status=\"SUCCESS\"");
+    }
+
+    for (TestPipeline &test : tests) {
+      CleanTest(&test);
+    }
+    CleanAtlas();
+
+    MemorySnapshot memory_after;
+    GetMemorySnapshot(&memory_after);
+    if (CheckMemoryLeak(memory_before, memory_after)) {
+      log("MEMORYLEAK in the atlas of jobs %zu to %zu, from %s", first_job, first_job + num_jobs - 1, entries[first_job].png_template.c_str());
+      num_leaky_jobs_ += (uint32_t)num_jobs;
+      for (size_t i = 0; i < num_jobs; i++) {
+        Metrics::Increment("gfz_leaky_jobs_total");
+      }
+    }
+    CheckMemoryGrowth(memory_after);
+    if (recycle_device_ && first_job + num_jobs < entries.size()) {
+      RecycleDevice();
+    }
+  }
+  prefetcher.LogCounters();
+  output_writer_->LogCounters();
 
   // Coherence after
-  PrepareTest(coherence_vertex_shader_spv_, coherence_fragment_shader_spv_, coherence_uniforms_string);
-  DrawTest(FLAGS_coherence_after.c_str(), false);
-  CleanTest();
+  RunCoherence(FLAGS_coherence_after.c_str());
 }
 
 // DumpWorkerInfo() is static to be callable without creating a full-blown worker.
@@ -1678,14 +4160,15 @@ void VulkanWorker::DumpWorkerInfo(const char *worker_info_filename) {
 
   uint32_t dumpinfo_num_physical_devices = 0;
   VKCHECK(vkEnumeratePhysicalDevices(dumpinfo_instance, &dumpinfo_num_physical_devices, nullptr));
-  assert(dumpinfo_num_physical_devices > 0 || "Cannot find any physical device");
+  assert(dumpinfo_num_physical_devices > 0 && "Cannot find any physical device");
   std::vector<VkPhysicalDevice> dumpinfo_physical_devices;
   dumpinfo_physical_devices.resize(dumpinfo_num_physical_devices);
   VKCHECK(vkEnumeratePhysicalDevices(dumpinfo_instance, &dumpinfo_num_physical_devices, dumpinfo_physical_devices.data()));
+  assert(FLAGS_device >= 0 && (size_t)FLAGS_device < dumpinfo_physical_devices.size() && "No physical device of index --device");
   if (dumpinfo_physical_devices.size() > 1) {
-    log("Warning: more than one GPU detected, the worker always targets the first one listed");
+    log("Warning: more than one GPU detected, the worker targets device %d, see --device", FLAGS_device);
   }
-  VkPhysicalDevice dumpinfo_physical_device = dumpinfo_physical_devices[0];
+  VkPhysicalDevice dumpinfo_physical_device = dumpinfo_physical_devices[FLAGS_device];
   VkPhysicalDeviceProperties dumpinfo_physical_device_properties;
   VKLOG(vkGetPhysicalDeviceProperties(dumpinfo_physical_device, &dumpinfo_physical_device_properties));
 
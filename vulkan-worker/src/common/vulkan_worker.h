@@ -16,9 +16,23 @@
 #define __VULKAN_WORKER__
 
 #include <vulkan/vulkan.h>
+#include <atomic>
+#include <map>
+#include <string>
 #include <vector>
 
 #include "platform.h"
+#include "arena.h"
+#include "batch_journal.h"
+#include "corpus.h"
+#include "crash_handler.h"
+#include "host_allocator.h"
+#include "metrics.h"
+#include "output_writer.h"
+#include "pipeline_cache_store.h"
+#include "result_cache.h"
+#include "result_transport.h"
+#include "watchdog.h"
 #include "gflags/gflags.h"
 
 DECLARE_bool(info);
@@ -26,7 +40,55 @@ DECLARE_bool(skip_render);
 DECLARE_string(coherence_before);
 DECLARE_string(coherence_after);
 DECLARE_int32(num_render);
+DECLARE_bool(fast_render);
+DECLARE_int32(max_render);
 DECLARE_string(png_template);
+DECLARE_string(batch);
+DECLARE_int32(batch_columns);
+DECLARE_int32(batch_max_tiles);
+DECLARE_bool(gpu_hash);
+DECLARE_string(reference_hash);
+DECLARE_string(corpus);
+DECLARE_int32(prefetch_depth);
+DECLARE_int32(coherence_every);
+DECLARE_int32(compile_timeout_ms);
+DECLARE_string(watchdog_file);
+DECLARE_string(crash_file);
+DECLARE_bool(async_log);
+DECLARE_int32(log_buffer);
+DECLARE_string(log_overflow);
+DECLARE_string(metrics_file);
+DECLARE_int32(metrics_port);
+DECLARE_int32(metrics_interval_ms);
+DECLARE_bool(async_output);
+DECLARE_string(output_fsync);
+DECLARE_int32(output_shards);
+DECLARE_string(result_cache);
+DECLARE_string(interesting_if);
+DECLARE_string(reference_image);
+DECLARE_string(compare);
+DECLARE_int32(fuzzy_component_threshold);
+DECLARE_int32(fuzzy_distance_threshold);
+DECLARE_int32(fuzzy_bad_pixels_threshold);
+DECLARE_int32(fuzzy_bad_sparse_pixels_threshold);
+DECLARE_bool(save_images);
+DECLARE_bool(host_memory_stats);
+DECLARE_int32(recycle_memory_growth_mb);
+DECLARE_int32(recycle_leaky_jobs);
+DECLARE_string(compile_farm);
+DECLARE_int32(compile_threads);
+DECLARE_string(batch_journal);
+DECLARE_string(pipeline_cache);
+DECLARE_int32(pipeline_cache_max_mb);
+DECLARE_int32(pipeline_cache_export_interval);
+DECLARE_string(result_transport);
+DECLARE_int32(result_transport_mb);
+DECLARE_string(perf_reference);
+DECLARE_int32(perf_iterations);
+DECLARE_int32(perf_warmup);
+DECLARE_int32(perf_draws);
+DECLARE_double(perf_slowdown);
+DECLARE_int32(device);
 
 typedef struct Vertex {
   float x, y, z, w; // position
@@ -38,26 +100,146 @@ typedef struct UniformEntry {
   void *value;
 } UniformEntry;
 
+// Everything needed to render a test: shader binaries and parsed uniforms, and
+// where to save the resulting images. The uniform values are owned by the job
+// until PrepareTest() hands them to a TestPipeline.
+typedef struct TestJob {
+  std::vector<uint32_t> vertex_spv;
+  std::vector<uint32_t> fragment_spv;
+  std::vector<UniformEntry> uniform_entries;
+  std::string png_template;
+  // Holds the uniform values, null when they were malloc()ed one by one
+  Arena *arena = nullptr;
+} TestJob;
+
+// Files of a job, as listed in a batch file
+typedef struct BatchEntry {
+  std::string vertex_filename;
+  std::string fragment_filename;
+  std::string uniforms_filename;
+  std::string png_template;
+} BatchEntry;
+
+// Exit codes of the interestingness test and performance regression modes, see
+// --interesting_if and --perf_reference. A crash of the driver terminates the
+// worker with yet another status, e.g. a signal.
+const int kExitInteresting = 0;
+const int kExitNotInteresting = 3;
+const int kExitInvalidTest = 4;
+
+// Outcome of rendering a test, as reported to the server. Times are in
+// microseconds.
+typedef struct TestResult {
+  int num_render;
+  // Index of the first frame that differs from frame 0, or -1
+  int nondet_render;
+  bool coherent;
+  int64_t compilation_time;
+  int64_t first_render_time;
+  int64_t other_renders_time;
+  int64_t capture_time;
+  // Hash of frame 0
+  uint64_t image_hash;
+  // Outcome taken from the result cache, nothing was rendered
+  bool cached;
+  // Host memory used by the driver for the test, with --host_memory_stats
+  bool has_host_memory;
+  HostMemoryUsage host_memory;
+  // More memory or objects alive after the test than before it
+  bool memory_leak;
+  // Set when nothing was rendered: the uniforms are invalid, or the pipeline
+  // cannot be created, e.g. for invalid SPIR-V, see compile_result
+  std::string error;
+  VkResult compile_result;
+  // Stage the error was raised at, named as the stages of the crash handler,
+  // e.g. "IMAGE_VALIDATE_PROGRAM"
+  const char *error_stage;
+} TestResult;
+
+// Vulkan objects that depend on the shaders and uniforms of a given test.
+// Several of them can be alive at the same time, e.g. when a batch of variants
+// is rendered into a single atlas image.
+typedef struct TestPipeline {
+  // Given to its Vulkan objects, for debugging and profiling tools
+  std::string name;
+  std::vector<uint32_t> vertex_shader_spv;
+  std::vector<uint32_t> fragment_shader_spv;
+  std::vector<UniformEntry> uniform_entries;
+  // Taken from the job, returned to the pool by CleanTest()
+  Arena *arena;
+  std::vector<VkBuffer> uniform_buffers;
+  std::vector<VkDeviceMemory> uniform_memories;
+  std::vector<VkDescriptorBufferInfo> descriptor_buffer_infos;
+  VkDescriptorSetLayout descriptor_set_layout;
+  VkPipelineLayout pipeline_layout;
+  VkDescriptorPool descriptor_pool;
+  VkDescriptorSet descriptor_set;
+  VkShaderModule vertex_shader_module;
+  VkShaderModule fragment_shader_module;
+  VkPipelineShaderStageCreateInfo shader_stages[2];
+  VkPipeline graphics_pipeline;
+} TestPipeline;
+
+// Memory in use at a point in time, see VulkanWorker::GetMemorySnapshot()
+typedef struct MemorySnapshot {
+  // From VK_EXT_memory_budget, no heap when it is not available
+  uint32_t num_heaps;
+  VkDeviceSize heap_usage[VK_MAX_MEMORY_HEAPS];
+  VkDeviceSize heap_budget[VK_MAX_MEMORY_HEAPS];
+  // Allocated by the worker
+  VkDeviceSize memory_in_use;
+  size_t num_memory_allocations;
+  // Created by the worker for jobs, see VulkanWorker::num_live_objects_
+  int64_t num_live_objects;
+  // Allocated by the driver, with --host_memory_stats
+  int64_t host_live_bytes;
+  int64_t host_live_allocations;
+} MemorySnapshot;
+
 class VulkanWorker {
   private:
 
   // Platform-specific data
   PlatformData *platform_data_;
 
+  // Terminates the process when pipeline creation hangs, see --compile_timeout_ms
+  Watchdog *watchdog_;
+  OutputWriter *output_writer_;
+  // Result files and frames go there instead of disk, see --result_transport
+  ResultTransport *result_transport_;
+  ResultCache *result_cache_;
+  // Progress of batch jobs, see --batch_journal
+  BatchJournal *batch_journal_;
+  // Host data of jobs, recycled from one job to the next
+  ArenaPool *job_arenas_;
+  // Image buffers of the frame being exported, reset before each export
+  Arena *frame_arena_;
+
   // Dimensions
   uint32_t width_;
   uint32_t height_;
 
   // Shader binaries
-  std::vector<uint32_t> vertex_shader_spv_;
-  std::vector<uint32_t> fragment_shader_spv_;
   std::vector<uint32_t> coherence_vertex_shader_spv_;
   std::vector<uint32_t> coherence_fragment_shader_spv_;
+  std::vector<uint32_t> frame_hash_shader_spv_;
 
 
   // Vulkan specific
 
+  // Allocation callbacks of all objects of the worker, null unless
+  // --host_memory_stats is set
+  HostAllocator *host_allocator_;
+  const VkAllocationCallbacks *allocator_;
+  // Shared with other workers, see --pipeline_cache
+  PipelineCacheStore *pipeline_cache_store_;
+  // VK_NULL_HANDLE without --pipeline_cache
+  VkPipelineCache pipeline_cache_;
   VkInstance instance_;
+  // VK_EXT_debug_utils entry points, null when the extension is not available
+  PFN_vkSetDebugUtilsObjectNameEXT set_debug_utils_object_name_;
+  PFN_vkCmdBeginDebugUtilsLabelEXT cmd_begin_debug_utils_label_;
+  PFN_vkCmdEndDebugUtilsLabelEXT cmd_end_debug_utils_label_;
   std::vector<VkPhysicalDevice> physical_devices_;
   VkPhysicalDeviceMemoryProperties physical_device_memory_properties_;
   VkPhysicalDeviceProperties physical_device_properties_;
@@ -71,30 +253,32 @@ class VulkanWorker {
   std::vector<VkCommandBuffer> export_command_buffers_;
   VkSurfaceKHR surface_;
   VkFormat format_;
+  // With --compile_farm, no surface nor image is created, see CreateCompileResources()
+  bool compile_only_;
   VkSwapchainKHR swapchain_;
   std::vector<VkImage> images_;
   std::vector<VkImageView> image_views_;
+  // Size of each allocation, see AllocateMemory()
+  std::map<VkDeviceMemory, VkDeviceSize> memory_sizes_;
+  VkDeviceSize memory_in_use_;
+  // Pipelines, shader modules, layouts, descriptors and uniform buffers of
+  // jobs that are alive. Compile farm threads create them concurrently.
+  std::atomic<int64_t> num_live_objects_;
+  // Leak detection and device recycling, see CheckMemoryGrowth()
+  PFN_vkGetPhysicalDeviceMemoryProperties2KHR get_physical_device_memory_properties2_;
+  bool memory_budget_supported_;
+  MemorySnapshot memory_baseline_;
+  uint32_t num_leaky_jobs_;
+  bool recycle_device_;
   VkImage depth_image_;
   VkDeviceMemory depth_memory_;
   VkImageView depth_image_view_;
-  std::vector<VkBuffer> uniform_buffers_;
-  std::vector<VkDeviceMemory> uniform_memories_;
-  std::vector<UniformEntry> uniform_entries_;
-  VkDescriptorSetLayout descriptor_set_layout_;
-  VkPipelineLayout pipeline_layout_;
-  VkDescriptorPool descriptor_pool_;
-  VkDescriptorSet descriptor_set_;
-  std::vector<VkDescriptorBufferInfo> descriptor_buffer_infos_;
   VkRenderPass render_pass_;
-  VkShaderModule vertex_shader_module_;
-  VkShaderModule fragment_shader_module_;
-  VkPipelineShaderStageCreateInfo shader_stages_[2];
   std::vector<VkFramebuffer> framebuffers_;
   VkBuffer vertex_buffer_;
   VkDeviceMemory vertex_memory_;
   VkVertexInputBindingDescription vertex_input_binding_description_;
   VkVertexInputAttributeDescription vertex_input_attribute_description_[2];
-  VkPipeline graphics_pipeline_;
   VkSemaphore semaphore_;
   uint32_t swapchain_image_index_;
   VkFence fence_;
@@ -102,14 +286,67 @@ class VulkanWorker {
   VkDeviceMemory export_image_memory_;
   VkMemoryRequirements export_image_memory_requirements_;
 
+  // Batch atlas: each variant of a batch is rendered at the origin of the tile
+  // image, then copied to its own tile of the atlas image
+  uint32_t atlas_columns_;
+  uint32_t atlas_rows_;
+  uint32_t atlas_width_;
+  uint32_t atlas_height_;
+  VkRenderPass atlas_render_pass_;
+  VkImage atlas_image_;
+  VkDeviceMemory atlas_image_memory_;
+  VkImage atlas_tile_image_;
+  VkDeviceMemory atlas_tile_image_memory_;
+  VkImageView atlas_tile_image_view_;
+  VkImage atlas_depth_image_;
+  VkDeviceMemory atlas_depth_memory_;
+  VkImageView atlas_depth_image_view_;
+  VkFramebuffer atlas_framebuffer_;
+  VkBuffer atlas_readback_buffer_;
+  VkDeviceMemory atlas_readback_memory_;
+
+  // GPU frame hash: a compute pass reduces the rendered image to one hash per
+  // row, such that only the hashes are read back in the common case.
+  bool frame_hash_supported_;
+  VkBuffer frame_hash_pixel_buffer_;
+  VkDeviceMemory frame_hash_pixel_memory_;
+  VkBuffer frame_hash_row_buffer_;
+  VkDeviceMemory frame_hash_row_memory_;
+  VkDescriptorSetLayout frame_hash_descriptor_set_layout_;
+  VkPipelineLayout frame_hash_pipeline_layout_;
+  VkDescriptorPool frame_hash_descriptor_pool_;
+  VkDescriptorSet frame_hash_descriptor_set_;
+  VkShaderModule frame_hash_shader_module_;
+  VkPipeline frame_hash_pipeline_;
+  std::vector<VkCommandBuffer> frame_hash_command_buffers_;
+  bool has_previous_frame_hash_;
+  uint64_t previous_frame_hash_;
+
+  // Hash of the first coherence frame, see CheckCoherence()
+  bool has_coherence_reference_hash_;
+  uint64_t coherence_reference_hash_;
+  // Coherence pipeline of server jobs, prepared by the first one, and number
+  // of server jobs run since, see RunServerTest()
+  TestPipeline *server_coherence_;
+  uint32_t num_server_jobs_;
+
   void CreateInstance();
   void DestroyInstance();
+  void CreateDeviceResources();
+  void DestroyDeviceResources();
+  void CreateCompileResources();
+  void DestroyCompileResources();
+  void SetObjectName(VkObjectType object_type, uint64_t object_handle, const std::string &name);
+  void BeginLabel(VkCommandBuffer command_buffer, const std::string &label);
+  void EndLabel(VkCommandBuffer command_buffer);
   void EnumeratePhysicalDevices();
   void PreparePhysicalDevice();
   void GetPhysicalDeviceQueueFamilyProperties();
   void FindGraphicsAndPresentQueueFamily();
   void CreateDevice();
   void DestroyDevice();
+  void CreatePipelineCache();
+  void DestroyPipelineCache();
   void CreateCommandPool();
   void DestroyCommandPool();
   void AllocateCommandBuffer();
@@ -126,54 +363,98 @@ class VulkanWorker {
   void BindDepthImageMemory();
   void CreateDepthImageView();
   void DestroyDepthResources();
-  void PrepareUniformBuffer();
-  void DestroyUniformResources();
-  void CreateDescriptorSetLayout();
-  void DestroyDescriptorSetLayout();
-  void CreatePipelineLayout();
-  void DestroyPipelineLayout();
-  void CreateDescriptorPool();
-  void DestroyDescriptorPool();
-  void AllocateDescriptorSet();
-  void FreeDescriptorSet();
-  void UpdateDescriptorSet();
-  void CreateRenderPass();
-  void DestroyRenderPass();
-  void CreateShaderModules();
-  void DestroyShaderModules();
-  void PrepareShaderStages();
+  void PrepareUniformBuffer(TestPipeline *test);
+  void DestroyUniformResources(TestPipeline *test);
+  void CreateDescriptorSetLayout(TestPipeline *test);
+  void DestroyDescriptorSetLayout(TestPipeline *test);
+  void CreatePipelineLayout(TestPipeline *test);
+  void DestroyPipelineLayout(TestPipeline *test);
+  void CreateDescriptorPool(TestPipeline *test);
+  void DestroyDescriptorPool(TestPipeline *test);
+  void AllocateDescriptorSet(TestPipeline *test);
+  void FreeDescriptorSet(TestPipeline *test);
+  void UpdateDescriptorSet(TestPipeline *test);
+  void CreateRenderPass(VkImageLayout color_final_layout, VkRenderPass *render_pass);
+  void DestroyRenderPass(VkRenderPass render_pass);
+  VkResult CreateShaderModules(TestPipeline *test);
+  void DestroyShaderModules(TestPipeline *test);
+  void PrepareShaderStages(TestPipeline *test);
   void CreateFramebuffers();
   void DestroyFramebuffers();
   void PrepareVertexBufferObject();
+  void PrepareVertexInputDescriptions();
   void CleanVertexBufferObject();
-  void CreateGraphicsPipeline();
-  void DestroyGraphicsPipeline();
+  VkResult CreateGraphicsPipeline(TestPipeline *test, VkRenderPass render_pass, const VkRect2D &render_area, Watchdog *watchdog);
+  void DestroyGraphicsPipeline(TestPipeline *test);
   void CreateSemaphore();
   void DestroySemaphore();
   void AcquireNextImage();
-  void PrepareCommandBuffer();
+  void PrepareCommandBuffer(TestPipeline *test, const char *label);
+  void AllocateMemory(const VkMemoryAllocateInfo *memory_allocate_info, VkDeviceMemory *memory);
+  void FreeMemory(VkDeviceMemory memory);
+  void GetMemorySnapshot(MemorySnapshot *snapshot);
+  bool CheckMemoryLeak(const MemorySnapshot &before, const MemorySnapshot &after);
+  void CheckMemoryGrowth(const MemorySnapshot &snapshot);
+  void RecycleDevice();
   void CreateFence();
   void DestroyFence();
+  void WaitForFence();
   void SubmitCommandBuffer();
   void PresentToDisplay();
-  void LoadUniforms(const char *uniforms_string);
   void PrepareExport();
   void CleanExport();
-  void ExportPNG(const char *png_filename);
+  void ReadbackFrame(unsigned char *rgba_blob);
+  uint64_t ExportPNG(const char *png_filename);
+  uint64_t HashRGBA(const unsigned char *rgba_blob);
+  uint64_t HashCurrentFrame();
+  void ConvertToRGBA(const unsigned char *source, VkDeviceSize row_pitch, unsigned char *rgba);
+  void SavePNG(const unsigned char *rgba, const char *png_filename);
+  unsigned char *AllocateFrame(const char *png_filename);
+  void SaveFrame(const unsigned char *rgba_blob, const char *png_filename);
+  void PrepareFrameHash();
+  void CleanFrameHash();
+  uint64_t HashFrame();
+  uint64_t ExportFrameHash(const char *png_filename, const char *hash_filename, bool *png_exported);
   void UpdateImageLayout(VkCommandBuffer command_buffer, VkImage image, VkImageLayout old_image_layout, VkImageLayout new_image_layout, VkPipelineStageFlags src_stage_mask, VkPipelineStageFlags dest_stage_mask);
-  void PrepareTest(std::vector<uint32_t> &vertex_spv, std::vector<uint32_t> &fragment_spv, const char *uniforms_string);
-  void CleanTest();
-  void DrawTest(const char *png_filename, bool skip_render);
+  VkResult PrepareTest(TestPipeline *test, TestJob *job, VkRenderPass render_pass, const VkRect2D &render_area);
+  void CleanTest(TestPipeline *test);
+  uint64_t DrawTest(TestPipeline *test, const char *png_filename, const char *hash_filename, bool skip_render, TestResult *result, bool *png_exported);
+  void PrepareAtlas(uint32_t num_tiles);
+  void CleanAtlas();
+  VkRect2D GetAtlasTile(uint32_t tile);
+  void DrawAtlas(std::vector<TestPipeline> &tests);
+  void ExportAtlas(std::vector<TestJob> &jobs, int render_index);
+  void BeginFrame(TestPipeline *test, const char *label);
+  void EndFrame();
+  void PrepareCoherence(TestPipeline *coherence);
+  bool CheckCoherence(TestPipeline *coherence, const char *png_filename);
+  void RunCoherence(const char *png_filename);
+  void RecordTimedDraws(TestPipeline *test, VkCommandBuffer command_buffer, VkQueryPool query_pool, uint32_t first_query);
+  void RenderTest(TestJob *job, bool skip_render, TestResult *result);
+  std::string GetResultCacheKey(const TestJob *job);
+  bool RestoreCachedResult(const std::string &key, TestJob *job, TestResult *result);
+  VkResult CompileCorpusJob(const CorpusJob &corpus_job, Arena *arena, Watchdog *watchdog);
 
   uint32_t GetMemoryTypeIndex(uint32_t memory_requirements_type_bits, VkMemoryPropertyFlags required_properties);
-  char *GetFileContent(FILE *file);
-  void LoadSpirvFromFile(FILE *source, std::vector<uint32_t> &spv);
+  // Static, as also used by the prefetch thread
+  static char *GetFileContent(FILE *file, Arena *arena);
+  static bool CheckSpirvFile(FILE *source);
+  static void LoadSpirvFromFile(FILE *source, std::vector<uint32_t> &spv);
+  static bool CheckUniforms(const char *uniforms_string, std::string *error);
+  static void LoadUniforms(const char *uniforms_string, std::vector<UniformEntry> &uniform_entries, Arena *arena);
+  static bool LoadTestJob(const char *vertex_filename, const char *fragment_filename, const char *uniforms_filename, TestJob *job, std::string *error);
   void LoadSpirvFromArray(unsigned char *array, unsigned int len, std::vector<uint32_t> &spv);
 
   public:
   VulkanWorker(PlatformData *platform_data);
   ~VulkanWorker();
   void RunTest(FILE *vertex_file, FILE *fragment_file, FILE *uniforms_file, bool skip_render);
+  int RunInterestingnessTest(FILE *vertex_file, FILE *fragment_file, FILE *uniforms_file);
+  int RunPerfTest(FILE *vertex_file, FILE *fragment_file, FILE *uniforms_file);
+  void RunBatch(FILE *batch_file);
+  void RunCorpus(Corpus *corpus, bool skip_render);
+  void RunCompileFarm(Corpus *corpus);
+  void RunServerTest(std::vector<uint32_t> vertex_spv, std::vector<uint32_t> fragment_spv, const char *uniforms_string, const std::string &png_template, bool skip_render, TestResult *result);
   static void DumpWorkerInfo(const char *worker_info_filename);
 };
 
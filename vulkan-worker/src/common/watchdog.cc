@@ -0,0 +1,89 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "watchdog.h"
+#include "platform.h"
+
+#include <stdio.h> // fopen(), fflush()
+#include <stdlib.h> // EXIT_FAILURE
+#include <unistd.h> // _exit()
+
+Watchdog::Watchdog(const char *record_filename) {
+  record_filename_ = record_filename;
+  armed_ = false;
+  quit_ = false;
+  timeout_ms_ = 0;
+  thread_ = std::thread(&Watchdog::Run, this);
+}
+
+Watchdog::~Watchdog() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  condition_.notify_one();
+  thread_.join();
+}
+
+void Watchdog::Arm(const char *stage, uint32_t timeout_ms) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stage_ = stage;
+    timeout_ms_ = timeout_ms;
+    deadline_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    armed_ = true;
+  }
+  condition_.notify_one();
+}
+
+void Watchdog::Disarm() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    armed_ = false;
+  }
+  condition_.notify_one();
+}
+
+void Watchdog::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!quit_) {
+    if (!armed_) {
+      condition_.wait(lock);
+      continue;
+    }
+    // Spurious wake-ups, re-arming and disarming are all handled by checking
+    // the state again on the next iteration.
+    std::chrono::steady_clock::time_point deadline = deadline_;
+    if (condition_.wait_until(lock, deadline) == std::cv_status::timeout && armed_ && deadline_ == deadline) {
+      Expire();
+    }
+  }
+}
+
+// Called with the mutex held, never returns.
+void Watchdog::Expire() {
+  log("WATCHDOG TIMEOUT %s after %u ms", stage_.c_str(), timeout_ms_);
+
+  FILE *record = fopen(record_filename_.c_str(), "w");
+  if (record != nullptr) {
+    fprintf(record, "%s\n", stage_.c_str());
+    fclose(record);
+  }
+
+  // The main thread is stuck in the driver: do not run any destructor, only
+  // make sure what was logged so far reaches the harness.
+  LogSink::Flush();
+  fflush(stdout);
+  _exit(EXIT_FAILURE);
+}
@@ -0,0 +1,53 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __WATCHDOG__
+#define __WATCHDOG__
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// The watchdog terminates the process when an armed stage does not complete
+// before its deadline. Driver compilers may hang on fuzzed shaders: with the
+// watchdog, such jobs cost the deadline rather than the harness global timeout.
+// On expiry, the name of the stage is written to the record file, such that
+// the harness can report a TIMEOUT at this stage.
+class Watchdog {
+  private:
+  std::string record_filename_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool armed_;
+  bool quit_;
+  std::string stage_;
+  uint32_t timeout_ms_;
+  std::chrono::steady_clock::time_point deadline_;
+
+  void Run();
+  void Expire();
+
+  public:
+  Watchdog(const char *record_filename);
+  ~Watchdog();
+  void Arm(const char *stage, uint32_t timeout_ms);
+  void Disarm();
+};
+
+#endif
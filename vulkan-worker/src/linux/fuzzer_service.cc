@@ -0,0 +1,663 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fuzzer_service.h"
+#include "platform.h"
+
+#include <assert.h> // assert()
+#include <netdb.h> // getaddrinfo()
+#include <stdlib.h> // strtol(), strtoul()
+#include <strings.h> // strncasecmp()
+#include <sys/socket.h> // socket(), connect(), send(), recv()
+#include <sys/time.h> // struct timeval
+#include <unistd.h> // close()
+
+// Seconds before giving up on a silent server
+const int kSocketTimeoutSeconds = 60;
+
+// Thrift binary protocol, see:
+// https://github.com/apache/thrift/blob/master/doc/specs/thrift-binary-protocol.md
+const uint8_t kThriftStop = 0;
+const uint8_t kThriftBool = 2;
+const uint8_t kThriftByte = 3;
+const uint8_t kThriftDouble = 4;
+const uint8_t kThriftI16 = 6;
+const uint8_t kThriftI32 = 8;
+const uint8_t kThriftI64 = 10;
+const uint8_t kThriftString = 11;
+const uint8_t kThriftStruct = 12;
+const uint8_t kThriftMap = 13;
+const uint8_t kThriftSet = 14;
+const uint8_t kThriftList = 15;
+
+const uint32_t kThriftVersion1 = 0x80010000;
+const uint32_t kThriftVersionMask = 0xffff0000;
+const uint8_t kThriftCall = 1;
+const uint8_t kThriftException = 3;
+
+// Nested structures deeper than this are rejected as malformed
+const int kThriftMaxDepth = 64;
+
+class ThriftWriter {
+  public:
+  std::string buffer;
+
+  void WriteByte(uint8_t value) {
+    buffer.push_back((char)value);
+  }
+
+  void WriteI16(int16_t value) {
+    WriteByte((uint8_t)((uint16_t)value >> 8));
+    WriteByte((uint8_t)value);
+  }
+
+  void WriteI32(int32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      WriteByte((uint8_t)((uint32_t)value >> shift));
+    }
+  }
+
+  void WriteI64(int64_t value) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      WriteByte((uint8_t)((uint64_t)value >> shift));
+    }
+  }
+
+  void WriteString(const std::string &value) {
+    WriteI32((int32_t)value.size());
+    buffer.append(value);
+  }
+
+  void WriteFieldBegin(uint8_t type, int16_t id) {
+    WriteByte(type);
+    WriteI16(id);
+  }
+
+  void WriteFieldStop() {
+    WriteByte(kThriftStop);
+  }
+
+  void WriteStringField(int16_t id, const std::string &value) {
+    WriteFieldBegin(kThriftString, id);
+    WriteString(value);
+  }
+
+  void WriteI32Field(int16_t id, int32_t value) {
+    WriteFieldBegin(kThriftI32, id);
+    WriteI32(value);
+  }
+
+  void WriteBoolField(int16_t id, bool value) {
+    WriteFieldBegin(kThriftBool, id);
+    WriteByte(value ? 1 : 0);
+  }
+};
+
+// Reads from a buffer. Reading past its end, or malformed data, clears ok()
+// rather than aborting, as the data comes from the network.
+class ThriftReader {
+  private:
+  const std::string &buffer_;
+  size_t position_;
+  bool ok_;
+
+  public:
+  ThriftReader(const std::string &buffer) : buffer_(buffer), position_(0), ok_(true) {}
+
+  bool ok() {
+    return ok_;
+  }
+
+  std::string Remaining() {
+    return ok_ ? buffer_.substr(position_) : std::string();
+  }
+
+  uint64_t ReadBigEndian(size_t size) {
+    if (!ok_ || buffer_.size() - position_ < size) {
+      ok_ = false;
+      return 0;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+      value = (value << 8) | (uint8_t)buffer_[position_++];
+    }
+    return value;
+  }
+
+  uint8_t ReadByte() {
+    return (uint8_t)ReadBigEndian(1);
+  }
+
+  int16_t ReadI16() {
+    return (int16_t)ReadBigEndian(2);
+  }
+
+  int32_t ReadI32() {
+    return (int32_t)ReadBigEndian(4);
+  }
+
+  int64_t ReadI64() {
+    return (int64_t)ReadBigEndian(8);
+  }
+
+  std::string ReadString() {
+    int32_t size = ReadI32();
+    if (!ok_ || size < 0 || buffer_.size() - position_ < (size_t)size) {
+      ok_ = false;
+      return std::string();
+    }
+    std::string value = buffer_.substr(position_, size);
+    position_ += size;
+    return value;
+  }
+
+  // Returns false on the stop field
+  bool ReadFieldBegin(uint8_t *type, int16_t *id) {
+    *type = ReadByte();
+    if (!ok_ || *type == kThriftStop) {
+      return false;
+    }
+    *id = ReadI16();
+    return ok_;
+  }
+
+  void Skip(uint8_t type, int depth) {
+    if (depth > kThriftMaxDepth) {
+      ok_ = false;
+      return;
+    }
+    switch (type) {
+      case kThriftBool:
+      case kThriftByte:
+        ReadBigEndian(1);
+        break;
+      case kThriftI16:
+        ReadBigEndian(2);
+        break;
+      case kThriftI32:
+        ReadBigEndian(4);
+        break;
+      case kThriftDouble:
+      case kThriftI64:
+        ReadBigEndian(8);
+        break;
+      case kThriftString:
+        ReadString();
+        break;
+      case kThriftStruct: {
+        uint8_t field_type;
+        int16_t field_id;
+        while (ReadFieldBegin(&field_type, &field_id)) {
+          Skip(field_type, depth + 1);
+        }
+        break;
+      }
+      case kThriftMap: {
+        uint8_t key_type = ReadByte();
+        uint8_t value_type = ReadByte();
+        int32_t size = ReadI32();
+        for (int32_t i = 0; ok_ && i < size; i++) {
+          Skip(key_type, depth + 1);
+          Skip(value_type, depth + 1);
+        }
+        break;
+      }
+      case kThriftSet:
+      case kThriftList: {
+        uint8_t element_type = ReadByte();
+        int32_t size = ReadI32();
+        for (int32_t i = 0; ok_ && i < size; i++) {
+          Skip(element_type, depth + 1);
+        }
+        break;
+      }
+      default:
+        ok_ = false;
+        break;
+    }
+  }
+};
+
+static void WriteTimingInfo(ThriftWriter *writer, const TimingInfo &timing_info) {
+  writer->WriteI32Field(1, timing_info.compilation_time);
+  writer->WriteI32Field(3, timing_info.first_render_time);
+  writer->WriteI32Field(4, timing_info.other_renders_time);
+  writer->WriteI32Field(5, timing_info.capture_time);
+  writer->WriteFieldStop();
+}
+
+static void WriteImageJobResult(ThriftWriter *writer, const ImageJobResult &result) {
+  writer->WriteI32Field(1, result.status);
+  writer->WriteStringField(2, result.log);
+  writer->WriteI32Field(3, result.stage);
+  writer->WriteFieldBegin(kThriftStruct, 4);
+  WriteTimingInfo(writer, result.timing_info);
+  writer->WriteBoolField(5, result.pass_sanity_check);
+  if (result.has_png) {
+    writer->WriteStringField(6, result.png);
+  }
+  if (result.has_png2) {
+    writer->WriteStringField(7, result.png2);
+  }
+  writer->WriteFieldStop();
+}
+
+static void WriteImageJob(ThriftWriter *writer, const ImageJob &image_job) {
+  writer->WriteStringField(1, image_job.name);
+  writer->WriteStringField(2, image_job.fragment_source);
+  writer->WriteStringField(3, image_job.vertex_source);
+  writer->WriteStringField(4, image_job.uniforms_info);
+  writer->WriteBoolField(8, image_job.skip_render);
+  if (image_job.has_result) {
+    writer->WriteFieldBegin(kThriftStruct, 9);
+    WriteImageJobResult(writer, image_job.result);
+  }
+  if (!image_job.compute_source.empty()) {
+    writer->WriteStringField(10, image_job.compute_source);
+    writer->WriteStringField(11, image_job.compute_info);
+  }
+  writer->WriteFieldStop();
+}
+
+static void WriteJob(ThriftWriter *writer, const Job &job) {
+  writer->WriteFieldBegin(kThriftI64, 1);
+  writer->WriteI64(job.job_id);
+  if (job.has_no_job) {
+    writer->WriteFieldBegin(kThriftStruct, 2);
+    writer->WriteFieldStop();
+  }
+  if (job.has_image_job) {
+    writer->WriteFieldBegin(kThriftStruct, 3);
+    WriteImageJob(writer, job.image_job);
+  }
+  if (job.has_skip_job) {
+    writer->WriteFieldBegin(kThriftStruct, 4);
+    writer->WriteFieldStop();
+  }
+  writer->WriteFieldStop();
+}
+
+// The result of an image job sent by the server is not needed, it is skipped.
+static void ReadImageJob(ThriftReader *reader, ImageJob *image_job) {
+  image_job->skip_render = false;
+  image_job->has_result = false;
+  uint8_t type;
+  int16_t id;
+  while (reader->ReadFieldBegin(&type, &id)) {
+    if (id == 1 && type == kThriftString) {
+      image_job->name = reader->ReadString();
+    } else if (id == 2 && type == kThriftString) {
+      image_job->fragment_source = reader->ReadString();
+    } else if (id == 3 && type == kThriftString) {
+      image_job->vertex_source = reader->ReadString();
+    } else if (id == 4 && type == kThriftString) {
+      image_job->uniforms_info = reader->ReadString();
+    } else if (id == 8 && type == kThriftBool) {
+      image_job->skip_render = (reader->ReadByte() != 0);
+    } else if (id == 10 && type == kThriftString) {
+      image_job->compute_source = reader->ReadString();
+    } else if (id == 11 && type == kThriftString) {
+      image_job->compute_info = reader->ReadString();
+    } else {
+      reader->Skip(type, 0);
+    }
+  }
+}
+
+static void ReadJob(ThriftReader *reader, Job *job) {
+  job->job_id = 0;
+  job->has_no_job = false;
+  job->has_image_job = false;
+  job->has_skip_job = false;
+  uint8_t type;
+  int16_t id;
+  while (reader->ReadFieldBegin(&type, &id)) {
+    if (id == 1 && type == kThriftI64) {
+      job->job_id = reader->ReadI64();
+    } else if (id == 2 && type == kThriftStruct) {
+      job->has_no_job = true;
+      reader->Skip(type, 0);
+    } else if (id == 3 && type == kThriftStruct) {
+      job->has_image_job = true;
+      ReadImageJob(reader, &job->image_job);
+    } else if (id == 4 && type == kThriftStruct) {
+      job->has_skip_job = true;
+      reader->Skip(type, 0);
+    } else {
+      reader->Skip(type, 0);
+    }
+  }
+}
+
+// Declared exceptions of FuzzerService methods all have the worker name as
+// first field.
+static void LogServiceException(const char *method, ThriftReader *reader) {
+  std::string worker_name;
+  uint8_t type;
+  int16_t id;
+  while (reader->ReadFieldBegin(&type, &id)) {
+    if (id == 1 && type == kThriftString) {
+      worker_name = reader->ReadString();
+    } else {
+      reader->Skip(type, 0);
+    }
+  }
+  log("%s(): worker name not found: %s", method, worker_name.c_str());
+}
+
+FuzzerServiceClient::FuzzerServiceClient(const char *url) {
+  std::string address = url;
+  const std::string scheme = "http://";
+  assert(address.compare(0, scheme.size(), scheme) == 0 && "Only http:// server URLs are supported");
+  address = address.substr(scheme.size());
+
+  size_t path_start = address.find('/');
+  if (path_start == std::string::npos) {
+    path_ = "/";
+  } else {
+    path_ = address.substr(path_start);
+    address = address.substr(0, path_start);
+  }
+
+  size_t port_start = address.find(':');
+  if (port_start == std::string::npos) {
+    host_ = address;
+    port_ = "80";
+  } else {
+    host_ = address.substr(0, port_start);
+    port_ = address.substr(port_start + 1);
+  }
+
+  sequence_id_ = 0;
+}
+
+// One connection per request: the server is polled about once a second, and
+// this keeps the worker robust to server restarts.
+bool FuzzerServiceClient::Post(const std::string &request, std::string *response) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addresses = nullptr;
+  if (getaddrinfo(host_.c_str(), port_.c_str(), &hints, &addresses) != 0) {
+    log("Cannot resolve server host %s", host_.c_str());
+    return false;
+  }
+
+  int fd = -1;
+  for (struct addrinfo *address = addresses; address != nullptr; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    struct timeval timeout = {};
+    timeout.tv_sec = kSocketTimeoutSeconds;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) {
+    log("Cannot connect to server %s:%s", host_.c_str(), port_.c_str());
+    return false;
+  }
+
+  std::string message =
+    "POST " + path_ + " HTTP/1.1\r\n"
+    "Host: " + host_ + ":" + port_ + "\r\n"
+    "Content-Type: application/x-thrift\r\n"
+    "Accept: application/x-thrift\r\n"
+    "Content-Length: " + std::to_string(request.size()) + "\r\n"
+    "Connection: close\r\n"
+    "\r\n" + request;
+
+  size_t sent = 0;
+  while (sent < message.size()) {
+    ssize_t num_bytes = send(fd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+    if (num_bytes <= 0) {
+      log("Cannot send request to server");
+      close(fd);
+      return false;
+    }
+    sent += num_bytes;
+  }
+
+  std::string reply;
+  char buffer[4096];
+  ssize_t num_bytes;
+  while ((num_bytes = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+    reply.append(buffer, num_bytes);
+  }
+  close(fd);
+  if (num_bytes < 0) {
+    log("Cannot receive reply from server");
+    return false;
+  }
+
+  size_t header_end = reply.find("\r\n\r\n");
+  if (header_end == std::string::npos || reply.compare(0, 5, "HTTP/") != 0) {
+    log("Malformed HTTP reply from server");
+    return false;
+  }
+  size_t status_start = reply.find(' ');
+  if (status_start > header_end || strtol(reply.c_str() + status_start + 1, nullptr, 10) != 200) {
+    log("HTTP error from server: %s", reply.substr(0, reply.find("\r\n")).c_str());
+    return false;
+  }
+
+  bool chunked = false;
+  long content_length = -1;
+  size_t line_start = reply.find("\r\n") + 2;
+  while (line_start < header_end) {
+    size_t line_end = reply.find("\r\n", line_start);
+    std::string line = reply.substr(line_start, line_end - line_start);
+    const char transfer_encoding[] = "Transfer-Encoding:";
+    const char content_length_header[] = "Content-Length:";
+    if (strncasecmp(line.c_str(), transfer_encoding, sizeof(transfer_encoding) - 1) == 0) {
+      chunked = (line.find("chunked") != std::string::npos);
+    } else if (strncasecmp(line.c_str(), content_length_header, sizeof(content_length_header) - 1) == 0) {
+      content_length = strtol(line.c_str() + sizeof(content_length_header) - 1, nullptr, 10);
+    }
+    line_start = line_end + 2;
+  }
+
+  size_t body_start = header_end + 4;
+  response->clear();
+  if (chunked) {
+    size_t position = body_start;
+    while (true) {
+      size_t size_end = reply.find("\r\n", position);
+      if (size_end == std::string::npos) {
+        log("Truncated HTTP reply from server");
+        return false;
+      }
+      size_t chunk_size = strtoul(reply.c_str() + position, nullptr, 16);
+      if (chunk_size == 0) {
+        break;
+      }
+      position = size_end + 2;
+      if (reply.size() - position < chunk_size) {
+        log("Truncated HTTP reply from server");
+        return false;
+      }
+      response->append(reply, position, chunk_size);
+      position += chunk_size + 2;
+    }
+  } else if (content_length >= 0) {
+    if (reply.size() - body_start < (size_t)content_length) {
+      log("Truncated HTTP reply from server");
+      return false;
+    }
+    response->assign(reply, body_start, content_length);
+  } else {
+    response->assign(reply, body_start, std::string::npos);
+  }
+  return true;
+}
+
+// Sends a call with the given serialized arguments struct, and returns the
+// serialized result struct.
+bool FuzzerServiceClient::Call(const char *method, const std::string &arguments, std::string *result) {
+  sequence_id_++;
+  ThriftWriter writer;
+  writer.WriteI32((int32_t)(kThriftVersion1 | kThriftCall));
+  writer.WriteString(method);
+  writer.WriteI32(sequence_id_);
+  writer.buffer.append(arguments);
+
+  std::string response;
+  if (!Post(writer.buffer, &response)) {
+    return false;
+  }
+
+  // Servers write strict message headers, which start with the version
+  ThriftReader reader(response);
+  uint32_t version = (uint32_t)reader.ReadI32();
+  if ((version & kThriftVersionMask) != kThriftVersion1) {
+    log("%s(): bad Thrift protocol version", method);
+    return false;
+  }
+  uint8_t message_type = (uint8_t)version;
+  reader.ReadString(); // Method name
+  reader.ReadI32(); // Sequence id
+  if (!reader.ok()) {
+    log("%s(): malformed reply", method);
+    return false;
+  }
+
+  if (message_type == kThriftException) {
+    std::string message;
+    uint8_t type;
+    int16_t id;
+    while (reader.ReadFieldBegin(&type, &id)) {
+      if (id == 1 && type == kThriftString) {
+        message = reader.ReadString();
+      } else {
+        reader.Skip(type, 0);
+      }
+    }
+    log("%s(): server exception: %s", method, message.c_str());
+    return false;
+  }
+
+  *result = reader.Remaining();
+  return true;
+}
+
+bool FuzzerServiceClient::GetWorkerName(const std::string &platform_info, const std::string &worker_name, GetWorkerNameResult *result) {
+  ThriftWriter arguments;
+  arguments.WriteStringField(1, platform_info);
+  arguments.WriteStringField(2, worker_name);
+  arguments.WriteFieldStop();
+
+  std::string reply;
+  if (!Call("getWorkerName", arguments.buffer, &reply)) {
+    return false;
+  }
+
+  result->has_worker_name = false;
+  result->error = 0;
+  bool has_success = false;
+  ThriftReader reader(reply);
+  uint8_t type;
+  int16_t id;
+  while (reader.ReadFieldBegin(&type, &id)) {
+    if (id == 0 && type == kThriftStruct) {
+      has_success = true;
+      uint8_t field_type;
+      int16_t field_id;
+      while (reader.ReadFieldBegin(&field_type, &field_id)) {
+        if (field_id == 1 && field_type == kThriftString) {
+          result->has_worker_name = true;
+          result->worker_name = reader.ReadString();
+        } else if (field_id == 2 && field_type == kThriftI32) {
+          result->error = reader.ReadI32();
+        } else {
+          reader.Skip(field_type, 0);
+        }
+      }
+    } else {
+      reader.Skip(type, 0);
+    }
+  }
+  if (!reader.ok() || !has_success) {
+    log("getWorkerName(): malformed reply");
+    return false;
+  }
+  return true;
+}
+
+bool FuzzerServiceClient::GetJob(const std::string &worker_name, Job *job) {
+  ThriftWriter arguments;
+  arguments.WriteStringField(1, worker_name);
+  arguments.WriteFieldStop();
+
+  std::string reply;
+  if (!Call("getJob", arguments.buffer, &reply)) {
+    return false;
+  }
+
+  bool has_success = false;
+  ThriftReader reader(reply);
+  uint8_t type;
+  int16_t id;
+  while (reader.ReadFieldBegin(&type, &id)) {
+    if (id == 0 && type == kThriftStruct) {
+      has_success = true;
+      ReadJob(&reader, job);
+    } else if (id == 1 && type == kThriftStruct) {
+      LogServiceException("getJob", &reader);
+      return false;
+    } else {
+      reader.Skip(type, 0);
+    }
+  }
+  if (!reader.ok() || !has_success) {
+    log("getJob(): malformed reply");
+    return false;
+  }
+  return true;
+}
+
+bool FuzzerServiceClient::JobDone(const std::string &worker_name, const Job &job) {
+  ThriftWriter arguments;
+  arguments.WriteStringField(1, worker_name);
+  arguments.WriteFieldBegin(kThriftStruct, 2);
+  WriteJob(&arguments, job);
+  arguments.WriteFieldStop();
+
+  std::string reply;
+  if (!Call("jobDone", arguments.buffer, &reply)) {
+    return false;
+  }
+
+  ThriftReader reader(reply);
+  uint8_t type;
+  int16_t id;
+  while (reader.ReadFieldBegin(&type, &id)) {
+    if (id == 1 && type == kThriftStruct) {
+      LogServiceException("jobDone", &reader);
+      return false;
+    }
+    reader.Skip(type, 0);
+  }
+  if (!reader.ok()) {
+    log("jobDone(): malformed reply");
+    return false;
+  }
+  return true;
+}
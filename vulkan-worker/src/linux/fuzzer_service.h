@@ -0,0 +1,117 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __FUZZER_SERVICE__
+#define __FUZZER_SERVICE__
+
+#include <stdint.h>
+
+#include <string>
+
+// Client side of the FuzzerService defined in
+// thrift/src/main/thrift/FuzzerService.thrift, using the Thrift binary protocol
+// over HTTP, like the Python workers do. Only the fields used by this worker
+// are represented: enum values and field ids must match the Thrift definition.
+
+enum JobStatus {
+  JOB_STATUS_UNKNOWN = 0,
+  JOB_STATUS_SUCCESS = 10,
+  JOB_STATUS_CRASH = 20,
+  JOB_STATUS_COMPILE_ERROR = 30,
+  JOB_STATUS_LINK_ERROR = 40,
+  JOB_STATUS_COHERENCE_ERROR = 45,
+  JOB_STATUS_NONDET = 50,
+  JOB_STATUS_TIMEOUT = 60,
+  JOB_STATUS_UNEXPECTED_ERROR = 70,
+  JOB_STATUS_SKIPPED = 80,
+  JOB_STATUS_SAME_AS_REFERENCE = 90,
+};
+
+enum JobStage {
+  JOB_STAGE_NOT_STARTED = 0,
+  JOB_STAGE_GET_JOB = 10,
+  JOB_STAGE_START_JOB = 20,
+  JOB_STAGE_IMAGE_PREPARE = 50,
+  JOB_STAGE_IMAGE_VALIDATE_PROGRAM = 60,
+  JOB_STAGE_IMAGE_RENDER = 70,
+  JOB_STAGE_IMAGE_REPLY_JOB = 80,
+};
+
+// Times in microseconds
+typedef struct TimingInfo {
+  int32_t compilation_time;
+  int32_t first_render_time;
+  int32_t other_renders_time;
+  int32_t capture_time;
+} TimingInfo;
+
+typedef struct ImageJobResult {
+  JobStatus status;
+  std::string log;
+  JobStage stage;
+  TimingInfo timing_info;
+  bool pass_sanity_check;
+  bool has_png;
+  std::string png;
+  bool has_png2;
+  std::string png2;
+} ImageJobResult;
+
+typedef struct ImageJob {
+  std::string name;
+  std::string fragment_source;
+  std::string vertex_source;
+  std::string compute_source;
+  std::string uniforms_info;
+  std::string compute_info;
+  bool skip_render;
+  bool has_result;
+  ImageJobResult result;
+} ImageJob;
+
+typedef struct Job {
+  int64_t job_id;
+  bool has_no_job;
+  bool has_image_job;
+  bool has_skip_job;
+  ImageJob image_job;
+} Job;
+
+typedef struct GetWorkerNameResult {
+  bool has_worker_name;
+  std::string worker_name;
+  int32_t error;
+} GetWorkerNameResult;
+
+// Each call returns false when the server cannot be reached, or replies with an
+// exception. The reason is logged, and the caller is expected to register again
+// before retrying.
+class FuzzerServiceClient {
+  private:
+  std::string host_;
+  std::string port_;
+  std::string path_;
+  int32_t sequence_id_;
+
+  bool Post(const std::string &request, std::string *response);
+  bool Call(const char *method, const std::string &arguments, std::string *result);
+
+  public:
+  FuzzerServiceClient(const char *url);
+  bool GetWorkerName(const std::string &platform_info, const std::string &worker_name, GetWorkerNameResult *result);
+  bool GetJob(const std::string &worker_name, Job *job);
+  bool JobDone(const std::string &worker_name, const Job &job);
+};
+
+#endif
@@ -25,6 +25,10 @@
 
 #include <gflags/gflags.h> // DEFINE_*, FLAGS_*
 
+#include "pipe_worker.h"
+#include "server_worker.h"
+#include "spool_worker.h"
+#include "supervisor.h"
 #include "vulkan_worker.h"
 
 const int WIDTH = 256;
@@ -40,38 +44,133 @@ int main(int argc, char **argv) {
     exit(EXIT_SUCCESS);
   }
 
-  if (argc != 4) {
-    printf("Error: need exactly 3 arguments\n");
-    printf("Usage: %s shader.vert.spv shader.frag.spv shader.json\n", argv[0]);
-    exit(EXIT_FAILURE);
+  // The supervisor only starts workers, it creates no window nor device
+  if (!FLAGS_supervise.empty()) {
+    if (argc != 1) {
+      printf("Error: no positional argument expected in supervisor mode\n");
+      printf("Usage: %s --supervise batch.txt --num_workers 8\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    Supervisor supervisor(FLAGS_supervise.c_str());
+    exit(supervisor.Run());
   }
 
+  FILE *batch_file = nullptr;
+  Corpus *corpus = nullptr;
   FILE *vertex_file = nullptr;
-  vertex_file = fopen(argv[1], "r");
-  assert(vertex_file != nullptr);
-
   FILE *fragment_file = nullptr;
-  fragment_file = fopen(argv[2], "r");
-  assert(fragment_file != nullptr);
-
   FILE *uniform_file = nullptr;
-  uniform_file = fopen(argv[3], "r");
-  assert(uniform_file != nullptr);
+
+  if (!FLAGS_server.empty()) {
+    if (argc != 1 || FLAGS_worker.empty()) {
+      printf("Error: server mode needs a worker name, and no positional argument\n");
+      printf("Usage: %s --server http://localhost:8080 --worker name\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  } else if (!FLAGS_spool.empty()) {
+    if (argc != 1) {
+      printf("Error: no positional argument expected in spool mode\n");
+      printf("Usage: %s --spool directory\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  } else if (FLAGS_pipe) {
+    if (argc != 1) {
+      printf("Error: no positional argument expected in pipe mode\n");
+      exit(EXIT_FAILURE);
+    }
+  } else if (!FLAGS_batch.empty() || !FLAGS_corpus.empty() || !FLAGS_compile_farm.empty()) {
+    if (!FLAGS_compile_farm.empty() && FLAGS_corpus.empty()) {
+      printf("Error: compile farm mode needs a corpus\n");
+      printf("Usage: %s --corpus corpus.bin --compile_farm results.tsv\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    if (argc != 1 || (!FLAGS_batch.empty() && !FLAGS_corpus.empty())) {
+      printf("Error: no positional argument expected in batch or corpus mode\n");
+      printf("Usage: %s --batch batch.txt\n", argv[0]);
+      printf("       %s --corpus corpus.bin\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    if (!FLAGS_batch.empty()) {
+      batch_file = fopen(FLAGS_batch.c_str(), "r");
+      assert(batch_file != nullptr);
+    } else {
+      corpus = new Corpus(FLAGS_corpus.c_str());
+    }
+  } else {
+    if (argc != 4) {
+      printf("Error: need exactly 3 arguments\n");
+      printf("Usage: %s shader.vert.spv shader.frag.spv shader.json\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+
+    vertex_file = fopen(argv[1], "r");
+    assert(vertex_file != nullptr);
+
+    fragment_file = fopen(argv[2], "r");
+    assert(fragment_file != nullptr);
+
+    uniform_file = fopen(argv[3], "r");
+    assert(uniform_file != nullptr);
+  }
+
+  // Results handed through the ring buffer are never PNG files, which the
+  // result cache stores and server replies carry
+  if (!FLAGS_result_transport.empty() && (!FLAGS_result_cache.empty() || !FLAGS_server.empty())) {
+    printf("Error: --result_transport cannot be used with --result_cache nor --server\n");
+    exit(EXIT_FAILURE);
+  }
 
   glfwInit();
   glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
 
   PlatformData platform_data = {};
+  // The compile farm renders nothing: its window is hidden, and only gives the
+  // surface format that render passes use in the other modes
+  if (!FLAGS_compile_farm.empty()) {
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+  }
   platform_data.window = glfwCreateWindow(WIDTH, HEIGHT, "VulkanWorker", nullptr, nullptr);
 
+  int exit_status = EXIT_SUCCESS;
   VulkanWorker* vulkan_worker = new VulkanWorker(&platform_data);
-  vulkan_worker->RunTest(vertex_file, fragment_file, uniform_file, FLAGS_skip_render);
+  if (!FLAGS_server.empty()) {
+    ServerWorker server_worker(vulkan_worker, FLAGS_server.c_str());
+    server_worker.Run();
+  } else if (!FLAGS_spool.empty()) {
+    SpoolWorker spool_worker(vulkan_worker, FLAGS_spool.c_str());
+    spool_worker.Run();
+  } else if (FLAGS_pipe) {
+    PipeWorker pipe_worker(vulkan_worker);
+    pipe_worker.Run();
+  } else if (batch_file != nullptr) {
+    vulkan_worker->RunBatch(batch_file);
+    fclose(batch_file);
+  } else if (corpus != nullptr) {
+    if (!FLAGS_compile_farm.empty()) {
+      vulkan_worker->RunCompileFarm(corpus);
+    } else {
+      vulkan_worker->RunCorpus(corpus, FLAGS_skip_render);
+    }
+    delete corpus;
+  } else if (!FLAGS_perf_reference.empty()) {
+    exit_status = vulkan_worker->RunPerfTest(vertex_file, fragment_file, uniform_file);
+    fclose(vertex_file);
+    fclose(fragment_file);
+    fclose(uniform_file);
+  } else if (!FLAGS_interesting_if.empty()) {
+    exit_status = vulkan_worker->RunInterestingnessTest(vertex_file, fragment_file, uniform_file);
+    fclose(vertex_file);
+    fclose(fragment_file);
+    fclose(uniform_file);
+  } else {
+    vulkan_worker->RunTest(vertex_file, fragment_file, uniform_file, FLAGS_skip_render);
+    fclose(vertex_file);
+    fclose(fragment_file);
+    fclose(uniform_file);
+  }
   delete vulkan_worker;
 
-  fclose(vertex_file);
-  fclose(fragment_file);
-  fclose(uniform_file);
-
   // while(!glfwWindowShouldClose(window)) {
   //   glfwPollEvents();
   // }
@@ -82,5 +181,5 @@ int main(int argc, char **argv) {
 
   log("\nLINUX TERMINATE OK\n");
 
-  exit(EXIT_SUCCESS);
+  exit(exit_status);
 }
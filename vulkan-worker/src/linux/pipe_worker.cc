@@ -0,0 +1,97 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pipe_worker.h"
+#include "platform.h"
+#include "spool_worker.h"
+
+#include <assert.h> // assert()
+#include <errno.h> // errno
+#include <inttypes.h> // PRIx64
+#include <stdio.h> // fgets(), snprintf()
+#include <unistd.h> // write()
+
+#include <sstream>
+
+DEFINE_bool(pipe, false, "Worker process of --supervise: read jobs from stdin and write results to file descriptor 3, see PipeWorker");
+
+PipeWorker::PipeWorker(VulkanWorker *vulkan_worker) {
+  vulkan_worker_ = vulkan_worker;
+}
+
+// A single write() per line: the supervisor never sees half a result, unless
+// the worker crashed.
+void PipeWorker::WriteResult(const std::string &line) {
+  std::string record = line + "\n";
+  size_t offset = 0;
+  while (offset < record.size()) {
+    ssize_t num_bytes = write(kPipeResultsFd, record.data() + offset, record.size() - offset);
+    if (num_bytes < 0) {
+      assert(errno == EINTR && "Cannot write to supervisor");
+      continue;
+    }
+    offset += num_bytes;
+  }
+}
+
+void PipeWorker::DoJob(const std::string &job_line) {
+  std::string vertex_filename;
+  std::string fragment_filename;
+  std::string uniforms_filename;
+  std::string png_template;
+  std::istringstream job_stream(job_line);
+  job_stream >> vertex_filename >> fragment_filename >> uniforms_filename >> png_template;
+
+  std::string status;
+  std::string error;
+  TestResult result = {};
+  if (png_template.empty()) {
+    status = "UNEXPECTED_ERROR";
+    error = "invalid job line: " + job_line;
+  } else {
+    status = SpoolWorker::RunJob(vulkan_worker_, vertex_filename, fragment_filename, uniforms_filename, png_template, &result, &error);
+  }
+  log("PIPE %s %s", png_template.c_str(), status.c_str());
+  Metrics::Increment("gfz_jobs_total", "status=\"" + status + "\"");
+
+  if (!error.empty()) {
+    WriteResult(status + "\t" + error);
+    return;
+  }
+  char fields[256];
+  snprintf(fields, sizeof(fields), "\t%016" PRIx64 "\t%d\t%d\t%lld\t%lld", result.image_hash, result.num_render, result.nondet_render,
+           (long long)result.compilation_time, (long long)result.first_render_time);
+  WriteResult(status + fields);
+}
+
+void PipeWorker::Run() {
+  WriteResult("READY");
+  int num_jobs = 0;
+  char line[4096];
+  while (FLAGS_max_jobs == 0 || num_jobs < FLAGS_max_jobs) {
+    CrashHandler::SetStage("GET_JOB");
+    if (fgets(line, sizeof(line), stdin) == nullptr) {
+      break;
+    }
+    std::string job_line = line;
+    job_line.erase(job_line.find_last_not_of(" \r\n") + 1);
+    if (job_line.empty()) {
+      continue;
+    }
+    CrashHandler::SetJobId(num_jobs);
+    LogSink::SetJobId(num_jobs);
+    DoJob(job_line);
+    num_jobs++;
+  }
+}
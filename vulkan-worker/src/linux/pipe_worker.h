@@ -0,0 +1,49 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __PIPE_WORKER__
+#define __PIPE_WORKER__
+
+#include <string>
+
+#include "vulkan_worker.h"
+#include "gflags/gflags.h"
+
+DECLARE_bool(pipe);
+DECLARE_int32(max_jobs);
+
+// File descriptor PipeWorker writes its results to, set up by Supervisor
+static const int kPipeResultsFd = 3;
+
+// Worker process of a Supervisor. Jobs are batch lines read from stdin,
+// '<vert.spv> <frag.spv> <uniforms.json> <png_template>', rendered one at a
+// time. Results are lines written to kPipeResultsFd, stdout being left to the
+// log: 'READY' once the device is created, then one line per job,
+// '<status> <image_hash> <num_render> <nondet_render> <compilation_time>
+// <first_render_time>', tab-separated, or '<status> <error>' when the job
+// could not be rendered. The worker exits on end of input, or after
+// --max_jobs jobs, for the supervisor to start a fresh process.
+class PipeWorker {
+  private:
+  VulkanWorker *vulkan_worker_;
+
+  void WriteResult(const std::string &line);
+  void DoJob(const std::string &job_line);
+
+  public:
+  PipeWorker(VulkanWorker *vulkan_worker);
+  void Run();
+};
+
+#endif
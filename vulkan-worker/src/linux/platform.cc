@@ -17,6 +17,7 @@
 #include "platform.h" // includes GLFW, vulkan
 
 #include <assert.h> // assert()
+#include <stdio.h> // fputs()
 #include <stdlib.h> // exit()
 #include <vector> // std::vector<>
 
@@ -51,3 +52,8 @@ void PlatformGetWidthHeight(PlatformData *platform_data, uint32_t *width, uint32
   *width = (uint32_t)w;
   *height = (uint32_t)h;
 }
+
+// Called by the log sink flusher, line ends with a newline
+void PlatformWriteLog(const char *line) {
+  fputs(line, stdout);
+}
@@ -23,9 +23,11 @@
 #include <stdio.h> // printf()
 #include <vector> // std::vector<>
 
+#include "log_sink.h"
+
 // Add a newline to format string. For details on ", ##__VA_ARGS__", see
 // http://gcc.gnu.org/onlinedocs/cpp/Variadic-Macros.html
-#define log(fmt, ...) printf(fmt "\n", ##__VA_ARGS__);
+#define log(fmt, ...) (LogSink::IsRunning() ? LogSink::Print(fmt "\n", ##__VA_ARGS__) : (void)printf(fmt "\n", ##__VA_ARGS__));
 
 typedef struct PlatformData {
   GLFWwindow* window;
@@ -35,5 +37,6 @@ void PlatformGetInstanceExtensions(std::vector<const char*> &extensions);
 void PlatformGetInstanceLayers(std::vector<const char*> &layers);
 void PlatformCreateSurface(PlatformData *platform_data, VkInstance instance, VkSurfaceKHR *surface);
 void PlatformGetWidthHeight(PlatformData *platform_data, uint32_t *width, uint32_t *height);
+void PlatformWriteLog(const char *line);
 
 #endif
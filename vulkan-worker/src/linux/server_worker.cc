@@ -0,0 +1,324 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server_worker.h"
+#include "platform.h"
+
+#include <assert.h> // assert()
+#include <stdint.h> // INT32_MAX
+#include <stdio.h> // fopen(), popen()
+#include <stdlib.h> // exit()
+#include <string.h> // memcpy(), strcmp()
+#include <sys/stat.h> // mkdir()
+#include <unistd.h> // sleep(), unlink()
+
+#include <algorithm> // std::max()
+#include <chrono>
+#include <vector>
+
+DEFINE_string(server, "", "URL of the server, e.g. http://localhost:8080, to get jobs from instead of running a single test");
+DEFINE_string(worker, "", "Worker name to identify to the server");
+DEFINE_string(glslang, "glslangValidator", "Command to compile the GLSL shaders of server jobs to SPIR-V");
+DEFINE_int32(max_jobs, 0, "In server, spool and pipe modes, exit after this number of image jobs. 0 means no limit");
+
+// Same as the one of glsl-to-spv-worker, for jobs without a vertex shader
+const char kDefaultVertexShader[] =
+  "#version 310 es\n"
+  "layout(location=0) in highp vec4 a_position;\n"
+  "void main (void) {\n"
+  "  gl_Position = a_position;\n"
+  "}\n";
+
+static int64_t GetTimeMicroseconds() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Server times are 32-bit
+static int32_t ToTimeInterval(int64_t microseconds) {
+  return (int32_t)std::min(microseconds, (int64_t)INT32_MAX);
+}
+
+static void WriteFileContent(const std::string &filename, const std::string &content) {
+  FILE *file = fopen(filename.c_str(), "wb");
+  assert(file != nullptr);
+  fwrite(content.data(), 1, content.size(), file);
+  fclose(file);
+}
+
+static bool ReadFileContent(const std::string &filename, std::string *content) {
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  content->clear();
+  char buffer[4096];
+  size_t num_bytes;
+  while ((num_bytes = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    content->append(buffer, num_bytes);
+  }
+  fclose(file);
+  return true;
+}
+
+static const char *GetJobStatusName(JobStatus status) {
+  switch (status) {
+    case JOB_STATUS_SUCCESS: return "SUCCESS";
+    case JOB_STATUS_CRASH: return "CRASH";
+    case JOB_STATUS_COMPILE_ERROR: return "COMPILE_ERROR";
+    case JOB_STATUS_LINK_ERROR: return "LINK_ERROR";
+    case JOB_STATUS_COHERENCE_ERROR: return "COHERENCE_ERROR";
+    case JOB_STATUS_NONDET: return "NONDET";
+    case JOB_STATUS_TIMEOUT: return "TIMEOUT";
+    case JOB_STATUS_UNEXPECTED_ERROR: return "UNEXPECTED_ERROR";
+    case JOB_STATUS_SKIPPED: return "SKIPPED";
+    case JOB_STATUS_SAME_AS_REFERENCE: return "SAME_AS_REFERENCE";
+    default: return "UNKNOWN";
+  }
+}
+
+// Stage of a failed test, as named by VulkanWorker::RunServerTest()
+static JobStage GetJobStage(const char *stage_name) {
+  if (stage_name == nullptr) {
+    return JOB_STAGE_IMAGE_RENDER;
+  } else if (strcmp(stage_name, "IMAGE_PREPARE") == 0) {
+    return JOB_STAGE_IMAGE_PREPARE;
+  } else if (strcmp(stage_name, "IMAGE_VALIDATE_PROGRAM") == 0) {
+    return JOB_STAGE_IMAGE_VALIDATE_PROGRAM;
+  }
+  return JOB_STAGE_IMAGE_RENDER;
+}
+
+// Job and worker names become directory and file names: names that could
+// escape the worker directory are rejected
+static bool IsValidJobName(const std::string &name) {
+  if (name.empty() || name == "." || name.find("..") != std::string::npos) {
+    return false;
+  }
+  for (char c : name) {
+    if ((unsigned char)c < 0x20 || c == 0x7f) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static std::string ShellQuote(const std::string &argument) {
+  std::string quoted = "'";
+  for (char c : argument) {
+    if (c == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "'";
+}
+
+ServerWorker::ServerWorker(VulkanWorker *vulkan_worker, const char *server_url) :
+  client_((std::string(server_url) + "/request").c_str()) {
+  vulkan_worker_ = vulkan_worker;
+  worker_name_ = FLAGS_worker;
+
+  // Job directories are created under a directory named after the worker, as
+  // glsl-to-spv-worker does.
+  mkdir(worker_name_.c_str(), 0755);
+  std::string worker_info_filename = worker_name_ + "/worker_info.json";
+  VulkanWorker::DumpWorkerInfo(worker_info_filename.c_str());
+  if (!ReadFileContent(worker_info_filename, &platform_info_)) {
+    platform_info_ = "{}";
+  }
+}
+
+bool ServerWorker::Register() {
+  log("Call getWorkerName()");
+  GetWorkerNameResult result = {};
+  if (!client_.GetWorkerName(platform_info_, FLAGS_worker, &result)) {
+    return false;
+  }
+  if (!result.has_worker_name) {
+    log("Worker error: %d", result.error);
+    exit(EXIT_FAILURE);
+  }
+  if (!IsValidJobName(result.worker_name) || result.worker_name.find('/') != std::string::npos) {
+    log("Invalid worker name: %s", result.worker_name.c_str());
+    exit(EXIT_FAILURE);
+  }
+  // The server may have given another name, e.g. when none was requested
+  if (result.worker_name != worker_name_) {
+    worker_name_ = result.worker_name;
+    mkdir(worker_name_.c_str(), 0755);
+  }
+  log("Got worker: %s", result.worker_name.c_str());
+  return true;
+}
+
+// The command and its output are appended to output
+bool ServerWorker::CompileShader(const std::string &glsl_filename, const std::string &spv_filename, std::string *output) {
+  std::string command = ShellQuote(FLAGS_glslang) + " -V " + ShellQuote(glsl_filename) + " -o " + ShellQuote(spv_filename) + " 2>&1";
+  *output += command + "\n";
+  FILE *pipe = popen(command.c_str(), "r");
+  if (pipe == nullptr) {
+    return false;
+  }
+  char buffer[4096];
+  size_t num_bytes;
+  while ((num_bytes = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+    output->append(buffer, num_bytes);
+  }
+  return pclose(pipe) == 0;
+}
+
+void ServerWorker::DoImageJob(ImageJob *image_job) {
+  image_job->has_result = true;
+  ImageJobResult *result = &image_job->result;
+  *result = ImageJobResult();
+  result->pass_sanity_check = true;
+
+  std::string name = image_job->name;
+  const std::string frag_extension = ".frag";
+  if (name.size() > frag_extension.size() && name.compare(name.size() - frag_extension.size(), frag_extension.size(), frag_extension) == 0) {
+    name = name.substr(0, name.size() - frag_extension.size());
+  }
+  std::replace(name.begin(), name.end(), '/', '_');
+  if (!IsValidJobName(name)) {
+    result->log = "Invalid job name\n";
+    result->status = JOB_STATUS_UNEXPECTED_ERROR;
+    return;
+  }
+  result->log = "Start: " + name + "\n";
+
+  if (!image_job->compute_source.empty()) {
+    result->log += "Compute jobs are not supported\n";
+    result->status = JOB_STATUS_UNEXPECTED_ERROR;
+    return;
+  }
+
+  result->stage = JOB_STAGE_IMAGE_PREPARE;
+  std::string job_dir = worker_name_ + "/" + name;
+  mkdir(job_dir.c_str(), 0755);
+  std::string png_template = job_dir + "/image";
+  // Images of a previous run of the same job must not be taken as results
+  for (int i = 0; i < std::max(FLAGS_num_render, FLAGS_max_render); i++) {
+    unlink((png_template + "_" + std::to_string(i) + ".png").c_str());
+  }
+
+  std::string vert_filename = job_dir + "/" + name + ".vert";
+  std::string frag_filename = job_dir + "/" + name + ".frag";
+  WriteFileContent(vert_filename, image_job->vertex_source.empty() ? kDefaultVertexShader : image_job->vertex_source);
+  WriteFileContent(frag_filename, image_job->fragment_source);
+
+  result->stage = JOB_STAGE_IMAGE_VALIDATE_PROGRAM;
+  int64_t start = GetTimeMicroseconds();
+  if (!CompileShader(vert_filename, vert_filename + ".spv", &result->log) ||
+      !CompileShader(frag_filename, frag_filename + ".spv", &result->log)) {
+    result->status = JOB_STATUS_COMPILE_ERROR;
+    return;
+  }
+  int64_t glslang_time = GetTimeMicroseconds() - start;
+
+  std::string vert_spv_content;
+  std::string frag_spv_content;
+  if (!ReadFileContent(vert_filename + ".spv", &vert_spv_content) || !ReadFileContent(frag_filename + ".spv", &frag_spv_content)) {
+    result->log += "Cannot read SPIR-V binaries\n";
+    result->status = JOB_STATUS_UNEXPECTED_ERROR;
+    return;
+  }
+  std::vector<uint32_t> vertex_spv(vert_spv_content.size() / sizeof(uint32_t));
+  memcpy(vertex_spv.data(), vert_spv_content.data(), vertex_spv.size() * sizeof(uint32_t));
+  std::vector<uint32_t> fragment_spv(frag_spv_content.size() / sizeof(uint32_t));
+  memcpy(fragment_spv.data(), frag_spv_content.data(), fragment_spv.size() * sizeof(uint32_t));
+
+  result->stage = JOB_STAGE_IMAGE_RENDER;
+  TestResult test_result = {};
+  vulkan_worker_->RunServerTest(std::move(vertex_spv), std::move(fragment_spv), image_job->uniforms_info.c_str(), png_template, image_job->skip_render, &test_result);
+
+  result->timing_info.compilation_time = ToTimeInterval(glslang_time + test_result.compilation_time);
+  result->timing_info.first_render_time = ToTimeInterval(test_result.first_render_time);
+  result->timing_info.other_renders_time = ToTimeInterval(test_result.other_renders_time);
+  result->timing_info.capture_time = ToTimeInterval(test_result.capture_time);
+  result->log += "NUM_RENDER_USED " + std::to_string(test_result.num_render) + "\n";
+  if (test_result.cached) {
+    result->log += "Result from cache\n";
+  }
+  if (test_result.memory_leak) {
+    result->log += "MEMORY_LEAK: more memory or objects alive after the job than before it\n";
+  }
+  if (test_result.has_host_memory) {
+    result->log += "HOST_MEMORY " + HostAllocator::FormatUsage(test_result.host_memory) + "\n";
+  }
+
+  if (!test_result.error.empty()) {
+    result->log += "Error: " + test_result.error + "\n";
+    result->status = (test_result.compile_result != VK_SUCCESS) ? JOB_STATUS_COMPILE_ERROR : JOB_STATUS_UNEXPECTED_ERROR;
+    result->stage = GetJobStage(test_result.error_stage);
+    return;
+  }
+  result->stage = JOB_STAGE_NOT_STARTED;
+  if (!image_job->skip_render) {
+    result->has_png = ReadFileContent(png_template + "_0.png", &result->png);
+  }
+  if (!test_result.coherent) {
+    result->status = JOB_STATUS_COHERENCE_ERROR;
+  } else if (test_result.nondet_render >= 0) {
+    result->status = JOB_STATUS_NONDET;
+    result->has_png2 = ReadFileContent(png_template + "_" + std::to_string(test_result.nondet_render) + ".png", &result->png2);
+  } else {
+    result->status = JOB_STATUS_SUCCESS;
+  }
+}
+
+void ServerWorker::Run() {
+  int num_jobs = 0;
+  bool registered = false;
+
+  while (FLAGS_max_jobs == 0 || num_jobs < FLAGS_max_jobs) {
+    if (!registered) {
+      registered = Register();
+      if (!registered) {
+        log("Cannot connect to server, retry in a second...");
+        sleep(1);
+        continue;
+      }
+    }
+
+    Job job = {};
+    CrashHandler::SetStage("GET_JOB");
+    if (!client_.GetJob(worker_name_, &job)) {
+      log("Connection to server lost. Re-initialising client.");
+      registered = false;
+      sleep(1);
+      continue;
+    }
+
+    if (job.has_no_job) {
+      log("No job");
+    } else if (job.has_skip_job) {
+      log("Skip job");
+      registered = client_.JobDone(worker_name_, job);
+    } else if (job.has_image_job) {
+      log("#### Image job: %s", job.image_job.name.c_str());
+      CrashHandler::SetJobId(job.job_id);
+      LogSink::SetJobId(job.job_id);
+      DoImageJob(&job.image_job);
+      log("Send back, results status: %d", job.image_job.result.status);
+      Metrics::Increment("gfz_jobs_total", std::string("status=\"") + GetJobStatusName(job.image_job.result.status) + "\"");
+      CrashHandler::SetStage("IMAGE_REPLY_JOB");
+      registered = client_.JobDone(worker_name_, job);
+      num_jobs++;
+      continue;
+    }
+
+    sleep(1);
+  }
+}
@@ -0,0 +1,50 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __SERVER_WORKER__
+#define __SERVER_WORKER__
+
+#include <string>
+
+#include "fuzzer_service.h"
+#include "vulkan_worker.h"
+#include "gflags/gflags.h"
+
+DECLARE_string(server);
+DECLARE_string(worker);
+DECLARE_string(glslang);
+DECLARE_int32(max_jobs);
+
+// Gets image jobs from the server, like glsl-to-spv-worker does, but without
+// spawning a process per job: GLSL shaders are compiled to SPIR-V with
+// --glslang, then rendered by the Vulkan worker of this process. A crash or a
+// watchdog timeout terminates the process: the server then sends the job again,
+// and eventually reports it as skipped.
+class ServerWorker {
+  private:
+  VulkanWorker *vulkan_worker_;
+  FuzzerServiceClient client_;
+  std::string worker_name_;
+  std::string platform_info_;
+
+  bool Register();
+  bool CompileShader(const std::string &glsl_filename, const std::string &spv_filename, std::string *output);
+  void DoImageJob(ImageJob *image_job);
+
+  public:
+  ServerWorker(VulkanWorker *vulkan_worker, const char *server_url);
+  void Run();
+};
+
+#endif
@@ -0,0 +1,217 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "spool_worker.h"
+#include "platform.h"
+
+#include <assert.h> // assert()
+#include <dirent.h> // opendir()
+#include <errno.h> // errno
+#include <limits.h> // NAME_MAX
+#include <stdio.h> // fopen(), rename()
+#include <string.h> // memcpy()
+#include <sys/inotify.h> // inotify_init1()
+#include <unistd.h> // read(), unlink()
+
+#include <algorithm> // std::sort()
+#include <sstream>
+#include <vector>
+
+DEFINE_string(spool, "", "Spool directory to take jobs from, see SpoolWorker, instead of running a single test");
+
+static const char kJobSuffix[] = ".job";
+
+static bool IsJobFile(const std::string &filename) {
+  const size_t suffix_size = sizeof(kJobSuffix) - 1;
+  return filename.size() > suffix_size && filename.compare(filename.size() - suffix_size, suffix_size, kJobSuffix) == 0;
+}
+
+static bool ReadFileContent(const std::string &filename, std::string *content) {
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  content->clear();
+  char buffer[4096];
+  size_t num_bytes;
+  while ((num_bytes = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    content->append(buffer, num_bytes);
+  }
+  fclose(file);
+  return true;
+}
+
+static bool ReadSpirv(const std::string &filename, std::vector<uint32_t> &spv) {
+  std::string content;
+  if (!ReadFileContent(filename, &content)) {
+    return false;
+  }
+  spv.resize(content.size() / sizeof(uint32_t));
+  memcpy(spv.data(), content.data(), spv.size() * sizeof(uint32_t));
+  // A SPIR-V module starts with a 5-word header, the first word being the magic number
+  return spv.size() >= 5 && spv[0] == 0x07230203;
+}
+
+SpoolWorker::SpoolWorker(VulkanWorker *vulkan_worker, const char *directory) {
+  vulkan_worker_ = vulkan_worker;
+  directory_ = directory;
+  inotify_fd_ = inotify_init1(IN_CLOEXEC);
+  assert(inotify_fd_ >= 0);
+  // Complete job files show up either renamed into the directory, or closed
+  // after writing.
+  int watch = inotify_add_watch(inotify_fd_, directory_.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE);
+  assert(watch >= 0 && "Cannot watch spool directory");
+  (void)watch;
+}
+
+SpoolWorker::~SpoolWorker() {
+  close(inotify_fd_);
+}
+
+// Jobs written before the watch was added, or lost to an event queue overflow
+void SpoolWorker::Scan() {
+  DIR *directory = opendir(directory_.c_str());
+  assert(directory != nullptr);
+  std::vector<std::string> names;
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != nullptr) {
+    if (IsJobFile(entry->d_name)) {
+      names.push_back(entry->d_name);
+    }
+  }
+  closedir(directory);
+  // In a stable order
+  std::sort(names.begin(), names.end());
+  pending_.insert(pending_.end(), names.begin(), names.end());
+}
+
+void SpoolWorker::WaitForJobs() {
+  alignas(struct inotify_event) char buffer[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+  ssize_t num_bytes = read(inotify_fd_, buffer, sizeof(buffer));
+  if (num_bytes < 0) {
+    assert(errno == EINTR);
+    return;
+  }
+  for (char *event_data = buffer; event_data < buffer + num_bytes;) {
+    const struct inotify_event *event = (const struct inotify_event *)event_data;
+    if (event->mask & IN_Q_OVERFLOW) {
+      log("SPOOL event queue overflow, rescan");
+      Scan();
+    } else if (event->len > 0 && IsJobFile(event->name)) {
+      pending_.push_back(event->name);
+    }
+    event_data += sizeof(struct inotify_event) + event->len;
+  }
+}
+
+// Another worker sharing the directory may have claimed the job first, or a
+// rescan may have seen it twice: only one rename succeeds.
+bool SpoolWorker::ClaimJob(const std::string &name) {
+  std::string job_filename = directory_ + "/" + name + kJobSuffix;
+  std::string running_filename = directory_ + "/" + name + ".running";
+  return rename(job_filename.c_str(), running_filename.c_str()) == 0;
+}
+
+std::string SpoolWorker::RunJob(VulkanWorker *vulkan_worker, const std::string &vertex_filename, const std::string &fragment_filename,
+                                const std::string &uniforms_filename, const std::string &png_template, TestResult *result, std::string *error) {
+  std::vector<uint32_t> vertex_spv;
+  std::vector<uint32_t> fragment_spv;
+  std::string uniforms;
+  if (!ReadSpirv(vertex_filename, vertex_spv) || !ReadSpirv(fragment_filename, fragment_spv) || !ReadFileContent(uniforms_filename, &uniforms)) {
+    *error = "cannot read shaders or uniforms";
+    return "UNEXPECTED_ERROR";
+  }
+  vulkan_worker->RunServerTest(std::move(vertex_spv), std::move(fragment_spv), uniforms.c_str(), png_template, FLAGS_skip_render, result);
+  if (!result->error.empty()) {
+    *error = result->error;
+    return (result->compile_result != VK_SUCCESS) ? "COMPILE_ERROR" : "UNEXPECTED_ERROR";
+  } else if (!result->coherent) {
+    return "COHERENCE_ERROR";
+  } else if (result->nondet_render >= 0) {
+    return "NONDET";
+  }
+  return "SUCCESS";
+}
+
+void SpoolWorker::DoJob(const std::string &name) {
+  std::string prefix = directory_ + "/" + name;
+  std::string status;
+  std::string error;
+  TestResult result = {};
+
+  std::string job_line;
+  std::string vertex_filename;
+  std::string fragment_filename;
+  std::string uniforms_filename;
+  ReadFileContent(prefix + ".running", &job_line);
+  job_line.erase(job_line.find_last_not_of(" \r\n") + 1);
+  std::istringstream job_stream(job_line);
+  job_stream >> vertex_filename >> fragment_filename >> uniforms_filename;
+
+  if (uniforms_filename.empty()) {
+    status = "UNEXPECTED_ERROR";
+    error = "invalid job line: " + job_line;
+  } else {
+    status = RunJob(vulkan_worker_, directory_ + "/" + vertex_filename, directory_ + "/" + fragment_filename,
+                    directory_ + "/" + uniforms_filename, prefix, &result, &error);
+  }
+  log("SPOOL %s %s", name.c_str(), status.c_str());
+  Metrics::Increment("gfz_jobs_total", "status=\"" + status + "\"");
+
+  // Written under a temporary name, such that '.done' files are complete
+  std::string done_filename = prefix + ".done";
+  std::string temporary_filename = done_filename + ".tmp";
+  FILE *done = fopen(temporary_filename.c_str(), "w");
+  assert(done != nullptr);
+  fprintf(done, "status %s\n", status.c_str());
+  if (!error.empty()) {
+    fprintf(done, "error %s\n", error.c_str());
+  } else {
+    fprintf(done, "num_render %d\n", result.num_render);
+    fprintf(done, "nondet_render %d\n", result.nondet_render);
+    fprintf(done, "image_hash %016llx\n", (unsigned long long)result.image_hash);
+    fprintf(done, "compilation_time %lld\n", (long long)result.compilation_time);
+    fprintf(done, "first_render_time %lld\n", (long long)result.first_render_time);
+    fprintf(done, "other_renders_time %lld\n", (long long)result.other_renders_time);
+    fprintf(done, "capture_time %lld\n", (long long)result.capture_time);
+    fprintf(done, "cached %d\n", result.cached ? 1 : 0);
+    fprintf(done, "memory_leak %d\n", result.memory_leak ? 1 : 0);
+  }
+  fclose(done);
+  rename(temporary_filename.c_str(), done_filename.c_str());
+  unlink((prefix + ".running").c_str());
+}
+
+void SpoolWorker::Run() {
+  log("SPOOL watching %s", directory_.c_str());
+  Scan();
+  int num_jobs = 0;
+  while (FLAGS_max_jobs == 0 || num_jobs < FLAGS_max_jobs) {
+    if (pending_.empty()) {
+      CrashHandler::SetStage("GET_JOB");
+      WaitForJobs();
+      continue;
+    }
+    std::string filename = pending_.front();
+    pending_.pop_front();
+    std::string name = filename.substr(0, filename.size() - (sizeof(kJobSuffix) - 1));
+    if (!ClaimJob(name)) {
+      continue;
+    }
+    CrashHandler::SetJobId(num_jobs);
+    LogSink::SetJobId(num_jobs);
+    DoJob(name);
+    num_jobs++;
+  }
+}
@@ -0,0 +1,61 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __SPOOL_WORKER__
+#define __SPOOL_WORKER__
+
+#include <deque>
+#include <string>
+
+#include "vulkan_worker.h"
+#include "gflags/gflags.h"
+
+DECLARE_string(spool);
+DECLARE_int32(max_jobs);
+
+// Takes jobs from a spool directory, watched with inotify, such that a harness
+// hands jobs to a long-running worker by writing files, as the Android flow
+// does, without polling nor a process per job.
+//
+// A job is a '<name>.job' file holding a batch line without png_template:
+// '<vert.spv> <frag.spv> <uniforms.json>', relative to the spool directory.
+// It must appear complete, e.g. written under another name then renamed. The
+// worker claims it by renaming it to '<name>.running', such that several
+// workers can share a directory. Images are saved to '<name>_<#id>.png', then
+// the outcome is written to '<name>.done', one field per line, and
+// '<name>.running' is removed. A job left '.running' crashed the worker.
+class SpoolWorker {
+  private:
+  VulkanWorker *vulkan_worker_;
+  std::string directory_;
+  int inotify_fd_;
+  // Names of jobs seen but not claimed yet
+  std::deque<std::string> pending_;
+
+  void Scan();
+  void WaitForJobs();
+  bool ClaimJob(const std::string &name);
+  void DoJob(const std::string &name);
+
+  public:
+  SpoolWorker(VulkanWorker *vulkan_worker, const char *directory);
+  // Renders the job, and returns its status as named by JobStatus. Also used
+  // by PipeWorker.
+  static std::string RunJob(VulkanWorker *vulkan_worker, const std::string &vertex_filename, const std::string &fragment_filename,
+                            const std::string &uniforms_filename, const std::string &png_template, TestResult *result, std::string *error);
+  ~SpoolWorker();
+  void Run();
+};
+
+#endif
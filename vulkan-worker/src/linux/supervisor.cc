@@ -0,0 +1,320 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "supervisor.h"
+#include "pipe_worker.h"
+#include "platform.h"
+
+#include <assert.h> // assert()
+#include <errno.h> // errno
+#include <fcntl.h> // O_CLOEXEC
+#include <poll.h> // poll()
+#include <sched.h> // sched_setaffinity()
+#include <signal.h> // signal()
+#include <stdlib.h> // EXIT_SUCCESS
+#include <sys/sysinfo.h> // get_nprocs()
+#include <sys/wait.h> // waitpid()
+#include <unistd.h> // fork(), execv()
+
+#include <algorithm> // std::min()
+#include <chrono>
+#include <sstream>
+
+DEFINE_string(supervise, "", "Path to a batch file whose jobs are run by --num_workers worker processes, see Supervisor, instead of running a single test");
+DEFINE_int32(num_workers, 1, "Number of worker processes of --supervise");
+DEFINE_string(worker_devices, "0", "Comma-separated indices of the physical devices of the --supervise workers, assigned to workers in turn, see --device");
+DEFINE_int32(cpus_per_worker, 0, "Pin --supervise worker i to CPUs i * N to (i + 1) * N - 1, wrapping around the CPUs of the host. 0 disables pinning");
+DEFINE_int32(retry_limit, 2, "Number of times a job that crashed its --supervise worker is run again, as the server's retry limit, before it is reported as SKIPPED");
+DEFINE_string(supervise_results, "", "Path of the --supervise results file, one line per job. Defaults to '<batch file>.results'");
+
+// Workers that keep dying before creating their device are not started again
+static const int kMaxFailedStarts = 3;
+
+// Flags naming files written by a worker, suffixed with the worker index to
+// keep workers apart
+static const char *kWorkerFileFlags[] = { "crash_file", "watchdog_file", "metrics_file", "coherence_before", "coherence_after", "result_transport" };
+
+static std::string DescribeExit(int status) {
+  if (WIFSIGNALED(status)) {
+    return "signal " + std::to_string(WTERMSIG(status));
+  }
+  return "exit status " + std::to_string(WEXITSTATUS(status));
+}
+
+Supervisor::Supervisor(const char *batch_filename) {
+  FILE *batch_file = fopen(batch_filename, "r");
+  assert(batch_file != nullptr && "Cannot open batch file");
+  char line[4096];
+  while (fgets(line, sizeof(line), batch_file) != nullptr) {
+    SupervisedJob job;
+    job.line = line;
+    job.line.erase(job.line.find_last_not_of(" \r\n") + 1);
+    // Comments are skipped, as in the worker batch mode
+    if (job.line.empty() || job.line[0] == '#') {
+      continue;
+    }
+    std::istringstream line_stream(job.line);
+    while (line_stream >> job.name) {
+    }
+    job.attempts = 0;
+    pending_.push_back(jobs_.size());
+    jobs_.push_back(job);
+  }
+  fclose(batch_file);
+
+  std::istringstream devices_stream(FLAGS_worker_devices);
+  std::string device;
+  while (std::getline(devices_stream, device, ',')) {
+    devices_.push_back(atoi(device.c_str()));
+  }
+  assert(!devices_.empty() && "No device in --worker_devices");
+  assert(FLAGS_num_workers > 0);
+
+  std::string results_filename = FLAGS_supervise_results.empty() ? std::string(batch_filename) + ".results" : FLAGS_supervise_results;
+  results_ = fopen(results_filename.c_str(), "w");
+  assert(results_ != nullptr && "Cannot open results file");
+  num_results_ = 0;
+  num_restarts_ = 0;
+}
+
+Supervisor::~Supervisor() {
+  fclose(results_);
+}
+
+void Supervisor::StartWorker(size_t index) {
+  WorkerProcess &worker = workers_[index];
+  int jobs_pipe[2];
+  int results_pipe[2];
+  int result = pipe2(jobs_pipe, O_CLOEXEC);
+  assert(result == 0);
+  result = pipe2(results_pipe, O_CLOEXEC);
+  assert(result == 0);
+  (void)result;
+
+  // Flags given last override the ones of the supervisor
+  std::vector<std::string> args = gflags::GetArgvs();
+  args.push_back("--supervise=");
+  args.push_back("--pipe");
+  args.push_back("--device=" + std::to_string(worker.device));
+  for (const char *flag : kWorkerFileFlags) {
+    std::string value;
+    if (gflags::GetCommandLineOption(flag, &value) && !value.empty()) {
+      args.push_back(std::string("--") + flag + "=" + value + "." + std::to_string(index));
+    }
+  }
+  if (FLAGS_metrics_port != 0) {
+    args.push_back("--metrics_port=" + std::to_string(FLAGS_metrics_port + (int)index));
+  }
+  std::vector<char *> argv;
+  for (std::string &arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  int num_cpus = get_nprocs();
+  for (int i = 0; i < FLAGS_cpus_per_worker; i++) {
+    CPU_SET(((int)index * FLAGS_cpus_per_worker + i) % num_cpus, &cpus);
+  }
+
+  pid_t pid = fork();
+  assert(pid >= 0 && "Cannot fork worker");
+  if (pid == 0) {
+    if (FLAGS_cpus_per_worker > 0) {
+      sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+    dup2(jobs_pipe[0], STDIN_FILENO);
+    if (results_pipe[1] == kPipeResultsFd) {
+      fcntl(kPipeResultsFd, F_SETFD, 0);
+    } else {
+      dup2(results_pipe[1], kPipeResultsFd);
+    }
+    execv("/proc/self/exe", argv.data());
+    _exit(127);
+  }
+
+  close(jobs_pipe[0]);
+  close(results_pipe[1]);
+  worker.pid = pid;
+  worker.jobs_fd = jobs_pipe[1];
+  worker.results_fd = results_pipe[0];
+  worker.buffer.clear();
+  worker.ready = false;
+  worker.job = -1;
+  log("SUPERVISOR worker %zu started, pid %d, device %d", index, (int)pid, worker.device);
+}
+
+void Supervisor::WriteResult(size_t job, const std::string &result) {
+  fprintf(results_, "%s\t%d\t%s\n", jobs_[job].name.c_str(), jobs_[job].attempts, result.c_str());
+  fflush(results_);
+  status_counts_[result.substr(0, result.find('\t'))]++;
+  num_results_++;
+}
+
+// A write to a worker that died fails with EPIPE, and its death is handled
+// once its results pipe is closed.
+void Supervisor::Dispatch(size_t index) {
+  WorkerProcess &worker = workers_[index];
+  if (pending_.empty() || !worker.ready || worker.job >= 0) {
+    return;
+  }
+  size_t job = pending_.front();
+  pending_.pop_front();
+  worker.job = (int)job;
+  jobs_[job].attempts++;
+  std::string line = jobs_[job].line + "\n";
+  ssize_t num_bytes = write(worker.jobs_fd, line.data(), line.size());
+  (void)num_bytes;
+}
+
+void Supervisor::DispatchIdle() {
+  for (size_t i = 0; i < workers_.size(); i++) {
+    if (workers_[i].pid >= 0) {
+      Dispatch(i);
+    }
+  }
+}
+
+void Supervisor::HandleLine(size_t index, const std::string &line) {
+  WorkerProcess &worker = workers_[index];
+  if (line == "READY") {
+    worker.ready = true;
+    worker.num_failed_starts = 0;
+  } else {
+    assert(worker.job >= 0 && "Result without a job in flight");
+    WriteResult(worker.job, line);
+    worker.job = -1;
+  }
+  Dispatch(index);
+}
+
+void Supervisor::HandleExit(size_t index) {
+  WorkerProcess &worker = workers_[index];
+  close(worker.jobs_fd);
+  close(worker.results_fd);
+  int status = 0;
+  while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  bool clean_exit = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+  log("SUPERVISOR worker %zu, pid %d, stopped with %s", index, (int)worker.pid, DescribeExit(status).c_str());
+  worker.pid = -1;
+
+  if (worker.job >= 0) {
+    SupervisedJob &job = jobs_[worker.job];
+    if (clean_exit) {
+      // The job was never read
+      job.attempts--;
+      pending_.push_front(worker.job);
+    } else if (job.attempts > FLAGS_retry_limit) {
+      log("SUPERVISOR job %s skipped after %d attempts", job.name.c_str(), job.attempts);
+      WriteResult(worker.job, "SKIPPED\t" + DescribeExit(status));
+    } else {
+      pending_.push_front(worker.job);
+    }
+    worker.job = -1;
+  } else if (!worker.ready && !clean_exit) {
+    worker.num_failed_starts++;
+  }
+
+  if (num_results_ < jobs_.size() && worker.num_failed_starts < kMaxFailedStarts) {
+    num_restarts_++;
+    StartWorker(index);
+  } else if (worker.num_failed_starts >= kMaxFailedStarts) {
+    log("SUPERVISOR worker %zu failed to start %d times, not started again", index, worker.num_failed_starts);
+  }
+  DispatchIdle();
+}
+
+int Supervisor::Run() {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  // Writes to dead workers fail with EPIPE instead
+  signal(SIGPIPE, SIG_IGN);
+
+  size_t num_workers = std::min((size_t)FLAGS_num_workers, jobs_.size());
+  workers_.resize(num_workers);
+  for (size_t i = 0; i < num_workers; i++) {
+    workers_[i].device = devices_[i % devices_.size()];
+    workers_[i].num_failed_starts = 0;
+    StartWorker(i);
+  }
+
+  std::vector<struct pollfd> poll_fds;
+  std::vector<size_t> poll_workers;
+  while (num_results_ < jobs_.size()) {
+    poll_fds.clear();
+    poll_workers.clear();
+    for (size_t i = 0; i < workers_.size(); i++) {
+      if (workers_[i].pid >= 0) {
+        struct pollfd poll_fd = {};
+        poll_fd.fd = workers_[i].results_fd;
+        poll_fd.events = POLLIN;
+        poll_fds.push_back(poll_fd);
+        poll_workers.push_back(i);
+      }
+    }
+    if (poll_fds.empty()) {
+      log("SUPERVISOR no worker left, %zu jobs without result", jobs_.size() - num_results_);
+      break;
+    }
+    if (poll(poll_fds.data(), poll_fds.size(), -1) < 0) {
+      assert(errno == EINTR);
+      continue;
+    }
+
+    for (size_t i = 0; i < poll_fds.size(); i++) {
+      if (poll_fds[i].revents == 0) {
+        continue;
+      }
+      size_t index = poll_workers[i];
+      WorkerProcess &worker = workers_[index];
+      char buffer[4096];
+      ssize_t num_bytes = read(worker.results_fd, buffer, sizeof(buffer));
+      if (num_bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (num_bytes <= 0) {
+        HandleExit(index);
+        continue;
+      }
+      worker.buffer.append(buffer, num_bytes);
+      size_t end;
+      while ((end = worker.buffer.find('\n')) != std::string::npos) {
+        std::string line = worker.buffer.substr(0, end);
+        worker.buffer.erase(0, end + 1);
+        HandleLine(index, line);
+      }
+    }
+  }
+
+  // End of input: workers exit once done
+  for (WorkerProcess &worker : workers_) {
+    if (worker.pid >= 0) {
+      close(worker.jobs_fd);
+      close(worker.results_fd);
+      int status;
+      while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR) {
+      }
+      worker.pid = -1;
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  log("SUPERVISOR %zu jobs in %.1f s, %.1f jobs/s, %zu workers, %zu restarts", num_results_, seconds, num_results_ / seconds,
+      workers_.size(), num_restarts_);
+  for (const auto &status_count : status_counts_) {
+    log("SUPERVISOR %s %zu", status_count.first.c_str(), status_count.second);
+  }
+  return num_results_ == jobs_.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,102 @@
+// Copyright 2019 The GraphicsFuzz Project Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __SUPERVISOR__
+#define __SUPERVISOR__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+
+DECLARE_string(supervise);
+DECLARE_int32(num_workers);
+DECLARE_string(worker_devices);
+DECLARE_int32(cpus_per_worker);
+DECLARE_int32(retry_limit);
+DECLARE_string(supervise_results);
+
+// A job of the batch file, see Supervisor
+typedef struct SupervisedJob {
+  // Batch line, sent as is to a worker
+  std::string line;
+  // png_template of the job
+  std::string name;
+  // Number of times the job was sent to a worker
+  int attempts;
+} SupervisedJob;
+
+// A worker process, see PipeWorker
+typedef struct WorkerProcess {
+  // -1 when not running
+  pid_t pid;
+  int device;
+  // Write end of the worker stdin
+  int jobs_fd;
+  // Read end of the worker results
+  int results_fd;
+  // Received bytes not forming a whole line yet
+  std::string buffer;
+  // READY was received: the device is created
+  bool ready;
+  // Index of the job in flight, or -1
+  int job;
+  // Number of times in a row the worker died before being ready
+  int num_failed_starts;
+} WorkerProcess;
+
+// Runs the jobs of a batch file on --num_workers worker processes, such that
+// a host with many cores, as used by software renderers, or with several GPUs,
+// is kept busy. Workers are this binary, run in PipeWorker mode, each pinned
+// to a physical device of --worker_devices and to --cpus_per_worker CPUs.
+// Jobs are dispatched one at a time to the workers that are idle.
+//
+// A worker that dies is started again. Its job in flight is sent again, to any
+// worker, until it was tried --retry_limit times more, as the server does,
+// then reported as SKIPPED. A worker exiting cleanly, e.g. after --max_jobs,
+// does not count as an attempt. Results are written as they come, one line per
+// job to --supervise_results: '<png_template> <attempts> <status> <fields>',
+// tab-separated, with the fields of the PipeWorker result.
+class Supervisor {
+  private:
+  std::vector<SupervisedJob> jobs_;
+  // Indices of jobs to dispatch, retried jobs first
+  std::deque<size_t> pending_;
+  std::vector<WorkerProcess> workers_;
+  std::vector<int> devices_;
+  FILE *results_;
+  size_t num_results_;
+  size_t num_restarts_;
+  std::map<std::string, size_t> status_counts_;
+
+  void StartWorker(size_t index);
+  void HandleExit(size_t index);
+  void HandleLine(size_t index, const std::string &line);
+  void Dispatch(size_t index);
+  void DispatchIdle();
+  void WriteResult(size_t job, const std::string &result);
+
+  public:
+  Supervisor(const char *batch_filename);
+  ~Supervisor();
+  // Returns the exit status of the process: failure unless all jobs have a result
+  int Run();
+};
+
+#endif